@@ -4,6 +4,9 @@
  *
  * Performs a benchmark of Peanut-GB with a specified ROM.
  * Plays the ROM five times and prints the FPS for each play.
+ * Build the peanut-benchmark-threaded target to compare the switch and threaded
+ * opcode dispatch modes, and the peanut-benchmark-jit target to measure the
+ * JIT.
  */
 #ifndef ENABLE_LCD
 # define ENABLE_LCD 1
@@ -115,27 +118,6 @@ static void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16
 	exit(EXIT_FAILURE);
 }
 
-#if ENABLE_LCD
-/**
- * Draws scanline into framebuffer.
- */
-static void lcd_draw_line(struct gb_s *gb, const uint8_t pixels[160],
-		const uint_fast8_t line)
-{
-	struct priv_t *priv = gb->direct.priv;
-	const uint16_t palette[] = { 0x7FFF, 0x5294, 0x294A, 0x0000 };
-
-	for (unsigned int x = 0; x < LCD_WIDTH; x++)
-	{
-#if PEANUT_GB_16BIT_COLOUR
-		priv->fb[line][x] = palette[pixels[x] & 3];
-#else
-		priv->fb[line][x] = palette[pixels[x]];
-#endif
-	}
-}
-#endif
-
 int main(int argc, char **argv)
 {
 	/* Must be freed */
@@ -152,6 +134,14 @@ int main(int argc, char **argv)
 			exit(EXIT_FAILURE);
 	}
 
+#if PEANUT_GB_JIT
+	printf("Dispatch: JIT\n");
+#elif PEANUT_GB_THREADED_DISPATCH
+	printf("Dispatch: threaded\n");
+#else
+	printf("Dispatch: switch\n");
+#endif
+
 	for(unsigned int i = 0; i < 5; i++)
 	{
 		/* Start benchmark. */
@@ -180,11 +170,21 @@ int main(int argc, char **argv)
 			exit(EXIT_FAILURE);
 		}
 
+#if PEANUT_GB_JIT
+		if(gb_jit_init(&gb) != 0)
+		{
+			fprintf(stderr, "JIT failed to initialise\n");
+			exit(EXIT_FAILURE);
+		}
+#endif
+
 		printf("Run %u: ", i);
 		priv.cart_ram = malloc(gb_get_save_size(&gb));
 
 #if ENABLE_LCD
-		gb_init_lcd(&gb, &lcd_draw_line);
+		/* Draw frames as RGB555 in four shades of grey. */
+		gb_init_lcd_frame(&gb, priv.fb, priv.fb, sizeof(priv.fb[0]),
+				GB_PIXEL_FORMAT_RGB555, NULL);
 		// gb.direct.interlace = true;
 #endif
 
@@ -205,6 +205,9 @@ int main(int argc, char **argv)
 			printf("%f FPS, dur: %f\n", fps, duration);
 		}
 
+#if PEANUT_GB_JIT
+		gb_jit_free(&gb);
+#endif
 		free(priv.cart_ram);
 		free(priv.rom);
 	}
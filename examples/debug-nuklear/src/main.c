@@ -97,6 +97,10 @@ static const SDL_Color colour_lut[4] = {
 
 static struct minigb_apu_ctx apu;
 
+/* Every address is a breakpoint, so that gb_run_until() with
+ * GB_RUN_BREAKPOINT executes a single instruction. */
+static uint8_t every_instruction[0x2000];
+
 static uint8_t gb_rom_read(struct gb_s *ctx, const uint_fast32_t addr)
 {
 	gb_priv_s *gb_priv;
@@ -468,13 +472,12 @@ static void render_peanut_gb(struct nk_context *ctx, struct gb_s *gb)
 			&gb_priv->pixels, &gb_priv->pitch);
 		SDL_assert_always(ret == 0);
 
-		gb->gb_frame = false;
-		while(!gb->gb_frame)
+		do
 		{
 			const char *lcd_mode_str[4] = {
 				"HBLANK", "VBLANK", "OAM", "TRANSFER"
 			};
-			__gb_step_cpu(gb);
+			gb_run_until(gb, GB_RUN_BREAKPOINT | GB_RUN_FRAME);
 
 			/* Debugging */
 			fprintf(log_file, "OP:%02X%s PC:%04X AF:%02X%02X BC:%04X DE:%04X SP:%04X HL:%04X ",
@@ -493,7 +496,7 @@ static void render_peanut_gb(struct nk_context *ctx, struct gb_s *gb)
 				gb->hram_io[IO_IF], gb->hram_io[IO_IE]);
 			fprintf(log_file, "ROM%d", gb->selected_rom_bank);
 			fprintf(log_file, "\n");
-		}
+		} while(!(gb->run.events & GB_RUN_FRAME));
 
 		if(!nk_window_is_collapsed(ctx, "VRAM Viewer"))
 			render_vram_tex(gb_priv->gb_vram_tex, gb);
@@ -528,7 +531,7 @@ static void render_peanut_gb(struct nk_context *ctx, struct gb_s *gb)
 			&gb_priv->pixels, &gb_priv->pitch);
 		SDL_assert_always(ret == 0);
 
-		__gb_step_cpu(gb);
+		gb_run_until(gb, GB_RUN_BREAKPOINT | GB_RUN_FRAME);
 
 		if(!nk_window_is_collapsed(ctx, "VRAM Viewer"))
 		{
@@ -729,10 +732,12 @@ static void render_peanut_gb(struct nk_context *ctx, struct gb_s *gb)
 			const char timer_str[3][5] = {
 				"TIMA", "TMA", "DIV"
 			};
-			const uint8_t *timer_reg[3] = {
-				&gb->hram_io[IO_TIMA],
-				&gb->hram_io[IO_TMA],
-				&gb->hram_io[IO_DIV]
+			/* DIV and TIMA are worked out without changing the
+			 * state of the game. */
+			const uint8_t timer_reg[3] = {
+				gb_get_io(gb, IO_TIMA),
+				gb_get_io(gb, IO_TMA),
+				gb_get_io(gb, IO_DIV)
 			};
 			static char timer_reg_str[3][3];
 
@@ -745,7 +750,7 @@ static void render_peanut_gb(struct nk_context *ctx, struct gb_s *gb)
 				nk_label(ctx, timer_str[i], NK_TEXT_CENTERED);
 				timer_reg_str_len = SDL_snprintf(
 					timer_reg_str[i], 3,
-					"%02X", *timer_reg[i]);
+					"%02X", timer_reg[i]);
 				nk_text(ctx, timer_reg_str[i],
 					timer_reg_str_len,
 					NK_TEXT_CENTERED);
@@ -759,11 +764,13 @@ static void render_peanut_gb(struct nk_context *ctx, struct gb_s *gb)
 			const char count_str[4][7] = {
 				"LCD", "DIV", "TIMA", "SERIAL"
 			};
-			const uint_fast16_t *count_ptrs[4] = {
-				&gb->counter.lcd_count,
-				&gb->counter.div_count,
-				&gb->counter.tima_count,
-				&gb->counter.serial_count
+			const uint_fast32_t counts[4] = {
+				(uint_fast32_t)(gb->counter.cycles -
+					gb->counter.lcd_start),
+				(uint_fast32_t)((gb->counter.cycles -
+					gb->counter.div_start) % DIV_CYCLES),
+				gb->counter.tima_count,
+				gb->counter.serial_count
 			};
 			static char timer_reg_str[4][16];
 
@@ -776,7 +783,7 @@ static void render_peanut_gb(struct nk_context *ctx, struct gb_s *gb)
 				nk_label(ctx, count_str[i], NK_TEXT_CENTERED);
 				timer_reg_str_len = SDL_snprintf(
 					timer_reg_str[i], 16,
-					"%" PRIuFAST16, *count_ptrs[i]);
+					"%" PRIuFAST32, counts[i]);
 				nk_text(ctx, timer_reg_str[i],
 					timer_reg_str_len,
 					NK_TEXT_CENTERED);
@@ -1108,6 +1115,9 @@ int main(int argc, char *argv[])
 
 		gb_init_lcd(&gb, lcd_draw_line);
 
+		SDL_memset(every_instruction, 0xFF, sizeof(every_instruction));
+		gb_set_breakpoints(&gb, every_instruction);
+
 		ram_sz = gb_get_save_size(&gb);
 		if (ram_sz != 0)
 		{
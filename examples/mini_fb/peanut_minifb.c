@@ -104,21 +104,6 @@ void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16_t val)
 	exit(EXIT_FAILURE);
 }
 
-#if ENABLE_LCD
-/**
- * Draws scanline into framebuffer.
- */
-void lcd_draw_line(struct gb_s *gb, const uint8_t pixels[160],
-		   const uint_fast8_t line)
-{
-	struct priv_t *priv = gb->direct.priv;
-	const uint32_t palette[] = { 0xFFFFFF, 0xA5A5A5, 0x525252, 0x000000 };
-
-	for(unsigned int x = 0; x < LCD_WIDTH; x++)
-		priv->fb[line][x] = palette[pixels[x] & 3];
-}
-#endif
-
 int main(int argc, char **argv)
 {
 	/* Must be freed */
@@ -158,7 +143,9 @@ int main(int argc, char **argv)
 	priv.cart_ram = malloc(gb_get_save_size(&gb));
 
 #if ENABLE_LCD
-	gb_init_lcd(&gb, &lcd_draw_line);
+	/* Draw frames in four shades of grey. */
+	gb_init_lcd_frame(&gb, priv.fb, priv.fb, sizeof(priv.fb[0]),
+			GB_PIXEL_FORMAT_XRGB8888, NULL);
 	// gb.direct.interlace = true;
 #endif
 
@@ -0,0 +1,244 @@
+/**
+ * MIT License
+ * Copyright (c) 2018-2023 Mahyar Koshkouei
+ *
+ * Replays a movie recorded by peanut-sdl as fast as possible, without audio,
+ * and only drawing the frames whose hashes were recorded or that are asked
+ * for. The whole movie is replayed even if the LCD output differs from the
+ * recording, so that every frame asked for is saved, and then the first
+ * frame that differs and the number of hashes that match are printed. Exits
+ * with a failure if any frame differs.
+ *
+ * Usage: peanut-replay ROM MOVIE [FRAME...]
+ * Each FRAME given is saved as frame_FRAME.pgm in the current folder.
+ */
+#define ENABLE_SOUND 0
+#define ENABLE_LCD 1
+/* Replaying as fast as possible is what idle loop skipping is for. */
+#define PEANUT_GB_IDLE_LOOP_SKIP 1
+
+/* Import emulator library. */
+#include "../../peanut_gb.h"
+#include "peanut_movie.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct priv_t
+{
+	/* Hash of the frame being drawn. */
+	uint32_t hash;
+	/* Shades of the frame being drawn. */
+	uint8_t fb[LCD_HEIGHT][LCD_WIDTH];
+};
+
+/**
+ * Returns a pointer to the allocated space containing the file, and its size.
+ * Must be freed.
+ */
+static uint8_t *read_file(const char *file_name, size_t *size)
+{
+	FILE *f = fopen(file_name, "rb");
+	uint8_t *buf = NULL;
+	long len;
+
+	if(f == NULL)
+		return NULL;
+
+	if(fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) <= 0)
+		goto out;
+
+	rewind(f);
+	buf = malloc(len);
+	if(buf != NULL && fread(buf, 1, len, f) != (size_t)len)
+	{
+		free(buf);
+		buf = NULL;
+	}
+
+	*size = len;
+out:
+	fclose(f);
+	return buf;
+}
+
+static void gb_error(struct gb_s *gb, const enum gb_error_e gb_err,
+		const uint16_t addr)
+{
+	(void) gb;
+	fprintf(stderr, "Error %d occurred at %04X. Exiting.\n", gb_err, addr);
+	exit(EXIT_FAILURE);
+}
+
+static void lcd_draw_line(struct gb_s *gb, const uint8_t pixels[LCD_WIDTH],
+		const uint_fast8_t line)
+{
+	struct priv_t *priv = gb->direct.priv;
+
+	priv->hash = movie_hash_line(priv->hash, pixels);
+
+	for(unsigned int x = 0; x < LCD_WIDTH; x++)
+		priv->fb[line][x] = pixels[x] & 3;
+}
+
+/**
+ * Saves the last frame as a greyscale PGM file.
+ */
+static int save_frame(const struct priv_t *priv, uint_fast32_t frame)
+{
+	static const uint8_t grey[4] = { 0xFF, 0xAA, 0x55, 0x00 };
+	uint8_t row[LCD_WIDTH];
+	char file_name[32];
+	FILE *f;
+	int ret = 0;
+
+	snprintf(file_name, sizeof(file_name), "frame_%lu.pgm",
+			(unsigned long)frame);
+	f = fopen(file_name, "wb");
+	if(f == NULL)
+		return -1;
+
+	fprintf(f, "P5\n%d %d\n255\n", LCD_WIDTH, LCD_HEIGHT);
+	for(unsigned int y = 0; y < LCD_HEIGHT; y++)
+	{
+		for(unsigned int x = 0; x < LCD_WIDTH; x++)
+			row[x] = grey[priv->fb[y][x]];
+
+		if(fwrite(row, 1, LCD_WIDTH, f) != LCD_WIDTH)
+			ret = -1;
+	}
+
+	if(fclose(f) != 0)
+		ret = -1;
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	static struct priv_t priv;
+	struct gb_s gb;
+	struct movie_s movie;
+	uint8_t *rom, *cart_ram = NULL;
+	size_t rom_size, save_size;
+	uint_fast32_t mismatches = 0, checked = 0;
+	/* Frames to save, from the end of the command line. */
+	unsigned long *saves = NULL;
+	const int save_count = argc > 3 ? argc - 3 : 0;
+	clock_t start;
+	double seconds;
+	int ret = EXIT_FAILURE;
+
+	if(argc < 3)
+	{
+		fprintf(stderr, "%s ROM MOVIE [FRAME...]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if((rom = read_file(argv[1], &rom_size)) == NULL)
+	{
+		fprintf(stderr, "Unable to read %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	saves = malloc((save_count + 1) * sizeof(*saves));
+	if(saves == NULL)
+	{
+		free(rom);
+		return EXIT_FAILURE;
+	}
+
+	for(int i = 0; i < save_count; i++)
+		saves[i] = strtoul(argv[i + 3], NULL, 10);
+
+	if(movie_load(&movie, argv[2]) != 0)
+	{
+		fprintf(stderr, "Unable to read movie %s\n", argv[2]);
+		free(saves);
+		free(rom);
+		return EXIT_FAILURE;
+	}
+
+	if(gb_init_buffer(&gb, rom, rom_size, NULL, 0, &gb_error, &priv) !=
+			GB_INIT_NO_ERROR || gb_get_save_size_s(&gb, &save_size) != 0)
+	{
+		fprintf(stderr, "Unable to initialise emulator\n");
+		goto out;
+	}
+
+	if(movie_check_rom(&movie, &gb) != 0)
+	{
+		fprintf(stderr, "Movie was not recorded with this ROM\n");
+		goto out;
+	}
+
+	if(save_size != 0)
+	{
+		cart_ram = calloc(1, save_size);
+		if(cart_ram == NULL)
+			goto out;
+
+		gb_set_cart_ram(&gb, cart_ram, save_size);
+	}
+
+	if(gb_state_load(&gb, movie.state, movie.state_size) !=
+			GB_STATE_NO_ERROR)
+	{
+		fprintf(stderr, "Unable to load the state of the movie\n");
+		goto out;
+	}
+
+	gb_init_lcd(&gb, &lcd_draw_line);
+
+	start = clock();
+	for(uint_fast32_t frame = 1; frame <= movie.frames; frame++)
+	{
+		int save = 0;
+
+		for(int i = 0; i < save_count; i++)
+			save |= saves[i] == frame;
+
+		/* Only draw the frames that are checked or saved. */
+		gb.direct.skip_next_frame = !save &&
+			!movie_hash_frame(&movie, frame);
+		gb.direct.joypad = movie.input[frame - 1];
+		priv.hash = movie_hash_init();
+		gb_run_frame(&gb);
+
+		if(movie_hash_frame(&movie, frame) &&
+				checked < movie.hashes)
+		{
+			if(priv.hash != movie.hash[checked] && mismatches++ == 0)
+			{
+				printf("First mismatch at frame %lu\n",
+						(unsigned long)frame);
+			}
+
+			checked++;
+		}
+
+		if(save && save_frame(&priv, frame) != 0)
+			fprintf(stderr, "Unable to save frame %lu\n",
+					(unsigned long)frame);
+	}
+
+	seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+	printf("Replayed %lu frames in %.2f s (%.0f FPS)\n",
+			(unsigned long)movie.frames, seconds,
+			seconds > 0 ? movie.frames / seconds : 0);
+	printf("%lu of %lu frame hashes match\n",
+			(unsigned long)(checked - mismatches),
+			(unsigned long)checked);
+
+	if(mismatches == 0)
+		ret = EXIT_SUCCESS;
+
+out:
+	movie_free(&movie);
+	free(cart_ram);
+	free(saves);
+	free(rom);
+	return ret;
+}
@@ -0,0 +1,359 @@
+/**
+ * MIT License
+ * Copyright (c) 2018-2023 Mahyar Koshkouei
+ *
+ * Movie files for Peanut-GB. A movie holds the save state that the recording
+ * started from, the joypad state of each frame, and a hash of the LCD output
+ * of every few frames, so that a replay can be checked against the recording.
+ *
+ * Layout of a movie file. Every value is little endian, as are the fields of
+ * the save state. The APU state at the end of the save state, if the recording
+ * front-end gave one with gb_init_audio_state(), is in the format of its APU
+ * and is skipped by front-ends without an APU.
+ *   "PGBM", version (u8), ROM header checksum (u8), ROM global checksum (u16),
+ *   frames (u32), hash interval (u32),
+ *   state size (u32), save state,
+ *   input size (u32), input as pairs of the joypad (u8) and the number of
+ *   frames it is held for (LEB128),
+ *   hash count (u32), one hash (u32) for every hash interval frames.
+ *
+ * Must be included after peanut_gb.h.
+ */
+
+#ifndef PEANUT_MOVIE_H
+#define PEANUT_MOVIE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MOVIE_VERSION		1
+/* Hash the LCD output of one of every this many frames. */
+#define MOVIE_HASH_INTERVAL	60
+
+struct movie_s
+{
+	uint8_t header_checksum;
+	uint16_t global_checksum;
+
+	/* Save state that the movie starts from. */
+	uint8_t *state;
+	size_t state_size;
+
+	/* Joypad state of each frame. */
+	uint8_t *input;
+	uint_fast32_t frames;
+	uint_fast32_t frames_max;
+
+	/* Hash of the LCD output of every hash_interval frames. */
+	uint32_t *hash;
+	uint_fast32_t hash_interval;
+	uint_fast32_t hashes;
+};
+
+/**
+ * Adds a line of LCD output to the hash of a frame. The hash of a frame is
+ * set to movie_hash_init() before the frame is run, and is FNV-1a over each
+ * line that is drawn in order. Frames that draw no lines, such as whilst the
+ * LCD is off, therefore hash to movie_hash_init().
+ */
+static inline uint32_t movie_hash_init(void)
+{
+	return 2166136261u;
+}
+
+static inline uint32_t movie_hash_line(uint32_t hash,
+		const uint8_t pixels[LCD_WIDTH])
+{
+	for(unsigned int x = 0; x < LCD_WIDTH; x++)
+	{
+		hash ^= pixels[x];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/**
+ * Returns non-zero if the hash of the given frame is recorded in the movie.
+ * Frames are counted from 1.
+ */
+static inline int movie_hash_frame(const struct movie_s *m,
+		uint_fast32_t frame)
+{
+	return frame % m->hash_interval == 0;
+}
+
+static inline void movie_free(struct movie_s *m)
+{
+	free(m->state);
+	free(m->input);
+	free(m->hash);
+	memset(m, 0, sizeof(*m));
+}
+
+/**
+ * Returns 0 if the movie was recorded with the game in the emulator context.
+ */
+static inline int movie_check_rom(const struct movie_s *m, struct gb_s *gb)
+{
+	const uint16_t global_checksum = (gb->gb_rom_read(gb, 0x014E) << 8) |
+		gb->gb_rom_read(gb, 0x014F);
+
+	return m->header_checksum == gb->gb_rom_read(gb, 0x014D) &&
+		m->global_checksum == global_checksum ? 0 : -1;
+}
+
+/**
+ * Starts recording a movie from the current state of the emulator.
+ * Returns 0 on success, or -1 if memory could not be allocated.
+ */
+static inline int movie_record_start(struct movie_s *m, struct gb_s *gb)
+{
+	memset(m, 0, sizeof(*m));
+	m->header_checksum = gb->gb_rom_read(gb, 0x014D);
+	m->global_checksum = (gb->gb_rom_read(gb, 0x014E) << 8) |
+		gb->gb_rom_read(gb, 0x014F);
+	m->hash_interval = MOVIE_HASH_INTERVAL;
+
+	m->state_size = gb_state_size(gb, GB_STATE_CART_RAM | GB_STATE_APU);
+	m->state = malloc(m->state_size);
+	if(m->state == NULL)
+		return -1;
+
+	gb_state_save(gb, m->state, GB_STATE_CART_RAM | GB_STATE_APU);
+	return 0;
+}
+
+/**
+ * Records the joypad state of the next frame. Must be called before each
+ * frame is run. Returns 0 on success, or -1 if memory could not be allocated.
+ */
+static inline int movie_record_input(struct movie_s *m, uint8_t joypad)
+{
+	if(m->frames == m->frames_max)
+	{
+		const uint_fast32_t frames_max =
+			m->frames_max != 0 ? m->frames_max * 2 : 60 * 60;
+		uint8_t *input = realloc(m->input, frames_max);
+
+		if(input == NULL)
+			return -1;
+
+		m->input = input;
+		m->frames_max = frames_max;
+	}
+
+	m->input[m->frames++] = joypad;
+	return 0;
+}
+
+/**
+ * Records the hash of the frame that was just run, if it is one of the frames
+ * that are hashed. Returns 0 on success, or -1 if memory could not be
+ * allocated.
+ */
+static inline int movie_record_hash(struct movie_s *m, uint32_t hash)
+{
+	uint32_t *hashes;
+
+	if(!movie_hash_frame(m, m->frames))
+		return 0;
+
+	hashes = realloc(m->hash, (m->hashes + 1) * sizeof(*m->hash));
+	if(hashes == NULL)
+		return -1;
+
+	m->hash = hashes;
+	m->hash[m->hashes++] = hash;
+	return 0;
+}
+
+static inline void movie_put_u32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static inline uint32_t movie_get_u32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) |
+		((uint32_t)p[3] << 24);
+}
+
+/**
+ * Writes a movie to a file. Returns 0 on success, or -1 on error.
+ */
+static inline int movie_save(const struct movie_s *m, const char *file_name)
+{
+	/* Each run of input takes at most six bytes. */
+	uint8_t *rle = malloc(m->frames * 6 + 4);
+	uint8_t hdr[20];
+	size_t rle_size = 0;
+	FILE *f;
+	int ret = -1;
+
+	if(rle == NULL)
+		return -1;
+
+	for(uint_fast32_t i = 0; i < m->frames;)
+	{
+		const uint8_t joypad = m->input[i];
+		uint_fast32_t run = 0;
+
+		while(i < m->frames && m->input[i] == joypad)
+		{
+			run++;
+			i++;
+		}
+
+		rle[rle_size++] = joypad;
+		do
+		{
+			rle[rle_size++] = (run & 0x7F) | (run > 0x7F ? 0x80 : 0);
+			run >>= 7;
+		} while(run != 0);
+	}
+
+	f = fopen(file_name, "wb");
+	if(f == NULL)
+		goto out;
+
+	memcpy(hdr, "PGBM", 4);
+	hdr[4] = MOVIE_VERSION;
+	hdr[5] = m->header_checksum;
+	hdr[6] = m->global_checksum;
+	hdr[7] = m->global_checksum >> 8;
+	movie_put_u32(hdr + 8, m->frames);
+	movie_put_u32(hdr + 12, m->hash_interval);
+	movie_put_u32(hdr + 16, m->state_size);
+	if(fwrite(hdr, 1, 20, f) != 20 ||
+			fwrite(m->state, 1, m->state_size, f) != m->state_size)
+		goto close;
+
+	movie_put_u32(hdr, rle_size);
+	if(fwrite(hdr, 1, 4, f) != 4 ||
+			fwrite(rle, 1, rle_size, f) != rle_size)
+		goto close;
+
+	movie_put_u32(hdr, m->hashes);
+	if(fwrite(hdr, 1, 4, f) != 4)
+		goto close;
+
+	for(uint_fast32_t i = 0; i < m->hashes; i++)
+	{
+		movie_put_u32(hdr, m->hash[i]);
+		if(fwrite(hdr, 1, 4, f) != 4)
+			goto close;
+	}
+
+	ret = 0;
+
+close:
+	if(fclose(f) != 0)
+		ret = -1;
+out:
+	free(rle);
+	return ret;
+}
+
+/**
+ * Reads a movie from a file. Returns 0 on success, or -1 if the file could
+ * not be read or is not a valid movie.
+ */
+static inline int movie_load(struct movie_s *m, const char *file_name)
+{
+	FILE *f = fopen(file_name, "rb");
+	uint8_t hdr[20];
+	uint8_t *rle = NULL;
+	size_t rle_size;
+	int ret = -1;
+
+	memset(m, 0, sizeof(*m));
+	if(f == NULL)
+		return -1;
+
+	if(fread(hdr, 1, 20, f) != 20 || memcmp(hdr, "PGBM", 4) != 0 ||
+			hdr[4] != MOVIE_VERSION)
+		goto out;
+
+	m->header_checksum = hdr[5];
+	m->global_checksum = hdr[6] | (hdr[7] << 8);
+	m->frames = movie_get_u32(hdr + 8);
+	m->frames_max = m->frames;
+	m->hash_interval = movie_get_u32(hdr + 12);
+	m->state_size = movie_get_u32(hdr + 16);
+	if(m->hash_interval == 0)
+		goto out;
+
+	m->state = malloc(m->state_size);
+	m->input = malloc(m->frames != 0 ? m->frames : 1);
+	if(m->state == NULL || m->input == NULL ||
+			fread(m->state, 1, m->state_size, f) != m->state_size ||
+			fread(hdr, 1, 4, f) != 4)
+		goto out;
+
+	rle_size = movie_get_u32(hdr);
+	rle = malloc(rle_size != 0 ? rle_size : 1);
+	if(rle == NULL || fread(rle, 1, rle_size, f) != rle_size)
+		goto out;
+
+	for(size_t i = 0, frame = 0; frame < m->frames;)
+	{
+		uint_fast32_t run = 0;
+		uint8_t joypad;
+		unsigned int shift = 0;
+
+		if(i == rle_size)
+			goto out;
+
+		joypad = rle[i++];
+		do
+		{
+			if(i == rle_size || shift > 28)
+				goto out;
+
+			run |= (uint_fast32_t)(rle[i] & 0x7F) << shift;
+			shift += 7;
+		} while(rle[i++] & 0x80);
+
+		if(run > m->frames - frame)
+			goto out;
+
+		memset(m->input + frame, joypad, run);
+		frame += run;
+	}
+
+	if(fread(hdr, 1, 4, f) != 4)
+		goto out;
+
+	m->hashes = movie_get_u32(hdr);
+	if(m->hashes > m->frames / m->hash_interval)
+		goto out;
+
+	m->hash = malloc((m->hashes != 0 ? m->hashes : 1) * sizeof(*m->hash));
+	if(m->hash == NULL)
+		goto out;
+
+	for(uint_fast32_t i = 0; i < m->hashes; i++)
+	{
+		if(fread(hdr, 1, 4, f) != 4)
+			goto out;
+
+		m->hash[i] = movie_get_u32(hdr);
+	}
+
+	ret = 0;
+
+out:
+	fclose(f);
+	free(rle);
+	if(ret != 0)
+		movie_free(m);
+
+	return ret;
+}
+
+#endif /* PEANUT_MOVIE_H */
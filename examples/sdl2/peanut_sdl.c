@@ -17,10 +17,15 @@
 #	include "minigb_apu/minigb_apu.h"
 #endif
 
+#if defined(ENABLE_SOUND_BLARGG)
 uint8_t audio_read(uint16_t addr);
 void audio_write(uint16_t addr, uint8_t val);
+#endif
 
+/* Hold Tab to rewind the game. */
+#define PEANUT_GB_REWIND 1
 #include "../../peanut_gb.h"
+#include "../replay/peanut_movie.h"
 
 enum {
 	LOG_CATERGORY_PEANUTSDL = SDL_LOG_CATEGORY_CUSTOM
@@ -43,9 +48,15 @@ struct priv_t
 	/* Colour palette for each BG, OBJ0, and OBJ1. */
 	uint16_t selected_palette[3][4];
 	uint16_t fb[LCD_HEIGHT][LCD_WIDTH];
-};
+	/* Hash of the last frame, which is recorded in movies. */
+	uint32_t frame_hash;
 
-static struct minigb_apu_ctx apu;
+#if defined(ENABLE_SOUND_MINIGB)
+	/* Audio processing unit of this emulator. */
+	struct minigb_apu_ctx apu;
+	SDL_AudioDeviceID audio_dev;
+#endif
+};
 
 /**
  * Returns a byte from the ROM file at the given address.
@@ -81,21 +92,78 @@ uint8_t gb_bootrom_read(struct gb_s *gb, const uint_fast16_t addr)
 	return p->bootrom[addr];
 }
 
-uint8_t audio_read(uint16_t addr)
+#if defined(ENABLE_SOUND_MINIGB)
+uint8_t gb_audio_read(struct gb_s *gb, const uint_fast16_t addr)
+{
+	struct priv_t * const p = gb->direct.priv;
+	return minigb_apu_audio_read(&p->apu, addr);
+}
+
+void gb_audio_write(struct gb_s *gb, const uint_fast16_t addr,
+		const uint8_t val)
+{
+	struct priv_t * const p = gb->direct.priv;
+	minigb_apu_audio_write(&p->apu, addr, val);
+}
+
+/**
+ * Saves the state of the APU in save states, such as to rewind it.
+ */
+void gb_audio_state_save(struct gb_s *gb, void *buf)
 {
-	return minigb_apu_audio_read(&apu, addr);
+	struct priv_t * const p = gb->direct.priv;
+
+	SDL_LockAudioDevice(p->audio_dev);
+	SDL_memcpy(buf, &p->apu, sizeof(p->apu));
+	SDL_UnlockAudioDevice(p->audio_dev);
 }
 
-void audio_write(uint16_t addr, uint8_t val)
+void gb_audio_state_load(struct gb_s *gb, const void *buf)
 {
-	minigb_apu_audio_write(&apu, addr, val);
+	struct priv_t * const p = gb->direct.priv;
+
+	SDL_LockAudioDevice(p->audio_dev);
+	SDL_memcpy(&p->apu, buf, sizeof(p->apu));
+	SDL_UnlockAudioDevice(p->audio_dev);
 }
 
 void audio_callback(void *ptr, uint8_t *data, int len)
 {
-	minigb_apu_audio_callback(&apu, (void *)data);
+	struct minigb_apu_ctx *apu = ptr;
+	minigb_apu_audio_callback(apu, (void *)data);
+}
+#elif defined(ENABLE_SOUND_BLARGG)
+/* Gb_Snd_Emu has a single global APU, which is given to the emulator in the
+ * same way as MiniGB APU. */
+uint8_t gb_audio_read(struct gb_s *gb, const uint_fast16_t addr)
+{
+	(void)gb;
+	return audio_read(addr);
 }
 
+void gb_audio_write(struct gb_s *gb, const uint_fast16_t addr,
+		const uint8_t val)
+{
+	(void)gb;
+	audio_write(addr, val);
+}
+#endif
+
+#if defined(ENABLE_SOUND_BLARGG) || defined(ENABLE_SOUND_MINIGB)
+/**
+ * Drops writes to the APU while running ahead, so that frames that are run
+ * ahead are not heard. Reads still go to the APU with gb_audio_read(), so the
+ * game reads its registers as they were before running ahead.
+ */
+void gb_audio_write_ahead(struct gb_s *gb, const uint_fast16_t addr,
+		const uint8_t val)
+{
+	(void)gb;
+	(void)addr;
+	(void)val;
+}
+#endif
+
 void read_cart_ram_file(const char *save_file_name, uint8_t **dest,
 			const size_t len)
 {
@@ -565,13 +633,15 @@ void lcd_draw_line(struct gb_s *gb, const uint8_t pixels[160],
 		   const uint_fast8_t line)
 {
 	struct priv_t *priv = gb->direct.priv;
+	uint32_t palette[12];
 
-	for(unsigned int x = 0; x < LCD_WIDTH; x++)
-	{
-		priv->fb[line][x] = priv->selected_palette
-				    [(pixels[x] & LCD_PALETTE_ALL) >> 4]
-				    [pixels[x] & 3];
-	}
+	for(unsigned int i = 0; i < 12; i++)
+		palette[i] = priv->selected_palette[i >> 2][i & 3];
+
+	priv->frame_hash = movie_hash_line(priv->frame_hash, pixels);
+
+	gb_lcd_convert_line(priv->fb[line], pixels, GB_PIXEL_FORMAT_RGB555,
+			palette);
 }
 #endif
 
@@ -613,6 +683,123 @@ ret:
 	return ret;
 }
 
+/**
+ * Returns the file name of the movie of the game, which is saved in the
+ * current folder.
+ */
+void get_movie_file_name(struct gb_s *gb, char file_name[32])
+{
+	char title_str[16];
+
+	SDL_snprintf(file_name, 32, "%.16s.pgbm",
+			gb_get_rom_name(gb, title_str));
+}
+
+/**
+ * Loads the movie of the game and starts playing it back. The state before
+ * playing back is saved in return_state. Returns 0 on success.
+ */
+int movie_play_start(struct gb_s *gb, struct movie_s *movie,
+		uint8_t **return_state)
+{
+	char file_name[32];
+
+	get_movie_file_name(gb, file_name);
+	if(movie_load(movie, file_name) != 0)
+	{
+		SDL_LogMessage(LOG_CATERGORY_PEANUTSDL,
+				SDL_LOG_PRIORITY_WARN,
+				"Unable to read movie %s", file_name);
+		return -1;
+	}
+
+	*return_state = SDL_malloc(gb_state_size(gb,
+				GB_STATE_CART_RAM | GB_STATE_APU));
+	if(movie_check_rom(movie, gb) != 0 || *return_state == NULL)
+		goto err;
+
+	gb_state_save(gb, *return_state, GB_STATE_CART_RAM | GB_STATE_APU);
+	if(gb_state_load(gb, movie->state, movie->state_size) !=
+			GB_STATE_NO_ERROR)
+		goto err;
+
+	SDL_LogMessage(LOG_CATERGORY_PEANUTSDL, SDL_LOG_PRIORITY_INFO,
+			"Playing back %s", file_name);
+	return 0;
+
+err:
+	SDL_LogMessage(LOG_CATERGORY_PEANUTSDL, SDL_LOG_PRIORITY_WARN,
+			"Movie %s was not recorded with this game", file_name);
+	SDL_free(*return_state);
+	*return_state = NULL;
+	movie_free(movie);
+	return -1;
+}
+
+/**
+ * Stops playing back a movie, and returns to the state before it was played
+ * back so that the save file is not changed by the movie.
+ */
+void movie_play_stop(struct gb_s *gb, struct movie_s *movie,
+		uint8_t **return_state)
+{
+	gb_state_load(gb, *return_state,
+			gb_state_size(gb, GB_STATE_CART_RAM | GB_STATE_APU));
+	SDL_free(*return_state);
+	*return_state = NULL;
+	movie_free(movie);
+	SDL_LogMessage(LOG_CATERGORY_PEANUTSDL, SDL_LOG_PRIORITY_INFO,
+			"Stopped playing back movie");
+}
+
+/**
+ * Stops recording a movie and saves it.
+ */
+void movie_record_stop(struct gb_s *gb, struct movie_s *movie)
+{
+	char file_name[32];
+
+	get_movie_file_name(gb, file_name);
+	if(movie_save(movie, file_name) == 0)
+		SDL_LogMessage(LOG_CATERGORY_PEANUTSDL,
+				SDL_LOG_PRIORITY_INFO,
+				"Saved %lu frames to %s",
+				(unsigned long)movie->frames, file_name);
+	else
+		SDL_LogMessage(LOG_CATERGORY_PEANUTSDL,
+				SDL_LOG_PRIORITY_WARN,
+				"Unable to save movie %s", file_name);
+
+	movie_free(movie);
+}
+
+/**
+ * Runs the given number of frames ahead with the current input, drawing only
+ * the last one, and then returns to the state before running ahead. Games that
+ * take a few frames to respond to input then appear to respond sooner.
+ */
+void run_ahead(struct gb_s *gb, uint8_t *state, unsigned int frames)
+{
+	const size_t size = gb_state_save(gb, state, GB_STATE_CART_RAM);
+
+#if defined(ENABLE_SOUND_BLARGG) || defined(ENABLE_SOUND_MINIGB)
+	/* Frames that are run ahead are not heard. */
+	gb_init_audio(gb, gb_audio_read, gb_audio_write_ahead);
+#endif
+
+	while(frames--)
+	{
+		gb->direct.skip_next_frame = frames != 0;
+		gb_run_frame(gb);
+	}
+
+	gb_state_load(gb, state, size);
+
+#if defined(ENABLE_SOUND_BLARGG) || defined(ENABLE_SOUND_MINIGB)
+	gb_init_audio(gb, gb_audio_read, gb_audio_write);
+#endif
+}
+
 int main(int argc, char **argv)
 {
 	struct gb_s gb;
@@ -632,6 +819,19 @@ int main(int argc, char **argv)
 	enum gb_init_error_e gb_ret;
 	unsigned int fast_mode = 1;
 	unsigned int fast_mode_timer = 1;
+	unsigned int rewinding = 0;
+	/* Number of frames to run ahead of the frame that is emulated. */
+	unsigned int run_ahead_frames = 0;
+	unsigned int run_ahead_now;
+	uint8_t *run_ahead_state = NULL;
+	/* Movie that is being recorded or played back. */
+	struct movie_s movie = { 0 };
+	enum {
+		MOVIE_OFF, MOVIE_RECORD, MOVIE_PLAY
+	} movie_mode = MOVIE_OFF;
+	uint_fast32_t movie_frame = 0;
+	/* State to return to after playing back a movie. */
+	uint8_t *movie_return_state = NULL;
 	/* Record save file every 60 seconds. */
 	int save_timer = 60;
 	/* Must be freed */
@@ -878,14 +1078,13 @@ int main(int argc, char **argv)
 #endif
 	}
 
-#if ENABLE_SOUND
+#if defined(ENABLE_SOUND_BLARGG) || defined(ENABLE_SOUND_MINIGB)
 	SDL_AudioDeviceID dev;
 #endif
 
-#if ENABLE_SOUND == 0
-	// Sound is disabled, so do nothing.
-#elif defined(ENABLE_SOUND_BLARGG)
+#if defined(ENABLE_SOUND_BLARGG)
 	audio_init(&dev);
+	gb_init_audio(&gb, gb_audio_read, gb_audio_write);
 #elif defined(ENABLE_SOUND_MINIGB)
 	{
 		SDL_AudioSpec want, have;
@@ -895,7 +1094,7 @@ int main(int argc, char **argv)
 		want.channels = 2;
 		want.samples = AUDIO_SAMPLES;
 		want.callback = audio_callback;
-		want.userdata = NULL;
+		want.userdata = &priv.apu;
 
 		SDL_LogMessage(LOG_CATERGORY_PEANUTSDL,
 				SDL_LOG_PRIORITY_INFO,
@@ -911,11 +1110,28 @@ int main(int argc, char **argv)
 			exit(EXIT_FAILURE);
 		}
 
-		minigb_apu_audio_init(&apu);
+		minigb_apu_audio_init(&priv.apu);
+		priv.audio_dev = dev;
+		gb_init_audio(&gb, gb_audio_read, gb_audio_write);
+		gb_init_audio_state(&gb, sizeof(priv.apu), gb_audio_state_save,
+				gb_audio_state_load);
 		SDL_PauseAudioDevice(dev, 0);
 	}
+#else
+	// Sound is disabled, so do nothing.
 #endif
 
+	/* Keep up to five minutes of frames to rewind to. The APU must be
+	 * given to the emulator first so that it is rewound too. */
+	if(gb_rewind_init(&gb, 16 * 1024 * 1024, 5 * 60 * 60, 60) != 0)
+	{
+		SDL_LogMessage(LOG_CATERGORY_PEANUTSDL,
+				SDL_LOG_PRIORITY_WARN,
+				"Unable to allocate memory for rewinding");
+	}
+
+	run_ahead_state = SDL_malloc(gb_state_size(&gb, GB_STATE_CART_RAM));
+
 #if ENABLE_LCD
 	gb_init_lcd(&gb, &lcd_draw_line);
 #endif
@@ -1184,7 +1400,83 @@ int main(int argc, char **argv)
 					break;
 
 				case SDLK_r:
-					gb_reset(&gb);
+					/* Resets are not recorded in movies. */
+					if(movie_mode == MOVIE_OFF)
+						gb_reset(&gb);
+					break;
+
+				case SDLK_TAB:
+					/* Movies can not be rewound. */
+					rewinding = movie_mode == MOVIE_OFF;
+					break;
+
+				case SDLK_m:
+					if(movie_mode == MOVIE_RECORD)
+					{
+						movie_record_stop(&gb, &movie);
+						movie_mode = MOVIE_OFF;
+						break;
+					}
+
+					if(movie_mode != MOVIE_OFF)
+						break;
+
+					/* Shift + m records from power on. */
+					if(event.key.keysym.mod & KMOD_SHIFT)
+						gb_reset(&gb);
+
+					if(movie_record_start(&movie, &gb) != 0)
+					{
+						movie_free(&movie);
+						break;
+					}
+
+					SDL_LogMessage(LOG_CATERGORY_PEANUTSDL,
+							SDL_LOG_PRIORITY_INFO,
+							"Recording movie");
+					movie_mode = MOVIE_RECORD;
+					movie_frame = 0;
+					rewinding = 0;
+					/* Draw whole frames, so that their
+					 * hashes can be recorded. */
+					gb.direct.interlace = false;
+					gb.direct.frame_skip = false;
+					break;
+
+				case SDLK_n:
+					if(movie_mode == MOVIE_PLAY)
+					{
+						movie_play_stop(&gb, &movie,
+							&movie_return_state);
+						movie_mode = MOVIE_OFF;
+						break;
+					}
+
+					if(movie_mode != MOVIE_OFF)
+						break;
+
+					if(movie_play_start(&gb, &movie,
+						&movie_return_state) != 0)
+						break;
+
+					movie_mode = MOVIE_PLAY;
+					movie_frame = 0;
+					rewinding = 0;
+					gb.direct.interlace = false;
+					gb.direct.frame_skip = false;
+					break;
+
+				case SDLK_l:
+					if(run_ahead_state == NULL)
+						break;
+
+					if(++run_ahead_frames > 4)
+						run_ahead_frames = 0;
+
+					SDL_LogMessage(LOG_CATERGORY_PEANUTSDL,
+							SDL_LOG_PRIORITY_INFO,
+							"Run-ahead: %u frames",
+							run_ahead_frames);
 					break;
 #if ENABLE_LCD
 
@@ -1274,6 +1566,10 @@ int main(int argc, char **argv)
 					fast_mode = 1;
 					break;
 
+				case SDLK_TAB:
+					rewinding = 0;
+					break;
+
 				case SDLK_f:
 					if(fullscreen)
 					{
@@ -1311,9 +1607,74 @@ int main(int argc, char **argv)
 			}
 		}
 
+		/* Frames that are skipped in fast mode are not drawn. When
+		 * running ahead, only the last frame that is run ahead is
+		 * drawn. */
+		run_ahead_now = run_ahead_frames != 0 && !rewinding &&
+			fast_mode_timer <= 1;
+		gb.direct.skip_next_frame = fast_mode_timer > 1 || run_ahead_now;
+
+		/* Frames whose hashes are in the movie are always drawn. */
+		if(movie_mode != MOVIE_OFF &&
+				movie_hash_frame(&movie, movie_frame + 1))
+			gb.direct.skip_next_frame = false;
+
+		if(movie_mode == MOVIE_PLAY)
+		{
+			if(movie_frame == movie.frames)
+			{
+				movie_play_stop(&gb, &movie,
+						&movie_return_state);
+				movie_mode = MOVIE_OFF;
+			}
+			else
+				gb.direct.joypad = movie.input[movie_frame];
+		}
+		else if(movie_mode == MOVIE_RECORD &&
+				movie_record_input(&movie,
+					gb.direct.joypad) != 0)
+		{
+			movie_record_stop(&gb, &movie);
+			movie_mode = MOVIE_OFF;
+		}
+
+		/* Go back one frame at a time whilst rewinding, and otherwise
+		 * keep a snapshot of each frame. */
+		if(rewinding)
+			gb_rewind_pop(&gb);
+
 		/* Execute CPU cycles until the screen has to be redrawn. */
+		priv.frame_hash = movie_hash_init();
 		gb_run_frame(&gb);
 
+		if(!rewinding)
+			gb_rewind_push(&gb);
+
+		if(movie_mode != MOVIE_OFF)
+			movie_frame++;
+
+		if(movie_mode == MOVIE_RECORD &&
+				movie_record_hash(&movie, priv.frame_hash) != 0)
+		{
+			movie_record_stop(&gb, &movie);
+			movie_mode = MOVIE_OFF;
+		}
+		else if(movie_mode == MOVIE_PLAY &&
+				movie_hash_frame(&movie, movie_frame) &&
+				movie_frame / movie.hash_interval <=
+					movie.hashes &&
+				movie.hash[movie_frame / movie.hash_interval -
+					1] != priv.frame_hash)
+		{
+			SDL_LogMessage(LOG_CATERGORY_PEANUTSDL,
+					SDL_LOG_PRIORITY_WARN,
+					"Movie does not match at frame %lu",
+					(unsigned long)movie_frame);
+		}
+
+		if(run_ahead_now)
+			run_ahead(&gb, run_ahead_state, run_ahead_frames);
+
 		/* Tick the internal RTC when 1 second has passed. */
 		rtc_timer += target_speed_ms / (double) fast_mode;
 
@@ -1439,6 +1800,12 @@ quit:
 #ifdef ENABLE_SOUND_BLARGG
 	audio_cleanup();
 #endif
+	gb_rewind_free(&gb);
+
+	if(movie_mode == MOVIE_RECORD)
+		movie_record_stop(&gb, &movie);
+	else if(movie_mode == MOVIE_PLAY)
+		movie_play_stop(&gb, &movie, &movie_return_state);
 
 	/* Record save file. */
 	write_cart_ram_file(save_file_name, &priv.cart_ram, priv.save_size);
@@ -1446,6 +1813,7 @@ quit:
 out:
 	SDL_free(priv.rom);
 	SDL_free(priv.cart_ram);
+	SDL_free(run_ahead_state);
 
 	/* If the save file name was automatically generated (which required memory
 	 * allocated on the help), then free it here. */
@@ -178,16 +178,14 @@ void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16_t addr
 void core1_lcd_draw_line(const uint_fast8_t line)
 {
     static uint16_t fb[LCD_WIDTH];
-    
-    // Convert Game Boy pixels to RGB565 colors
-    for (unsigned int x = 0; x < LCD_WIDTH; x++) {
-        uint8_t pixel_data = pixels_buffer[x];
-        uint8_t shade = pixel_data & 3;  // Lower 2 bits for shade
-        uint8_t layer = (pixel_data >> 4) & 3;  // Upper 2 bits for layer
-        
-        // Use the palette to get the actual color
-        fb[x] = palette[layer][shade];
-    }
+    uint32_t lut[12];
+
+    // Convert Game Boy pixels to RGB565 colors, using the OBJ0, OBJ1 and
+    // BG palettes
+    for (unsigned int i = 0; i < 12; i++)
+        lut[i] = palette[i >> 2][i & 3];
+
+    gb_lcd_convert_line(fb, pixels_buffer, GB_PIXEL_FORMAT_RGB565, lut);
     
     // Calculate display position (center the 160x144 Game Boy screen on 240x240 display)
     uint16_t display_x = (SCREEN_SIZE_X - LCD_WIDTH) / 2;  // 40
@@ -76,9 +76,12 @@
 
 /** Definitions for compile-time setting of features. **/
 /**
- * Sound support must be provided by an external library. When audio_read() and
- * audio_write() functions are provided, define ENABLE_SOUND to a non-zero value
- * before including peanut_gb.h in order for these functions to be used.
+ * Sound support must be provided by an external library, which is given the
+ * APU registers of each emulator context with gb_init_audio().
+ * Alternatively, when global audio_read() and audio_write() functions are
+ * provided, define ENABLE_SOUND to a non-zero value before including
+ * peanut_gb.h in order for these functions to be used by every context that
+ * gb_init_audio() was not called for. This alternative is deprecated.
  */
 #ifndef ENABLE_SOUND
 # define ENABLE_SOUND 0
@@ -105,6 +108,131 @@
 # define PEANUT_GB_USE_INTRINSICS 1
 #endif
 
+/* Dispatch opcodes with a direct-threaded interpreter loop using the labels as
+ * values extension of GCC and Clang. gb_run_frame() then stays within a single
+ * function for the whole frame, and each opcode handler jumps straight to the
+ * next handler. Ignored on other compilers. */
+#ifndef PEANUT_GB_THREADED_DISPATCH
+# define PEANUT_GB_THREADED_DISPATCH 0
+#endif
+#if PEANUT_GB_THREADED_DISPATCH && !defined(__GNUC__)
+# undef PEANUT_GB_THREADED_DISPATCH
+# define PEANUT_GB_THREADED_DISPATCH 0
+#endif
+
+/* Map each 4 KiB page of the address space to host memory where possible, so
+ * that most reads and writes are a single indexed load or store. ROM pages are
+ * only mapped when the ROM is given to gb_init_buffer(). */
+#ifndef PEANUT_GB_USE_MEMORY_MAP
+# define PEANUT_GB_USE_MEMORY_MAP 1
+#endif
+
+/* Experimental: translate blocks of guest instructions into native x86-64 code
+ * at run time. Only used after gb_jit_init() succeeds, with the interpreter
+ * executing any instruction that is not translated. Blocks are not chained to
+ * each other and guest registers are not kept in host registers, so the JIT is
+ * only slightly faster than the interpreter. Requires GCC or Clang on an x86-64
+ * Unix host with anonymous mmap(), and is ignored elsewhere. */
+#ifndef PEANUT_GB_JIT
+# define PEANUT_GB_JIT 0
+#endif
+#if PEANUT_GB_JIT && !(defined(__GNUC__) && defined(__x86_64__) && \
+		defined(__unix__))
+# undef PEANUT_GB_JIT
+# define PEANUT_GB_JIT 0
+#endif
+#if PEANUT_GB_JIT
+# include <sys/mman.h>	/* Required for mmap */
+# if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#  define MAP_ANONYMOUS MAP_ANON
+# endif
+/* Anonymous mappings are hidden by strict modes such as -std=c99 on glibc,
+ * unless a feature test macro such as _DEFAULT_SOURCE is defined. */
+# if !defined(MAP_ANONYMOUS)
+#  undef PEANUT_GB_JIT
+#  define PEANUT_GB_JIT 0
+# endif
+#endif
+
+/* Detect short loops that only poll memory, such as waiting for LY to reach a
+ * given line, and skip the iterations that complete before the next event that
+ * could change what is read. Timing is not affected. Only loops run by the
+ * interpreter are detected, so loops translated by the JIT are not skipped. */
+#ifndef PEANUT_GB_IDLE_LOOP_SKIP
+# define PEANUT_GB_IDLE_LOOP_SKIP 0
+#endif
+
+/* Decode each instruction in ROM, WRAM and HRAM once into a record holding its
+ * opcode, operands and cycles, so that the interpreter does not fetch every
+ * byte through __gb_read() each time. Decoded instructions are only kept after
+ * gb_predecode_init() succeeds. Portable, but uses more memory. */
+#ifndef PEANUT_GB_PREDECODE
+# define PEANUT_GB_PREDECODE 0
+#endif
+
+/* Record the operands and result of 8-bit arithmetic and logic instructions
+ * instead of setting each flag, and only work out the flags when they are read.
+ * Most results are overwritten before their flags are read. The F register is
+ * up to date whenever gb_run_frame(), gb_run_cycles() or gb_run_until()
+ * returns. */
+#ifndef PEANUT_GB_LAZY_FLAGS
+# define PEANUT_GB_LAZY_FLAGS 0
+#endif
+
+/* Execute CB prefixed instructions with a separate case for each of the 256
+ * opcodes, instead of decoding the register, bit and operation each time. */
+#ifndef PEANUT_GB_CB_TABLE
+# define PEANUT_GB_CB_TABLE 0
+#endif
+
+/* Keep the pixels of every tile in VRAM decoded, and only decode a tile again
+ * after it is written to. This uses 48 KiB more memory in each emulator
+ * context. */
+#ifndef PEANUT_GB_TILE_CACHE
+# define PEANUT_GB_TILE_CACHE 0
+#endif
+
+/* Draw the background and window eight pixels at a time using 64-bit integer
+ * operations (SIMD within a register). Enabled by default on 64-bit hosts, as
+ * it may be slower than drawing each pixel on 32-bit microcontrollers. */
+#ifndef PEANUT_GB_SWAR_LCD
+# if UINTPTR_MAX > 0xFFFFFFFF
+#  define PEANUT_GB_SWAR_LCD 1
+# else
+#  define PEANUT_GB_SWAR_LCD 0
+# endif
+#endif
+
+/* Keep a list of the sprites on each line, which is only updated after OAM or
+ * the sprite size is changed, instead of checking all 40 sprites on every
+ * line. Front-ends that change gb->oam directly must then set
+ * gb->sprite_lines.dirty. */
+#ifndef PEANUT_GB_SPRITE_BUCKETS
+# define PEANUT_GB_SPRITE_BUCKETS 1
+#endif
+#if !ENABLE_LCD
+# undef PEANUT_GB_SPRITE_BUCKETS
+# define PEANUT_GB_SPRITE_BUCKETS 0
+#endif
+
+/* Keep a hash of the tiles, sprites and registers used to draw each line, and
+ * skip drawing lines that are the same as in the previous frame. The lines
+ * drawn in each frame are given by gb_get_changed_lines(). */
+#ifndef PEANUT_GB_SKIP_UNCHANGED_LINES
+# define PEANUT_GB_SKIP_UNCHANGED_LINES 0
+#endif
+#if !ENABLE_LCD
+# undef PEANUT_GB_SKIP_UNCHANGED_LINES
+# define PEANUT_GB_SKIP_UNCHANGED_LINES 0
+#endif
+
+/* Keep a ring of snapshots of the last frames after gb_rewind_init()
+ * succeeds, each compressed as the difference to the last keyframe, so that
+ * the game can be rewound with gb_rewind_pop(). */
+#ifndef PEANUT_GB_REWIND
+# define PEANUT_GB_REWIND 0
+#endif
+
 /* Only include function prototypes. At least one file must *not* have this
  * defined. */
 // #define PEANUT_GB_HEADER_ONLY
@@ -138,6 +266,30 @@
 #define HRAM_ADDR       0xFF80
 #define INTR_EN_ADDR    0xFFFF
 
+/* I/O registers, as offsets from IO_ADDR. */
+#define IO_JOYP	0x00
+#define IO_SB	0x01
+#define IO_SC	0x02
+#define IO_DIV	0x04
+#define IO_TIMA	0x05
+#define IO_TMA	0x06
+#define IO_TAC	0x07
+#define IO_IF	0x0F
+#define IO_LCDC	0x40
+#define IO_STAT	0x41
+#define IO_SCY	0x42
+#define IO_SCX	0x43
+#define IO_LY	0x44
+#define IO_LYC	0x45
+#define	IO_DMA	0x46
+#define	IO_BGP	0x47
+#define	IO_OBP0	0x48
+#define IO_OBP1	0x49
+#define IO_WY	0x4A
+#define IO_WX	0x4B
+#define IO_BOOT	0x50
+#define IO_IE	0xFF
+
 /* Cart section sizes */
 #define ROM_BANK_SIZE   0x4000
 #define WRAM_BANK_SIZE  0x1000
@@ -221,6 +373,7 @@
 #define VRAM_BMAP_2         (0x9C00 - VRAM_ADDR)
 #define VRAM_TILES_3        (0x8000 - VRAM_ADDR + VRAM_BANK_SIZE)
 #define VRAM_TILES_4        (0x8800 - VRAM_ADDR + VRAM_BANK_SIZE)
+#define VRAM_TILES_NUM      0x180
 
 /* Interrupt jump addresses */
 #define VBLANK_INTR_ADDR    0x0040
@@ -313,6 +466,88 @@
 # endif
 #endif /* PEANUT_GB_USE_INTRINSICS */
 
+#if PEANUT_GB_LAZY_FLAGS
+/* Instruction whose flags are held in gb->lazy_flags rather than in F. */
+# define PGB_LAZY_NONE	0	/* F is up to date */
+# define PGB_LAZY_INC	1	/* C is kept in F */
+# define PGB_LAZY_DEC	2	/* C is kept in F */
+# define PGB_LAZY_ADD	3
+# define PGB_LAZY_SUB	4
+# define PGB_LAZY_AND	5
+# define PGB_LAZY_OR	6	/* Also used for XOR */
+
+/* Read the Z or C flag. */
+# define PGB_FLAG_Z()							\
+	(gb->lazy_flags.op == PGB_LAZY_NONE ? gb->cpu_reg.f.f_bits.z :	\
+		(gb->lazy_flags.res & 0xFF) == 0)
+# define PGB_FLAG_C()	__gb_flag_c(gb)
+/* Bring F up to date before it is read or partly written. */
+# define PGB_FLAGS_SYNC()						\
+	do {								\
+		if(gb->lazy_flags.op != PGB_LAZY_NONE)			\
+			__gb_flags_sync(gb);				\
+	} while(0)
+
+# define PGB_INSTR_LAZY(op_, lhs_, rhs_, res_)				\
+	do {								\
+		gb->lazy_flags.lhs = (lhs_);				\
+		gb->lazy_flags.rhs = (rhs_);				\
+		gb->lazy_flags.res = (res_);				\
+		gb->lazy_flags.op = (op_);				\
+	} while(0)
+
+# define PGB_INSTR_SBC_R8(r,cin)						\
+	{									\
+		const uint8_t rhs = (r);					\
+		const uint16_t temp = gb->cpu_reg.a - (rhs + (cin));		\
+		PGB_INSTR_LAZY(PGB_LAZY_SUB, gb->cpu_reg.a, rhs, temp);	\
+		gb->cpu_reg.a = (temp & 0xFF);					\
+	}
+
+# define PGB_INSTR_CP_R8(r)							\
+	{									\
+		const uint8_t rhs = (r);					\
+		const uint16_t temp = gb->cpu_reg.a - rhs;			\
+		PGB_INSTR_LAZY(PGB_LAZY_SUB, gb->cpu_reg.a, rhs, temp);	\
+	}
+
+# define PGB_INSTR_ADC_R8(r,cin)						\
+	{									\
+		const uint8_t rhs = (r);					\
+		const uint16_t temp = gb->cpu_reg.a + rhs + (cin);		\
+		PGB_INSTR_LAZY(PGB_LAZY_ADD, gb->cpu_reg.a, rhs, temp);	\
+		gb->cpu_reg.a = (temp & 0xFF);					\
+	}
+
+/* INC and DEC keep C, so it must be taken out of the last instruction. */
+# define PGB_INSTR_INC_R8(r)							\
+	if(gb->lazy_flags.op >= PGB_LAZY_ADD)					\
+		gb->cpu_reg.f.f_bits.c = __gb_flag_c(gb);			\
+	r++;									\
+	PGB_INSTR_LAZY(PGB_LAZY_INC, 0, 0, r)
+
+# define PGB_INSTR_DEC_R8(r)							\
+	if(gb->lazy_flags.op >= PGB_LAZY_ADD)					\
+		gb->cpu_reg.f.f_bits.c = __gb_flag_c(gb);			\
+	r--;									\
+	PGB_INSTR_LAZY(PGB_LAZY_DEC, 0, 0, r)
+
+# define PGB_INSTR_XOR_R8(r)							\
+	gb->cpu_reg.a ^= r;							\
+	PGB_INSTR_LAZY(PGB_LAZY_OR, 0, 0, gb->cpu_reg.a)
+
+# define PGB_INSTR_OR_R8(r)							\
+	gb->cpu_reg.a |= r;							\
+	PGB_INSTR_LAZY(PGB_LAZY_OR, 0, 0, gb->cpu_reg.a)
+
+# define PGB_INSTR_AND_R8(r)							\
+	gb->cpu_reg.a &= r;							\
+	PGB_INSTR_LAZY(PGB_LAZY_AND, 0, 0, gb->cpu_reg.a)
+#else
+# define PGB_FLAG_Z()		gb->cpu_reg.f.f_bits.z
+# define PGB_FLAG_C()		gb->cpu_reg.f.f_bits.c
+# define PGB_FLAGS_SYNC()	do {} while(0)
+
 #if defined(PGB_INTRIN_SBC)
 # define PGB_INSTR_SBC_R8(r,cin)						\
 	{									\
@@ -402,6 +637,7 @@
 	gb->cpu_reg.f.reg = 0;							\
 	gb->cpu_reg.f.f_bits.z = (gb->cpu_reg.a == 0x00);			\
 	gb->cpu_reg.f.f_bits.h = 1
+#endif /* PEANUT_GB_LAZY_FLAGS */
 
 #if PEANUT_GB_IS_LITTLE_ENDIAN
 # define PEANUT_GB_GET_LSB16(x) (x & 0xFF)
@@ -486,14 +722,39 @@ struct cpu_registers_s
 #undef PEANUT_GB_LE_REG
 };
 
+/* Hardware events that are scheduled at a given cycle. */
+enum gb_event_e
+{
+	GB_EVENT_LCD = 0,	/* LCD mode change, or frame end if LCD is off */
+	GB_EVENT_TIMA,		/* TIMA overflow */
+	GB_EVENT_SERIAL,	/* Serial transfer completion */
+	GB_EVENT_RTC,		/* RTC second */
+	GB_EVENT_STOP,		/* End of the budget given to gb_run_cycles() */
+
+	GB_EVENT_MAX
+};
+
+/* All times are counted in cycles since the last reset. */
 struct count_s
 {
-	uint_fast16_t lcd_count;	/* LCD Timing */
-	uint_fast16_t div_count;	/* Divider Register Counter */
+	uint64_t cycles;		/* Cycles executed */
+	uint64_t next_event;		/* Earliest deadline in event */
+	uint64_t event[GB_EVENT_MAX];	/* Deadlines, UINT64_MAX if unused */
+
+	/* Start of the current line. If the LCD is off, this is instead
+	 * when the LCD would have started the current frame. */
+	uint64_t lcd_start;
+	/* DIV counts the 256 cycle periods since this time. */
+	uint64_t div_start;
+	/* Times when the following counters were last brought up to date. */
+	uint64_t tima_sync;
+	uint64_t serial_sync;
+	uint64_t rtc_sync;
+
 	uint_fast16_t tima_count;	/* Timer Counter */
 	uint_fast16_t serial_count;	/* Serial Counter */
 	uint_fast32_t rtc_count;	/* RTC Counter */
-	uint_fast32_t lcd_off_count;	/* Cycles LCD has been disabled */
+	uint_fast32_t lcd_off_count;	/* Cycles LCD was disabled, while on */
 };
 
 #if ENABLE_LCD
@@ -547,6 +808,33 @@ enum gb_init_error_e
 	GB_INIT_INVALID_MAX
 };
 
+/**
+ * Parts of the emulator that are optionally saved in a save state.
+ */
+enum gb_state_flags_e
+{
+	/* Save the cart RAM, if the cartridge has any. */
+	GB_STATE_CART_RAM = 1,
+	/* Save the state of the APU given to gb_init_audio_state(), if any. */
+	GB_STATE_APU = 2
+};
+
+/**
+ * Errors that may occur when loading a save state.
+ */
+enum gb_state_error_e
+{
+	GB_STATE_NO_ERROR = 0,
+	/* Not a save state, or shorter than the save state. */
+	GB_STATE_INVALID,
+	/* Saved by a version of Peanut-GB with a different layout. */
+	GB_STATE_VERSION,
+	/* The cart RAM is a different size to that of the game. */
+	GB_STATE_CART_RAM_SIZE,
+	/* The APU state is a different size to that of the APU. */
+	GB_STATE_APU_SIZE
+};
+
 /**
  * Return codes for serial receive function, mainly for clarity.
  */
@@ -556,6 +844,50 @@ enum gb_serial_rx_ret_e
 	GB_SERIAL_RX_NO_CONNECTION = 1
 };
 
+/**
+ * Events that gb_run_until() can stop at. These may be combined.
+ */
+enum gb_run_event_e
+{
+	GB_RUN_FRAME = 0x01,		/* Frame has ended, as in gb_run_frame() */
+	GB_RUN_SCANLINE = 0x02,		/* LCD has started a new line */
+	GB_RUN_SERIAL = 0x04,		/* Serial transfer has completed */
+	GB_RUN_BREAKPOINT = 0x08,	/* PC has reached a breakpoint */
+	GB_RUN_CYCLES = 0x10		/* Budget of gb_run_cycles() is used */
+};
+
+/**
+ * Formats of the pixels written to frame buffers set with
+ * gb_init_lcd_frame().
+ */
+enum gb_pixel_format_e
+{
+	/* One byte per pixel, the same as the pixels given to lcd_draw_line. */
+	GB_PIXEL_FORMAT_SHADE = 0,
+	/* 16-bit RRRRRGGG GGGBBBBB in host byte order. */
+	GB_PIXEL_FORMAT_RGB565,
+	/* 16-bit RGB565 with the most significant byte first, as sent to many
+	 * SPI LCD panels. */
+	GB_PIXEL_FORMAT_RGB565_BE,
+	/* 16-bit 0RRRRRGG GGGBBBBB in host byte order. */
+	GB_PIXEL_FORMAT_RGB555,
+	/* 32-bit 0xRRGGBBAA in host byte order, with alpha set to 0xFF. */
+	GB_PIXEL_FORMAT_RGBA8888,
+	/* 32-bit 0x00RRGGBB in host byte order. */
+	GB_PIXEL_FORMAT_XRGB8888
+};
+
+/**
+ * Formats of the observation frames set with gb_set_lcd_obs().
+ */
+enum gb_obs_format_e
+{
+	/* Shade of each pixel, from 0 (lightest) to 3 (darkest). */
+	GB_OBS_FORMAT_SHADE = 0,
+	/* Luminance of each pixel, from 0 (black) to 255 (white). */
+	GB_OBS_FORMAT_LUMA
+};
+
 union cart_rtc
 {
 	struct
@@ -575,6 +907,16 @@ union cart_rtc
  * Only values within the `direct` struct may be modified directly by the
  * front-end implementation. Other variables must not be modified.
  */
+#if PEANUT_GB_JIT
+struct gb_jit_s;
+#endif
+#if PEANUT_GB_PREDECODE
+struct gb_predecode_s;
+#endif
+#if PEANUT_GB_REWIND
+struct gb_rewind_s;
+#endif
+
 struct gb_s
 {
 	/**
@@ -618,6 +960,15 @@ struct gb_s
 	void (*gb_serial_tx)(struct gb_s*, const uint8_t tx);
 	enum gb_serial_rx_ret_e (*gb_serial_rx)(struct gb_s*, uint8_t* rx);
 
+	/* Read and write APU registers 0xFF10 to 0xFF3F. */
+	uint8_t (*gb_audio_read)(struct gb_s*, const uint_fast16_t addr);
+	void (*gb_audio_write)(struct gb_s*, const uint_fast16_t addr,
+			const uint8_t val);
+	/* Save and restore the state of the APU in save states. */
+	size_t gb_audio_state_size;
+	void (*gb_audio_state_save)(struct gb_s*, void *buf);
+	void (*gb_audio_state_load)(struct gb_s*, const void *buf);
+
 	/* Read byte from boot ROM at given address. */
 	uint8_t (*gb_bootrom_read)(struct gb_s*, const uint_fast16_t addr);
 
@@ -654,16 +1005,127 @@ struct gb_s
 
 	union cart_rtc rtc_latched, rtc_real;
 
+	struct
+	{
+		/* ROM and cart RAM given to gb_init_buffer(). These are NULL if
+		 * the front-end provides its own read and write functions. */
+		const uint8_t *rom;
+		size_t rom_size;
+		uint8_t *cart_ram;
+		size_t cart_ram_size;
+
+#if PEANUT_GB_USE_MEMORY_MAP
+		/* Host memory for each 4 KiB page of the address space. Pages
+		 * set to NULL are handled by the address decoder instead. */
+		const uint8_t *read_page[16];
+		uint8_t *write_page[16];
+#endif
+	} mem;
+
+#if PEANUT_GB_JIT
+	/* Cache of translated code. NULL unless gb_jit_init() succeeded. */
+	struct gb_jit_s *jit;
+#endif
+#if PEANUT_GB_PREDECODE
+	/* Decoded instructions. NULL unless gb_predecode_init() succeeded. */
+	struct gb_predecode_s *predecode;
+#endif
+#if PEANUT_GB_REWIND
+	/* Snapshots to rewind to. NULL unless gb_rewind_init() succeeded. */
+	struct gb_rewind_s *rewind;
+#endif
+
 	struct cpu_registers_s cpu_reg;
 	//struct gb_registers_s gb_reg;
+#if PEANUT_GB_LAZY_FLAGS
+	/* Last instruction whose flags are not yet in cpu_reg.f. */
+	struct
+	{
+		uint16_t res;	/* Result, with the carry or borrow above */
+		uint8_t lhs;
+		uint8_t rhs;
+		uint8_t op;	/* PGB_LAZY_* */
+	} lazy_flags;
+#endif
 	struct count_s counter;
 
+	/* State of the last call to gb_run_frame(), gb_run_cycles() or
+	 * gb_run_until(). */
+	struct
+	{
+		/* Bitmap of breakpoints set with gb_set_breakpoints(). */
+		const uint8_t *breakpoints;
+		uint8_t mask;	/* Events that end the run */
+		/* Events from enum gb_run_event_e that occurred during the
+		 * run. May be read by the front-end. */
+		uint8_t events;
+		bool stop;	/* Set once an event in mask occurs */
+	} run;
+
+#if PEANUT_GB_IDLE_LOOP_SKIP
+	/* The last backward branch taken to a short loop. */
+	struct
+	{
+		uint64_t cycles;	/* Time the branch was last taken */
+		uint64_t next_event;	/* Next event at that time */
+		uint64_t skipped;	/* Cycles skipped since reset */
+		uint_fast16_t target;
+		uint_fast16_t end;	/* Address after the branch */
+		uint_fast16_t bank;
+		/* Cycles taken by each iteration, or 0 if the loop is not
+		 * idle. */
+		uint_fast16_t loop_cycles;
+	} idle;
+#endif
+
 	/* TODO: Allow implementation to allocate WRAM, VRAM and Frame Buffer. */
 	uint8_t wram[WRAM_SIZE];
 	uint8_t vram[VRAM_SIZE];
 	uint8_t oam[OAM_SIZE];
+	/* DIV and TIMA are only brought up to date when read by the game, so
+	 * hram_io[IO_DIV] and hram_io[IO_TIMA] are usually stale. Use
+	 * gb_get_io() to read them. */
 	uint8_t hram_io[HRAM_IO_SIZE];
 
+#if ENABLE_LCD && PEANUT_GB_TILE_CACHE
+	struct
+	{
+		/* Colour number of each pixel of each tile row, from left to
+		 * right, and from right to left for X flipped sprites. */
+		uint8_t row[2][VRAM_TILES_NUM][8][8];
+		/* Set bits mark tiles written to since they were decoded. */
+		uint8_t dirty[VRAM_TILES_NUM / 8];
+	} tile_cache;
+#endif
+
+#if PEANUT_GB_SPRITE_BUCKETS
+	struct
+	{
+# if PEANUT_GB_HIGH_LCD_ACCURACY
+		/* Up to ten sprites on each line, ordered by X position and
+		 * then by sprite number. */
+		uint8_t number[LCD_HEIGHT][MAX_SPRITES_LINE];
+		uint8_t count[LCD_HEIGHT];
+# else
+		/* Bit set for each sprite on each line. */
+		uint64_t mask[LCD_HEIGHT];
+# endif
+		/* Set when the lists must be updated before they are used. */
+		bool dirty;
+	} sprite_lines;
+#endif
+
+#if PEANUT_GB_SKIP_UNCHANGED_LINES
+	struct
+	{
+		/* Hash of what was last drawn on each line. 0 if the line must
+		 * be drawn again. */
+		uint64_t hash[LCD_HEIGHT];
+		/* Set bits mark the lines drawn in the current frame. */
+		uint8_t changed[LCD_HEIGHT / 8];
+	} line_change;
+#endif
+
 	struct
 	{
 		/**
@@ -696,9 +1158,39 @@ struct gb_s
 		uint8_t window_clear;
 		uint8_t WY;
 
-		/* Only support 30fps frame skip. */
-		bool frame_skip_count : 1;
+		/* Lines and columns drawn, set with gb_set_lcd_region(). */
+		uint8_t line_mask[LCD_HEIGHT / 8];
+		uint8_t x_start;
+		uint8_t x_end;
+
+		/* Number of frames skipped in a row, and whether the current
+		 * frame is skipped. */
+		uint8_t frame_skip_count;
+		bool frame_skipped : 1;
 		bool interlace_count : 1;
+
+		/* Frame buffers set with gb_init_lcd_frame(), used when
+		 * lcd_draw_line is NULL. Lines are drawn to the back buffer,
+		 * which then becomes the front buffer at the end of the
+		 * frame. */
+		void *frame_buffer[2];
+		size_t frame_stride;
+		void (*lcd_frame_ready)(struct gb_s *gb, void *frame);
+		enum gb_pixel_format_e frame_format;
+		uint8_t frame_back;
+		/* Colours of OBJ0, OBJ1 and BG in frame_format. */
+		uint32_t frame_palette[12];
+
+		/* Scaled down frames set with gb_set_lcd_obs(). The newest
+		 * frame is drawn to the last of obs_stack frames, after the
+		 * older frames are moved down at the start of each frame. */
+		uint8_t *obs_buffer;
+		size_t obs_stride;
+		uint8_t obs_width;
+		uint8_t obs_height;
+		uint8_t obs_stack;
+		enum gb_obs_format_e obs_format;
+		bool obs_shift;
 	} display;
 
 	/**
@@ -714,7 +1206,18 @@ struct gb_s
 		 * (at the next line drawing).
 		 */
 		bool interlace : 1;
+		/* Set to only draw one of every frame_skip_ratio frames. */
 		bool frame_skip : 1;
+		/* Set to skip drawing the frames that start while this is set,
+		 * such as when the front-end is behind real time, or will not
+		 * show the frames. */
+		bool skip_next_frame : 1;
+		/* Frames drawn when frame_skip is set, as one frame in every
+		 * frame_skip_ratio frames. 0 is the same as 2 (30fps), and 1
+		 * draws every frame. If not 0, this also limits skip_next_frame
+		 * to skipping at most frame_skip_ratio - 1 frames in a row, so
+		 * 1 draws every frame in both cases. */
+		uint8_t frame_skip_ratio;
 
 		union
 		{
@@ -743,32 +1246,12 @@ struct gb_s
 
 #ifndef PEANUT_GB_HEADER_ONLY
 
-#define IO_JOYP	0x00
-#define IO_SB	0x01
-#define IO_SC	0x02
-#define IO_DIV	0x04
-#define IO_TIMA	0x05
-#define IO_TMA	0x06
-#define IO_TAC	0x07
-#define IO_IF	0x0F
-#define IO_LCDC	0x40
-#define IO_STAT	0x41
-#define IO_SCY	0x42
-#define IO_SCX	0x43
-#define IO_LY	0x44
-#define IO_LYC	0x45
-#define	IO_DMA	0x46
-#define	IO_BGP	0x47
-#define	IO_OBP0	0x48
-#define IO_OBP1	0x49
-#define IO_WY	0x4A
-#define IO_WX	0x4B
-#define IO_BOOT	0x50
-#define IO_IE	0xFF
-
 #define IO_TAC_RATE_MASK	0x3
 #define IO_TAC_ENABLE_MASK	0x4
 
+/* Number of clock cycles per TIMA increment for each TAC rate. */
+static const uint_fast16_t TAC_CYCLES[4] = {1024, 16, 64, 256};
+
 /* LCD Mode defines. */
 #define IO_STAT_MODE_HBLANK		0
 #define IO_STAT_MODE_VBLANK		1
@@ -777,88 +1260,406 @@ struct gb_s
 #define IO_STAT_MODE_VBLANK_OR_TRANSFER_MASK 0x1
 
 /**
- * Internal function used to read bytes.
- * addr is host platform endian.
+ * ROM and cart RAM access functions used by gb_init_buffer().
  */
-uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
+static uint8_t __gb_rom_read_buffer(struct gb_s *gb, const uint_fast32_t addr)
 {
-	switch(PEANUT_GB_GET_MSN16(addr))
+	if(addr < gb->mem.rom_size)
+		return gb->mem.rom[addr];
+
+	return 0xFF;
+}
+
+static uint8_t __gb_cart_ram_read_buffer(struct gb_s *gb,
+		const uint_fast32_t addr)
+{
+	if(addr < gb->mem.cart_ram_size)
+		return gb->mem.cart_ram[addr];
+
+	return 0xFF;
+}
+
+static void __gb_cart_ram_write_buffer(struct gb_s *gb,
+		const uint_fast32_t addr, const uint8_t val)
+{
+	if(addr < gb->mem.cart_ram_size)
+		gb->mem.cart_ram[addr] = val;
+}
+
+#if PEANUT_GB_USE_MEMORY_MAP
+/**
+ * Internal function used to rebuild the page tables used by __gb_read() and
+ * __gb_write(). Must be called whenever the MBC registers or the boot ROM
+ * overlay change.
+ */
+static void __gb_update_memory_map(struct gb_s *gb)
+{
+	const uint8_t *rom_0 = NULL;
+	const uint8_t *rom_n = NULL;
+	uint8_t *cart_ram = NULL;
+	uint_fast8_t i;
+
+	if(gb->mem.rom != NULL)
 	{
-	case 0x0:
-		/* IO_BOOT is only set to 1 if gb->gb_bootrom_read was not NULL
-		 * on reset. */
-		if(gb->hram_io[IO_BOOT] == 0 && addr < 0x0100)
-		{
-			return gb->gb_bootrom_read(gb, addr);
-		}
+		uint_fast32_t bank;
 
-		/* Fallthrough */
-	case 0x1:
-	case 0x2:
-	case 0x3:
-		return gb->gb_rom_read(gb, addr);
+		if(gb->mem.rom_size >= ROM_BANK_SIZE)
+			rom_0 = gb->mem.rom;
 
-	case 0x4:
-	case 0x5:
-	case 0x6:
-	case 0x7:
 		if(gb->mbc == 1 && gb->cart_mode_select)
-			return gb->gb_rom_read(gb,
-					       addr + ((gb->selected_rom_bank & 0x1F) - 1) * ROM_BANK_SIZE);
+			bank = gb->selected_rom_bank & 0x1F;
 		else
-			return gb->gb_rom_read(gb, addr + (gb->selected_rom_bank - 1) * ROM_BANK_SIZE);
-
-	case 0x8:
-	case 0x9:
-		return gb->vram[addr - VRAM_ADDR];
+			bank = gb->selected_rom_bank;
 
-	case 0xA:
-	case 0xB:
-		if(gb->mbc == 3 && gb->cart_ram_bank >= 0x08)
-		{
-			return gb->rtc_latched.bytes[gb->cart_ram_bank - 0x08];
-		}
-		else if(gb->cart_ram && gb->enable_cart_ram)
-		{
-			if(gb->mbc == 2)
-			{
-				/* Only 9 bits are available in address. */
-				addr &= 0x1FF;
-				return gb->gb_cart_ram_read(gb, addr);
-			}
-			else if((gb->cart_mode_select || gb->mbc != 1) &&
-					gb->cart_ram_bank < gb->num_ram_banks)
-			{
-				return gb->gb_cart_ram_read(gb, addr - CART_RAM_ADDR +
-							    (gb->cart_ram_bank * CRAM_BANK_SIZE));
-			}
-			else
-				return gb->gb_cart_ram_read(gb, addr - CART_RAM_ADDR);
-		}
+		/* Banks outside of the ROM image are left to gb_rom_read. */
+		if((bank + 1) * ROM_BANK_SIZE <= gb->mem.rom_size)
+			rom_n = gb->mem.rom + bank * ROM_BANK_SIZE;
+	}
 
-		return 0xFF;
+	/* Cart RAM is only mapped if it is enabled, and if it is not an RTC
+	 * register or the 4-bit MBC2 RAM. */
+	if(gb->mem.cart_ram != NULL && gb->cart_ram && gb->enable_cart_ram &&
+			gb->mbc != 2 &&
+			!(gb->mbc == 3 && gb->cart_ram_bank >= 0x08))
+	{
+		uint_fast32_t offset = 0;
 
-	case 0xC:
-	case 0xD:
-		return gb->wram[addr - WRAM_0_ADDR];
+		if((gb->cart_mode_select || gb->mbc != 1) &&
+				gb->cart_ram_bank < gb->num_ram_banks)
+			offset = gb->cart_ram_bank * CRAM_BANK_SIZE;
 
-	case 0xE:
-		return gb->wram[addr - ECHO_ADDR];
+		if(offset + CRAM_BANK_SIZE <= gb->mem.cart_ram_size)
+			cart_ram = gb->mem.cart_ram + offset;
+	}
 
-	case 0xF:
-		if(addr < OAM_ADDR)
-			return gb->wram[addr - ECHO_ADDR];
+	for(i = 0; i < 4; i++)
+	{
+		gb->mem.read_page[i] = rom_0 ? rom_0 + i * 0x1000 : NULL;
+		gb->mem.read_page[i + 4] = rom_n ? rom_n + i * 0x1000 : NULL;
+		gb->mem.write_page[i] = NULL;
+		gb->mem.write_page[i + 4] = NULL;
+	}
 
-		if(addr < UNUSED_ADDR)
-			return gb->oam[addr - OAM_ADDR];
+	/* The boot ROM overlays the start of ROM bank 0. */
+	if(gb->hram_io[IO_BOOT] == 0)
+		gb->mem.read_page[0x0] = NULL;
+
+	gb->mem.read_page[0x8] = gb->mem.write_page[0x8] = gb->vram;
+	gb->mem.read_page[0x9] = gb->mem.write_page[0x9] = gb->vram + 0x1000;
+	gb->mem.read_page[0xA] = gb->mem.write_page[0xA] = cart_ram;
+	gb->mem.read_page[0xB] = gb->mem.write_page[0xB] =
+		cart_ram ? cart_ram + 0x1000 : NULL;
+	gb->mem.read_page[0xC] = gb->mem.write_page[0xC] = gb->wram;
+	gb->mem.read_page[0xD] = gb->mem.write_page[0xD] = gb->wram + 0x1000;
+	gb->mem.read_page[0xE] = gb->mem.write_page[0xE] = gb->wram;
+	/* Echo RAM, OAM, IO and HRAM are always decoded. */
+	gb->mem.read_page[0xF] = gb->mem.write_page[0xF] = NULL;
+
+#if ENABLE_LCD && PEANUT_GB_TILE_CACHE
+	/* Writes to tile data must mark the tile to be decoded again. */
+	gb->mem.write_page[0x8] = NULL;
+	gb->mem.write_page[0x9] = NULL;
+#endif
 
-		/* Unusable memory area. Reading from this area returns 0xFF.*/
+#if PEANUT_GB_JIT
+	/* Writes to WRAM must be seen by the JIT in case they overwrite code
+	 * that was translated. */
+	if(gb->jit != NULL)
+	{
+		gb->mem.write_page[0xC] = NULL;
+		gb->mem.write_page[0xD] = NULL;
+		gb->mem.write_page[0xE] = NULL;
+	}
+#endif
+#if PEANUT_GB_PREDECODE
+	/* Likewise for instructions decoded from WRAM. */
+	if(gb->predecode != NULL)
+	{
+		gb->mem.write_page[0xC] = NULL;
+		gb->mem.write_page[0xD] = NULL;
+		gb->mem.write_page[0xE] = NULL;
+	}
+#endif
+}
+#endif
+
+/**
+ * Internal function used to set the deadline of an event, and to find the
+ * earliest deadline again.
+ */
+static void __gb_schedule(struct gb_s *gb, const enum gb_event_e event,
+		const uint64_t deadline)
+{
+	uint_fast8_t i;
+
+	gb->counter.event[event] = deadline;
+	gb->counter.next_event = gb->counter.event[0];
+
+	for(i = 1; i < GB_EVENT_MAX; i++)
+	{
+		if(gb->counter.event[i] < gb->counter.next_event)
+			gb->counter.next_event = gb->counter.event[i];
+	}
+}
+
+/**
+ * Internal function used to record that an event from enum gb_run_event_e
+ * has occurred, and to stop the run if it was waiting for that event.
+ */
+static void __gb_run_event(struct gb_s *gb, const uint_fast8_t event)
+{
+	gb->run.events |= event;
+
+	if(gb->run.mask & event)
+		gb->run.stop = true;
+}
+
+/**
+ * Internal function used to schedule the next LCD mode change, or the end of
+ * the frame if the LCD is off.
+ */
+static void __gb_lcd_schedule(struct gb_s *gb)
+{
+	uint_fast32_t end;
+
+	if(!(gb->hram_io[IO_LCDC] & LCDC_ENABLE))
+		end = LCD_FRAME_CYCLES;
+	else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_OAM_SCAN)
+		end = LCD_MODE2_OAM_SCAN_END;
+	else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_LCD_DRAW)
+		end = LCD_MODE3_LCD_DRAW_END;
+	else
+		end = LCD_LINE_CYCLES;
+
+	__gb_schedule(gb, GB_EVENT_LCD, gb->counter.lcd_start + end);
+}
+
+/**
+ * Internal function used to bring TIMA up to date, and to schedule its next
+ * overflow. Must be called before and after the timer registers are changed.
+ */
+static void __gb_tima_sync(struct gb_s *gb)
+{
+	const uint64_t now = gb->counter.cycles;
+	uint64_t deadline = UINT64_MAX;
+
+	if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
+	{
+		const uint_fast16_t period =
+			TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK];
+		uint_fast32_t count = gb->counter.tima_count +
+			(uint_fast32_t)(now - gb->counter.tima_sync);
+
+		while(count >= period)
+		{
+			count -= period;
+
+			if(++gb->hram_io[IO_TIMA] == 0)
+			{
+				gb->hram_io[IO_IF] |= TIMER_INTR;
+				/* On overflow, set TMA to TIMA. */
+				gb->hram_io[IO_TIMA] = gb->hram_io[IO_TMA];
+			}
+		}
+
+		gb->counter.tima_count = count;
+		deadline = now + (0x100 - gb->hram_io[IO_TIMA]) * period - count;
+	}
+
+	gb->counter.tima_sync = now;
+	__gb_schedule(gb, GB_EVENT_TIMA, deadline);
+}
+
+/**
+ * Internal function used to bring the serial counter up to date, and to
+ * schedule the end of the transfer if one is in progress. A transfer is
+ * started if SC requests one and none is in progress. Must be called before
+ * and after SC is changed.
+ */
+static void __gb_serial_sync(struct gb_s *gb)
+{
+	const uint64_t now = gb->counter.cycles;
+	uint64_t deadline = UINT64_MAX;
+
+	if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
+	{
+		gb->counter.serial_count +=
+			(uint_fast16_t)(now - gb->counter.serial_sync);
+
+		/* If new transfer, call TX function. */
+		if(gb->counter.serial_count == 0 && gb->gb_serial_tx != NULL)
+			(gb->gb_serial_tx)(gb, gb->hram_io[IO_SB]);
+
+		deadline = now + SERIAL_CYCLES - gb->counter.serial_count;
+	}
+
+	gb->counter.serial_sync = now;
+	__gb_schedule(gb, GB_EVENT_SERIAL, deadline);
+}
+
+/**
+ * Internal function used to advance the RTC by one second.
+ */
+static void __gb_rtc_second(struct gb_s *gb)
+{
+	/* Detect invalid rollover. */
+	if(PGB_UNLIKELY(gb->rtc_real.reg.sec == 63))
+	{
+		gb->rtc_real.reg.sec = 0;
+		return;
+	}
+
+	if(++gb->rtc_real.reg.sec != 60)
+		return;
+
+	gb->rtc_real.reg.sec = 0;
+	if(gb->rtc_real.reg.min == 63)
+	{
+		gb->rtc_real.reg.min = 0;
+		return;
+	}
+	if(++gb->rtc_real.reg.min != 60)
+		return;
+
+	gb->rtc_real.reg.min = 0;
+	if(gb->rtc_real.reg.hour == 31)
+	{
+		gb->rtc_real.reg.hour = 0;
+		return;
+	}
+	if(++gb->rtc_real.reg.hour != 24)
+		return;
+
+	gb->rtc_real.reg.hour = 0;
+	if(++gb->rtc_real.reg.yday != 0)
+		return;
+
+	if(gb->rtc_real.reg.high & 1)  /* Bit 8 of days*/
+		gb->rtc_real.reg.high |= 0x80; /* Overflow bit */
+
+	gb->rtc_real.reg.high ^= 1;
+}
+
+/**
+ * Internal function used to bring the RTC up to date, and to schedule its
+ * next second. Must be called before and after the RTC registers are changed.
+ */
+static void __gb_rtc_sync(struct gb_s *gb)
+{
+	const uint64_t now = gb->counter.cycles;
+	uint64_t deadline = UINT64_MAX;
+
+	if(gb->mbc == 3 && (gb->rtc_real.reg.high & 0x40) == 0)
+	{
+		gb->counter.rtc_count +=
+			(uint_fast32_t)(now - gb->counter.rtc_sync);
+
+		while(PGB_UNLIKELY(gb->counter.rtc_count >= RTC_CYCLES))
+		{
+			gb->counter.rtc_count -= RTC_CYCLES;
+			__gb_rtc_second(gb);
+		}
+
+		deadline = now + RTC_CYCLES - gb->counter.rtc_count;
+	}
+
+	gb->counter.rtc_sync = now;
+	__gb_schedule(gb, GB_EVENT_RTC, deadline);
+}
+
+/**
+ * Internal function used to read bytes.
+ * addr is host platform endian.
+ */
+uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
+{
+#if PEANUT_GB_USE_MEMORY_MAP
+	const uint8_t *page = gb->mem.read_page[PEANUT_GB_GET_MSN16(addr)];
+
+	if(PGB_LIKELY(page != NULL))
+		return page[addr & 0x0FFF];
+#endif
+
+	switch(PEANUT_GB_GET_MSN16(addr))
+	{
+	case 0x0:
+		/* IO_BOOT is only set to 1 if gb->gb_bootrom_read was not NULL
+		 * on reset. */
+		if(gb->hram_io[IO_BOOT] == 0 && addr < 0x0100)
+		{
+			return gb->gb_bootrom_read(gb, addr);
+		}
+
+		/* Fallthrough */
+	case 0x1:
+	case 0x2:
+	case 0x3:
+		return gb->gb_rom_read(gb, addr);
+
+	case 0x4:
+	case 0x5:
+	case 0x6:
+	case 0x7:
+		if(gb->mbc == 1 && gb->cart_mode_select)
+			return gb->gb_rom_read(gb,
+					       addr + ((gb->selected_rom_bank & 0x1F) - 1) * ROM_BANK_SIZE);
+		else
+			return gb->gb_rom_read(gb, addr + (gb->selected_rom_bank - 1) * ROM_BANK_SIZE);
+
+	case 0x8:
+	case 0x9:
+		return gb->vram[addr - VRAM_ADDR];
+
+	case 0xA:
+	case 0xB:
+		if(gb->mbc == 3 && gb->cart_ram_bank >= 0x08)
+		{
+			return gb->rtc_latched.bytes[gb->cart_ram_bank - 0x08];
+		}
+		else if(gb->cart_ram && gb->enable_cart_ram)
+		{
+			if(gb->mbc == 2)
+			{
+				/* Only 9 bits are available in address. */
+				addr &= 0x1FF;
+				return gb->gb_cart_ram_read(gb, addr);
+			}
+			else if((gb->cart_mode_select || gb->mbc != 1) &&
+					gb->cart_ram_bank < gb->num_ram_banks)
+			{
+				return gb->gb_cart_ram_read(gb, addr - CART_RAM_ADDR +
+							    (gb->cart_ram_bank * CRAM_BANK_SIZE));
+			}
+			else
+				return gb->gb_cart_ram_read(gb, addr - CART_RAM_ADDR);
+		}
+
+		return 0xFF;
+
+	case 0xC:
+	case 0xD:
+		return gb->wram[addr - WRAM_0_ADDR];
+
+	case 0xE:
+		return gb->wram[addr - ECHO_ADDR];
+
+	case 0xF:
+		if(addr < OAM_ADDR)
+			return gb->wram[addr - ECHO_ADDR];
+
+		if(addr < UNUSED_ADDR)
+			return gb->oam[addr - OAM_ADDR];
+
+		/* Unusable memory area. Reading from this area returns 0xFF.*/
 		if(addr < IO_ADDR)
 			return 0xFF;
 
 		/* APU registers. */
 		if((addr >= 0xFF10) && (addr <= 0xFF3F))
 		{
+			if(gb->gb_audio_read != NULL)
+				return gb->gb_audio_read(gb, addr);
+
 #if ENABLE_SOUND
 			return audio_read(addr);
 #else
@@ -876,6 +1677,14 @@ uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
 #endif
 		}
 
+		/* DIV and TIMA are only brought up to date when read. */
+		if(addr == IO_ADDR + IO_DIV)
+			return (uint8_t)((gb->counter.cycles -
+					gb->counter.div_start) / DIV_CYCLES);
+
+		if(addr == IO_ADDR + IO_TIMA)
+			__gb_tima_sync(gb);
+
 		/* HRAM */
 		if(addr >= IO_ADDR)
 			return gb->hram_io[addr - IO_ADDR];
@@ -887,11 +1696,28 @@ uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
 	PGB_UNREACHABLE();
 }
 
+#if PEANUT_GB_JIT
+static void __gb_jit_invalidate(struct gb_s *gb, uint_fast16_t addr);
+#endif
+#if PEANUT_GB_PREDECODE
+static void __gb_predecode_invalidate(struct gb_s *gb, uint_fast16_t addr);
+#endif
+
 /**
  * Internal function used to write bytes.
  */
 void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 {
+#if PEANUT_GB_USE_MEMORY_MAP
+	uint8_t *page = gb->mem.write_page[PEANUT_GB_GET_MSN16(addr)];
+
+	if(PGB_LIKELY(page != NULL))
+	{
+		page[addr & 0x0FFF] = val;
+		return;
+	}
+#endif
+
 	switch(PEANUT_GB_GET_MSN16(addr))
 	{
 	case 0x0:
@@ -900,7 +1726,7 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		if(gb->mbc > 0 && gb->mbc != 2 && gb->cart_ram)
 		{
 			gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
-			return;
+			break;
 		}
 
 	/* Intentional fall through. */
@@ -910,7 +1736,7 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			gb->selected_rom_bank = (gb->selected_rom_bank & 0x100) | val;
 			gb->selected_rom_bank =
 				gb->selected_rom_bank & gb->num_rom_banks_mask;
-			return;
+			break;
 		}
 
 	/* Intentional fall through. */
@@ -937,7 +1763,7 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			else
 			{
 				gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
-				return;
+				break;
 			}
 		}
 		else if(gb->mbc == 3)
@@ -953,7 +1779,7 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			gb->selected_rom_bank = (val & 0x01) << 8 | (gb->selected_rom_bank & 0xFF);
 
 		gb->selected_rom_bank = gb->selected_rom_bank & gb->num_rom_banks_mask;
-		return;
+		break;
 
 	case 0x4:
 	case 0x5:
@@ -976,7 +1802,7 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		else if(gb->mbc == 5)
 			gb->cart_ram_bank = (val & 0x0F);
 
-		return;
+		break;
 
 	case 0x6:
 	case 0x7:
@@ -986,11 +1812,18 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 
 		/* Set banking mode select. */
 		gb->cart_mode_select = val;
-		return;
+		break;
 
 	case 0x8:
 	case 0x9:
 		gb->vram[addr - VRAM_ADDR] = val;
+#if ENABLE_LCD && PEANUT_GB_TILE_CACHE
+		if(addr < VRAM_ADDR + VRAM_TILES_NUM * 0x10)
+		{
+			const uint_fast16_t n = (addr - VRAM_ADDR) >> 4;
+			gb->tile_cache.dirty[n >> 3] |= 1 << (n & 7);
+		}
+#endif
 		return;
 
 	case 0xA:
@@ -1003,7 +1836,9 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			uint8_t reg = gb->cart_ram_bank - 0x08;
 			//if(reg == 0) gb->counter.rtc_count = 0;
 
+			__gb_rtc_sync(gb);
 			gb->rtc_real.bytes[reg] = val & rtc_reg_mask[reg];
+			__gb_rtc_sync(gb);
 		}
 		/* Do not write to RAM if unavailable or disabled. */
 		else if(gb->cart_ram && gb->enable_cart_ram)
@@ -1035,26 +1870,53 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 
 	case 0xC:
 		gb->wram[addr - WRAM_0_ADDR] = val;
+#if PEANUT_GB_JIT
+		__gb_jit_invalidate(gb, addr);
+#endif
+#if PEANUT_GB_PREDECODE
+		__gb_predecode_invalidate(gb, addr);
+#endif
 		return;
 
 	case 0xD:
 		gb->wram[addr - WRAM_1_ADDR + WRAM_BANK_SIZE] = val;
+#if PEANUT_GB_JIT
+		__gb_jit_invalidate(gb, addr);
+#endif
+#if PEANUT_GB_PREDECODE
+		__gb_predecode_invalidate(gb, addr);
+#endif
 		return;
 
 	case 0xE:
 		gb->wram[addr - ECHO_ADDR] = val;
+#if PEANUT_GB_JIT
+		__gb_jit_invalidate(gb, addr);
+#endif
+#if PEANUT_GB_PREDECODE
+		__gb_predecode_invalidate(gb, addr);
+#endif
 		return;
 
 	case 0xF:
 		if(addr < OAM_ADDR)
 		{
 			gb->wram[addr - ECHO_ADDR] = val;
+#if PEANUT_GB_JIT
+			__gb_jit_invalidate(gb, addr);
+#endif
+#if PEANUT_GB_PREDECODE
+			__gb_predecode_invalidate(gb, addr);
+#endif
 			return;
 		}
 
 		if(addr < UNUSED_ADDR)
 		{
 			gb->oam[addr - OAM_ADDR] = val;
+#if PEANUT_GB_SPRITE_BUCKETS
+			gb->sprite_lines.dirty = true;
+#endif
 			return;
 		}
 
@@ -1065,11 +1927,23 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		if(HRAM_ADDR <= addr && addr < INTR_EN_ADDR)
 		{
 			gb->hram_io[addr - IO_ADDR] = val;
+#if PEANUT_GB_JIT
+			__gb_jit_invalidate(gb, addr);
+#endif
+#if PEANUT_GB_PREDECODE
+			__gb_predecode_invalidate(gb, addr);
+#endif
 			return;
 		}
 
 		if((addr >= 0xFF10) && (addr <= 0xFF3F))
 		{
+			if(gb->gb_audio_write != NULL)
+			{
+				gb->gb_audio_write(gb, addr, val);
+				return;
+			}
+
 #if ENABLE_SOUND
 			audio_write(addr, val);
 #else
@@ -1103,16 +1977,25 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			return;
 
 		case 0x02:
+			__gb_serial_sync(gb);
 			gb->hram_io[IO_SC] = val;
+			__gb_serial_sync(gb);
 			return;
 
 		/* Timer Registers */
 		case 0x04:
-			gb->hram_io[IO_DIV] = 0x00;
+		{
+			/* DIV is reset, but the phase of the divider is kept. */
+			const uint64_t now = gb->counter.cycles;
+			gb->counter.div_start = now -
+				(now - gb->counter.div_start) % DIV_CYCLES;
 			return;
+		}
 
 		case 0x05:
+			__gb_tima_sync(gb);
 			gb->hram_io[IO_TIMA] = val;
+			__gb_tima_sync(gb);
 			return;
 
 		case 0x06:
@@ -1120,7 +2003,9 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			return;
 
 		case 0x07:
+			__gb_tima_sync(gb);
 			gb->hram_io[IO_TAC] = val;
+			__gb_tima_sync(gb);
 			return;
 
 		/* Interrupt Flag Register */
@@ -1136,12 +2021,24 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			/* Check if LCD is already enabled. */
 			lcd_enabled = (gb->hram_io[IO_LCDC] & LCDC_ENABLE);
 
+#if PEANUT_GB_SPRITE_BUCKETS
+			if((gb->hram_io[IO_LCDC] ^ val) & LCDC_OBJ_SIZE)
+				gb->sprite_lines.dirty = true;
+#endif
+
 			gb->hram_io[IO_LCDC] = val;
 
 			/* Check if LCD is going to be switched on. */
 			if (!lcd_enabled && (val & LCDC_ENABLE))
 			{
 				gb->lcd_blank = true;
+				/* Keep track of the time the LCD was off, and
+				 * start the first line. */
+				gb->counter.lcd_off_count = (uint_fast32_t)
+					(gb->counter.cycles -
+					 gb->counter.lcd_start);
+				gb->counter.lcd_start = gb->counter.cycles;
+				__gb_lcd_schedule(gb);
 			}
 			/* Check if LCD is being switched off. */
 			else if (lcd_enabled && !(val & LCDC_ENABLE))
@@ -1156,12 +2053,17 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 					IO_STAT_MODE_HBLANK;
 				/* LY fixed to 0 when LCD turned off. */
 				gb->hram_io[IO_LY] = 0;
-				/* Keep track of lcd_count to correctly track
-				 * passing time. */
-				gb->counter.lcd_off_count += gb->counter.lcd_count;
-				/* Reset LCD timer, since the LCD starts from
-				 * the beginning on power on. */
-				gb->counter.lcd_count = 0;
+				/* Keep track of the current line to correctly
+				 * track passing time. The LCD starts from the
+				 * beginning on power on. */
+				gb->counter.lcd_start -= gb->counter.lcd_off_count;
+				__gb_lcd_schedule(gb);
+#if PEANUT_GB_SKIP_UNCHANGED_LINES
+				/* The frame may be incomplete, so draw every
+				 * line of the next frame. */
+				memset(gb->line_change.hash, 0,
+					sizeof(gb->line_change.hash));
+#endif
 			}
 			return;
 		}
@@ -1186,17 +2088,49 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		/* DMA Register */
 		case 0x46:
 		{
-			uint16_t dma_addr;
+			const uint16_t dma_addr = (uint_fast16_t)val << 8;
+			const uint8_t *src = NULL;
 			uint16_t i;
 
-			dma_addr = (uint_fast16_t)val << 8;
 			gb->hram_io[IO_DMA] = val;
 
+			/* The source is 256 byte aligned, so the transfer never
+			 * crosses a page and can be copied in one go if the
+			 * page is directly readable. */
+#if PEANUT_GB_USE_MEMORY_MAP
+			src = gb->mem.read_page[PEANUT_GB_GET_MSN16(dma_addr)];
+			if(src != NULL)
+				src += dma_addr & 0x0FFF;
+#else
+			if(dma_addr >= VRAM_ADDR && dma_addr < CART_RAM_ADDR)
+				src = gb->vram + (dma_addr - VRAM_ADDR);
+			else if(dma_addr >= WRAM_0_ADDR &&
+					dma_addr < WRAM_0_ADDR + WRAM_SIZE)
+				src = gb->wram + (dma_addr - WRAM_0_ADDR);
+#endif
+
+			if(src != NULL)
+			{
+#if PEANUT_GB_SPRITE_BUCKETS
+				/* Most games copy the same sprites every
+				 * frame. */
+				if(memcmp(gb->oam, src, OAM_SIZE) == 0)
+					return;
+
+				gb->sprite_lines.dirty = true;
+#endif
+				memcpy(gb->oam, src, OAM_SIZE);
+				return;
+			}
+
 			for(i = 0; i < OAM_SIZE; i++)
 			{
 				gb->oam[i] = __gb_read(gb, dma_addr + i);
 			}
 
+#if PEANUT_GB_SPRITE_BUCKETS
+			gb->sprite_lines.dirty = true;
+#endif
 			return;
 		}
 
@@ -1237,6 +2171,9 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		/* Turn off boot ROM */
 		case 0x50:
 			gb->hram_io[IO_BOOT] = 0x01;
+#if PEANUT_GB_USE_MEMORY_MAP
+			__gb_update_memory_map(gb);
+#endif
 			return;
 
 		/* Interrupt Enable Register */
@@ -1244,35 +2181,251 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			gb->hram_io[IO_IE] = val;
 			return;
 		}
+
+		/* Invalid writes are ignored. */
+		return;
 	}
 
-	/* Invalid writes are ignored. */
+	/* Only writes to the MBC registers reach this point. */
+#if PEANUT_GB_USE_MEMORY_MAP
+	__gb_update_memory_map(gb);
+#endif
 	return;
 }
 
-uint8_t __gb_execute_cb(struct gb_s *gb)
+#if PEANUT_GB_LAZY_FLAGS
+/**
+ * Internal function used to work out the C flag of the last instruction.
+ */
+static uint8_t __gb_flag_c(const struct gb_s *gb)
 {
-	uint8_t inst_cycles;
-	uint8_t cbop = __gb_read(gb, gb->cpu_reg.pc.reg++);
-	uint8_t r = (cbop & 0x7);
-	uint8_t b = (cbop >> 3) & 0x7;
-	uint8_t d = (cbop >> 3) & 0x1;
-	uint8_t val;
-	uint8_t writeback = 1;
-
-	inst_cycles = 8;
-	/* Add an additional 8 cycles to these sets of instructions. */
-	switch(cbop & 0xC7)
+	switch(gb->lazy_flags.op)
 	{
-	case 0x06:
-	case 0x86:
-    	case 0xC6:
-		inst_cycles += 8;
-    	break;
-    	case 0x46:
-		inst_cycles += 4;
-    	break;
-	}
+	case PGB_LAZY_ADD:
+	case PGB_LAZY_SUB:
+		return (gb->lazy_flags.res & 0xFF00) != 0;
+
+	case PGB_LAZY_AND:
+	case PGB_LAZY_OR:
+		return 0;
+
+	default:
+		return gb->cpu_reg.f.f_bits.c;
+	}
+}
+
+/**
+ * Internal function used to write the flags of the last instruction to F.
+ */
+static void __gb_flags_sync(struct gb_s *gb)
+{
+	const uint16_t res = gb->lazy_flags.res;
+
+	gb->cpu_reg.f.f_bits.c = __gb_flag_c(gb);
+	gb->cpu_reg.f.f_bits.z = (res & 0xFF) == 0;
+
+	switch(gb->lazy_flags.op)
+	{
+	case PGB_LAZY_INC:
+		gb->cpu_reg.f.f_bits.h = (res & 0x0F) == 0x00;
+		gb->cpu_reg.f.f_bits.n = 0;
+		break;
+
+	case PGB_LAZY_DEC:
+		gb->cpu_reg.f.f_bits.h = (res & 0x0F) == 0x0F;
+		gb->cpu_reg.f.f_bits.n = 1;
+		break;
+
+	case PGB_LAZY_ADD:
+	case PGB_LAZY_SUB:
+		gb->cpu_reg.f.f_bits.h = ((gb->lazy_flags.lhs ^
+				gb->lazy_flags.rhs ^ res) & 0x10) != 0;
+		gb->cpu_reg.f.f_bits.n = gb->lazy_flags.op == PGB_LAZY_SUB;
+		break;
+
+	case PGB_LAZY_AND:
+		gb->cpu_reg.f.f_bits.h = 1;
+		gb->cpu_reg.f.f_bits.n = 0;
+		break;
+
+	case PGB_LAZY_OR:
+		gb->cpu_reg.f.f_bits.h = 0;
+		gb->cpu_reg.f.f_bits.n = 0;
+		break;
+	}
+
+	gb->lazy_flags.op = PGB_LAZY_NONE;
+}
+#endif
+
+#if PEANUT_GB_CB_TABLE
+/* Operations of CB prefixed instructions on the register or value r. bit is
+ * only used by BIT, RES and SET. */
+#define PGB_CB_SHIFT_FLAGS(r, carry)					\
+	gb->cpu_reg.f.reg = 0;						\
+	gb->cpu_reg.f.f_bits.z = (r == 0x00);				\
+	gb->cpu_reg.f.f_bits.c = (carry)
+#define PGB_CB_RLC(r, bit)						\
+	{								\
+		const uint8_t carry = r >> 7;				\
+		r = (r << 1) | carry;					\
+		PGB_CB_SHIFT_FLAGS(r, carry);				\
+	}
+#define PGB_CB_RRC(r, bit)						\
+	{								\
+		const uint8_t carry = r & 0x01;				\
+		r = (r >> 1) | (carry << 7);				\
+		PGB_CB_SHIFT_FLAGS(r, carry);				\
+	}
+#define PGB_CB_RL(r, bit)						\
+	{								\
+		const uint8_t carry = r >> 7;				\
+		r = (r << 1) | gb->cpu_reg.f.f_bits.c;			\
+		PGB_CB_SHIFT_FLAGS(r, carry);				\
+	}
+#define PGB_CB_RR(r, bit)						\
+	{								\
+		const uint8_t carry = r & 0x01;				\
+		r = (r >> 1) | (gb->cpu_reg.f.f_bits.c << 7);		\
+		PGB_CB_SHIFT_FLAGS(r, carry);				\
+	}
+#define PGB_CB_SLA(r, bit)						\
+	{								\
+		const uint8_t carry = r >> 7;				\
+		r = r << 1;						\
+		PGB_CB_SHIFT_FLAGS(r, carry);				\
+	}
+#define PGB_CB_SRA(r, bit)						\
+	{								\
+		const uint8_t carry = r & 0x01;				\
+		r = (r >> 1) | (r & 0x80);				\
+		PGB_CB_SHIFT_FLAGS(r, carry);				\
+	}
+#define PGB_CB_SWAP(r, bit)						\
+	{								\
+		r = (r >> 4) | (r << 4);				\
+		PGB_CB_SHIFT_FLAGS(r, 0);				\
+	}
+#define PGB_CB_SRL(r, bit)						\
+	{								\
+		const uint8_t carry = r & 0x01;				\
+		r = r >> 1;						\
+		PGB_CB_SHIFT_FLAGS(r, carry);				\
+	}
+#define PGB_CB_BIT(r, bit)						\
+	{								\
+		gb->cpu_reg.f.f_bits.z = !((r >> (bit)) & 0x01);	\
+		gb->cpu_reg.f.f_bits.n = 0;				\
+		gb->cpu_reg.f.f_bits.h = 1;				\
+	}
+#define PGB_CB_RES(r, bit)	{ r &= ~(0x01 << (bit)); }
+#define PGB_CB_SET(r, bit)	{ r |= (0x01 << (bit)); }
+
+/* The eight opcodes from op that apply fn to B, C, D, E, H, L, (HL) and A.
+ * (HL) takes cycles_hl cycles, and is only written back if writeback is
+ * set. */
+#define PGB_CB_CASES(op, fn, bit, cycles_hl, writeback)			\
+	case (op) + 0: fn(gb->cpu_reg.bc.bytes.b, bit); return 8;	\
+	case (op) + 1: fn(gb->cpu_reg.bc.bytes.c, bit); return 8;	\
+	case (op) + 2: fn(gb->cpu_reg.de.bytes.d, bit); return 8;	\
+	case (op) + 3: fn(gb->cpu_reg.de.bytes.e, bit); return 8;	\
+	case (op) + 4: fn(gb->cpu_reg.hl.bytes.h, bit); return 8;	\
+	case (op) + 5: fn(gb->cpu_reg.hl.bytes.l, bit); return 8;	\
+	case (op) + 6:							\
+	{								\
+		uint8_t val = __gb_read(gb, gb->cpu_reg.hl.reg);	\
+		fn(val, bit);						\
+		if(writeback)						\
+			__gb_write(gb, gb->cpu_reg.hl.reg, val);	\
+		return cycles_hl;					\
+	}								\
+	case (op) + 7: fn(gb->cpu_reg.a, bit); return 8
+
+/* Each of the 256 opcodes has its own case, so that the register, bit and
+ * operation are fixed at compile time rather than decoded. */
+uint8_t __gb_execute_cb(struct gb_s *gb, uint8_t cbop)
+{
+	PGB_FLAGS_SYNC();
+
+	switch(cbop)
+	{
+	/* *INDENT-OFF* */
+	PGB_CB_CASES(0x00, PGB_CB_RLC, 0, 16, 1);
+	PGB_CB_CASES(0x08, PGB_CB_RRC, 0, 16, 1);
+	PGB_CB_CASES(0x10, PGB_CB_RL, 0, 16, 1);
+	PGB_CB_CASES(0x18, PGB_CB_RR, 0, 16, 1);
+	PGB_CB_CASES(0x20, PGB_CB_SLA, 0, 16, 1);
+	PGB_CB_CASES(0x28, PGB_CB_SRA, 0, 16, 1);
+	PGB_CB_CASES(0x30, PGB_CB_SWAP, 0, 16, 1);
+	PGB_CB_CASES(0x38, PGB_CB_SRL, 0, 16, 1);
+	PGB_CB_CASES(0x40, PGB_CB_BIT, 0, 12, 0);
+	PGB_CB_CASES(0x48, PGB_CB_BIT, 1, 12, 0);
+	PGB_CB_CASES(0x50, PGB_CB_BIT, 2, 12, 0);
+	PGB_CB_CASES(0x58, PGB_CB_BIT, 3, 12, 0);
+	PGB_CB_CASES(0x60, PGB_CB_BIT, 4, 12, 0);
+	PGB_CB_CASES(0x68, PGB_CB_BIT, 5, 12, 0);
+	PGB_CB_CASES(0x70, PGB_CB_BIT, 6, 12, 0);
+	PGB_CB_CASES(0x78, PGB_CB_BIT, 7, 12, 0);
+	PGB_CB_CASES(0x80, PGB_CB_RES, 0, 16, 1);
+	PGB_CB_CASES(0x88, PGB_CB_RES, 1, 16, 1);
+	PGB_CB_CASES(0x90, PGB_CB_RES, 2, 16, 1);
+	PGB_CB_CASES(0x98, PGB_CB_RES, 3, 16, 1);
+	PGB_CB_CASES(0xA0, PGB_CB_RES, 4, 16, 1);
+	PGB_CB_CASES(0xA8, PGB_CB_RES, 5, 16, 1);
+	PGB_CB_CASES(0xB0, PGB_CB_RES, 6, 16, 1);
+	PGB_CB_CASES(0xB8, PGB_CB_RES, 7, 16, 1);
+	PGB_CB_CASES(0xC0, PGB_CB_SET, 0, 16, 1);
+	PGB_CB_CASES(0xC8, PGB_CB_SET, 1, 16, 1);
+	PGB_CB_CASES(0xD0, PGB_CB_SET, 2, 16, 1);
+	PGB_CB_CASES(0xD8, PGB_CB_SET, 3, 16, 1);
+	PGB_CB_CASES(0xE0, PGB_CB_SET, 4, 16, 1);
+	PGB_CB_CASES(0xE8, PGB_CB_SET, 5, 16, 1);
+	PGB_CB_CASES(0xF0, PGB_CB_SET, 6, 16, 1);
+	PGB_CB_CASES(0xF8, PGB_CB_SET, 7, 16, 1);
+	/* *INDENT-ON* */
+	}
+
+	/* All 256 opcodes are handled above. */
+	PGB_UNREACHABLE();
+}
+
+#undef PGB_CB_SHIFT_FLAGS
+#undef PGB_CB_RLC
+#undef PGB_CB_RRC
+#undef PGB_CB_RL
+#undef PGB_CB_RR
+#undef PGB_CB_SLA
+#undef PGB_CB_SRA
+#undef PGB_CB_SWAP
+#undef PGB_CB_SRL
+#undef PGB_CB_BIT
+#undef PGB_CB_RES
+#undef PGB_CB_SET
+#undef PGB_CB_CASES
+#else
+uint8_t __gb_execute_cb(struct gb_s *gb, uint8_t cbop)
+{
+	uint8_t inst_cycles;
+	uint8_t r = (cbop & 0x7);
+	uint8_t b = (cbop >> 3) & 0x7;
+	uint8_t d = (cbop >> 3) & 0x1;
+	uint8_t val;
+	uint8_t writeback = 1;
+
+	PGB_FLAGS_SYNC();
+	inst_cycles = 8;
+	/* Add an additional 8 cycles to these sets of instructions. */
+	switch(cbop & 0xC7)
+	{
+	case 0x06:
+	case 0x86:
+    	case 0xC6:
+		inst_cycles += 8;
+    	break;
+    	case 0x46:
+		inst_cycles += 4;
+    	break;
+	}
 
 	switch(r)
 	{
@@ -1436,6 +2589,7 @@ uint8_t __gb_execute_cb(struct gb_s *gb)
 	}
 	return inst_cycles;
 }
+#endif
 
 #if ENABLE_LCD
 struct sprite_data {
@@ -1443,7 +2597,7 @@ struct sprite_data {
 	uint8_t x;
 };
 
-#if PEANUT_GB_HIGH_LCD_ACCURACY
+#if PEANUT_GB_HIGH_LCD_ACCURACY && !PEANUT_GB_SPRITE_BUCKETS
 static int compare_sprites(const struct sprite_data *const sd1, const struct sprite_data *const sd2)
 {
 	int x_res;
@@ -1456,193 +2610,819 @@ static int compare_sprites(const struct sprite_data *const sd1, const struct spr
 }
 #endif
 
-void __gb_draw_line(struct gb_s *gb)
+/**
+ * Internal function used to get the address of a background or window tile
+ * in VRAM from its index in the tile map.
+ */
+static uint16_t __gb_bg_tile(const struct gb_s *gb, const uint8_t idx)
 {
-	uint8_t pixels[160] = {0};
+	/* Select addressing mode. */
+	if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
+		return VRAM_TILES_1 + idx * 0x10;
 
-	/* If LCD not initialised by front-end, don't render anything. */
-	if(gb->display.lcd_draw_line == NULL)
-		return;
+	return VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
+}
 
-	if(gb->direct.frame_skip && !gb->display.frame_skip_count)
-		return;
+#if PEANUT_GB_TILE_CACHE
+/**
+ * Internal function used to decode the rows of a tile that was written to.
+ */
+static void __gb_tile_decode(struct gb_s *gb, const uint_fast16_t n)
+{
+	const uint8_t *data = &gb->vram[n * 0x10];
+	uint_fast8_t y, x;
 
-	/* If interlaced mode is activated, check if we need to draw the current
-	 * line. */
-	if(gb->direct.interlace)
+	for(y = 0; y < 8; y++)
 	{
-		if((!gb->display.interlace_count
-				&& (gb->hram_io[IO_LY] & 1) == 0)
-				|| (gb->display.interlace_count
-				    && (gb->hram_io[IO_LY] & 1) == 1))
+		const uint8_t t1 = data[2 * y];
+		const uint8_t t2 = data[2 * y + 1];
+
+		for(x = 0; x < 8; x++)
 		{
-			/* Compensate for missing window draw if required. */
-			if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
-					&& gb->hram_io[IO_LY] >= gb->display.WY
-					&& gb->hram_io[IO_WX] <= 166)
-				gb->display.window_clear++;
+			const uint8_t c = ((t1 >> (7 - x)) & 0x1) |
+				(((t2 >> (7 - x)) & 0x1) << 1);
 
-			return;
+			gb->tile_cache.row[0][n][y][x] = c;
+			gb->tile_cache.row[1][n][y][7 - x] = c;
 		}
 	}
 
-	/* If background is enabled, draw it. */
-	if(gb->hram_io[IO_LCDC] & LCDC_BG_ENABLE)
+	gb->tile_cache.dirty[n >> 3] &= ~(1 << (n & 7));
+}
+#endif
+
+#if PEANUT_GB_TILE_CACHE || !PEANUT_GB_SWAR_LCD
+/**
+ * Internal function used to get the colour numbers of the eight pixels of a
+ * tile row, from left to right, or from right to left if flip is set.
+ *
+ * \param tile	Address of the tile in VRAM.
+ * \param py	Row of the tile, between 0 and 7.
+ * \param buf	Eight bytes to decode the row into if it is not cached.
+ */
+static const uint8_t *__gb_tile_row(struct gb_s *gb, const uint16_t tile,
+		const uint8_t py, const uint8_t flip, uint8_t *buf)
+{
+#if PEANUT_GB_TILE_CACHE
+	const uint_fast16_t n = tile >> 4;
+
+	(void) buf;
+
+	if(gb->tile_cache.dirty[n >> 3] & (1 << (n & 7)))
+		__gb_tile_decode(gb, n);
+
+	return gb->tile_cache.row[flip][n][py];
+#else
+	const uint8_t t1 = gb->vram[tile + 2 * py];
+	const uint8_t t2 = gb->vram[tile + 2 * py + 1];
+	uint_fast8_t x;
+
+	for(x = 0; x < 8; x++)
 	{
-		uint8_t bg_y, disp_x, bg_x, idx, py, px, t1, t2;
-		uint16_t bg_map, tile;
+		const uint_fast8_t bit = flip ? x : 7 - x;
+		buf[x] = ((t1 >> bit) & 0x1) | (((t2 >> bit) & 0x1) << 1);
+	}
 
-		/* Calculate current background line to draw. Constant because
-		 * this function draws only this one line each time it is
-		 * called. */
-		bg_y = gb->hram_io[IO_LY] + gb->hram_io[IO_SCY];
+	return buf;
+#endif
+}
+#endif
 
-		/* Get selected background map address for first tile
-		 * corresponding to current line.
-		 * 0x20 (32) is the width of a background tile, and the bit
-		 * shift is to calculate the address. */
-		bg_map =
-			((gb->hram_io[IO_LCDC] & LCDC_BG_MAP) ?
-			 VRAM_BMAP_2 : VRAM_BMAP_1)
-			+ (bg_y >> 3) * 0x20;
+#if PEANUT_GB_SWAR_LCD
+/* Each byte set to 0x01, and the bit of a tile row shown by each byte, from the
+ * leftmost pixel in memory to the rightmost, or the other way round for X
+ * flipped sprites. */
+#define PGB_SWAR_ONES	UINT64_C(0x0101010101010101)
+#if PEANUT_GB_IS_LITTLE_ENDIAN
+# define PGB_SWAR_BITS		UINT64_C(0x0102040810204080)
+# define PGB_SWAR_BITS_FLIP	UINT64_C(0x8040201008040201)
+#else
+# define PGB_SWAR_BITS		UINT64_C(0x8040201008040201)
+# define PGB_SWAR_BITS_FLIP	UINT64_C(0x0102040810204080)
+#endif
 
-		/* The displays (what the player sees) X coordinate, drawn right
-		 * to left. */
-		disp_x = LCD_WIDTH - 1;
+/**
+ * Internal function used to set each byte that is not zero to 0xFF.
+ * Each byte must be less than 0x80.
+ */
+static uint64_t __gb_swar_mask(uint64_t x)
+{
+	x = ((x + UINT64_C(0x7F7F7F7F7F7F7F7F)) >> 7) & PGB_SWAR_ONES;
+	return (x << 8) - x;
+}
 
-		/* The X coordinate to begin drawing the background at. */
-		bg_x = disp_x + gb->hram_io[IO_SCX];
+#if !PEANUT_GB_TILE_CACHE
+/**
+ * Internal function used to spread the eight bits of a tile row bitplane into
+ * eight bytes, each 0 or 0xFF, in pixel order.
+ */
+static uint64_t __gb_swar_spread(const uint8_t plane, const uint64_t bits)
+{
+	uint64_t x = plane;
 
-		/* Get tile index for current background tile. */
-		idx = gb->vram[bg_map + (bg_x >> 3)];
-		/* Y coordinate of tile pixel to draw. */
-		py = (bg_y & 0x07);
-		/* X coordinate of tile pixel to draw. */
-		px = 7 - (bg_x & 0x07);
+	x |= x << 8;
+	x |= x << 16;
+	x |= x << 32;
+	return __gb_swar_mask(x & bits);
+}
+#endif
 
-		/* Select addressing mode. */
-		if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
-			tile = VRAM_TILES_1 + idx * 0x10;
-		else
-			tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
+/**
+ * Internal function used to get the two bitplanes of a tile row, with each
+ * byte 0 or 0xFF.
+ *
+ * \param tile	Address of the tile in VRAM.
+ * \param py	Row of the tile, between 0 and 7.
+ * \param flip	Get the pixels from right to left.
+ */
+static void __gb_swar_planes(struct gb_s *gb, const uint16_t tile,
+		const uint8_t py, const uint8_t flip, uint64_t *lo, uint64_t *hi)
+{
+#if PEANUT_GB_TILE_CACHE
+	uint64_t row;
 
-		tile += 2 * py;
+	memcpy(&row, __gb_tile_row(gb, tile, py, flip, NULL), sizeof(row));
+	*lo = __gb_swar_mask(row & PGB_SWAR_ONES);
+	*hi = __gb_swar_mask((row >> 1) & PGB_SWAR_ONES);
+#else
+	const uint64_t bits = flip ? PGB_SWAR_BITS_FLIP : PGB_SWAR_BITS;
 
-		/* fetch first tile */
-		t1 = gb->vram[tile] >> px;
-		t2 = gb->vram[tile + 1] >> px;
+	*lo = __gb_swar_spread(gb->vram[tile + 2 * py], bits);
+	*hi = __gb_swar_spread(gb->vram[tile + 2 * py + 1], bits);
+#endif
+}
 
-		for(; disp_x != 0xFF; disp_x--)
-		{
-			uint8_t c;
+/**
+ * Internal function used to select the shade of each pixel from a palette.
+ *
+ * \param palette	Each of the four shades repeated in all eight bytes.
+ */
+static uint64_t __gb_swar_shade(const uint64_t lo, const uint64_t hi,
+		const uint64_t *palette)
+{
+	return (~lo & ~hi & palette[0]) | (lo & ~hi & palette[1]) |
+		(~lo & hi & palette[2]) | (lo & hi & palette[3]);
+}
 
-			if(px == 8)
-			{
-				/* fetch next tile */
-				px = 0;
-				bg_x = disp_x + gb->hram_io[IO_SCX];
-				idx = gb->vram[bg_map + (bg_x >> 3)];
+/**
+ * Internal function used to draw the eight pixels of a background or window
+ * tile row at once.
+ *
+ * \param dst		First of the eight pixels to write.
+ */
+static void __gb_swar_tile(struct gb_s *gb, uint8_t *dst, const uint16_t tile,
+		const uint8_t py, const uint64_t *palette)
+{
+	uint64_t lo, hi, out;
 
-				if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
-					tile = VRAM_TILES_1 + idx * 0x10;
-				else
-					tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
+	__gb_swar_planes(gb, tile, py, 0, &lo, &hi);
+	out = __gb_swar_shade(lo, hi, palette);
+	memcpy(dst, &out, sizeof(out));
+}
 
-				tile += 2 * py;
-				t1 = gb->vram[tile];
-				t2 = gb->vram[tile + 1];
-			}
+/**
+ * Internal function used to draw the eight pixels of a sprite row over the
+ * pixels already drawn.
+ *
+ * \param dst		First of the eight pixels, which may be up to seven
+ * 			pixels either side of the screen.
+ * \param OF		Attributes of the sprite.
+ * \param palette	Shades of the palette selected by the sprite.
+ */
+static void __gb_swar_sprite(struct gb_s *gb, uint8_t *dst,
+		const uint16_t tile, const uint8_t py, const uint8_t OF,
+		const uint64_t *palette)
+{
+	uint64_t lo, hi, opaque, out;
 
-			/* copy background */
-			c = (t1 & 0x1) | ((t2 & 0x1) << 1);
-			pixels[disp_x] = gb->display.bg_palette[c];
-#if PEANUT_GB_12_COLOUR
-			pixels[disp_x] |= LCD_PALETTE_BG;
+	memcpy(&out, dst, sizeof(out));
+	__gb_swar_planes(gb, tile, py, (OF & OBJ_FLIP_X) != 0, &lo, &hi);
+
+	/* Colour 0 is transparent. */
+	opaque = lo | hi;
+
+	/* Sprites behind the background are only drawn over pixels with the
+	 * same shade as background colour 0. */
+	if(OF & OBJ_PRIORITY)
+	{
+		const uint64_t bg = (out & (LCD_COLOUR * PGB_SWAR_ONES)) ^
+			(gb->display.bg_palette[0] * PGB_SWAR_ONES);
+		opaque &= ~__gb_swar_mask(bg);
+	}
+
+	out = (out & ~opaque) | (__gb_swar_shade(lo, hi, palette) & opaque);
+	memcpy(dst, &out, sizeof(out));
+}
 #endif
-			t1 = t1 >> 1;
-			t2 = t2 >> 1;
-			px++;
-		}
+
+uint32_t gb_rgb_to_pixel(const enum gb_pixel_format_e format,
+		const uint32_t rgb)
+{
+	const uint32_t r = (rgb >> 16) & 0xFF;
+	const uint32_t g = (rgb >> 8) & 0xFF;
+	const uint32_t b = rgb & 0xFF;
+
+	switch(format)
+	{
+	case GB_PIXEL_FORMAT_RGB565:
+	case GB_PIXEL_FORMAT_RGB565_BE:
+		return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+
+	case GB_PIXEL_FORMAT_RGB555:
+		return ((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3);
+
+	case GB_PIXEL_FORMAT_RGBA8888:
+		return (r << 24) | (g << 16) | (b << 8) | 0xFF;
+
+	case GB_PIXEL_FORMAT_XRGB8888:
+		return (r << 16) | (g << 8) | b;
+
+	case GB_PIXEL_FORMAT_SHADE:
+	default:
+		return 0;
 	}
+}
 
-	/* draw window */
-	if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
-			&& gb->hram_io[IO_LY] >= gb->display.WY
-			&& gb->hram_io[IO_WX] <= 166)
+void gb_lcd_convert_line(void *dst, const uint8_t *pixels,
+		const enum gb_pixel_format_e format, const uint32_t palette[12])
+{
+	/* Colours indexed by the shade in bits 1-0 and the palette in bits
+	 * 5-4 of each pixel, moved down to bits 3-2. */
+	uint32_t lut[16] = {0};
+	uint_fast8_t x;
+
+	if(format == GB_PIXEL_FORMAT_SHADE)
 	{
-		uint16_t win_line, tile;
-		uint8_t disp_x, win_x, py, px, idx, t1, t2, end;
+		memcpy(dst, pixels, LCD_WIDTH);
+		return;
+	}
 
-		/* Calculate Window Map Address. */
-		win_line = (gb->hram_io[IO_LCDC] & LCDC_WINDOW_MAP) ?
-				    VRAM_BMAP_2 : VRAM_BMAP_1;
-		win_line += (gb->display.window_clear >> 3) * 0x20;
+	for(x = 0; x < 12; x++)
+	{
+		lut[x] = palette[x];
 
-		disp_x = LCD_WIDTH - 1;
-		win_x = disp_x - gb->hram_io[IO_WX] + 7;
+#if PEANUT_GB_IS_LITTLE_ENDIAN
+		if(format == GB_PIXEL_FORMAT_RGB565_BE)
+			lut[x] = ((lut[x] & 0xFF) << 8) | ((lut[x] >> 8) & 0xFF);
+#endif
+	}
 
-		// look up tile
-		py = gb->display.window_clear & 0x07;
-		px = 7 - (win_x & 0x07);
-		idx = gb->vram[win_line + (win_x >> 3)];
+#define PGB_LUT_INDEX(p) (((p) & LCD_COLOUR) | (((p) >> 2) & 0x0C))
+	switch(format)
+	{
+	case GB_PIXEL_FORMAT_RGB565:
+	case GB_PIXEL_FORMAT_RGB565_BE:
+	case GB_PIXEL_FORMAT_RGB555:
+	{
+		uint16_t *out = dst;
 
-		if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
-			tile = VRAM_TILES_1 + idx * 0x10;
-		else
-			tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
+		for(x = 0; x < LCD_WIDTH; x++)
+			out[x] = (uint16_t)lut[PGB_LUT_INDEX(pixels[x])];
 
-		tile += 2 * py;
+		break;
+	}
 
-		// fetch first tile
-		t1 = gb->vram[tile] >> px;
-		t2 = gb->vram[tile + 1] >> px;
+	default:
+	{
+		uint32_t *out = dst;
 
-		// loop & copy window
-		end = (gb->hram_io[IO_WX] < 7 ? 0 : gb->hram_io[IO_WX] - 7) - 1;
+		for(x = 0; x < LCD_WIDTH; x++)
+			out[x] = lut[PGB_LUT_INDEX(pixels[x])];
+
+		break;
+	}
+	}
+#undef PGB_LUT_INDEX
+}
+
+#if PEANUT_GB_SPRITE_BUCKETS
+/**
+ * Internal function used to find the sprites on each line again after OAM or
+ * the sprite size was changed.
+ */
+static void __gb_sprite_lines_update(struct gb_s *gb)
+{
+	const int height = gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 16 : 8;
+	uint8_t s;
+
+#if PEANUT_GB_HIGH_LCD_ACCURACY
+	memset(gb->sprite_lines.count, 0, sizeof(gb->sprite_lines.count));
+#else
+	memset(gb->sprite_lines.mask, 0, sizeof(gb->sprite_lines.mask));
+#endif
+
+	for(s = 0; s < NUM_SPRITES; s++)
+	{
+		/* The sprite covers the lines from OY - 16. */
+		const int top = (int)gb->oam[4 * s + 0] - 16;
+		int line = top < 0 ? 0 : top;
+		const int end = top + height > LCD_HEIGHT ?
+			LCD_HEIGHT : top + height;
 
-		for(; disp_x != end; disp_x--)
+		for(; line < end; line++)
 		{
-			uint8_t c;
+#if PEANUT_GB_HIGH_LCD_ACCURACY
+			/* Keep the first ten sprites ordered by X position,
+			 * and then by sprite number. */
+			uint8_t *number = gb->sprite_lines.number[line];
+			const uint8_t count = gb->sprite_lines.count[line];
+			const uint8_t OX = gb->oam[4 * s + 1];
+			uint8_t place;
 
-			if(px == 8)
+			for(place = count; place != 0; place--)
 			{
-				// fetch next tile
-				px = 0;
-				win_x = disp_x - gb->hram_io[IO_WX] + 7;
-				idx = gb->vram[win_line + (win_x >> 3)];
+				if(gb->oam[4 * number[place - 1] + 1] <= OX)
+					break;
+			}
 
-				if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
-					tile = VRAM_TILES_1 + idx * 0x10;
-				else
-					tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
+			if(place >= MAX_SPRITES_LINE)
+				continue;
 
-				tile += 2 * py;
-				t1 = gb->vram[tile];
-				t2 = gb->vram[tile + 1];
-			}
+			memmove(&number[place + 1], &number[place],
+				MAX_SPRITES_LINE - place - 1);
+			number[place] = s;
 
-			// copy window
-			c = (t1 & 0x1) | ((t2 & 0x1) << 1);
-			pixels[disp_x] = gb->display.bg_palette[c];
-#if PEANUT_GB_12_COLOUR
-			pixels[disp_x] |= LCD_PALETTE_BG;
+			if(count < MAX_SPRITES_LINE)
+				gb->sprite_lines.count[line]++;
+#else
+			gb->sprite_lines.mask[line] |= (uint64_t)1 << s;
 #endif
-			t1 = t1 >> 1;
-			t2 = t2 >> 1;
-			px++;
 		}
-
-		gb->display.window_clear++; // advance window line
 	}
 
-	// draw sprites
-	if(gb->hram_io[IO_LCDC] & LCDC_OBJ_ENABLE)
-	{
-		uint8_t sprite_number;
-#if PEANUT_GB_HIGH_LCD_ACCURACY
-		uint8_t number_of_sprites = 0;
+	gb->sprite_lines.dirty = false;
+}
+#endif
 
-		struct sprite_data sprites_to_render[MAX_SPRITES_LINE];
+#if PEANUT_GB_SKIP_UNCHANGED_LINES
+/* Mix a value into a line hash, in the same way as FNV-1a. */
+#define PGB_LINE_MIX(h, v) h = ((h) ^ (uint64_t)(v)) * UINT64_C(0x100000001B3)
+
+/**
+ * Internal function used to get the bitplanes of a background or window tile
+ * row as one value.
+ */
+static uint16_t __gb_line_tile(const struct gb_s *gb, const uint16_t map,
+		const uint8_t py)
+{
+	const uint16_t tile = __gb_bg_tile(gb, gb->vram[map]) + 2 * py;
+	return gb->vram[tile] | (gb->vram[tile + 1] << 8);
+}
+
+/**
+ * Internal function used to hash everything that is drawn on the current line.
+ * The hash is never 0.
+ */
+static uint64_t __gb_line_hash(struct gb_s *gb)
+{
+	const uint8_t ly = gb->hram_io[IO_LY];
+	uint64_t h = UINT64_C(0xCBF29CE484222325);
+	uint8_t i;
+
+	PGB_LINE_MIX(h, gb->hram_io[IO_LCDC]);
+	PGB_LINE_MIX(h, gb->hram_io[IO_SCX] & 0x07);
+	PGB_LINE_MIX(h, gb->hram_io[IO_WX]);
+	for(i = 0; i < 4; i++)
+		PGB_LINE_MIX(h, gb->display.bg_palette[i]);
+	for(i = 0; i < 8; i++)
+		PGB_LINE_MIX(h, gb->display.sp_palette[i]);
+
+	if(gb->hram_io[IO_LCDC] & LCDC_BG_ENABLE)
+	{
+		const uint8_t bg_y = ly + gb->hram_io[IO_SCY];
+		const uint16_t bg_map =
+			((gb->hram_io[IO_LCDC] & LCDC_BG_MAP) ?
+			 VRAM_BMAP_2 : VRAM_BMAP_1)
+			+ (bg_y >> 3) * 0x20;
+		const uint8_t map_x = gb->hram_io[IO_SCX] >> 3;
+
+		for(i = 0; i <= LCD_WIDTH / 8; i++)
+		{
+			PGB_LINE_MIX(h, __gb_line_tile(gb,
+					bg_map + ((map_x + i) & 0x1F),
+					bg_y & 0x07));
+		}
+	}
+
+	if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
+			&& ly >= gb->display.WY
+			&& gb->hram_io[IO_WX] <= 166)
+	{
+		const uint16_t win_line =
+			((gb->hram_io[IO_LCDC] & LCDC_WINDOW_MAP) ?
+			 VRAM_BMAP_2 : VRAM_BMAP_1)
+			+ (gb->display.window_clear >> 3) * 0x20;
+		const uint8_t tiles =
+			(LCD_WIDTH + 7 - gb->hram_io[IO_WX] + 7) / 8;
+
+		PGB_LINE_MIX(h, 1);
+		for(i = 0; i < tiles; i++)
+		{
+			PGB_LINE_MIX(h, __gb_line_tile(gb, win_line + i,
+					gb->display.window_clear & 0x07));
+		}
+	}
+
+	if(gb->hram_io[IO_LCDC] & LCDC_OBJ_ENABLE)
+	{
+		const uint8_t height =
+			gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 16 : 8;
+
+#if PEANUT_GB_SPRITE_BUCKETS
+		if(gb->sprite_lines.dirty)
+			__gb_sprite_lines_update(gb);
+#endif
+
+		/* Every sprite on the line, which includes those that are
+		 * drawn. */
+		for(i = 0; i < NUM_SPRITES; i++)
+		{
+			const uint8_t *oam = &gb->oam[4 * i];
+			uint16_t tile;
+			uint8_t py;
+
+#if PEANUT_GB_SPRITE_BUCKETS && !PEANUT_GB_HIGH_LCD_ACCURACY
+			if(!((gb->sprite_lines.mask[ly] >> i) & 1))
+				continue;
+#else
+			if(ly + 16 < oam[0] || ly + 16 >= oam[0] + height)
+				continue;
+#endif
+
+			py = ly + 16 - oam[0];
+			if(oam[3] & OBJ_FLIP_Y)
+				py = height - 1 - py;
+
+			tile = VRAM_TILES_1 +
+				((oam[2] & (height == 16 ? 0xFE : 0xFF)) +
+				 (py >> 3)) * 0x10 + 2 * (py & 0x07);
+
+			PGB_LINE_MIX(h, i);
+			PGB_LINE_MIX(h, oam[1] | (oam[3] << 8) |
+					((uint32_t)gb->vram[tile] << 16) |
+					((uint32_t)gb->vram[tile + 1] << 24));
+		}
+	}
+
+	return h | 1;
+}
+#undef PGB_LINE_MIX
+#endif
+
+/**
+ * Internal function used to sample the current line into the observation
+ * frame, if the line is used by it.
+ */
+static void __gb_lcd_obs_line(struct gb_s *gb, const uint8_t *pixels)
+{
+	static const uint8_t shade[2][4] = {
+		{ 0, 1, 2, 3 },		/* GB_OBS_FORMAT_SHADE */
+		{ 255, 170, 85, 0 }	/* GB_OBS_FORMAT_LUMA */
+	};
+	const uint8_t *lut = shade[gb->display.obs_format != GB_OBS_FORMAT_SHADE];
+	const uint_fast16_t ly = gb->hram_io[IO_LY];
+	const uint_fast16_t height = gb->display.obs_height;
+	const size_t frame_size = gb->display.obs_stride * height;
+	/* Rows are sampled from line (row * 144 / height). */
+	const uint_fast16_t row = (ly * height + LCD_HEIGHT - 1) / LCD_HEIGHT;
+	const uint_fast32_t step = ((uint_fast32_t)LCD_WIDTH << 16) /
+		gb->display.obs_width;
+	uint_fast32_t src = 0;
+	uint8_t *dst;
+
+	if(row * LCD_HEIGHT / height != ly)
+		return;
+
+	dst = gb->display.obs_buffer +
+		frame_size * (gb->display.obs_stack - 1) +
+		gb->display.obs_stride * row;
+
+	for(uint_fast8_t x = 0; x < gb->display.obs_width; x++, src += step)
+		dst[x] = lut[pixels[src >> 16] & 0x03];
+}
+
+/**
+ * Internal function used to advance the line of the window when the current
+ * line is not drawn.
+ */
+static void __gb_window_skip_line(struct gb_s *gb)
+{
+	if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
+			&& gb->hram_io[IO_LY] >= gb->display.WY
+			&& gb->hram_io[IO_WX] <= 166)
+		gb->display.window_clear++;
+}
+
+void __gb_draw_line(struct gb_s *gb)
+{
+#if PEANUT_GB_SWAR_LCD
+	/* Tiles are drawn whole, so allow up to seven pixels either side. */
+	uint8_t line[8 + LCD_WIDTH + 8] = {0};
+	uint8_t *const pixels = line + 8;
+	uint64_t palette[4];
+#else
+	uint8_t pixels[160] = {0};
+#endif
+#if PEANUT_GB_SKIP_UNCHANGED_LINES
+	uint64_t hash;
+#endif
+
+	/* If LCD not initialised by front-end, don't render anything. */
+	if(gb->display.lcd_draw_line == NULL &&
+			gb->display.frame_buffer[0] == NULL &&
+			gb->display.obs_buffer == NULL)
+		return;
+
+	if(gb->display.frame_skipped)
+		return;
+
+	/* Move the older observation frames down before the first line of a
+	 * new frame is drawn, as lines that are not drawn again are kept. */
+	if(gb->display.obs_shift && gb->display.obs_buffer != NULL)
+	{
+		const size_t frame_size =
+			gb->display.obs_stride * gb->display.obs_height;
+
+		memmove(gb->display.obs_buffer,
+				gb->display.obs_buffer + frame_size,
+				frame_size * (gb->display.obs_stack - 1));
+		gb->display.obs_shift = false;
+	}
+
+	/* If interlaced mode is activated, check if we need to draw the current
+	 * line. Lines that the front-end did not ask for are not drawn
+	 * either. */
+	if((gb->direct.interlace &&
+			((!gb->display.interlace_count
+			  && (gb->hram_io[IO_LY] & 1) == 0)
+			 || (gb->display.interlace_count
+			     && (gb->hram_io[IO_LY] & 1) == 1)))
+			|| !((gb->display.line_mask[gb->hram_io[IO_LY] >> 3] >>
+				(gb->hram_io[IO_LY] & 0x07)) & 1))
+	{
+		/* Compensate for missing window draw if required. */
+		__gb_window_skip_line(gb);
+
+#if PEANUT_GB_SKIP_UNCHANGED_LINES
+		/* The frame buffer is not drawn to on this line. */
+		gb->line_change.hash[gb->hram_io[IO_LY]] = 0;
+#endif
+		return;
+	}
+
+#if PEANUT_GB_SKIP_UNCHANGED_LINES
+	hash = __gb_line_hash(gb);
+
+	if(hash == gb->line_change.hash[gb->hram_io[IO_LY]])
+	{
+		const uint8_t ly = gb->hram_io[IO_LY];
+
+		__gb_window_skip_line(gb);
+
+		/* The back buffer holds an older frame, so copy the line
+		 * from the front buffer. */
+		if(gb->display.lcd_draw_line == NULL &&
+				gb->display.frame_buffer[0] !=
+				gb->display.frame_buffer[1])
+		{
+			const size_t offset = gb->display.frame_stride * ly;
+			const uint8_t *front = gb->display.frame_buffer[
+				gb->display.frame_back ^ 1];
+			uint8_t *back = gb->display.frame_buffer[
+				gb->display.frame_back];
+			size_t size = LCD_WIDTH;
+
+			if(gb->display.frame_format == GB_PIXEL_FORMAT_RGBA8888 ||
+					gb->display.frame_format ==
+					GB_PIXEL_FORMAT_XRGB8888)
+				size *= 4;
+			else if(gb->display.frame_format !=
+					GB_PIXEL_FORMAT_SHADE)
+				size *= 2;
+
+			memcpy(back + offset, front + offset, size);
+		}
+
+		return;
+	}
+
+	gb->line_change.hash[gb->hram_io[IO_LY]] = hash;
+	gb->line_change.changed[gb->hram_io[IO_LY] >> 3] |=
+		1 << (gb->hram_io[IO_LY] & 0x07);
+#endif
+
+#if PEANUT_GB_SWAR_LCD
+	for(uint_fast8_t c = 0; c < 4; c++)
+	{
+		palette[c] = gb->display.bg_palette[c] * PGB_SWAR_ONES;
+# if PEANUT_GB_12_COLOUR
+		palette[c] |= LCD_PALETTE_BG * PGB_SWAR_ONES;
+# endif
+	}
+
+#endif
+	/* If background is enabled, draw it. */
+	if(gb->hram_io[IO_LCDC] & LCDC_BG_ENABLE)
+	{
+#if PEANUT_GB_SWAR_LCD
+		uint8_t bg_y, map_x, py, i, last;
+		uint16_t bg_map;
+		uint8_t *dst;
+
+		bg_y = gb->hram_io[IO_LY] + gb->hram_io[IO_SCY];
+		bg_map =
+			((gb->hram_io[IO_LCDC] & LCDC_BG_MAP) ?
+			 VRAM_BMAP_2 : VRAM_BMAP_1)
+			+ (bg_y >> 3) * 0x20;
+		py = (bg_y & 0x07);
+
+		/* Draw whole tiles, starting up to seven pixels to the left
+		 * of the screen. Up to 21 tiles then cover the whole line. */
+		map_x = gb->hram_io[IO_SCX] >> 3;
+		dst = pixels - (gb->hram_io[IO_SCX] & 0x07);
+		i = (gb->display.x_start + (gb->hram_io[IO_SCX] & 0x07)) >> 3;
+		last = (gb->display.x_end - 1 +
+				(gb->hram_io[IO_SCX] & 0x07)) >> 3;
+
+		for(dst += 8 * i; i <= last; i++, dst += 8)
+		{
+			uint8_t idx = gb->vram[bg_map + ((map_x + i) & 0x1F)];
+			__gb_swar_tile(gb, dst, __gb_bg_tile(gb, idx), py,
+					palette);
+		}
+#else
+		uint8_t bg_y, disp_x, bg_x, py, px;
+		uint16_t bg_map;
+		const uint8_t *row;
+		uint8_t buf[8];
+
+		/* Calculate current background line to draw. Constant because
+		 * this function draws only this one line each time it is
+		 * called. */
+		bg_y = gb->hram_io[IO_LY] + gb->hram_io[IO_SCY];
+
+		/* Get selected background map address for first tile
+		 * corresponding to current line.
+		 * 0x20 (32) is the width of a background tile, and the bit
+		 * shift is to calculate the address. */
+		bg_map =
+			((gb->hram_io[IO_LCDC] & LCDC_BG_MAP) ?
+			 VRAM_BMAP_2 : VRAM_BMAP_1)
+			+ (bg_y >> 3) * 0x20;
+
+		/* The X coordinate to begin drawing the background at. */
+		bg_x = gb->display.x_start + gb->hram_io[IO_SCX];
+
+		/* Y coordinate of tile pixel to draw. */
+		py = (bg_y & 0x07);
+		/* X coordinate of tile pixel to draw. */
+		px = (bg_x & 0x07);
+
+		/* fetch first tile */
+		row = __gb_tile_row(gb,
+				__gb_bg_tile(gb, gb->vram[bg_map + (bg_x >> 3)]),
+				py, 0, buf);
+
+		for(disp_x = gb->display.x_start;
+				disp_x < gb->display.x_end;
+				disp_x++)
+		{
+			if(px == 8)
+			{
+				/* fetch next tile */
+				px = 0;
+				bg_x = disp_x + gb->hram_io[IO_SCX];
+				row = __gb_tile_row(gb,
+						__gb_bg_tile(gb,
+							gb->vram[bg_map + (bg_x >> 3)]),
+						py, 0, buf);
+			}
+
+			/* copy background */
+			pixels[disp_x] = gb->display.bg_palette[row[px]];
+#if PEANUT_GB_12_COLOUR
+			pixels[disp_x] |= LCD_PALETTE_BG;
+#endif
+			px++;
+		}
+#endif
+	}
+
+	/* draw window */
+	if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
+			&& gb->hram_io[IO_LY] >= gb->display.WY
+			&& gb->hram_io[IO_WX] <= 166)
+	{
+#if PEANUT_GB_SWAR_LCD
+		uint16_t win_line;
+		uint8_t py, i;
+		uint8_t *dst;
+
+		/* Calculate Window Map Address. */
+		win_line = (gb->hram_io[IO_LCDC] & LCDC_WINDOW_MAP) ?
+				    VRAM_BMAP_2 : VRAM_BMAP_1;
+		win_line += (gb->display.window_clear >> 3) * 0x20;
+		py = gb->display.window_clear & 0x07;
+
+		/* The window starts at WX - 7, which is up to seven pixels to
+		 * the left of the screen. */
+		dst = pixels + gb->hram_io[IO_WX] - 7;
+		i = 0;
+
+		if(dst < pixels + gb->display.x_start)
+		{
+			i = (pixels + gb->display.x_start - dst) >> 3;
+			dst += 8 * i;
+		}
+
+		for(; dst < pixels + gb->display.x_end; i++, dst += 8)
+		{
+			uint8_t idx = gb->vram[win_line + i];
+			__gb_swar_tile(gb, dst, __gb_bg_tile(gb, idx), py,
+					palette);
+		}
+#else
+		uint16_t win_line;
+		uint8_t disp_x, win_x, py, px;
+		const uint8_t *row;
+		uint8_t buf[8];
+
+		/* Calculate Window Map Address. */
+		win_line = (gb->hram_io[IO_LCDC] & LCDC_WINDOW_MAP) ?
+				    VRAM_BMAP_2 : VRAM_BMAP_1;
+		win_line += (gb->display.window_clear >> 3) * 0x20;
+
+		disp_x = gb->hram_io[IO_WX] < 7 ? 0 : gb->hram_io[IO_WX] - 7;
+		if(disp_x < gb->display.x_start)
+			disp_x = gb->display.x_start;
+		win_x = disp_x - gb->hram_io[IO_WX] + 7;
+
+		// look up tile
+		py = gb->display.window_clear & 0x07;
+		px = win_x & 0x07;
+
+		// fetch first tile
+		row = __gb_tile_row(gb,
+				__gb_bg_tile(gb, gb->vram[win_line + (win_x >> 3)]),
+				py, 0, buf);
+
+		// loop & copy window
+		for(; disp_x < gb->display.x_end; disp_x++)
+		{
+			if(px == 8)
+			{
+				// fetch next tile
+				px = 0;
+				win_x = disp_x - gb->hram_io[IO_WX] + 7;
+				row = __gb_tile_row(gb,
+						__gb_bg_tile(gb,
+							gb->vram[win_line + (win_x >> 3)]),
+						py, 0, buf);
+			}
+
+			// copy window
+			pixels[disp_x] = gb->display.bg_palette[row[px]];
+#if PEANUT_GB_12_COLOUR
+			pixels[disp_x] |= LCD_PALETTE_BG;
+#endif
+			px++;
+		}
+#endif
+
+		gb->display.window_clear++; // advance window line
+	}
+
+	// draw sprites
+	if(gb->hram_io[IO_LCDC] & LCDC_OBJ_ENABLE)
+	{
+		uint8_t sprite_number;
+#if PEANUT_GB_SWAR_LCD
+		uint64_t obj_palette[2][4];
+
+		for(uint_fast8_t c = 0; c < 4; c++)
+		{
+			obj_palette[0][c] =
+				gb->display.sp_palette[c] * PGB_SWAR_ONES;
+			obj_palette[1][c] =
+				gb->display.sp_palette[c + 4] * PGB_SWAR_ONES;
+# if PEANUT_GB_12_COLOUR
+			obj_palette[1][c] |= OBJ_PALETTE * PGB_SWAR_ONES;
+# endif
+		}
+#endif
+#if PEANUT_GB_SPRITE_BUCKETS
+		if(gb->sprite_lines.dirty)
+			__gb_sprite_lines_update(gb);
+#endif
+#if PEANUT_GB_HIGH_LCD_ACCURACY && PEANUT_GB_SPRITE_BUCKETS
+		const uint8_t number_of_sprites =
+			gb->sprite_lines.count[gb->hram_io[IO_LY]];
+		const uint8_t *sprites_to_render =
+			gb->sprite_lines.number[gb->hram_io[IO_LY]];
+#elif PEANUT_GB_HIGH_LCD_ACCURACY
+		uint8_t number_of_sprites = 0;
+
+		struct sprite_data sprites_to_render[MAX_SPRITES_LINE];
 
 		/* Record number of sprites on the line being rendered, limited
 		 * to the maximum number sprites that the Game Boy is able to
@@ -1693,7 +3473,24 @@ void __gb_draw_line(struct gb_s *gb)
 				sprite_number != 0xFF;
 				sprite_number--)
 		{
+# if PEANUT_GB_SPRITE_BUCKETS
+			uint8_t s = sprites_to_render[sprite_number];
+# else
 			uint8_t s = sprites_to_render[sprite_number].sprite_number;
+# endif
+#elif PEANUT_GB_SPRITE_BUCKETS
+		uint64_t mask = gb->sprite_lines.mask[gb->hram_io[IO_LY]];
+
+		for(sprite_number = NUM_SPRITES - 1;
+			mask != 0;
+			sprite_number--)
+		{
+			uint8_t s = sprite_number;
+
+			if(!((mask >> s) & 1))
+				continue;
+
+			mask &= ~((uint64_t)1 << s);
 #else
 		for (sprite_number = NUM_SPRITES - 1;
 			sprite_number != 0xFF;
@@ -1701,7 +3498,12 @@ void __gb_draw_line(struct gb_s *gb)
 		{
 			uint8_t s = sprite_number;
 #endif
-			uint8_t py, t1, t2, dir, start, end, shift, disp_x;
+			uint8_t py;
+#if !PEANUT_GB_SWAR_LCD
+			uint8_t start, end, i;
+			const uint8_t *row;
+			uint8_t buf[8];
+#endif
 			/* Sprite Y position. */
 			uint8_t OY = gb->oam[4 * s + 0];
 			/* Sprite X position. */
@@ -1712,7 +3514,7 @@ void __gb_draw_line(struct gb_s *gb)
 			/* Additional attributes. */
 			uint8_t OF = gb->oam[4 * s + 3];
 
-#if !PEANUT_GB_HIGH_LCD_ACCURACY
+#if !PEANUT_GB_HIGH_LCD_ACCURACY && !PEANUT_GB_SPRITE_BUCKETS
 			/* If sprite isn't on this line, continue. */
 			if(gb->hram_io[IO_LY] +
 					(gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 0 : 8) >= OY ||
@@ -1724,42 +3526,40 @@ void __gb_draw_line(struct gb_s *gb)
 			if(OX == 0 || OX >= 168)
 				continue;
 
+			/* Continue if sprite is outside of the columns drawn. */
+			if(OX <= gb->display.x_start ||
+					OX - 8 >= gb->display.x_end)
+				continue;
+
 			// y flip
 			py = gb->hram_io[IO_LY] - OY + 16;
 
 			if(OF & OBJ_FLIP_Y)
 				py = (gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 15 : 7) - py;
 
-			// fetch the tile
-			t1 = gb->vram[VRAM_TILES_1 + OT * 0x10 + 2 * py];
-			t2 = gb->vram[VRAM_TILES_1 + OT * 0x10 + 2 * py + 1];
-
-			// handle x flip
-			if(OF & OBJ_FLIP_X)
-			{
-				dir = 1;
-				start = (OX < 8 ? 0 : OX - 8);
-				end = MIN(OX, LCD_WIDTH);
-				shift = 8 - OX + start;
-			}
-			else
-			{
-				dir = (uint8_t)-1;
-				start = MIN(OX, LCD_WIDTH) - 1;
-				end = (OX < 8 ? 0 : OX - 8) - 1;
-				shift = OX - (start + 1);
-			}
+#if PEANUT_GB_SWAR_LCD
+			/* The line buffer has room for the pixels of sprites
+			 * that are partly off screen. */
+			__gb_swar_sprite(gb, pixels + OX - 8,
+					VRAM_TILES_1 + (OT + (py >> 3)) * 0x10,
+					py & 0x07, OF, obj_palette[(OF & OBJ_PALETTE) != 0]);
+#else
+			// fetch the tile, handling x flip
+			row = __gb_tile_row(gb,
+					VRAM_TILES_1 + (OT + (py >> 3)) * 0x10,
+					py & 0x07, (OF & OBJ_FLIP_X) != 0, buf);
 
-			// copy tile
-			t1 >>= shift;
-			t2 >>= shift;
+			/* The pixels of the sprite that are on the screen. */
+			start = (OX < 8 ? 8 - OX : 0);
+			end = (OX > LCD_WIDTH ? LCD_WIDTH + 8 - OX : 8);
 
 			/* TODO: Put for loop within the to if statements
 			 * because the BG priority bit will be the same for
 			 * all the pixels in the tile. */
-			for(disp_x = start; disp_x != end; disp_x += dir)
+			for(i = start; i != end; i++)
 			{
-				uint8_t c = (t1 & 0x1) | ((t2 & 0x1) << 1);
+				const uint8_t disp_x = OX - 8 + i;
+				uint8_t c = row[i];
 				// check transparency / sprite overlap / background overlap
 
 				if(c && !(OF & OBJ_PRIORITY && !((pixels[disp_x] & 0x3) == gb->display.bg_palette[0])))
@@ -1773,1108 +3573,1959 @@ void __gb_draw_line(struct gb_s *gb)
 					pixels[disp_x] |= (OF & OBJ_PALETTE);
 #endif
 				}
-
-				t1 = t1 >> 1;
-				t2 = t2 >> 1;
 			}
+#endif
 		}
 	}
 
-	gb->display.lcd_draw_line(gb, pixels, gb->hram_io[IO_LY]);
+	if(gb->display.obs_buffer != NULL)
+		__gb_lcd_obs_line(gb, pixels);
+
+	if(gb->display.lcd_draw_line != NULL)
+		gb->display.lcd_draw_line(gb, pixels, gb->hram_io[IO_LY]);
+	else if(gb->display.frame_buffer[0] != NULL)
+		gb_lcd_convert_line((uint8_t *)
+				gb->display.frame_buffer[gb->display.frame_back] +
+				gb->hram_io[IO_LY] * gb->display.frame_stride,
+				pixels, gb->display.frame_format,
+				gb->display.frame_palette);
 }
-#endif
 
 /**
- * Internal function used to step the CPU.
+ * Internal function used to check whether the frame that is starting is
+ * skipped.
  */
-void __gb_step_cpu(struct gb_s *gb)
+static bool __gb_frame_skipped(const struct gb_s *gb)
 {
-	uint8_t opcode;
-	uint_fast16_t inst_cycles;
-	static const uint8_t op_cycles[0x100] =
-	{
-		/* *INDENT-OFF* */
-		/*0 1 2  3  4  5  6  7  8  9  A  B  C  D  E  F	*/
-		4,12, 8, 8, 4, 4, 8, 4,20, 8, 8, 8, 4, 4, 8, 4,	/* 0x00 */
-		4,12, 8, 8, 4, 4, 8, 4,12, 8, 8, 8, 4, 4, 8, 4,	/* 0x10 */
-		8,12, 8, 8, 4, 4, 8, 4, 8, 8, 8, 8, 4, 4, 8, 4,	/* 0x20 */
-		8,12, 8, 8,12,12,12, 4, 8, 8, 8, 8, 4, 4, 8, 4,	/* 0x30 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x40 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x50 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x60 */
-		8, 8, 8, 8, 8, 8, 4, 8, 4, 4, 4, 4, 4, 4, 8, 4, /* 0x70 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x80 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x90 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0xA0 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0xB0 */
-		8,12,12,16,12,16, 8,16, 8,16,12, 8,12,24, 8,16,	/* 0xC0 */
-		8,12,12, 0,12,16, 8,16, 8,16,12, 0,12, 0, 8,16,	/* 0xD0 */
-		12,12,8, 0, 0,16, 8,16,16, 4,16, 0, 0, 0, 8,16,	/* 0xE0 */
-		12,12,8, 4, 0,16, 8,16,12, 8,16, 4, 0, 0, 8,16	/* 0xF0 */
-		/* *INDENT-ON* */
-	};
-	static const uint_fast16_t TAC_CYCLES[4] = {1024, 16, 64, 256};
+	const uint8_t ratio = gb->direct.frame_skip_ratio;
+	const uint_fast16_t frames = gb->display.frame_skip_count + 1;
 
-	/* Handle interrupts */
-	/* If gb_halt is positive, then an interrupt must have occurred by the
-	 * time we reach here, because on HALT, we jump to the next interrupt
-	 * immediately. */
-	while(gb->gb_halt || (gb->gb_ime &&
-			gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & ANY_INTR))
-	{
-		gb->gb_halt = false;
+	if(gb->direct.frame_skip)
+		return frames < (ratio == 0 ? 2 : ratio);
 
-		if(!gb->gb_ime)
-			break;
+	if(gb->direct.skip_next_frame)
+		return ratio == 0 || frames < ratio;
 
-		/* Disable interrupts */
-		gb->gb_ime = false;
+	return false;
+}
 
-		/* Push Program Counter */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+/**
+ * Internal function used to show the frame drawn to the back buffer.
+ */
+static void __gb_lcd_frame_swap(struct gb_s *gb)
+{
+	void *frame = gb->display.frame_buffer[gb->display.frame_back];
 
-		/* Call interrupt handler if required. */
-		if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & VBLANK_INTR)
-		{
-			gb->cpu_reg.pc.reg = VBLANK_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= VBLANK_INTR;
-		}
-		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & LCDC_INTR)
-		{
-			gb->cpu_reg.pc.reg = LCDC_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= LCDC_INTR;
-		}
-		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & TIMER_INTR)
-		{
-			gb->cpu_reg.pc.reg = TIMER_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= TIMER_INTR;
-		}
-		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & SERIAL_INTR)
-		{
-			gb->cpu_reg.pc.reg = SERIAL_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= SERIAL_INTR;
-		}
-		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & CONTROL_INTR)
-		{
-			gb->cpu_reg.pc.reg = CONTROL_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= CONTROL_INTR;
-		}
+	gb->display.frame_back ^= 1;
 
-		break;
+	if(gb->display.lcd_frame_ready != NULL)
+		gb->display.lcd_frame_ready(gb, frame);
+}
+
+#if PEANUT_GB_SWAR_LCD
+# undef PGB_SWAR_ONES
+# undef PGB_SWAR_BITS
+# undef PGB_SWAR_BITS_FLIP
+#endif
+#endif
+
+/**
+ * Internal function used to complete a serial transfer.
+ */
+static void __gb_serial_event(struct gb_s *gb)
+{
+	/* If RX can be done, do it. */
+	/* If RX failed, do not change SB if using external
+	 * clock, or set to 0xFF if using internal clock. */
+	uint8_t rx;
+
+	if(gb->gb_serial_rx != NULL &&
+		(gb->gb_serial_rx(gb, &rx) ==
+			GB_SERIAL_RX_SUCCESS))
+	{
+		gb->hram_io[IO_SB] = rx;
+
+		/* Inform game of serial TX/RX completion. */
+		gb->hram_io[IO_SC] &= 0x01;
+		gb->hram_io[IO_IF] |= SERIAL_INTR;
+		__gb_run_event(gb, GB_RUN_SERIAL);
+	}
+	else if(gb->hram_io[IO_SC] & SERIAL_SC_CLOCK_SRC)
+	{
+		/* If using internal clock, and console is not
+		 * attached to any external peripheral, shifted
+		 * bits are replaced with logic 1. */
+		gb->hram_io[IO_SB] = 0xFF;
+
+		/* Inform game of serial TX/RX completion. */
+		gb->hram_io[IO_SC] &= 0x01;
+		gb->hram_io[IO_IF] |= SERIAL_INTR;
+		__gb_run_event(gb, GB_RUN_SERIAL);
+	}
+	else
+	{
+		/* If using external clock, and console is not
+		 * attached to any external peripheral, bits are
+		 * not shifted, so SB is not modified. */
 	}
 
-	/* Obtain opcode */
-	opcode = __gb_read(gb, gb->cpu_reg.pc.reg++);
-	inst_cycles = op_cycles[opcode];
+	/* A transfer that is still requested starts again. */
+	gb->counter.serial_count = 0;
+	gb->counter.serial_sync = gb->counter.cycles;
+	__gb_serial_sync(gb);
+}
 
-	/* Execute opcode */
-	switch(opcode)
+/**
+ * Internal function used to change the LCD mode once the current mode has
+ * ended, or to end the frame if the LCD is off.
+ */
+static void __gb_lcd_event(struct gb_s *gb)
+{
+	const uint_fast32_t lcd_count =
+		(uint_fast32_t)(gb->counter.cycles - gb->counter.lcd_start);
+
+	/* If LCD is off, don't update LCD state. Instead, keep track of
+	 * the amount of time that is being passed. */
+	if(!(gb->hram_io[IO_LCDC] & LCDC_ENABLE))
 	{
-	case 0x00: /* NOP */
-		break;
+		gb->counter.lcd_start += LCD_FRAME_CYCLES;
+		gb->gb_frame = true;
+		__gb_run_event(gb, GB_RUN_FRAME);
+	}
+	/* New Scanline. HBlank -> VBlank or OAM Scan */
+	else if(lcd_count >= LCD_LINE_CYCLES)
+	{
+		gb->counter.lcd_start += LCD_LINE_CYCLES;
 
-	case 0x01: /* LD BC, imm */
-		gb->cpu_reg.bc.bytes.c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		break;
+		/* Next line */
+		gb->hram_io[IO_LY] = gb->hram_io[IO_LY] + 1;
+		if (gb->hram_io[IO_LY] == LCD_VERT_LINES)
+			gb->hram_io[IO_LY] = 0;
 
-	case 0x02: /* LD (BC), A */
-		__gb_write(gb, gb->cpu_reg.bc.reg, gb->cpu_reg.a);
-		break;
+		__gb_run_event(gb, GB_RUN_SCANLINE);
 
-	case 0x03: /* INC BC */
-		gb->cpu_reg.bc.reg++;
-		break;
+		/* LYC Update */
+		if(gb->hram_io[IO_LY] == gb->hram_io[IO_LYC])
+		{
+			gb->hram_io[IO_STAT] |= STAT_LYC_COINC;
 
-	case 0x04: /* INC B */
-		PGB_INSTR_INC_R8(gb->cpu_reg.bc.bytes.b);
-		break;
+			if(gb->hram_io[IO_STAT] & STAT_LYC_INTR)
+				gb->hram_io[IO_IF] |= LCDC_INTR;
+		}
+		else
+			gb->hram_io[IO_STAT] &= 0xFB;
 
-	case 0x05: /* DEC B */
-		PGB_INSTR_DEC_R8(gb->cpu_reg.bc.bytes.b);
-		break;
+		/* Check if LCD should be in Mode 1 (VBLANK) state */
+		if(gb->hram_io[IO_LY] == LCD_HEIGHT)
+		{
+#if ENABLE_LCD
+			/* Show the frame, unless it was blank or skipped. */
+			if(gb->display.frame_buffer[0] != NULL &&
+					!gb->lcd_blank &&
+					!gb->display.frame_skipped)
+				__gb_lcd_frame_swap(gb);
+#endif
 
-	case 0x06: /* LD B, imm */
-		gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		break;
+			gb->hram_io[IO_STAT] =
+				(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_VBLANK;
+			gb->gb_frame = true;
+			__gb_run_event(gb, GB_RUN_FRAME);
+			gb->hram_io[IO_IF] |= VBLANK_INTR;
+			gb->lcd_blank = false;
 
-	case 0x07: /* RLCA */
-		gb->cpu_reg.a = (gb->cpu_reg.a << 1) | (gb->cpu_reg.a >> 7);
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.c = (gb->cpu_reg.a & 0x01);
-		break;
+			if(gb->hram_io[IO_STAT] & STAT_MODE_1_INTR)
+				gb->hram_io[IO_IF] |= LCDC_INTR;
 
-	case 0x08: /* LD (imm), SP */
-	{
-		uint8_t h, l;
-		uint16_t temp;
-		l = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		h = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		temp = PEANUT_GB_U8_TO_U16(h,l);
-		__gb_write(gb, temp++, gb->cpu_reg.sp.bytes.p);
-		__gb_write(gb, temp, gb->cpu_reg.sp.bytes.s);
-		break;
+#if ENABLE_LCD
+			/* If interlaced is activated, change which lines get
+			 * updated. Also, only update lines on frames that are
+			 * actually drawn when frame skip is enabled. */
+			if(gb->direct.interlace && !gb->display.frame_skipped)
+			{
+				gb->display.interlace_count =
+					!gb->display.interlace_count;
+			}
+#endif
+		}
+		/* Start of normal Line (not in VBLANK) */
+		else if(gb->hram_io[IO_LY] < LCD_HEIGHT)
+		{
+			if(gb->hram_io[IO_LY] == 0)
+			{
+				/* Clear Screen */
+				gb->display.WY = gb->hram_io[IO_WY];
+				gb->display.window_clear = 0;
+				gb->display.obs_shift = true;
+#if ENABLE_LCD
+				/* Check if we need to draw the frame or skip
+				 * it. */
+				gb->display.frame_skipped = __gb_frame_skipped(gb);
+
+				if(!gb->display.frame_skipped)
+					gb->display.frame_skip_count = 0;
+				else if(gb->display.frame_skip_count < UINT8_MAX)
+					gb->display.frame_skip_count++;
+#endif
+#if PEANUT_GB_SKIP_UNCHANGED_LINES
+				memset(gb->line_change.changed, 0,
+					sizeof(gb->line_change.changed));
+#endif
+			}
+
+			/* OAM Search occurs at the start of the line. */
+			gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_OAM_SCAN;
+			gb->counter.lcd_start = gb->counter.cycles;
+
+			if(gb->hram_io[IO_STAT] & STAT_MODE_2_INTR)
+				gb->hram_io[IO_IF] |= LCDC_INTR;
+		}
 	}
+	/* Go from Mode 3 (LCD Draw) to Mode 0 (HBLANK). */
+	else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_LCD_DRAW &&
+			lcd_count >= LCD_MODE3_LCD_DRAW_END)
+	{
+		gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_HBLANK;
 
-	case 0x09: /* ADD HL, BC */
+		if(gb->hram_io[IO_STAT] & STAT_MODE_0_INTR)
+			gb->hram_io[IO_IF] |= LCDC_INTR;
+	}
+	/* Go from Mode 2 (OAM Scan) to Mode 3 (LCD Draw). */
+	else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_OAM_SCAN &&
+			lcd_count >= LCD_MODE2_OAM_SCAN_END)
 	{
-		uint_fast32_t temp = gb->cpu_reg.hl.reg + gb->cpu_reg.bc.reg;
-		gb->cpu_reg.f.f_bits.n = 0;
-		gb->cpu_reg.f.f_bits.h =
-			(temp ^ gb->cpu_reg.hl.reg ^ gb->cpu_reg.bc.reg) & 0x1000 ? 1 : 0;
-		gb->cpu_reg.f.f_bits.c = (temp & 0xFFFF0000) ? 1 : 0;
-		gb->cpu_reg.hl.reg = (temp & 0x0000FFFF);
-		break;
+		gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_LCD_DRAW;
+#if ENABLE_LCD
+		if(!gb->lcd_blank)
+			__gb_draw_line(gb);
+#endif
 	}
 
-	case 0x0A: /* LD A, (BC) */
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.bc.reg);
-		break;
+	__gb_lcd_schedule(gb);
+}
 
-	case 0x0B: /* DEC BC */
-		gb->cpu_reg.bc.reg--;
-		break;
+/**
+ * Internal function used to handle every event that is due.
+ */
+static void __gb_run_events(struct gb_s *gb)
+{
+	const uint64_t now = gb->counter.cycles;
 
-	case 0x0C: /* INC C */
-		PGB_INSTR_INC_R8(gb->cpu_reg.bc.bytes.c);
-		break;
+	do
+	{
+		if(gb->counter.event[GB_EVENT_RTC] <= now)
+			__gb_rtc_sync(gb);
 
-	case 0x0D: /* DEC C */
-		PGB_INSTR_DEC_R8(gb->cpu_reg.bc.bytes.c);
-		break;
+		if(gb->counter.event[GB_EVENT_SERIAL] <= now)
+			__gb_serial_event(gb);
 
-	case 0x0E: /* LD C, imm */
-		gb->cpu_reg.bc.bytes.c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		break;
+		if(gb->counter.event[GB_EVENT_TIMA] <= now)
+			__gb_tima_sync(gb);
 
-	case 0x0F: /* RRCA */
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.c = gb->cpu_reg.a & 0x01;
-		gb->cpu_reg.a = (gb->cpu_reg.a >> 1) | (gb->cpu_reg.a << 7);
-		break;
+		if(gb->counter.event[GB_EVENT_LCD] <= now)
+			__gb_lcd_event(gb);
 
-	case 0x10: /* STOP */
-		//gb->gb_halt = true;
-		break;
+		if(gb->counter.event[GB_EVENT_STOP] <= now)
+		{
+			__gb_schedule(gb, GB_EVENT_STOP, UINT64_MAX);
+			__gb_run_event(gb, GB_RUN_CYCLES);
+			gb->run.stop = true;
+		}
+	} while(gb->counter.next_event <= now);
+}
 
-	case 0x11: /* LD DE, imm */
-		gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		break;
+/**
+ * Internal function used to advance the timers, serial, RTC and LCD by the
+ * number of cycles taken by the last instruction. If the CPU is halted, time
+ * is advanced from one event to the next until an interrupt occurs, or until
+ * the run is stopped.
+ */
+static void __gb_tick(struct gb_s *gb, uint_fast16_t inst_cycles)
+{
+	gb->counter.cycles += inst_cycles;
 
-	case 0x12: /* LD (DE), A */
-		__gb_write(gb, gb->cpu_reg.de.reg, gb->cpu_reg.a);
-		break;
+	if(PGB_UNLIKELY(gb->counter.cycles >= gb->counter.next_event))
+		__gb_run_events(gb);
 
-	case 0x13: /* INC DE */
-		gb->cpu_reg.de.reg++;
-		break;
+	/* If halted, loop until an interrupt occurs. */
+	while(PGB_UNLIKELY(gb->gb_halt) &&
+			(gb->hram_io[IO_IF] & gb->hram_io[IO_IE]) == 0)
+	{
+		/* Return to the caller, which resumes the HALT in the next
+		 * run. This also returns if halted forever. */
+		if(gb->run.stop)
+			break;
 
-	case 0x14: /* INC D */
-		PGB_INSTR_INC_R8(gb->cpu_reg.de.bytes.d);
-		break;
+		gb->counter.cycles = gb->counter.next_event;
+		__gb_run_events(gb);
+	}
+}
 
-	case 0x15: /* DEC D */
-		PGB_INSTR_DEC_R8(gb->cpu_reg.de.bytes.d);
-		break;
+/* Cycles taken by each opcode. Taken branches and CB prefixed instructions
+ * add to these. */
+static const uint8_t op_cycles[0x100] =
+{
+	/* *INDENT-OFF* */
+	/*0 1 2  3  4  5  6  7  8  9  A  B  C  D  E  F	*/
+	4,12, 8, 8, 4, 4, 8, 4,20, 8, 8, 8, 4, 4, 8, 4,	/* 0x00 */
+	4,12, 8, 8, 4, 4, 8, 4,12, 8, 8, 8, 4, 4, 8, 4,	/* 0x10 */
+	8,12, 8, 8, 4, 4, 8, 4, 8, 8, 8, 8, 4, 4, 8, 4,	/* 0x20 */
+	8,12, 8, 8,12,12,12, 4, 8, 8, 8, 8, 4, 4, 8, 4,	/* 0x30 */
+	4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x40 */
+	4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x50 */
+	4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x60 */
+	8, 8, 8, 8, 8, 8, 4, 8, 4, 4, 4, 4, 4, 4, 8, 4, /* 0x70 */
+	4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x80 */
+	4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x90 */
+	4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0xA0 */
+	4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0xB0 */
+	8,12,12,16,12,16, 8,16, 8,16,12, 8,12,24, 8,16,	/* 0xC0 */
+	8,12,12, 0,12,16, 8,16, 8,16,12, 0,12, 0, 8,16,	/* 0xD0 */
+	12,12,8, 0, 0,16, 8,16,16, 4,16, 0, 0, 0, 8,16,	/* 0xE0 */
+	12,12,8, 4, 0,16, 8,16,12, 8,16, 4, 0, 0, 8,16	/* 0xF0 */
+	/* *INDENT-ON* */
+};
 
-	case 0x16: /* LD D, imm */
-		gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		break;
+#if PEANUT_GB_PREDECODE
+/* Length of each instruction in bytes, including its operands. STOP is
+ * treated as a single byte instruction, as it is by the interpreter. */
+static const uint8_t op_length[0x100] =
+{
+	/* *INDENT-OFF* */
+	/*0 1 2  3  4  5  6  7  8  9  A  B  C  D  E  F	*/
+	1, 3, 1, 1, 1, 1, 2, 1, 3, 1, 1, 1, 1, 1, 2, 1,	/* 0x00 */
+	1, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,	/* 0x10 */
+	2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,	/* 0x20 */
+	2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,	/* 0x30 */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,	/* 0x40 */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,	/* 0x50 */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,	/* 0x60 */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,	/* 0x70 */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,	/* 0x80 */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,	/* 0x90 */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,	/* 0xA0 */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,	/* 0xB0 */
+	1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1,	/* 0xC0 */
+	1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 1, 2, 1,	/* 0xD0 */
+	2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1,	/* 0xE0 */
+	2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1	/* 0xF0 */
+	/* *INDENT-ON* */
+};
 
-	case 0x17: /* RLA */
-	{
-		uint8_t temp = gb->cpu_reg.a;
-		gb->cpu_reg.a = (gb->cpu_reg.a << 1) | gb->cpu_reg.f.f_bits.c;
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.c = (temp >> 7) & 0x01;
-		break;
-	}
+/**
+ * An instruction decoded for the interpreter. A length of zero marks an entry
+ * that has not been decoded yet, or that was overwritten.
+ */
+struct pgb_decoded_s
+{
+	uint16_t imm;
+	uint8_t opcode;
+	uint8_t length;
+	uint8_t cycles;
+};
 
-	case 0x18: /* JR imm */
+struct gb_predecode_s
+{
+	/* An array of ROM_BANK_SIZE entries for each ROM bank. Each is
+	 * allocated when code in that bank is first executed. */
+	struct pgb_decoded_s **rom;
+	uint_fast32_t rom_banks;
+
+	struct pgb_decoded_s wram[WRAM_SIZE];
+	struct pgb_decoded_s hram[INTR_EN_ADDR - HRAM_ADDR];
+};
+
+/**
+ * Internal function used to discard the decoded instructions that may include
+ * the byte written to addr. Instructions are at most three bytes long.
+ */
+static void __gb_predecode_invalidate(struct gb_s *gb, uint_fast16_t addr)
+{
+	struct pgb_decoded_s *entries;
+	uint_fast16_t off;
+
+	if(gb->predecode == NULL)
+		return;
+
+	/* Echo RAM mirrors WRAM. */
+	if(addr >= ECHO_ADDR && addr < OAM_ADDR)
+		addr -= ECHO_ADDR - WRAM_0_ADDR;
+
+	if(addr >= WRAM_0_ADDR && addr < ECHO_ADDR)
 	{
-		int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.pc.reg += temp;
-		break;
+		entries = gb->predecode->wram;
+		off = addr - WRAM_0_ADDR;
 	}
-
-	case 0x19: /* ADD HL, DE */
+	else if(addr >= HRAM_ADDR && addr < INTR_EN_ADDR)
 	{
-		uint_fast32_t temp = gb->cpu_reg.hl.reg + gb->cpu_reg.de.reg;
-		gb->cpu_reg.f.f_bits.n = 0;
-		gb->cpu_reg.f.f_bits.h =
-			(temp ^ gb->cpu_reg.hl.reg ^ gb->cpu_reg.de.reg) & 0x1000 ? 1 : 0;
-		gb->cpu_reg.f.f_bits.c = (temp & 0xFFFF0000) ? 1 : 0;
-		gb->cpu_reg.hl.reg = (temp & 0x0000FFFF);
-		break;
+		entries = gb->predecode->hram;
+		off = addr - HRAM_ADDR;
 	}
+	else
+		return;
 
-	case 0x1A: /* LD A, (DE) */
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.de.reg);
-		break;
+	entries[off].length = 0;
 
-	case 0x1B: /* DEC DE */
-		gb->cpu_reg.de.reg--;
-		break;
+	if(off >= 1)
+		entries[off - 1].length = 0;
 
-	case 0x1C: /* INC E */
-		PGB_INSTR_INC_R8(gb->cpu_reg.de.bytes.e);
-		break;
+	if(off >= 2)
+		entries[off - 2].length = 0;
+}
 
-	case 0x1D: /* DEC E */
-		PGB_INSTR_DEC_R8(gb->cpu_reg.de.bytes.e);
-		break;
+/**
+ * Internal function used to decode the instruction at addr.
+ */
+static void __gb_predecode(struct gb_s *gb, const uint_fast16_t addr,
+		struct pgb_decoded_s *d)
+{
+	const uint8_t opcode = __gb_read(gb, addr);
 
-	case 0x1E: /* LD E, imm */
-		gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		break;
+	d->opcode = opcode;
+	d->length = op_length[opcode];
+	d->cycles = op_cycles[opcode];
+	d->imm = 0;
 
-	case 0x1F: /* RRA */
+	if(d->length > 1)
+		d->imm = __gb_read(gb, addr + 1);
+
+	if(d->length > 2)
+		d->imm |= __gb_read(gb, addr + 2) << 8;
+}
+
+/**
+ * Internal function used to return the decoded instruction at PC. Instructions
+ * that are not kept, such as those in the boot ROM or in VRAM, are decoded
+ * into scratch.
+ */
+static const struct pgb_decoded_s *__gb_predecode_fetch(struct gb_s *gb,
+		struct pgb_decoded_s *scratch)
+{
+	struct gb_predecode_s *pd = gb->predecode;
+	const uint_fast16_t pc = gb->cpu_reg.pc.reg;
+	struct pgb_decoded_s *d = scratch;
+	/* Bytes left until the end of the memory region holding the entry. */
+	uint_fast16_t room = 3;
+
+	if(pd == NULL)
 	{
-		uint8_t temp = gb->cpu_reg.a;
-		gb->cpu_reg.a = gb->cpu_reg.a >> 1 | (gb->cpu_reg.f.f_bits.c << 7);
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.c = temp & 0x1;
-		break;
+		/* Nothing is kept. */
 	}
+	else if(pc < VRAM_ADDR)
+	{
+		uint_fast32_t bank = 0;
 
-	case 0x20: /* JR NZ, imm */
-		if(!gb->cpu_reg.f.f_bits.z)
+		if(pc >= ROM_N_ADDR)
 		{
-			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-			gb->cpu_reg.pc.reg += temp;
-			inst_cycles += 4;
+			if(gb->mbc == 1 && gb->cart_mode_select)
+				bank = gb->selected_rom_bank & 0x1F;
+			else
+				bank = gb->selected_rom_bank;
 		}
-		else
-			gb->cpu_reg.pc.reg++;
 
-		break;
+		/* The boot ROM is not kept. */
+		if((pc >= 0x0100 || gb->hram_io[IO_BOOT] != 0) &&
+				bank < pd->rom_banks)
+		{
+			if(pd->rom[bank] == NULL)
+				pd->rom[bank] = calloc(ROM_BANK_SIZE,
+						sizeof(struct pgb_decoded_s));
 
-	case 0x21: /* LD HL, imm */
-		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		break;
+			if(pd->rom[bank] != NULL)
+			{
+				d = &pd->rom[bank][pc & (ROM_BANK_SIZE - 1)];
+				room = ROM_BANK_SIZE - (pc & (ROM_BANK_SIZE - 1));
+			}
+		}
+	}
+	else if(pc >= WRAM_0_ADDR && pc < ECHO_ADDR)
+	{
+		d = &pd->wram[pc - WRAM_0_ADDR];
+		room = ECHO_ADDR - pc;
+	}
+	else if(pc >= HRAM_ADDR && pc < INTR_EN_ADDR)
+	{
+		d = &pd->hram[pc - HRAM_ADDR];
+		room = INTR_EN_ADDR - pc;
+	}
 
-	case 0x22: /* LDI (HL), A */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.a);
-		gb->cpu_reg.hl.reg++;
-		break;
+	if(d != scratch && PGB_LIKELY(d->length != 0))
+		return d;
 
-	case 0x23: /* INC HL */
-		gb->cpu_reg.hl.reg++;
-		break;
-
-	case 0x24: /* INC H */
-		PGB_INSTR_INC_R8(gb->cpu_reg.hl.bytes.h);
-		break;
-
-	case 0x25: /* DEC H */
-		PGB_INSTR_DEC_R8(gb->cpu_reg.hl.bytes.h);
-		break;
+	__gb_predecode(gb, pc, d);
 
-	case 0x26: /* LD H, imm */
-		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		break;
-
-	case 0x27: /* DAA */
+	/* Instructions that run into the next memory region are not kept, as
+	 * that region may change independently. */
+	if(d->length > room)
 	{
-		/* The following is from SameBoy. MIT License. */
-		int16_t a = gb->cpu_reg.a;
+		*scratch = *d;
+		d->length = 0;
+		d = scratch;
+	}
 
-		if(gb->cpu_reg.f.f_bits.n)
-		{
-			if(gb->cpu_reg.f.f_bits.h)
-				a = (a - 0x06) & 0xFF;
+	return d;
+}
 
-			if(gb->cpu_reg.f.f_bits.c)
-				a -= 0x60;
-		}
-		else
-		{
-			if(gb->cpu_reg.f.f_bits.h || (a & 0x0F) > 9)
-				a += 0x06;
+/* Fetch the next instruction and its operands, and move PC past them. */
+# define PGB_FETCH()							\
+	do {								\
+		const struct pgb_decoded_s *d_ =			\
+			__gb_predecode_fetch(gb, &decoded);		\
+		opcode = d_->opcode;					\
+		inst_cycles = d_->cycles;				\
+		imm = d_->imm;						\
+		gb->cpu_reg.pc.reg += d_->length;			\
+	} while(0)
+/* First and second operand bytes of the instruction. */
+# define PGB_IMM_LO()	((uint8_t)(imm & 0xFF))
+# define PGB_IMM_HI()	((uint8_t)(imm >> 8))
+/* Skip operands that are not used. PC is already past them. */
+# define PGB_IMM_SKIP(n)	do {} while(0)
+#else
+# define PGB_FETCH()							\
+	do {								\
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg++);		\
+		inst_cycles = op_cycles[opcode];			\
+	} while(0)
+# define PGB_IMM_LO()	__gb_read(gb, gb->cpu_reg.pc.reg++)
+# define PGB_IMM_HI()	__gb_read(gb, gb->cpu_reg.pc.reg++)
+# define PGB_IMM_SKIP(n)	(gb->cpu_reg.pc.reg += (n))
+#endif
 
-			if(gb->cpu_reg.f.f_bits.c || a > 0x9F)
-				a += 0x60;
-		}
+#if PEANUT_GB_IDLE_LOOP_SKIP
+/* Longest loop that is checked, in bytes. */
+#define PGB_IDLE_LOOP_MAX_BYTES	16
 
-		if((a & 0x100) == 0x100)
-			gb->cpu_reg.f.f_bits.c = 1;
+/**
+ * Internal function used to check whether reading addr returns the same value
+ * until the next event.
+ */
+static bool __gb_idle_read_stable(const struct gb_s *gb,
+		const uint_fast16_t addr)
+{
+	if(addr < IO_ADDR || addr >= HRAM_ADDR)
+		return true;
 
-		gb->cpu_reg.a = a;
-		gb->cpu_reg.f.f_bits.z = (gb->cpu_reg.a == 0);
-		gb->cpu_reg.f.f_bits.h = 0;
+	/* DIV and TIMA advance between events. */
+	if(addr == IO_ADDR + IO_DIV || addr == IO_ADDR + IO_TIMA)
+		return false;
 
-		break;
-	}
+	/* The APU may change its registers at any time. */
+	if(addr >= 0xFF10 && addr <= 0xFF3F &&
+			(ENABLE_SOUND || gb->gb_audio_read != NULL))
+		return false;
 
-	case 0x28: /* JR Z, imm */
-		if(gb->cpu_reg.f.f_bits.z)
-		{
-			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-			gb->cpu_reg.pc.reg += temp;
-			inst_cycles += 4;
-		}
-		else
-			gb->cpu_reg.pc.reg++;
+	return true;
+}
 
-		break;
+/**
+ * Internal function used to check whether the loop from target to the branch
+ * ending at end only polls memory. The loop must load A before using it, only
+ * change A and the flags, only read memory that is stable until the next
+ * event, and only branch on flags that it sets. Every iteration then leaves
+ * the CPU in the same state.
+ *
+ * \param target		Address of the start of the loop.
+ * \param end			Address after the branch ending the loop.
+ * \param branch_length	Length of the branch instruction in bytes.
+ * \param branch_cycles	Cycles taken by the branch instruction.
+ * \returns				Cycles taken by each iteration, or 0 if the
+ *						loop is not idle.
+ */
+static uint_fast16_t __gb_idle_loop_cycles(struct gb_s *gb,
+		const uint_fast16_t target, const uint_fast16_t end,
+		const uint_fast16_t branch_length,
+		const uint_fast16_t branch_cycles)
+{
+	const uint_fast16_t branch = end - branch_length;
+	uint_fast16_t addr = target;
+	uint_fast16_t cycles = branch_cycles;
+	bool a_loaded = false;
+	bool z_set = false, c_set = false;
 
-	case 0x29: /* ADD HL, HL */
+	while(addr < branch)
 	{
-		gb->cpu_reg.f.f_bits.c = (gb->cpu_reg.hl.reg & 0x8000) > 0;
-		gb->cpu_reg.hl.reg <<= 1;
-		gb->cpu_reg.f.f_bits.n = 0;
-		gb->cpu_reg.f.f_bits.h = (gb->cpu_reg.hl.reg & 0x1000) > 0;
-		break;
-	}
-
-	case 0x2A: /* LD A, (HL+) */
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.hl.reg++);
-		break;
-
-	case 0x2B: /* DEC HL */
-		gb->cpu_reg.hl.reg--;
-		break;
+		const uint8_t opcode = __gb_read(gb, addr);
+		uint_fast16_t src;
 
-	case 0x2C: /* INC L */
-		PGB_INSTR_INC_R8(gb->cpu_reg.hl.bytes.l);
-		break;
-
-	case 0x2D: /* DEC L */
-		PGB_INSTR_DEC_R8(gb->cpu_reg.hl.bytes.l);
-		break;
+		cycles += op_cycles[opcode];
 
-	case 0x2E: /* LD L, imm */
-		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		break;
+		switch(opcode)
+		{
+		case 0x00: /* NOP */
+			addr++;
+			continue;
 
-	case 0x2F: /* CPL */
-		gb->cpu_reg.a = ~gb->cpu_reg.a;
-		gb->cpu_reg.f.f_bits.n = 1;
-		gb->cpu_reg.f.f_bits.h = 1;
-		break;
+		case 0x0A: /* LD A, (BC) */
+			src = gb->cpu_reg.bc.reg;
+			addr++;
+			break;
 
-	case 0x30: /* JR NC, imm */
-		if(!gb->cpu_reg.f.f_bits.c)
-		{
-			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-			gb->cpu_reg.pc.reg += temp;
-			inst_cycles += 4;
-		}
-		else
-			gb->cpu_reg.pc.reg++;
+		case 0x1A: /* LD A, (DE) */
+			src = gb->cpu_reg.de.reg;
+			addr++;
+			break;
 
-		break;
+		case 0x7E: /* LD A, (HL) */
+			src = gb->cpu_reg.hl.reg;
+			addr++;
+			break;
 
-	case 0x31: /* LD SP, imm */
-		gb->cpu_reg.sp.bytes.p = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.sp.bytes.s = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		break;
+		case 0xF0: /* LD A, (0xFF00+imm) */
+			src = IO_ADDR | __gb_read(gb, addr + 1);
+			addr += 2;
+			break;
 
-	case 0x32: /* LD (HL), A */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.a);
-		gb->cpu_reg.hl.reg--;
-		break;
+		case 0xF2: /* LD A, (0xFF00+C) */
+			src = IO_ADDR | gb->cpu_reg.bc.bytes.c;
+			addr++;
+			break;
 
-	case 0x33: /* INC SP */
-		gb->cpu_reg.sp.reg++;
-		break;
+		case 0xFA: /* LD A, (imm) */
+			src = __gb_read(gb, addr + 1) |
+			      (__gb_read(gb, addr + 2) << 8);
+			addr += 3;
+			break;
 
-	case 0x34: /* INC (HL) */
-	{
-		uint8_t temp = __gb_read(gb, gb->cpu_reg.hl.reg);
-		PGB_INSTR_INC_R8(temp);
-		__gb_write(gb, gb->cpu_reg.hl.reg, temp);
-		break;
-	}
+		case 0x3E: /* LD A, imm */
+			a_loaded = true;
+			addr += 2;
+			continue;
 
-	case 0x35: /* DEC (HL) */
-	{
-		uint8_t temp = __gb_read(gb, gb->cpu_reg.hl.reg);
-		PGB_INSTR_DEC_R8(temp);
-		__gb_write(gb, gb->cpu_reg.hl.reg, temp);
-		break;
-	}
+		case 0x78: /* LD A, B */
+		case 0x79: /* LD A, C */
+		case 0x7A: /* LD A, D */
+		case 0x7B: /* LD A, E */
+		case 0x7C: /* LD A, H */
+		case 0x7D: /* LD A, L */
+			a_loaded = true;
+			addr++;
+			continue;
 
-	case 0x36: /* LD (HL), imm */
-		__gb_write(gb, gb->cpu_reg.hl.reg, __gb_read(gb, gb->cpu_reg.pc.reg++));
-		break;
+		case 0xE6: /* AND imm */
+		case 0xEE: /* XOR imm */
+		case 0xF6: /* OR imm */
+		case 0xFE: /* CP imm */
+			if(!a_loaded)
+				return 0;
 
-	case 0x37: /* SCF */
-		gb->cpu_reg.f.f_bits.n = 0;
-		gb->cpu_reg.f.f_bits.h = 0;
-		gb->cpu_reg.f.f_bits.c = 1;
-		break;
+			z_set = c_set = true;
+			addr += 2;
+			continue;
 
-	case 0x38: /* JR C, imm */
-		if(gb->cpu_reg.f.f_bits.c)
+		case 0xCB: /* CB INST */
 		{
-			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-			gb->cpu_reg.pc.reg += temp;
-			inst_cycles += 4;
-		}
-		else
-			gb->cpu_reg.pc.reg++;
+			const uint8_t cbop = __gb_read(gb, addr + 1);
 
-		break;
+			/* Only BIT sets the flags without changing registers. */
+			if(cbop < 0x40 || cbop > 0x7F)
+				return 0;
 
-	case 0x39: /* ADD HL, SP */
-	{
-		uint_fast32_t temp = gb->cpu_reg.hl.reg + gb->cpu_reg.sp.reg;
-		gb->cpu_reg.f.f_bits.n = 0;
-		gb->cpu_reg.f.f_bits.h =
-			((gb->cpu_reg.hl.reg & 0xFFF) + (gb->cpu_reg.sp.reg & 0xFFF)) & 0x1000 ? 1 : 0;
-		gb->cpu_reg.f.f_bits.c = temp & 0x10000 ? 1 : 0;
-		gb->cpu_reg.hl.reg = (uint16_t)temp;
-		break;
-	}
+			if((cbop & 0x07) == 0x07 && !a_loaded)
+				return 0;
 
-	case 0x3A: /* LD A, (HL) */
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.hl.reg--);
-		break;
+			if((cbop & 0x07) == 0x06 &&
+					!__gb_idle_read_stable(gb, gb->cpu_reg.hl.reg))
+				return 0;
 
-	case 0x3B: /* DEC SP */
-		gb->cpu_reg.sp.reg--;
-		break;
+			/* Use the cycles of BIT rather than of the prefix. */
+			cycles -= op_cycles[opcode];
+			cycles += (cbop & 0x07) == 0x06 ? 12 : 8;
+			z_set = true;
+			addr += 2;
+			continue;
+		}
 
-	case 0x3C: /* INC A */
-		PGB_INSTR_INC_R8(gb->cpu_reg.a);
-		break;
+		default:
+			/* AND, XOR, OR, CP with a register or (HL). */
+			if(opcode < 0xA0 || opcode > 0xBF || !a_loaded)
+				return 0;
 
-	case 0x3D: /* DEC A */
-		PGB_INSTR_DEC_R8(gb->cpu_reg.a);
-		break;
+			if((opcode & 0x07) == 0x06 &&
+					!__gb_idle_read_stable(gb, gb->cpu_reg.hl.reg))
+				return 0;
 
-	case 0x3E: /* LD A, imm */
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		break;
+			z_set = c_set = true;
+			addr++;
+			continue;
+		}
 
-	case 0x3F: /* CCF */
-		gb->cpu_reg.f.f_bits.n = 0;
-		gb->cpu_reg.f.f_bits.h = 0;
-		gb->cpu_reg.f.f_bits.c = ~gb->cpu_reg.f.f_bits.c;
-		break;
+		/* A is loaded from memory. */
+		if(!__gb_idle_read_stable(gb, src))
+			return 0;
 
-	case 0x40: /* LD B, B */
-		break;
+		a_loaded = true;
+	}
 
-	case 0x41: /* LD B, C */
-		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.bc.bytes.c;
-		break;
+	/* The loop must not jump over the branch. */
+	if(addr != branch)
+		return 0;
 
-	case 0x42: /* LD B, D */
-		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.de.bytes.d;
+	switch(__gb_read(gb, branch))
+	{
+	case 0x18: /* JR imm */
+	case 0xC3: /* JP imm */
 		break;
 
-	case 0x43: /* LD B, E */
-		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.de.bytes.e;
-		break;
+	case 0x20: /* JR NZ, imm */
+	case 0x28: /* JR Z, imm */
+	case 0xC2: /* JP NZ, imm */
+	case 0xCA: /* JP Z, imm */
+		if(!z_set)
+			return 0;
 
-	case 0x44: /* LD B, H */
-		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.hl.bytes.h;
 		break;
 
-	case 0x45: /* LD B, L */
-		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.hl.bytes.l;
-		break;
+	case 0x30: /* JR NC, imm */
+	case 0x38: /* JR C, imm */
+	case 0xD2: /* JP NC, imm */
+	case 0xDA: /* JP C, imm */
+		if(!c_set)
+			return 0;
 
-	case 0x46: /* LD B, (HL) */
-		gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.hl.reg);
 		break;
 
-	case 0x47: /* LD B, A */
-		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.a;
-		break;
+	default:
+		return 0;
+	}
 
-	case 0x48: /* LD C, B */
-		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.bc.bytes.b;
-		break;
+	return cycles;
+}
 
-	case 0x49: /* LD C, C */
-		break;
+/**
+ * Internal function used when a branch back to target is taken. If the loop
+ * only polls memory and the last iteration did not reach an event, then every
+ * iteration until the next event does exactly the same. Those iterations are
+ * skipped by advancing time.
+ *
+ * \param target		Address of the start of the loop.
+ * \param branch_length	Length of the branch instruction in bytes.
+ * \param branch_cycles	Cycles taken by the branch instruction.
+ */
+static void __gb_idle_loop(struct gb_s *gb, const uint_fast16_t target,
+		const uint_fast16_t branch_length,
+		const uint_fast16_t branch_cycles)
+{
+	const uint_fast16_t end = gb->cpu_reg.pc.reg;
+	const uint64_t now = gb->counter.cycles;
+	uint_fast16_t bank = 0;
+	bool in_rom;
 
-	case 0x4A: /* LD C, D */
-		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.de.bytes.d;
-		break;
+	if(end - target > PGB_IDLE_LOOP_MAX_BYTES)
+		return;
 
-	case 0x4B: /* LD C, E */
-		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.de.bytes.e;
-		break;
+	/* The boot ROM is skipped as it shares addresses with the cartridge. */
+	if(end <= VRAM_ADDR && (target >= 0x0100 || gb->hram_io[IO_BOOT] != 0))
+		in_rom = true;
+	else if((target >= WRAM_0_ADDR && end <= ECHO_ADDR) ||
+			(target >= HRAM_ADDR && end <= INTR_EN_ADDR))
+		in_rom = false;
+	else
+		return;
 
-	case 0x4C: /* LD C, H */
-		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.hl.bytes.h;
-		break;
+	if(in_rom && end > ROM_N_ADDR)
+	{
+		if(gb->mbc == 1 && gb->cart_mode_select)
+			bank = gb->selected_rom_bank & 0x1F;
+		else
+			bank = gb->selected_rom_bank;
+	}
 
-	case 0x4D: /* LD C, L */
-		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.hl.bytes.l;
-		break;
+	if(gb->idle.target == target && gb->idle.end == end &&
+			gb->idle.bank == bank && gb->idle.loop_cycles != 0 &&
+			now - gb->idle.cycles == gb->idle.loop_cycles &&
+			gb->idle.next_event == gb->counter.next_event &&
+			gb->counter.next_event > now + branch_cycles)
+	{
+		/* Skip whole iterations that end before the next event. */
+		const uint64_t skip = (gb->counter.next_event - now -
+				branch_cycles - 1) / gb->idle.loop_cycles *
+				gb->idle.loop_cycles;
 
-	case 0x4E: /* LD C, (HL) */
-		gb->cpu_reg.bc.bytes.c = __gb_read(gb, gb->cpu_reg.hl.reg);
-		break;
+		gb->counter.cycles += skip;
+		gb->idle.skipped += skip;
+	}
+	/* Code in ROM only changes with the bank. Code in RAM may have been
+	 * changed by anything that ran since the last iteration. */
+	else if(!in_rom || gb->idle.target != target ||
+			gb->idle.end != end || gb->idle.bank != bank)
+	{
+		gb->idle.target = target;
+		gb->idle.end = end;
+		gb->idle.bank = bank;
+		gb->idle.loop_cycles = __gb_idle_loop_cycles(gb, target, end,
+				branch_length, branch_cycles);
+	}
 
-	case 0x4F: /* LD C, A */
-		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.a;
-		break;
+	gb->idle.cycles = gb->counter.cycles;
+	gb->idle.next_event = gb->counter.next_event;
+}
 
-	case 0x50: /* LD D, B */
-		gb->cpu_reg.de.bytes.d = gb->cpu_reg.bc.bytes.b;
-		break;
+/* Check for an idle loop when a branch back to target is taken. */
+# define PGB_IDLE_LOOP(target, length)					\
+	do {								\
+		if(PGB_UNLIKELY((target) < gb->cpu_reg.pc.reg))	\
+			__gb_idle_loop(gb, (target), (length),		\
+					inst_cycles);			\
+	} while(0)
+#else
+# define PGB_IDLE_LOOP(target, length)	do {} while(0)
+#endif
 
-	case 0x51: /* LD D, C */
-		gb->cpu_reg.de.bytes.d = gb->cpu_reg.bc.bytes.c;
-		break;
+#if PEANUT_GB_THREADED_DISPATCH
+/* Each opcode handler is also a label, and ends by executing the timing tail
+ * and jumping directly to the handler of the next opcode. Control only leaves
+ * the handlers when an interrupt or HALT must be serviced, or when execution
+ * must return to the caller. */
+# define PGB_OP(op)	case op: op_##op
+# define PGB_OP_DEFAULT	default: op_invalid
+# define PGB_OP_END()							\
+	do {								\
+		__gb_tick(gb, inst_cycles);				\
+		if(PGB_UNLIKELY(single_step || gb->run.stop ||		\
+				gb->gb_halt || (gb->gb_ime &&		\
+				gb->hram_io[IO_IF] & gb->hram_io[IO_IE] &	\
+				ANY_INTR)))					\
+			goto exit_dispatch;				\
+		PGB_FETCH();						\
+		goto *dispatch[opcode];					\
+	} while(0)
+#else
+# define PGB_OP(op)	case op
+# define PGB_OP_DEFAULT	default
+# define PGB_OP_END()	break
+#endif
 
-	case 0x52: /* LD D, D */
-		break;
+/**
+ * Internal function used to execute instructions. When threaded dispatch is
+ * enabled and single_step is false, instructions are executed until the end of
+ * the frame. Otherwise only one instruction is executed.
+ */
+static void __gb_execute(struct gb_s *gb, const bool single_step)
+{
+	uint8_t opcode;
+	uint_fast16_t inst_cycles;
+#if PEANUT_GB_PREDECODE
+	struct pgb_decoded_s decoded;
+	uint_fast16_t imm;
+#endif
+#if PEANUT_GB_THREADED_DISPATCH
+	static const void *const dispatch[0x100] =
+	{
+		/* *INDENT-OFF* */
+		&&op_0x00, &&op_0x01, &&op_0x02, &&op_0x03,
+		&&op_0x04, &&op_0x05, &&op_0x06, &&op_0x07,
+		&&op_0x08, &&op_0x09, &&op_0x0A, &&op_0x0B,
+		&&op_0x0C, &&op_0x0D, &&op_0x0E, &&op_0x0F,
+		&&op_0x10, &&op_0x11, &&op_0x12, &&op_0x13,
+		&&op_0x14, &&op_0x15, &&op_0x16, &&op_0x17,
+		&&op_0x18, &&op_0x19, &&op_0x1A, &&op_0x1B,
+		&&op_0x1C, &&op_0x1D, &&op_0x1E, &&op_0x1F,
+		&&op_0x20, &&op_0x21, &&op_0x22, &&op_0x23,
+		&&op_0x24, &&op_0x25, &&op_0x26, &&op_0x27,
+		&&op_0x28, &&op_0x29, &&op_0x2A, &&op_0x2B,
+		&&op_0x2C, &&op_0x2D, &&op_0x2E, &&op_0x2F,
+		&&op_0x30, &&op_0x31, &&op_0x32, &&op_0x33,
+		&&op_0x34, &&op_0x35, &&op_0x36, &&op_0x37,
+		&&op_0x38, &&op_0x39, &&op_0x3A, &&op_0x3B,
+		&&op_0x3C, &&op_0x3D, &&op_0x3E, &&op_0x3F,
+		&&op_0x40, &&op_0x41, &&op_0x42, &&op_0x43,
+		&&op_0x44, &&op_0x45, &&op_0x46, &&op_0x47,
+		&&op_0x48, &&op_0x49, &&op_0x4A, &&op_0x4B,
+		&&op_0x4C, &&op_0x4D, &&op_0x4E, &&op_0x4F,
+		&&op_0x50, &&op_0x51, &&op_0x52, &&op_0x53,
+		&&op_0x54, &&op_0x55, &&op_0x56, &&op_0x57,
+		&&op_0x58, &&op_0x59, &&op_0x5A, &&op_0x5B,
+		&&op_0x5C, &&op_0x5D, &&op_0x5E, &&op_0x5F,
+		&&op_0x60, &&op_0x61, &&op_0x62, &&op_0x63,
+		&&op_0x64, &&op_0x65, &&op_0x66, &&op_0x67,
+		&&op_0x68, &&op_0x69, &&op_0x6A, &&op_0x6B,
+		&&op_0x6C, &&op_0x6D, &&op_0x6E, &&op_0x6F,
+		&&op_0x70, &&op_0x71, &&op_0x72, &&op_0x73,
+		&&op_0x74, &&op_0x75, &&op_0x76, &&op_0x77,
+		&&op_0x78, &&op_0x79, &&op_0x7A, &&op_0x7B,
+		&&op_0x7C, &&op_0x7D, &&op_0x7E, &&op_0x7F,
+		&&op_0x80, &&op_0x81, &&op_0x82, &&op_0x83,
+		&&op_0x84, &&op_0x85, &&op_0x86, &&op_0x87,
+		&&op_0x88, &&op_0x89, &&op_0x8A, &&op_0x8B,
+		&&op_0x8C, &&op_0x8D, &&op_0x8E, &&op_0x8F,
+		&&op_0x90, &&op_0x91, &&op_0x92, &&op_0x93,
+		&&op_0x94, &&op_0x95, &&op_0x96, &&op_0x97,
+		&&op_0x98, &&op_0x99, &&op_0x9A, &&op_0x9B,
+		&&op_0x9C, &&op_0x9D, &&op_0x9E, &&op_0x9F,
+		&&op_0xA0, &&op_0xA1, &&op_0xA2, &&op_0xA3,
+		&&op_0xA4, &&op_0xA5, &&op_0xA6, &&op_0xA7,
+		&&op_0xA8, &&op_0xA9, &&op_0xAA, &&op_0xAB,
+		&&op_0xAC, &&op_0xAD, &&op_0xAE, &&op_0xAF,
+		&&op_0xB0, &&op_0xB1, &&op_0xB2, &&op_0xB3,
+		&&op_0xB4, &&op_0xB5, &&op_0xB6, &&op_0xB7,
+		&&op_0xB8, &&op_0xB9, &&op_0xBA, &&op_0xBB,
+		&&op_0xBC, &&op_0xBD, &&op_0xBE, &&op_0xBF,
+		&&op_0xC0, &&op_0xC1, &&op_0xC2, &&op_0xC3,
+		&&op_0xC4, &&op_0xC5, &&op_0xC6, &&op_0xC7,
+		&&op_0xC8, &&op_0xC9, &&op_0xCA, &&op_0xCB,
+		&&op_0xCC, &&op_0xCD, &&op_0xCE, &&op_0xCF,
+		&&op_0xD0, &&op_0xD1, &&op_0xD2, &&op_invalid,
+		&&op_0xD4, &&op_0xD5, &&op_0xD6, &&op_0xD7,
+		&&op_0xD8, &&op_0xD9, &&op_0xDA, &&op_invalid,
+		&&op_0xDC, &&op_invalid, &&op_0xDE, &&op_0xDF,
+		&&op_0xE0, &&op_0xE1, &&op_0xE2, &&op_invalid,
+		&&op_invalid, &&op_0xE5, &&op_0xE6, &&op_0xE7,
+		&&op_0xE8, &&op_0xE9, &&op_0xEA, &&op_invalid,
+		&&op_invalid, &&op_invalid, &&op_0xEE, &&op_0xEF,
+		&&op_0xF0, &&op_0xF1, &&op_0xF2, &&op_0xF3,
+		&&op_invalid, &&op_0xF5, &&op_0xF6, &&op_0xF7,
+		&&op_0xF8, &&op_0xF9, &&op_0xFA, &&op_0xFB,
+		&&op_invalid, &&op_invalid, &&op_0xFE, &&op_0xFF
+		/* *INDENT-ON* */
+	};
 
-	case 0x53: /* LD D, E */
-		gb->cpu_reg.de.bytes.d = gb->cpu_reg.de.bytes.e;
-		break;
+next_instruction:
+#else
+	(void) single_step;
+#endif
 
-	case 0x54: /* LD D, H */
-		gb->cpu_reg.de.bytes.d = gb->cpu_reg.hl.bytes.h;
-		break;
+	/* Resume a HALT that was left when the last run stopped. */
+	if(PGB_UNLIKELY(gb->gb_halt) &&
+			(gb->hram_io[IO_IF] & gb->hram_io[IO_IE]) == 0)
+	{
+		__gb_tick(gb, 0);
 
-	case 0x55: /* LD D, L */
-		gb->cpu_reg.de.bytes.d = gb->cpu_reg.hl.bytes.l;
-		break;
+		if(gb->gb_halt && (gb->hram_io[IO_IF] & gb->hram_io[IO_IE]) == 0)
+			return;
+	}
 
-	case 0x56: /* LD D, (HL) */
-		gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.hl.reg);
-		break;
+	/* Handle interrupts */
+	/* If gb_halt is positive, then an interrupt must have occurred by the
+	 * time we reach here, because on HALT, we jump to the next interrupt
+	 * immediately. */
+	while(gb->gb_halt || (gb->gb_ime &&
+			gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & ANY_INTR))
+	{
+		gb->gb_halt = false;
 
-	case 0x57: /* LD D, A */
-		gb->cpu_reg.de.bytes.d = gb->cpu_reg.a;
-		break;
+		if(!gb->gb_ime)
+			break;
 
-	case 0x58: /* LD E, B */
-		gb->cpu_reg.de.bytes.e = gb->cpu_reg.bc.bytes.b;
-		break;
+		/* Disable interrupts */
+		gb->gb_ime = false;
 
-	case 0x59: /* LD E, C */
-		gb->cpu_reg.de.bytes.e = gb->cpu_reg.bc.bytes.c;
-		break;
+		/* Push Program Counter */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 
-	case 0x5A: /* LD E, D */
-		gb->cpu_reg.de.bytes.e = gb->cpu_reg.de.bytes.d;
-		break;
+		/* Call interrupt handler if required. */
+		if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & VBLANK_INTR)
+		{
+			gb->cpu_reg.pc.reg = VBLANK_INTR_ADDR;
+			gb->hram_io[IO_IF] ^= VBLANK_INTR;
+		}
+		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & LCDC_INTR)
+		{
+			gb->cpu_reg.pc.reg = LCDC_INTR_ADDR;
+			gb->hram_io[IO_IF] ^= LCDC_INTR;
+		}
+		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & TIMER_INTR)
+		{
+			gb->cpu_reg.pc.reg = TIMER_INTR_ADDR;
+			gb->hram_io[IO_IF] ^= TIMER_INTR;
+		}
+		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & SERIAL_INTR)
+		{
+			gb->cpu_reg.pc.reg = SERIAL_INTR_ADDR;
+			gb->hram_io[IO_IF] ^= SERIAL_INTR;
+		}
+		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & CONTROL_INTR)
+		{
+			gb->cpu_reg.pc.reg = CONTROL_INTR_ADDR;
+			gb->hram_io[IO_IF] ^= CONTROL_INTR;
+		}
 
-	case 0x5B: /* LD E, E */
-		break;
+		/* Let breakpoints be checked at the start of the handler. */
+		if(single_step && (gb->run.mask & GB_RUN_BREAKPOINT))
+			return;
 
-	case 0x5C: /* LD E, H */
-		gb->cpu_reg.de.bytes.e = gb->cpu_reg.hl.bytes.h;
 		break;
+	}
 
-	case 0x5D: /* LD E, L */
-		gb->cpu_reg.de.bytes.e = gb->cpu_reg.hl.bytes.l;
-		break;
+	/* Obtain opcode */
+	PGB_FETCH();
 
-	case 0x5E: /* LD E, (HL) */
-		gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.hl.reg);
-		break;
+#if PEANUT_GB_THREADED_DISPATCH
+	goto *dispatch[opcode];
+#endif
 
-	case 0x5F: /* LD E, A */
-		gb->cpu_reg.de.bytes.e = gb->cpu_reg.a;
-		break;
+	/* Execute opcode */
+	switch(opcode)
+	{
+	PGB_OP(0x00): /* NOP */
+		PGB_OP_END();
 
-	case 0x60: /* LD H, B */
-		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.bc.bytes.b;
-		break;
+	PGB_OP(0x01): /* LD BC, imm */
+		gb->cpu_reg.bc.bytes.c = PGB_IMM_LO();
+		gb->cpu_reg.bc.bytes.b = PGB_IMM_HI();
+		PGB_OP_END();
 
-	case 0x61: /* LD H, C */
-		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.bc.bytes.c;
-		break;
+	PGB_OP(0x02): /* LD (BC), A */
+		__gb_write(gb, gb->cpu_reg.bc.reg, gb->cpu_reg.a);
+		PGB_OP_END();
 
-	case 0x62: /* LD H, D */
-		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.de.bytes.d;
-		break;
+	PGB_OP(0x03): /* INC BC */
+		gb->cpu_reg.bc.reg++;
+		PGB_OP_END();
 
-	case 0x63: /* LD H, E */
-		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.de.bytes.e;
-		break;
+	PGB_OP(0x04): /* INC B */
+		PGB_INSTR_INC_R8(gb->cpu_reg.bc.bytes.b);
+		PGB_OP_END();
 
-	case 0x64: /* LD H, H */
-		break;
+	PGB_OP(0x05): /* DEC B */
+		PGB_INSTR_DEC_R8(gb->cpu_reg.bc.bytes.b);
+		PGB_OP_END();
 
-	case 0x65: /* LD H, L */
-		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.hl.bytes.l;
-		break;
+	PGB_OP(0x06): /* LD B, imm */
+		gb->cpu_reg.bc.bytes.b = PGB_IMM_LO();
+		PGB_OP_END();
 
-	case 0x66: /* LD H, (HL) */
-		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.hl.reg);
-		break;
+	PGB_OP(0x07): /* RLCA */
+		PGB_FLAGS_SYNC();
+		gb->cpu_reg.a = (gb->cpu_reg.a << 1) | (gb->cpu_reg.a >> 7);
+		gb->cpu_reg.f.reg = 0;
+		gb->cpu_reg.f.f_bits.c = (gb->cpu_reg.a & 0x01);
+		PGB_OP_END();
 
-	case 0x67: /* LD H, A */
-		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.a;
-		break;
+	PGB_OP(0x08): /* LD (imm), SP */
+	{
+		uint8_t h, l;
+		uint16_t temp;
+		l = PGB_IMM_LO();
+		h = PGB_IMM_HI();
+		temp = PEANUT_GB_U8_TO_U16(h,l);
+		__gb_write(gb, temp++, gb->cpu_reg.sp.bytes.p);
+		__gb_write(gb, temp, gb->cpu_reg.sp.bytes.s);
+		PGB_OP_END();
+	}
 
-	case 0x68: /* LD L, B */
-		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.bc.bytes.b;
-		break;
+	PGB_OP(0x09): /* ADD HL, BC */
+	{
+		uint_fast32_t temp = gb->cpu_reg.hl.reg + gb->cpu_reg.bc.reg;
+		PGB_FLAGS_SYNC();
+		gb->cpu_reg.f.f_bits.n = 0;
+		gb->cpu_reg.f.f_bits.h =
+			(temp ^ gb->cpu_reg.hl.reg ^ gb->cpu_reg.bc.reg) & 0x1000 ? 1 : 0;
+		gb->cpu_reg.f.f_bits.c = (temp & 0xFFFF0000) ? 1 : 0;
+		gb->cpu_reg.hl.reg = (temp & 0x0000FFFF);
+		PGB_OP_END();
+	}
 
-	case 0x69: /* LD L, C */
-		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.bc.bytes.c;
-		break;
+	PGB_OP(0x0A): /* LD A, (BC) */
+		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.bc.reg);
+		PGB_OP_END();
 
-	case 0x6A: /* LD L, D */
-		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.de.bytes.d;
-		break;
+	PGB_OP(0x0B): /* DEC BC */
+		gb->cpu_reg.bc.reg--;
+		PGB_OP_END();
 
-	case 0x6B: /* LD L, E */
-		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.de.bytes.e;
-		break;
+	PGB_OP(0x0C): /* INC C */
+		PGB_INSTR_INC_R8(gb->cpu_reg.bc.bytes.c);
+		PGB_OP_END();
 
-	case 0x6C: /* LD L, H */
-		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.hl.bytes.h;
-		break;
+	PGB_OP(0x0D): /* DEC C */
+		PGB_INSTR_DEC_R8(gb->cpu_reg.bc.bytes.c);
+		PGB_OP_END();
 
-	case 0x6D: /* LD L, L */
-		break;
+	PGB_OP(0x0E): /* LD C, imm */
+		gb->cpu_reg.bc.bytes.c = PGB_IMM_LO();
+		PGB_OP_END();
 
-	case 0x6E: /* LD L, (HL) */
-		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.hl.reg);
-		break;
+	PGB_OP(0x0F): /* RRCA */
+		PGB_FLAGS_SYNC();
+		gb->cpu_reg.f.reg = 0;
+		gb->cpu_reg.f.f_bits.c = gb->cpu_reg.a & 0x01;
+		gb->cpu_reg.a = (gb->cpu_reg.a >> 1) | (gb->cpu_reg.a << 7);
+		PGB_OP_END();
 
-	case 0x6F: /* LD L, A */
-		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.a;
-		break;
+	PGB_OP(0x10): /* STOP */
+		//gb->gb_halt = true;
+		PGB_OP_END();
 
-	case 0x70: /* LD (HL), B */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.bc.bytes.b);
-		break;
+	PGB_OP(0x11): /* LD DE, imm */
+		gb->cpu_reg.de.bytes.e = PGB_IMM_LO();
+		gb->cpu_reg.de.bytes.d = PGB_IMM_HI();
+		PGB_OP_END();
 
-	case 0x71: /* LD (HL), C */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.bc.bytes.c);
-		break;
+	PGB_OP(0x12): /* LD (DE), A */
+		__gb_write(gb, gb->cpu_reg.de.reg, gb->cpu_reg.a);
+		PGB_OP_END();
 
-	case 0x72: /* LD (HL), D */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.de.bytes.d);
-		break;
+	PGB_OP(0x13): /* INC DE */
+		gb->cpu_reg.de.reg++;
+		PGB_OP_END();
 
-	case 0x73: /* LD (HL), E */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.de.bytes.e);
-		break;
+	PGB_OP(0x14): /* INC D */
+		PGB_INSTR_INC_R8(gb->cpu_reg.de.bytes.d);
+		PGB_OP_END();
 
-	case 0x74: /* LD (HL), H */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.hl.bytes.h);
-		break;
+	PGB_OP(0x15): /* DEC D */
+		PGB_INSTR_DEC_R8(gb->cpu_reg.de.bytes.d);
+		PGB_OP_END();
 
-	case 0x75: /* LD (HL), L */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.hl.bytes.l);
-		break;
+	PGB_OP(0x16): /* LD D, imm */
+		gb->cpu_reg.de.bytes.d = PGB_IMM_LO();
+		PGB_OP_END();
+
+	PGB_OP(0x17): /* RLA */
+	{
+		uint8_t temp = gb->cpu_reg.a;
+		PGB_FLAGS_SYNC();
+		gb->cpu_reg.a = (gb->cpu_reg.a << 1) | gb->cpu_reg.f.f_bits.c;
+		gb->cpu_reg.f.reg = 0;
+		gb->cpu_reg.f.f_bits.c = (temp >> 7) & 0x01;
+		PGB_OP_END();
+	}
 
-	case 0x76: /* HALT */
+	PGB_OP(0x18): /* JR imm */
 	{
-		int_fast16_t halt_cycles = INT_FAST16_MAX;
+		int8_t temp = (int8_t) PGB_IMM_LO();
+		PGB_IDLE_LOOP((uint16_t)(gb->cpu_reg.pc.reg + temp), 2);
+		gb->cpu_reg.pc.reg += temp;
+		PGB_OP_END();
+	}
 
-		/* TODO: Emulate HALT bug? */
-		gb->gb_halt = true;
+	PGB_OP(0x19): /* ADD HL, DE */
+	{
+		uint_fast32_t temp = gb->cpu_reg.hl.reg + gb->cpu_reg.de.reg;
+		PGB_FLAGS_SYNC();
+		gb->cpu_reg.f.f_bits.n = 0;
+		gb->cpu_reg.f.f_bits.h =
+			(temp ^ gb->cpu_reg.hl.reg ^ gb->cpu_reg.de.reg) & 0x1000 ? 1 : 0;
+		gb->cpu_reg.f.f_bits.c = (temp & 0xFFFF0000) ? 1 : 0;
+		gb->cpu_reg.hl.reg = (temp & 0x0000FFFF);
+		PGB_OP_END();
+	}
 
-		if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
-		{
-			int serial_cycles = SERIAL_CYCLES -
-				gb->counter.serial_count;
+	PGB_OP(0x1A): /* LD A, (DE) */
+		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.de.reg);
+		PGB_OP_END();
 
-			if(serial_cycles < halt_cycles)
-				halt_cycles = serial_cycles;
-		}
+	PGB_OP(0x1B): /* DEC DE */
+		gb->cpu_reg.de.reg--;
+		PGB_OP_END();
 
-		if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
-		{
-			int tac_cycles = TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK] -
-				gb->counter.tima_count;
+	PGB_OP(0x1C): /* INC E */
+		PGB_INSTR_INC_R8(gb->cpu_reg.de.bytes.e);
+		PGB_OP_END();
 
-			if(tac_cycles < halt_cycles)
-				halt_cycles = tac_cycles;
-		}
+	PGB_OP(0x1D): /* DEC E */
+		PGB_INSTR_DEC_R8(gb->cpu_reg.de.bytes.e);
+		PGB_OP_END();
 
-		if((gb->hram_io[IO_LCDC] & LCDC_ENABLE))
-		{
-			int lcd_cycles;
+	PGB_OP(0x1E): /* LD E, imm */
+		gb->cpu_reg.de.bytes.e = PGB_IMM_LO();
+		PGB_OP_END();
 
-			/* If LCD is in HBlank, calculate the number of cycles
-			 * until the end of HBlank and the start of mode 2 or
-			 * mode 1. */
-			if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_HBLANK)
-			{
-				lcd_cycles = LCD_MODE0_HBLANK_MAX_DRUATION - gb->counter.lcd_count;
-			}
-			else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_OAM_SCAN)
-			{
-				lcd_cycles = LCD_MODE3_LCD_DRAW_MIN_DURATION - gb->counter.lcd_count;
-			}
-			else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_LCD_DRAW)
-			{
-				lcd_cycles = LCD_MODE0_HBLANK_MAX_DRUATION - gb->counter.lcd_count;
-			}
-			else
-			{
-				/* VBlank */
-				lcd_cycles = LCD_LINE_CYCLES - gb->counter.lcd_count;
-			}
+	PGB_OP(0x1F): /* RRA */
+	{
+		uint8_t temp = gb->cpu_reg.a;
+		PGB_FLAGS_SYNC();
+		gb->cpu_reg.a = gb->cpu_reg.a >> 1 | (gb->cpu_reg.f.f_bits.c << 7);
+		gb->cpu_reg.f.reg = 0;
+		gb->cpu_reg.f.f_bits.c = temp & 0x1;
+		PGB_OP_END();
+	}
 
-			if(lcd_cycles < halt_cycles)
-				halt_cycles = lcd_cycles;
+	PGB_OP(0x20): /* JR NZ, imm */
+		if(!PGB_FLAG_Z())
+		{
+			int8_t temp = (int8_t) PGB_IMM_LO();
+			inst_cycles += 4;
+			PGB_IDLE_LOOP((uint16_t)(gb->cpu_reg.pc.reg + temp), 2);
+			gb->cpu_reg.pc.reg += temp;
 		}
+		else
+			PGB_IMM_SKIP(1);
 
-		/* Some halt cycles may already be very high, so make sure we
-		 * don't underflow here. */
-		if(halt_cycles <= 0)
-			halt_cycles = 4;
+		PGB_OP_END();
 
-		inst_cycles = (uint_fast16_t)halt_cycles;
-		break;
-	}
+	PGB_OP(0x21): /* LD HL, imm */
+		gb->cpu_reg.hl.bytes.l = PGB_IMM_LO();
+		gb->cpu_reg.hl.bytes.h = PGB_IMM_HI();
+		PGB_OP_END();
 
-	case 0x77: /* LD (HL), A */
+	PGB_OP(0x22): /* LDI (HL), A */
 		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.a);
-		break;
-
-	case 0x78: /* LD A, B */
-		gb->cpu_reg.a = gb->cpu_reg.bc.bytes.b;
-		break;
+		gb->cpu_reg.hl.reg++;
+		PGB_OP_END();
 
-	case 0x79: /* LD A, C */
-		gb->cpu_reg.a = gb->cpu_reg.bc.bytes.c;
-		break;
+	PGB_OP(0x23): /* INC HL */
+		gb->cpu_reg.hl.reg++;
+		PGB_OP_END();
 
-	case 0x7A: /* LD A, D */
-		gb->cpu_reg.a = gb->cpu_reg.de.bytes.d;
-		break;
+	PGB_OP(0x24): /* INC H */
+		PGB_INSTR_INC_R8(gb->cpu_reg.hl.bytes.h);
+		PGB_OP_END();
 
-	case 0x7B: /* LD A, E */
-		gb->cpu_reg.a = gb->cpu_reg.de.bytes.e;
-		break;
+	PGB_OP(0x25): /* DEC H */
+		PGB_INSTR_DEC_R8(gb->cpu_reg.hl.bytes.h);
+		PGB_OP_END();
 
-	case 0x7C: /* LD A, H */
-		gb->cpu_reg.a = gb->cpu_reg.hl.bytes.h;
-		break;
+	PGB_OP(0x26): /* LD H, imm */
+		gb->cpu_reg.hl.bytes.h = PGB_IMM_LO();
+		PGB_OP_END();
 
-	case 0x7D: /* LD A, L */
-		gb->cpu_reg.a = gb->cpu_reg.hl.bytes.l;
-		break;
+	PGB_OP(0x27): /* DAA */
+	{
+		/* The following is from SameBoy. MIT License. */
+		int16_t a = gb->cpu_reg.a;
+		PGB_FLAGS_SYNC();
 
-	case 0x7E: /* LD A, (HL) */
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.hl.reg);
-		break;
+		if(gb->cpu_reg.f.f_bits.n)
+		{
+			if(gb->cpu_reg.f.f_bits.h)
+				a = (a - 0x06) & 0xFF;
 
-	case 0x7F: /* LD A, A */
-		break;
+			if(gb->cpu_reg.f.f_bits.c)
+				a -= 0x60;
+		}
+		else
+		{
+			if(gb->cpu_reg.f.f_bits.h || (a & 0x0F) > 9)
+				a += 0x06;
 
-	case 0x80: /* ADD A, B */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.bc.bytes.b, 0);
-		break;
+			if(gb->cpu_reg.f.f_bits.c || a > 0x9F)
+				a += 0x60;
+		}
 
-	case 0x81: /* ADD A, C */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.bc.bytes.c, 0);
-		break;
+		if((a & 0x100) == 0x100)
+			gb->cpu_reg.f.f_bits.c = 1;
 
-	case 0x82: /* ADD A, D */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.de.bytes.d, 0);
-		break;
+		gb->cpu_reg.a = a;
+		gb->cpu_reg.f.f_bits.z = (gb->cpu_reg.a == 0);
+		gb->cpu_reg.f.f_bits.h = 0;
 
-	case 0x83: /* ADD A, E */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.de.bytes.e, 0);
-		break;
+		PGB_OP_END();
+	}
 
-	case 0x84: /* ADD A, H */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.hl.bytes.h, 0);
-		break;
+	PGB_OP(0x28): /* JR Z, imm */
+		if(PGB_FLAG_Z())
+		{
+			int8_t temp = (int8_t) PGB_IMM_LO();
+			inst_cycles += 4;
+			PGB_IDLE_LOOP((uint16_t)(gb->cpu_reg.pc.reg + temp), 2);
+			gb->cpu_reg.pc.reg += temp;
+		}
+		else
+			PGB_IMM_SKIP(1);
 
-	case 0x85: /* ADD A, L */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.hl.bytes.l, 0);
-		break;
+		PGB_OP_END();
 
-	case 0x86: /* ADD A, (HL) */
-		PGB_INSTR_ADC_R8(__gb_read(gb, gb->cpu_reg.hl.reg), 0);
-		break;
+	PGB_OP(0x29): /* ADD HL, HL */
+	{
+		PGB_FLAGS_SYNC();
+		gb->cpu_reg.f.f_bits.c = (gb->cpu_reg.hl.reg & 0x8000) > 0;
+		gb->cpu_reg.hl.reg <<= 1;
+		gb->cpu_reg.f.f_bits.n = 0;
+		gb->cpu_reg.f.f_bits.h = (gb->cpu_reg.hl.reg & 0x1000) > 0;
+		PGB_OP_END();
+	}
 
-	case 0x87: /* ADD A, A */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.a, 0);
-		break;
+	PGB_OP(0x2A): /* LD A, (HL+) */
+		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.hl.reg++);
+		PGB_OP_END();
 
-	case 0x88: /* ADC A, B */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.bc.bytes.b, gb->cpu_reg.f.f_bits.c);
-		break;
+	PGB_OP(0x2B): /* DEC HL */
+		gb->cpu_reg.hl.reg--;
+		PGB_OP_END();
 
-	case 0x89: /* ADC A, C */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.bc.bytes.c, gb->cpu_reg.f.f_bits.c);
-		break;
+	PGB_OP(0x2C): /* INC L */
+		PGB_INSTR_INC_R8(gb->cpu_reg.hl.bytes.l);
+		PGB_OP_END();
 
-	case 0x8A: /* ADC A, D */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.de.bytes.d, gb->cpu_reg.f.f_bits.c);
-		break;
+	PGB_OP(0x2D): /* DEC L */
+		PGB_INSTR_DEC_R8(gb->cpu_reg.hl.bytes.l);
+		PGB_OP_END();
 
-	case 0x8B: /* ADC A, E */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.de.bytes.e, gb->cpu_reg.f.f_bits.c);
-		break;
+	PGB_OP(0x2E): /* LD L, imm */
+		gb->cpu_reg.hl.bytes.l = PGB_IMM_LO();
+		PGB_OP_END();
 
-	case 0x8C: /* ADC A, H */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.hl.bytes.h, gb->cpu_reg.f.f_bits.c);
-		break;
+	PGB_OP(0x2F): /* CPL */
+		PGB_FLAGS_SYNC();
+		gb->cpu_reg.a = ~gb->cpu_reg.a;
+		gb->cpu_reg.f.f_bits.n = 1;
+		gb->cpu_reg.f.f_bits.h = 1;
+		PGB_OP_END();
 
-	case 0x8D: /* ADC A, L */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.hl.bytes.l, gb->cpu_reg.f.f_bits.c);
-		break;
+	PGB_OP(0x30): /* JR NC, imm */
+		if(!PGB_FLAG_C())
+		{
+			int8_t temp = (int8_t) PGB_IMM_LO();
+			inst_cycles += 4;
+			PGB_IDLE_LOOP((uint16_t)(gb->cpu_reg.pc.reg + temp), 2);
+			gb->cpu_reg.pc.reg += temp;
+		}
+		else
+			PGB_IMM_SKIP(1);
 
-	case 0x8E: /* ADC A, (HL) */
-		PGB_INSTR_ADC_R8(__gb_read(gb, gb->cpu_reg.hl.reg), gb->cpu_reg.f.f_bits.c);
-		break;
+		PGB_OP_END();
 
-	case 0x8F: /* ADC A, A */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.a, gb->cpu_reg.f.f_bits.c);
-		break;
+	PGB_OP(0x31): /* LD SP, imm */
+		gb->cpu_reg.sp.bytes.p = PGB_IMM_LO();
+		gb->cpu_reg.sp.bytes.s = PGB_IMM_HI();
+		PGB_OP_END();
+
+	PGB_OP(0x32): /* LD (HL), A */
+		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.a);
+		gb->cpu_reg.hl.reg--;
+		PGB_OP_END();
+
+	PGB_OP(0x33): /* INC SP */
+		gb->cpu_reg.sp.reg++;
+		PGB_OP_END();
+
+	PGB_OP(0x34): /* INC (HL) */
+	{
+		uint8_t temp = __gb_read(gb, gb->cpu_reg.hl.reg);
+		PGB_INSTR_INC_R8(temp);
+		__gb_write(gb, gb->cpu_reg.hl.reg, temp);
+		PGB_OP_END();
+	}
+
+	PGB_OP(0x35): /* DEC (HL) */
+	{
+		uint8_t temp = __gb_read(gb, gb->cpu_reg.hl.reg);
+		PGB_INSTR_DEC_R8(temp);
+		__gb_write(gb, gb->cpu_reg.hl.reg, temp);
+		PGB_OP_END();
+	}
+
+	PGB_OP(0x36): /* LD (HL), imm */
+		__gb_write(gb, gb->cpu_reg.hl.reg, PGB_IMM_LO());
+		PGB_OP_END();
+
+	PGB_OP(0x37): /* SCF */
+		PGB_FLAGS_SYNC();
+		gb->cpu_reg.f.f_bits.n = 0;
+		gb->cpu_reg.f.f_bits.h = 0;
+		gb->cpu_reg.f.f_bits.c = 1;
+		PGB_OP_END();
+
+	PGB_OP(0x38): /* JR C, imm */
+		if(PGB_FLAG_C())
+		{
+			int8_t temp = (int8_t) PGB_IMM_LO();
+			inst_cycles += 4;
+			PGB_IDLE_LOOP((uint16_t)(gb->cpu_reg.pc.reg + temp), 2);
+			gb->cpu_reg.pc.reg += temp;
+		}
+		else
+			PGB_IMM_SKIP(1);
+
+		PGB_OP_END();
+
+	PGB_OP(0x39): /* ADD HL, SP */
+	{
+		uint_fast32_t temp = gb->cpu_reg.hl.reg + gb->cpu_reg.sp.reg;
+		PGB_FLAGS_SYNC();
+		gb->cpu_reg.f.f_bits.n = 0;
+		gb->cpu_reg.f.f_bits.h =
+			((gb->cpu_reg.hl.reg & 0xFFF) + (gb->cpu_reg.sp.reg & 0xFFF)) & 0x1000 ? 1 : 0;
+		gb->cpu_reg.f.f_bits.c = temp & 0x10000 ? 1 : 0;
+		gb->cpu_reg.hl.reg = (uint16_t)temp;
+		PGB_OP_END();
+	}
+
+	PGB_OP(0x3A): /* LD A, (HL) */
+		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.hl.reg--);
+		PGB_OP_END();
+
+	PGB_OP(0x3B): /* DEC SP */
+		gb->cpu_reg.sp.reg--;
+		PGB_OP_END();
+
+	PGB_OP(0x3C): /* INC A */
+		PGB_INSTR_INC_R8(gb->cpu_reg.a);
+		PGB_OP_END();
+
+	PGB_OP(0x3D): /* DEC A */
+		PGB_INSTR_DEC_R8(gb->cpu_reg.a);
+		PGB_OP_END();
+
+	PGB_OP(0x3E): /* LD A, imm */
+		gb->cpu_reg.a = PGB_IMM_LO();
+		PGB_OP_END();
+
+	PGB_OP(0x3F): /* CCF */
+		PGB_FLAGS_SYNC();
+		gb->cpu_reg.f.f_bits.n = 0;
+		gb->cpu_reg.f.f_bits.h = 0;
+		gb->cpu_reg.f.f_bits.c = ~gb->cpu_reg.f.f_bits.c;
+		PGB_OP_END();
+
+	PGB_OP(0x40): /* LD B, B */
+		PGB_OP_END();
+
+	PGB_OP(0x41): /* LD B, C */
+		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.bc.bytes.c;
+		PGB_OP_END();
+
+	PGB_OP(0x42): /* LD B, D */
+		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.de.bytes.d;
+		PGB_OP_END();
+
+	PGB_OP(0x43): /* LD B, E */
+		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.de.bytes.e;
+		PGB_OP_END();
+
+	PGB_OP(0x44): /* LD B, H */
+		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.hl.bytes.h;
+		PGB_OP_END();
+
+	PGB_OP(0x45): /* LD B, L */
+		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.hl.bytes.l;
+		PGB_OP_END();
+
+	PGB_OP(0x46): /* LD B, (HL) */
+		gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.hl.reg);
+		PGB_OP_END();
+
+	PGB_OP(0x47): /* LD B, A */
+		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.a;
+		PGB_OP_END();
+
+	PGB_OP(0x48): /* LD C, B */
+		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.bc.bytes.b;
+		PGB_OP_END();
+
+	PGB_OP(0x49): /* LD C, C */
+		PGB_OP_END();
+
+	PGB_OP(0x4A): /* LD C, D */
+		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.de.bytes.d;
+		PGB_OP_END();
+
+	PGB_OP(0x4B): /* LD C, E */
+		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.de.bytes.e;
+		PGB_OP_END();
+
+	PGB_OP(0x4C): /* LD C, H */
+		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.hl.bytes.h;
+		PGB_OP_END();
+
+	PGB_OP(0x4D): /* LD C, L */
+		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.hl.bytes.l;
+		PGB_OP_END();
+
+	PGB_OP(0x4E): /* LD C, (HL) */
+		gb->cpu_reg.bc.bytes.c = __gb_read(gb, gb->cpu_reg.hl.reg);
+		PGB_OP_END();
+
+	PGB_OP(0x4F): /* LD C, A */
+		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.a;
+		PGB_OP_END();
+
+	PGB_OP(0x50): /* LD D, B */
+		gb->cpu_reg.de.bytes.d = gb->cpu_reg.bc.bytes.b;
+		PGB_OP_END();
+
+	PGB_OP(0x51): /* LD D, C */
+		gb->cpu_reg.de.bytes.d = gb->cpu_reg.bc.bytes.c;
+		PGB_OP_END();
+
+	PGB_OP(0x52): /* LD D, D */
+		PGB_OP_END();
+
+	PGB_OP(0x53): /* LD D, E */
+		gb->cpu_reg.de.bytes.d = gb->cpu_reg.de.bytes.e;
+		PGB_OP_END();
+
+	PGB_OP(0x54): /* LD D, H */
+		gb->cpu_reg.de.bytes.d = gb->cpu_reg.hl.bytes.h;
+		PGB_OP_END();
+
+	PGB_OP(0x55): /* LD D, L */
+		gb->cpu_reg.de.bytes.d = gb->cpu_reg.hl.bytes.l;
+		PGB_OP_END();
+
+	PGB_OP(0x56): /* LD D, (HL) */
+		gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.hl.reg);
+		PGB_OP_END();
+
+	PGB_OP(0x57): /* LD D, A */
+		gb->cpu_reg.de.bytes.d = gb->cpu_reg.a;
+		PGB_OP_END();
+
+	PGB_OP(0x58): /* LD E, B */
+		gb->cpu_reg.de.bytes.e = gb->cpu_reg.bc.bytes.b;
+		PGB_OP_END();
+
+	PGB_OP(0x59): /* LD E, C */
+		gb->cpu_reg.de.bytes.e = gb->cpu_reg.bc.bytes.c;
+		PGB_OP_END();
+
+	PGB_OP(0x5A): /* LD E, D */
+		gb->cpu_reg.de.bytes.e = gb->cpu_reg.de.bytes.d;
+		PGB_OP_END();
+
+	PGB_OP(0x5B): /* LD E, E */
+		PGB_OP_END();
+
+	PGB_OP(0x5C): /* LD E, H */
+		gb->cpu_reg.de.bytes.e = gb->cpu_reg.hl.bytes.h;
+		PGB_OP_END();
+
+	PGB_OP(0x5D): /* LD E, L */
+		gb->cpu_reg.de.bytes.e = gb->cpu_reg.hl.bytes.l;
+		PGB_OP_END();
+
+	PGB_OP(0x5E): /* LD E, (HL) */
+		gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.hl.reg);
+		PGB_OP_END();
+
+	PGB_OP(0x5F): /* LD E, A */
+		gb->cpu_reg.de.bytes.e = gb->cpu_reg.a;
+		PGB_OP_END();
+
+	PGB_OP(0x60): /* LD H, B */
+		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.bc.bytes.b;
+		PGB_OP_END();
+
+	PGB_OP(0x61): /* LD H, C */
+		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.bc.bytes.c;
+		PGB_OP_END();
+
+	PGB_OP(0x62): /* LD H, D */
+		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.de.bytes.d;
+		PGB_OP_END();
+
+	PGB_OP(0x63): /* LD H, E */
+		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.de.bytes.e;
+		PGB_OP_END();
+
+	PGB_OP(0x64): /* LD H, H */
+		PGB_OP_END();
+
+	PGB_OP(0x65): /* LD H, L */
+		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.hl.bytes.l;
+		PGB_OP_END();
+
+	PGB_OP(0x66): /* LD H, (HL) */
+		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.hl.reg);
+		PGB_OP_END();
+
+	PGB_OP(0x67): /* LD H, A */
+		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.a;
+		PGB_OP_END();
+
+	PGB_OP(0x68): /* LD L, B */
+		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.bc.bytes.b;
+		PGB_OP_END();
+
+	PGB_OP(0x69): /* LD L, C */
+		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.bc.bytes.c;
+		PGB_OP_END();
+
+	PGB_OP(0x6A): /* LD L, D */
+		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.de.bytes.d;
+		PGB_OP_END();
+
+	PGB_OP(0x6B): /* LD L, E */
+		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.de.bytes.e;
+		PGB_OP_END();
+
+	PGB_OP(0x6C): /* LD L, H */
+		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.hl.bytes.h;
+		PGB_OP_END();
+
+	PGB_OP(0x6D): /* LD L, L */
+		PGB_OP_END();
+
+	PGB_OP(0x6E): /* LD L, (HL) */
+		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.hl.reg);
+		PGB_OP_END();
+
+	PGB_OP(0x6F): /* LD L, A */
+		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.a;
+		PGB_OP_END();
+
+	PGB_OP(0x70): /* LD (HL), B */
+		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.bc.bytes.b);
+		PGB_OP_END();
+
+	PGB_OP(0x71): /* LD (HL), C */
+		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.bc.bytes.c);
+		PGB_OP_END();
+
+	PGB_OP(0x72): /* LD (HL), D */
+		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.de.bytes.d);
+		PGB_OP_END();
+
+	PGB_OP(0x73): /* LD (HL), E */
+		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.de.bytes.e);
+		PGB_OP_END();
+
+	PGB_OP(0x74): /* LD (HL), H */
+		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.hl.bytes.h);
+		PGB_OP_END();
+
+	PGB_OP(0x75): /* LD (HL), L */
+		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.hl.bytes.l);
+		PGB_OP_END();
+
+	PGB_OP(0x76): /* HALT */
+		/* TODO: Emulate HALT bug? */
+		/* Time is advanced to the next interrupt by __gb_tick(). */
+		gb->gb_halt = true;
+		PGB_OP_END();
+
+	PGB_OP(0x77): /* LD (HL), A */
+		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.a);
+		PGB_OP_END();
+
+	PGB_OP(0x78): /* LD A, B */
+		gb->cpu_reg.a = gb->cpu_reg.bc.bytes.b;
+		PGB_OP_END();
+
+	PGB_OP(0x79): /* LD A, C */
+		gb->cpu_reg.a = gb->cpu_reg.bc.bytes.c;
+		PGB_OP_END();
+
+	PGB_OP(0x7A): /* LD A, D */
+		gb->cpu_reg.a = gb->cpu_reg.de.bytes.d;
+		PGB_OP_END();
+
+	PGB_OP(0x7B): /* LD A, E */
+		gb->cpu_reg.a = gb->cpu_reg.de.bytes.e;
+		PGB_OP_END();
+
+	PGB_OP(0x7C): /* LD A, H */
+		gb->cpu_reg.a = gb->cpu_reg.hl.bytes.h;
+		PGB_OP_END();
+
+	PGB_OP(0x7D): /* LD A, L */
+		gb->cpu_reg.a = gb->cpu_reg.hl.bytes.l;
+		PGB_OP_END();
+
+	PGB_OP(0x7E): /* LD A, (HL) */
+		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.hl.reg);
+		PGB_OP_END();
+
+	PGB_OP(0x7F): /* LD A, A */
+		PGB_OP_END();
+
+	PGB_OP(0x80): /* ADD A, B */
+		PGB_INSTR_ADC_R8(gb->cpu_reg.bc.bytes.b, 0);
+		PGB_OP_END();
+
+	PGB_OP(0x81): /* ADD A, C */
+		PGB_INSTR_ADC_R8(gb->cpu_reg.bc.bytes.c, 0);
+		PGB_OP_END();
+
+	PGB_OP(0x82): /* ADD A, D */
+		PGB_INSTR_ADC_R8(gb->cpu_reg.de.bytes.d, 0);
+		PGB_OP_END();
+
+	PGB_OP(0x83): /* ADD A, E */
+		PGB_INSTR_ADC_R8(gb->cpu_reg.de.bytes.e, 0);
+		PGB_OP_END();
+
+	PGB_OP(0x84): /* ADD A, H */
+		PGB_INSTR_ADC_R8(gb->cpu_reg.hl.bytes.h, 0);
+		PGB_OP_END();
+
+	PGB_OP(0x85): /* ADD A, L */
+		PGB_INSTR_ADC_R8(gb->cpu_reg.hl.bytes.l, 0);
+		PGB_OP_END();
 
-	case 0x90: /* SUB B */
+	PGB_OP(0x86): /* ADD A, (HL) */
+		PGB_INSTR_ADC_R8(__gb_read(gb, gb->cpu_reg.hl.reg), 0);
+		PGB_OP_END();
+
+	PGB_OP(0x87): /* ADD A, A */
+		PGB_INSTR_ADC_R8(gb->cpu_reg.a, 0);
+		PGB_OP_END();
+
+	PGB_OP(0x88): /* ADC A, B */
+		PGB_INSTR_ADC_R8(gb->cpu_reg.bc.bytes.b, PGB_FLAG_C());
+		PGB_OP_END();
+
+	PGB_OP(0x89): /* ADC A, C */
+		PGB_INSTR_ADC_R8(gb->cpu_reg.bc.bytes.c, PGB_FLAG_C());
+		PGB_OP_END();
+
+	PGB_OP(0x8A): /* ADC A, D */
+		PGB_INSTR_ADC_R8(gb->cpu_reg.de.bytes.d, PGB_FLAG_C());
+		PGB_OP_END();
+
+	PGB_OP(0x8B): /* ADC A, E */
+		PGB_INSTR_ADC_R8(gb->cpu_reg.de.bytes.e, PGB_FLAG_C());
+		PGB_OP_END();
+
+	PGB_OP(0x8C): /* ADC A, H */
+		PGB_INSTR_ADC_R8(gb->cpu_reg.hl.bytes.h, PGB_FLAG_C());
+		PGB_OP_END();
+
+	PGB_OP(0x8D): /* ADC A, L */
+		PGB_INSTR_ADC_R8(gb->cpu_reg.hl.bytes.l, PGB_FLAG_C());
+		PGB_OP_END();
+
+	PGB_OP(0x8E): /* ADC A, (HL) */
+		PGB_INSTR_ADC_R8(__gb_read(gb, gb->cpu_reg.hl.reg), PGB_FLAG_C());
+		PGB_OP_END();
+
+	PGB_OP(0x8F): /* ADC A, A */
+		PGB_INSTR_ADC_R8(gb->cpu_reg.a, PGB_FLAG_C());
+		PGB_OP_END();
+
+	PGB_OP(0x90): /* SUB B */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.bc.bytes.b, 0);
-		break;
+		PGB_OP_END();
 
-	case 0x91: /* SUB C */
+	PGB_OP(0x91): /* SUB C */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.bc.bytes.c, 0);
-		break;
+		PGB_OP_END();
 
-	case 0x92: /* SUB D */
+	PGB_OP(0x92): /* SUB D */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.de.bytes.d, 0);
-		break;
+		PGB_OP_END();
 
-	case 0x93: /* SUB E */
+	PGB_OP(0x93): /* SUB E */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.de.bytes.e, 0);
-		break;
+		PGB_OP_END();
 
-	case 0x94: /* SUB H */
+	PGB_OP(0x94): /* SUB H */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.hl.bytes.h, 0);
-		break;
+		PGB_OP_END();
 
-	case 0x95: /* SUB L */
+	PGB_OP(0x95): /* SUB L */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.hl.bytes.l, 0);
-		break;
+		PGB_OP_END();
 
-	case 0x96: /* SUB (HL) */
+	PGB_OP(0x96): /* SUB (HL) */
 		PGB_INSTR_SBC_R8(__gb_read(gb, gb->cpu_reg.hl.reg), 0);
-		break;
+		PGB_OP_END();
 
-	case 0x97: /* SUB A */
+	PGB_OP(0x97): /* SUB A */
+		PGB_FLAGS_SYNC();
 		gb->cpu_reg.a = 0;
 		gb->cpu_reg.f.reg = 0;
 		gb->cpu_reg.f.f_bits.z = 1;
 		gb->cpu_reg.f.f_bits.n = 1;
-		break;
+		PGB_OP_END();
 
-	case 0x98: /* SBC A, B */
-		PGB_INSTR_SBC_R8(gb->cpu_reg.bc.bytes.b, gb->cpu_reg.f.f_bits.c);
-		break;
+	PGB_OP(0x98): /* SBC A, B */
+		PGB_INSTR_SBC_R8(gb->cpu_reg.bc.bytes.b, PGB_FLAG_C());
+		PGB_OP_END();
 
-	case 0x99: /* SBC A, C */
-		PGB_INSTR_SBC_R8(gb->cpu_reg.bc.bytes.c, gb->cpu_reg.f.f_bits.c);
-		break;
+	PGB_OP(0x99): /* SBC A, C */
+		PGB_INSTR_SBC_R8(gb->cpu_reg.bc.bytes.c, PGB_FLAG_C());
+		PGB_OP_END();
 
-	case 0x9A: /* SBC A, D */
-		PGB_INSTR_SBC_R8(gb->cpu_reg.de.bytes.d, gb->cpu_reg.f.f_bits.c);
-		break;
+	PGB_OP(0x9A): /* SBC A, D */
+		PGB_INSTR_SBC_R8(gb->cpu_reg.de.bytes.d, PGB_FLAG_C());
+		PGB_OP_END();
 
-	case 0x9B: /* SBC A, E */
-		PGB_INSTR_SBC_R8(gb->cpu_reg.de.bytes.e, gb->cpu_reg.f.f_bits.c);
-		break;
+	PGB_OP(0x9B): /* SBC A, E */
+		PGB_INSTR_SBC_R8(gb->cpu_reg.de.bytes.e, PGB_FLAG_C());
+		PGB_OP_END();
 
-	case 0x9C: /* SBC A, H */
-		PGB_INSTR_SBC_R8(gb->cpu_reg.hl.bytes.h, gb->cpu_reg.f.f_bits.c);
-		break;
+	PGB_OP(0x9C): /* SBC A, H */
+		PGB_INSTR_SBC_R8(gb->cpu_reg.hl.bytes.h, PGB_FLAG_C());
+		PGB_OP_END();
 
-	case 0x9D: /* SBC A, L */
-		PGB_INSTR_SBC_R8(gb->cpu_reg.hl.bytes.l, gb->cpu_reg.f.f_bits.c);
-		break;
+	PGB_OP(0x9D): /* SBC A, L */
+		PGB_INSTR_SBC_R8(gb->cpu_reg.hl.bytes.l, PGB_FLAG_C());
+		PGB_OP_END();
 
-	case 0x9E: /* SBC A, (HL) */
-		PGB_INSTR_SBC_R8(__gb_read(gb, gb->cpu_reg.hl.reg), gb->cpu_reg.f.f_bits.c);
-		break;
+	PGB_OP(0x9E): /* SBC A, (HL) */
+		PGB_INSTR_SBC_R8(__gb_read(gb, gb->cpu_reg.hl.reg), PGB_FLAG_C());
+		PGB_OP_END();
 
-	case 0x9F: /* SBC A, A */
+	PGB_OP(0x9F): /* SBC A, A */
+		PGB_FLAGS_SYNC();
 		gb->cpu_reg.a = gb->cpu_reg.f.f_bits.c ? 0xFF : 0x00;
 		gb->cpu_reg.f.f_bits.z = !gb->cpu_reg.f.f_bits.c;
 		gb->cpu_reg.f.f_bits.n = 1;
 		gb->cpu_reg.f.f_bits.h = gb->cpu_reg.f.f_bits.c;
-		break;
+		PGB_OP_END();
 
-	case 0xA0: /* AND B */
+	PGB_OP(0xA0): /* AND B */
 		PGB_INSTR_AND_R8(gb->cpu_reg.bc.bytes.b);
-		break;
+		PGB_OP_END();
 
-	case 0xA1: /* AND C */
+	PGB_OP(0xA1): /* AND C */
 		PGB_INSTR_AND_R8(gb->cpu_reg.bc.bytes.c);
-		break;
+		PGB_OP_END();
 
-	case 0xA2: /* AND D */
+	PGB_OP(0xA2): /* AND D */
 		PGB_INSTR_AND_R8(gb->cpu_reg.de.bytes.d);
-		break;
+		PGB_OP_END();
 
-	case 0xA3: /* AND E */
+	PGB_OP(0xA3): /* AND E */
 		PGB_INSTR_AND_R8(gb->cpu_reg.de.bytes.e);
-		break;
+		PGB_OP_END();
 
-	case 0xA4: /* AND H */
+	PGB_OP(0xA4): /* AND H */
 		PGB_INSTR_AND_R8(gb->cpu_reg.hl.bytes.h);
-		break;
+		PGB_OP_END();
 
-	case 0xA5: /* AND L */
+	PGB_OP(0xA5): /* AND L */
 		PGB_INSTR_AND_R8(gb->cpu_reg.hl.bytes.l);
-		break;
+		PGB_OP_END();
 
-	case 0xA6: /* AND (HL) */
+	PGB_OP(0xA6): /* AND (HL) */
 		PGB_INSTR_AND_R8(__gb_read(gb, gb->cpu_reg.hl.reg));
-		break;
+		PGB_OP_END();
 
-	case 0xA7: /* AND A */
+	PGB_OP(0xA7): /* AND A */
 		PGB_INSTR_AND_R8(gb->cpu_reg.a);
-		break;
+		PGB_OP_END();
 
-	case 0xA8: /* XOR B */
+	PGB_OP(0xA8): /* XOR B */
 		PGB_INSTR_XOR_R8(gb->cpu_reg.bc.bytes.b);
-		break;
+		PGB_OP_END();
 
-	case 0xA9: /* XOR C */
+	PGB_OP(0xA9): /* XOR C */
 		PGB_INSTR_XOR_R8(gb->cpu_reg.bc.bytes.c);
-		break;
+		PGB_OP_END();
 
-	case 0xAA: /* XOR D */
+	PGB_OP(0xAA): /* XOR D */
 		PGB_INSTR_XOR_R8(gb->cpu_reg.de.bytes.d);
-		break;
+		PGB_OP_END();
 
-	case 0xAB: /* XOR E */
+	PGB_OP(0xAB): /* XOR E */
 		PGB_INSTR_XOR_R8(gb->cpu_reg.de.bytes.e);
-		break;
+		PGB_OP_END();
 
-	case 0xAC: /* XOR H */
+	PGB_OP(0xAC): /* XOR H */
 		PGB_INSTR_XOR_R8(gb->cpu_reg.hl.bytes.h);
-		break;
+		PGB_OP_END();
 
-	case 0xAD: /* XOR L */
+	PGB_OP(0xAD): /* XOR L */
 		PGB_INSTR_XOR_R8(gb->cpu_reg.hl.bytes.l);
-		break;
+		PGB_OP_END();
 
-	case 0xAE: /* XOR (HL) */
+	PGB_OP(0xAE): /* XOR (HL) */
 		PGB_INSTR_XOR_R8(__gb_read(gb, gb->cpu_reg.hl.reg));
-		break;
+		PGB_OP_END();
 
-	case 0xAF: /* XOR A */
+	PGB_OP(0xAF): /* XOR A */
 		PGB_INSTR_XOR_R8(gb->cpu_reg.a);
-		break;
+		PGB_OP_END();
 
-	case 0xB0: /* OR B */
+	PGB_OP(0xB0): /* OR B */
 		PGB_INSTR_OR_R8(gb->cpu_reg.bc.bytes.b);
-		break;
+		PGB_OP_END();
 
-	case 0xB1: /* OR C */
+	PGB_OP(0xB1): /* OR C */
 		PGB_INSTR_OR_R8(gb->cpu_reg.bc.bytes.c);
-		break;
+		PGB_OP_END();
 
-	case 0xB2: /* OR D */
+	PGB_OP(0xB2): /* OR D */
 		PGB_INSTR_OR_R8(gb->cpu_reg.de.bytes.d);
-		break;
+		PGB_OP_END();
 
-	case 0xB3: /* OR E */
+	PGB_OP(0xB3): /* OR E */
 		PGB_INSTR_OR_R8(gb->cpu_reg.de.bytes.e);
-		break;
+		PGB_OP_END();
 
-	case 0xB4: /* OR H */
+	PGB_OP(0xB4): /* OR H */
 		PGB_INSTR_OR_R8(gb->cpu_reg.hl.bytes.h);
-		break;
+		PGB_OP_END();
 
-	case 0xB5: /* OR L */
+	PGB_OP(0xB5): /* OR L */
 		PGB_INSTR_OR_R8(gb->cpu_reg.hl.bytes.l);
-		break;
+		PGB_OP_END();
 
-	case 0xB6: /* OR (HL) */
+	PGB_OP(0xB6): /* OR (HL) */
 		PGB_INSTR_OR_R8(__gb_read(gb, gb->cpu_reg.hl.reg));
-		break;
+		PGB_OP_END();
 
-	case 0xB7: /* OR A */
+	PGB_OP(0xB7): /* OR A */
 		PGB_INSTR_OR_R8(gb->cpu_reg.a);
-		break;
+		PGB_OP_END();
 
-	case 0xB8: /* CP B */
+	PGB_OP(0xB8): /* CP B */
 		PGB_INSTR_CP_R8(gb->cpu_reg.bc.bytes.b);
-		break;
+		PGB_OP_END();
 
-	case 0xB9: /* CP C */
+	PGB_OP(0xB9): /* CP C */
 		PGB_INSTR_CP_R8(gb->cpu_reg.bc.bytes.c);
-		break;
+		PGB_OP_END();
 
-	case 0xBA: /* CP D */
+	PGB_OP(0xBA): /* CP D */
 		PGB_INSTR_CP_R8(gb->cpu_reg.de.bytes.d);
-		break;
+		PGB_OP_END();
 
-	case 0xBB: /* CP E */
+	PGB_OP(0xBB): /* CP E */
 		PGB_INSTR_CP_R8(gb->cpu_reg.de.bytes.e);
-		break;
+		PGB_OP_END();
 
-	case 0xBC: /* CP H */
+	PGB_OP(0xBC): /* CP H */
 		PGB_INSTR_CP_R8(gb->cpu_reg.hl.bytes.h);
-		break;
+		PGB_OP_END();
 
-	case 0xBD: /* CP L */
+	PGB_OP(0xBD): /* CP L */
 		PGB_INSTR_CP_R8(gb->cpu_reg.hl.bytes.l);
-		break;
+		PGB_OP_END();
 
-	case 0xBE: /* CP (HL) */
+	PGB_OP(0xBE): /* CP (HL) */
 		PGB_INSTR_CP_R8(__gb_read(gb, gb->cpu_reg.hl.reg));
-		break;
+		PGB_OP_END();
 
-	case 0xBF: /* CP A */
+	PGB_OP(0xBF): /* CP A */
+		PGB_FLAGS_SYNC();
 		gb->cpu_reg.f.reg = 0;
 		gb->cpu_reg.f.f_bits.z = 1;
 		gb->cpu_reg.f.f_bits.n = 1;
-		break;
+		PGB_OP_END();
 
-	case 0xC0: /* RET NZ */
-		if(!gb->cpu_reg.f.f_bits.z)
+	PGB_OP(0xC0): /* RET NZ */
+		if(!PGB_FLAG_Z())
 		{
 			gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
 			gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
 			inst_cycles += 12;
 		}
 
-		break;
+		PGB_OP_END();
 
-	case 0xC1: /* POP BC */
+	PGB_OP(0xC1): /* POP BC */
 		gb->cpu_reg.bc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
 		gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.sp.reg++);
-		break;
+		PGB_OP_END();
 
-	case 0xC2: /* JP NZ, imm */
-		if(!gb->cpu_reg.f.f_bits.z)
+	PGB_OP(0xC2): /* JP NZ, imm */
+		if(!PGB_FLAG_Z())
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg);
+			c = PGB_IMM_LO();
+			p = PGB_IMM_HI();
+			inst_cycles += 4;
+			PGB_IDLE_LOOP(c | (p << 8), 3);
 			gb->cpu_reg.pc.bytes.c = c;
 			gb->cpu_reg.pc.bytes.p = p;
-			inst_cycles += 4;
 		}
 		else
-			gb->cpu_reg.pc.reg += 2;
+			PGB_IMM_SKIP(2);
 
-		break;
+		PGB_OP_END();
 
-	case 0xC3: /* JP imm */
+	PGB_OP(0xC3): /* JP imm */
 	{
 		uint8_t p, c;
-		c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		p = __gb_read(gb, gb->cpu_reg.pc.reg);
+		c = PGB_IMM_LO();
+		p = PGB_IMM_HI();
+		PGB_IDLE_LOOP(c | (p << 8), 3);
 		gb->cpu_reg.pc.bytes.c = c;
 		gb->cpu_reg.pc.bytes.p = p;
-		break;
+		PGB_OP_END();
 	}
 
-	case 0xC4: /* CALL NZ imm */
-		if(!gb->cpu_reg.f.f_bits.z)
+	PGB_OP(0xC4): /* CALL NZ imm */
+		if(!PGB_FLAG_Z())
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg++);
+			c = PGB_IMM_LO();
+			p = PGB_IMM_HI();
 			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 			gb->cpu_reg.pc.bytes.c = c;
@@ -2882,69 +5533,70 @@ void __gb_step_cpu(struct gb_s *gb)
 			inst_cycles += 12;
 		}
 		else
-			gb->cpu_reg.pc.reg += 2;
+			PGB_IMM_SKIP(2);
 
-		break;
+		PGB_OP_END();
 
-	case 0xC5: /* PUSH BC */
+	PGB_OP(0xC5): /* PUSH BC */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.bc.bytes.b);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.bc.bytes.c);
-		break;
+		PGB_OP_END();
 
-	case 0xC6: /* ADD A, imm */
+	PGB_OP(0xC6): /* ADD A, imm */
 	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		uint8_t val = PGB_IMM_LO();
 		PGB_INSTR_ADC_R8(val, 0);
-		break;
+		PGB_OP_END();
 	}
 
-	case 0xC7: /* RST 0x0000 */
+	PGB_OP(0xC7): /* RST 0x0000 */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 		gb->cpu_reg.pc.reg = 0x0000;
-		break;
+		PGB_OP_END();
 
-	case 0xC8: /* RET Z */
-		if(gb->cpu_reg.f.f_bits.z)
+	PGB_OP(0xC8): /* RET Z */
+		if(PGB_FLAG_Z())
 		{
 			gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
 			gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
 			inst_cycles += 12;
 		}
-		break;
+		PGB_OP_END();
 
-	case 0xC9: /* RET */
+	PGB_OP(0xC9): /* RET */
 	{
 		gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
 		gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
-		break;
+		PGB_OP_END();
 	}
 
-	case 0xCA: /* JP Z, imm */
-		if(gb->cpu_reg.f.f_bits.z)
+	PGB_OP(0xCA): /* JP Z, imm */
+		if(PGB_FLAG_Z())
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg);
+			c = PGB_IMM_LO();
+			p = PGB_IMM_HI();
+			inst_cycles += 4;
+			PGB_IDLE_LOOP(c | (p << 8), 3);
 			gb->cpu_reg.pc.bytes.c = c;
 			gb->cpu_reg.pc.bytes.p = p;
-			inst_cycles += 4;
 		}
 		else
-			gb->cpu_reg.pc.reg += 2;
+			PGB_IMM_SKIP(2);
 
-		break;
+		PGB_OP_END();
 
-	case 0xCB: /* CB INST */
-		inst_cycles = __gb_execute_cb(gb);
-		break;
+	PGB_OP(0xCB): /* CB INST */
+		inst_cycles = __gb_execute_cb(gb, PGB_IMM_LO());
+		PGB_OP_END();
 
-	case 0xCC: /* CALL Z, imm */
-		if(gb->cpu_reg.f.f_bits.z)
+	PGB_OP(0xCC): /* CALL Z, imm */
+		if(PGB_FLAG_Z())
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg++);
+			c = PGB_IMM_LO();
+			p = PGB_IMM_HI();
 			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 			gb->cpu_reg.pc.bytes.c = c;
@@ -2952,71 +5604,72 @@ void __gb_step_cpu(struct gb_s *gb)
 			inst_cycles += 12;
 		}
 		else
-			gb->cpu_reg.pc.reg += 2;
+			PGB_IMM_SKIP(2);
 
-		break;
+		PGB_OP_END();
 
-	case 0xCD: /* CALL imm */
+	PGB_OP(0xCD): /* CALL imm */
 	{
 		uint8_t p, c;
-		c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		p = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		c = PGB_IMM_LO();
+		p = PGB_IMM_HI();
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 		gb->cpu_reg.pc.bytes.c = c;
 		gb->cpu_reg.pc.bytes.p = p;
 	}
-	break;
+	PGB_OP_END();
 
-	case 0xCE: /* ADC A, imm */
+	PGB_OP(0xCE): /* ADC A, imm */
 	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		PGB_INSTR_ADC_R8(val, gb->cpu_reg.f.f_bits.c);
-		break;
+		uint8_t val = PGB_IMM_LO();
+		PGB_INSTR_ADC_R8(val, PGB_FLAG_C());
+		PGB_OP_END();
 	}
 
-	case 0xCF: /* RST 0x0008 */
+	PGB_OP(0xCF): /* RST 0x0008 */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 		gb->cpu_reg.pc.reg = 0x0008;
-		break;
+		PGB_OP_END();
 
-	case 0xD0: /* RET NC */
-		if(!gb->cpu_reg.f.f_bits.c)
+	PGB_OP(0xD0): /* RET NC */
+		if(!PGB_FLAG_C())
 		{
 			gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
 			gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
 			inst_cycles += 12;
 		}
 
-		break;
+		PGB_OP_END();
 
-	case 0xD1: /* POP DE */
+	PGB_OP(0xD1): /* POP DE */
 		gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.sp.reg++);
 		gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.sp.reg++);
-		break;
+		PGB_OP_END();
 
-	case 0xD2: /* JP NC, imm */
-		if(!gb->cpu_reg.f.f_bits.c)
+	PGB_OP(0xD2): /* JP NC, imm */
+		if(!PGB_FLAG_C())
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg);
+			c = PGB_IMM_LO();
+			p = PGB_IMM_HI();
+			inst_cycles += 4;
+			PGB_IDLE_LOOP(c | (p << 8), 3);
 			gb->cpu_reg.pc.bytes.c = c;
 			gb->cpu_reg.pc.bytes.p = p;
-			inst_cycles += 4;
 		}
 		else
-			gb->cpu_reg.pc.reg += 2;
+			PGB_IMM_SKIP(2);
 
-		break;
+		PGB_OP_END();
 
-	case 0xD4: /* CALL NC, imm */
-		if(!gb->cpu_reg.f.f_bits.c)
+	PGB_OP(0xD4): /* CALL NC, imm */
+		if(!PGB_FLAG_C())
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg++);
+			c = PGB_IMM_LO();
+			p = PGB_IMM_HI();
 			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 			gb->cpu_reg.pc.bytes.c = c;
@@ -3024,73 +5677,75 @@ void __gb_step_cpu(struct gb_s *gb)
 			inst_cycles += 12;
 		}
 		else
-			gb->cpu_reg.pc.reg += 2;
+			PGB_IMM_SKIP(2);
 
-		break;
+		PGB_OP_END();
 
-	case 0xD5: /* PUSH DE */
+	PGB_OP(0xD5): /* PUSH DE */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.de.bytes.d);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.de.bytes.e);
-		break;
+		PGB_OP_END();
 
-	case 0xD6: /* SUB imm */
+	PGB_OP(0xD6): /* SUB imm */
 	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		uint8_t val = PGB_IMM_LO();
 		uint16_t temp = gb->cpu_reg.a - val;
+		PGB_FLAGS_SYNC();
 		gb->cpu_reg.f.f_bits.z = ((temp & 0xFF) == 0x00);
 		gb->cpu_reg.f.f_bits.n = 1;
 		gb->cpu_reg.f.f_bits.h =
 			(gb->cpu_reg.a ^ val ^ temp) & 0x10 ? 1 : 0;
 		gb->cpu_reg.f.f_bits.c = (temp & 0xFF00) ? 1 : 0;
 		gb->cpu_reg.a = (temp & 0xFF);
-		break;
+		PGB_OP_END();
 	}
 
-	case 0xD7: /* RST 0x0010 */
+	PGB_OP(0xD7): /* RST 0x0010 */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 		gb->cpu_reg.pc.reg = 0x0010;
-		break;
+		PGB_OP_END();
 
-	case 0xD8: /* RET C */
-		if(gb->cpu_reg.f.f_bits.c)
+	PGB_OP(0xD8): /* RET C */
+		if(PGB_FLAG_C())
 		{
 			gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
 			gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
 			inst_cycles += 12;
 		}
 
-		break;
+		PGB_OP_END();
 
-	case 0xD9: /* RETI */
+	PGB_OP(0xD9): /* RETI */
 	{
 		gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
 		gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
 		gb->gb_ime = true;
 	}
-	break;
+	PGB_OP_END();
 
-	case 0xDA: /* JP C, imm */
-		if(gb->cpu_reg.f.f_bits.c)
+	PGB_OP(0xDA): /* JP C, imm */
+		if(PGB_FLAG_C())
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg);
+			c = PGB_IMM_LO();
+			p = PGB_IMM_HI();
+			inst_cycles += 4;
+			PGB_IDLE_LOOP(c | (p << 8), 3);
 			gb->cpu_reg.pc.bytes.c = c;
 			gb->cpu_reg.pc.bytes.p = p;
-			inst_cycles += 4;
 		}
 		else
-			gb->cpu_reg.pc.reg += 2;
+			PGB_IMM_SKIP(2);
 
-		break;
+		PGB_OP_END();
 
-	case 0xDC: /* CALL C, imm */
-		if(gb->cpu_reg.f.f_bits.c)
+	PGB_OP(0xDC): /* CALL C, imm */
+		if(PGB_FLAG_C())
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg++);
+			c = PGB_IMM_LO();
+			p = PGB_IMM_HI();
 			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 			gb->cpu_reg.pc.bytes.c = c;
@@ -3098,517 +5753,2494 @@ void __gb_step_cpu(struct gb_s *gb)
 			inst_cycles += 12;
 		}
 		else
-			gb->cpu_reg.pc.reg += 2;
+			PGB_IMM_SKIP(2);
 
-		break;
+		PGB_OP_END();
 
-	case 0xDE: /* SBC A, imm */
+	PGB_OP(0xDE): /* SBC A, imm */
 	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		PGB_INSTR_SBC_R8(val, gb->cpu_reg.f.f_bits.c);
-		break;
+		uint8_t val = PGB_IMM_LO();
+		PGB_INSTR_SBC_R8(val, PGB_FLAG_C());
+		PGB_OP_END();
 	}
 
-	case 0xDF: /* RST 0x0018 */
+	PGB_OP(0xDF): /* RST 0x0018 */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 		gb->cpu_reg.pc.reg = 0x0018;
-		break;
+		PGB_OP_END();
 
-	case 0xE0: /* LD (0xFF00+imm), A */
-		__gb_write(gb, 0xFF00 | __gb_read(gb, gb->cpu_reg.pc.reg++),
+	PGB_OP(0xE0): /* LD (0xFF00+imm), A */
+		__gb_write(gb, 0xFF00 | PGB_IMM_LO(),
 			   gb->cpu_reg.a);
-		break;
+		PGB_OP_END();
 
-	case 0xE1: /* POP HL */
+	PGB_OP(0xE1): /* POP HL */
 		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.sp.reg++);
 		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.sp.reg++);
-		break;
+		PGB_OP_END();
 
-	case 0xE2: /* LD (C), A */
+	PGB_OP(0xE2): /* LD (C), A */
 		__gb_write(gb, 0xFF00 | gb->cpu_reg.bc.bytes.c, gb->cpu_reg.a);
-		break;
+		PGB_OP_END();
 
-	case 0xE5: /* PUSH HL */
+	PGB_OP(0xE5): /* PUSH HL */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.hl.bytes.h);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.hl.bytes.l);
-		break;
+		PGB_OP_END();
 
-	case 0xE6: /* AND imm */
+	PGB_OP(0xE6): /* AND imm */
 	{
-		uint8_t temp = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		uint8_t temp = PGB_IMM_LO();
 		PGB_INSTR_AND_R8(temp);
-		break;
+		PGB_OP_END();
+	}
+
+	PGB_OP(0xE7): /* RST 0x0020 */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0020;
+		PGB_OP_END();
+
+	PGB_OP(0xE8): /* ADD SP, imm */
+	{
+		int8_t offset = (int8_t) PGB_IMM_LO();
+		PGB_FLAGS_SYNC();
+		gb->cpu_reg.f.reg = 0;
+		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
+		gb->cpu_reg.f.f_bits.c = ((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF);
+		gb->cpu_reg.sp.reg += offset;
+		PGB_OP_END();
+	}
+
+	PGB_OP(0xE9): /* JP (HL) */
+		gb->cpu_reg.pc.reg = gb->cpu_reg.hl.reg;
+		PGB_OP_END();
+
+	PGB_OP(0xEA): /* LD (imm), A */
+	{
+		uint8_t h, l;
+		uint16_t addr;
+		l = PGB_IMM_LO();
+		h = PGB_IMM_HI();
+		addr = PEANUT_GB_U8_TO_U16(h, l);
+		__gb_write(gb, addr, gb->cpu_reg.a);
+		PGB_OP_END();
+	}
+
+	PGB_OP(0xEE): /* XOR imm */
+		PGB_INSTR_XOR_R8(PGB_IMM_LO());
+		PGB_OP_END();
+
+	PGB_OP(0xEF): /* RST 0x0028 */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0028;
+		PGB_OP_END();
+
+	PGB_OP(0xF0): /* LD A, (0xFF00+imm) */
+		gb->cpu_reg.a =
+			__gb_read(gb, 0xFF00 | PGB_IMM_LO());
+		PGB_OP_END();
+
+	PGB_OP(0xF1): /* POP AF */
+	{
+		uint8_t temp_8 = __gb_read(gb, gb->cpu_reg.sp.reg++);
+		PGB_FLAGS_SYNC();
+		gb->cpu_reg.f.f_bits.z = (temp_8 >> 7) & 1;
+		gb->cpu_reg.f.f_bits.n = (temp_8 >> 6) & 1;
+		gb->cpu_reg.f.f_bits.h = (temp_8 >> 5) & 1;
+		gb->cpu_reg.f.f_bits.c = (temp_8 >> 4) & 1;
+		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.sp.reg++);
+		PGB_OP_END();
+	}
+
+	PGB_OP(0xF2): /* LD A, (C) */
+		gb->cpu_reg.a = __gb_read(gb, 0xFF00 | gb->cpu_reg.bc.bytes.c);
+		PGB_OP_END();
+
+	PGB_OP(0xF3): /* DI */
+		gb->gb_ime = false;
+		PGB_OP_END();
+
+	PGB_OP(0xF5): /* PUSH AF */
+		PGB_FLAGS_SYNC();
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.a);
+		__gb_write(gb, --gb->cpu_reg.sp.reg,
+			   gb->cpu_reg.f.f_bits.z << 7 | gb->cpu_reg.f.f_bits.n << 6 |
+			   gb->cpu_reg.f.f_bits.h << 5 | gb->cpu_reg.f.f_bits.c << 4);
+		PGB_OP_END();
+
+	PGB_OP(0xF6): /* OR imm */
+		PGB_INSTR_OR_R8(PGB_IMM_LO());
+		PGB_OP_END();
+
+	PGB_OP(0xF7): /* PUSH AF */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0030;
+		PGB_OP_END();
+
+	PGB_OP(0xF8): /* LD HL, SP+/-imm */
+	{
+		/* Taken from SameBoy, which is released under MIT Licence. */
+		int8_t offset = (int8_t) PGB_IMM_LO();
+		PGB_FLAGS_SYNC();
+		gb->cpu_reg.hl.reg = gb->cpu_reg.sp.reg + offset;
+		gb->cpu_reg.f.reg = 0;
+		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
+		gb->cpu_reg.f.f_bits.c = ((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF) ? 1 : 0;
+		PGB_OP_END();
+	}
+
+	PGB_OP(0xF9): /* LD SP, HL */
+		gb->cpu_reg.sp.reg = gb->cpu_reg.hl.reg;
+		PGB_OP_END();
+
+	PGB_OP(0xFA): /* LD A, (imm) */
+	{
+		uint8_t h, l;
+		uint16_t addr;
+		l = PGB_IMM_LO();
+		h = PGB_IMM_HI();
+		addr = PEANUT_GB_U8_TO_U16(h, l);
+		gb->cpu_reg.a = __gb_read(gb, addr);
+		PGB_OP_END();
+	}
+
+	PGB_OP(0xFB): /* EI */
+		gb->gb_ime = true;
+		PGB_OP_END();
+
+	PGB_OP(0xFE): /* CP imm */
+	{
+		uint8_t val = PGB_IMM_LO();
+		PGB_INSTR_CP_R8(val);
+		PGB_OP_END();
+	}
+
+	PGB_OP(0xFF): /* RST 0x0038 */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0038;
+		PGB_OP_END();
+
+	PGB_OP_DEFAULT:
+		/* Return address where invalid opcode that was read. */
+		(gb->gb_error)(gb, GB_INVALID_OPCODE, gb->cpu_reg.pc.reg - 1);
+		PGB_UNREACHABLE();
+	}
+
+#if PEANUT_GB_THREADED_DISPATCH
+	/* Handlers only return to here when leaving the interpreter loop. */
+exit_dispatch:
+	if(!single_step && !gb->run.stop)
+		goto next_instruction;
+#else
+	__gb_tick(gb, inst_cycles);
+#endif
+}
+
+#undef PGB_OP
+#undef PGB_OP_DEFAULT
+#undef PGB_OP_END
+#undef PGB_FETCH
+#undef PGB_IMM_LO
+#undef PGB_IMM_HI
+#undef PGB_IMM_SKIP
+#undef PGB_IDLE_LOOP
+
+#if PEANUT_GB_PREDECODE
+int gb_predecode_init(struct gb_s *gb)
+{
+	struct gb_predecode_s *pd;
+
+	if(gb->predecode != NULL)
+		return 0;
+
+	pd = calloc(1, sizeof(*pd));
+	if(pd == NULL)
+		return -1;
+
+	pd->rom_banks = gb->num_rom_banks_mask + 1u;
+	pd->rom = calloc(pd->rom_banks, sizeof(*pd->rom));
+	if(pd->rom == NULL)
+	{
+		free(pd);
+		return -1;
+	}
+
+	gb->predecode = pd;
+#if PEANUT_GB_USE_MEMORY_MAP
+	__gb_update_memory_map(gb);
+#endif
+	return 0;
+}
+
+void gb_predecode_free(struct gb_s *gb)
+{
+	uint_fast32_t bank;
+
+	if(gb->predecode == NULL)
+		return;
+
+	for(bank = 0; bank < gb->predecode->rom_banks; bank++)
+		free(gb->predecode->rom[bank]);
+
+	free(gb->predecode->rom);
+	free(gb->predecode);
+	gb->predecode = NULL;
+#if PEANUT_GB_USE_MEMORY_MAP
+	__gb_update_memory_map(gb);
+#endif
+}
+#endif
+
+#if PEANUT_GB_JIT
+#include <stddef.h>	/* Required for offsetof */
+
+/* Size of the buffer that translated blocks are written to. The buffer is
+ * never writable and executable at the same time. */
+#define PGB_JIT_CODE_SIZE	(4 * 1024 * 1024)
+/* Number of blocks translated from ROM that can be held, as a power of two. */
+#define PGB_JIT_ROM_BITS	15
+#define PGB_JIT_ROM_BLOCKS	(1 << PGB_JIT_ROM_BITS)
+/* Maximum number of guest instructions in one block. */
+#define PGB_JIT_MAX_INSTRS	32
+/* Upper bound of the native code emitted for a single guest instruction. */
+#define PGB_JIT_MAX_INSTR_CODE	160
+#define PGB_JIT_MAX_BLOCK_CODE	\
+	(64 + PGB_JIT_MAX_INSTRS * PGB_JIT_MAX_INSTR_CODE)
+/* Size of a page on x86-64, which is the unit that mprotect() works on. */
+#define PGB_JIT_PAGE_SIZE	4096
+
+/**
+ * A translated block. Executes guest instructions from the current PC for
+ * less than budget cycles, updates the PC and returns the number of cycles
+ * that were executed.
+ */
+typedef uint32_t (*pgb_jit_block_fn)(struct gb_s *gb, uint32_t budget);
+
+/* Marks an address where the first instruction is not translated, so that
+ * the interpreter is used without attempting translation again. */
+#define PGB_JIT_INTERPRET	((pgb_jit_block_fn)(uintptr_t)1)
+
+struct gb_jit_s
+{
+	uint8_t *code;
+	size_t code_used;
+
+	/* Blocks in ROM are keyed by ROM bank and address. */
+	struct
+	{
+		uint32_t key;
+		pgb_jit_block_fn fn;
+	} rom[PGB_JIT_ROM_BLOCKS];
+	uint_fast32_t rom_count;
+
+	/* Blocks in WRAM and HRAM are indexed by address. They do not cross a
+	 * 256 byte page, so that a write to a page only has to discard the
+	 * blocks starting within it. */
+	pgb_jit_block_fn wram[WRAM_SIZE];
+	pgb_jit_block_fn hram[INTR_EN_ADDR - HRAM_ADDR];
+	bool wram_code[WRAM_SIZE >> 8];
+	bool hram_code;
+	/* Set when a write discards translated code. */
+	bool discarded;
+
+	/* Converts the x86 flags stored by LAHF to the Z, H and C flags. */
+	uint8_t lahf_to_f[0x100];
+};
+
+/* Offsets of the guest registers within the emulator context. */
+#define PGB_JIT_OFF(m)	((uint32_t)offsetof(struct gb_s, m))
+#define PGB_JIT_A	PGB_JIT_OFF(cpu_reg.a)
+#define PGB_JIT_F	PGB_JIT_OFF(cpu_reg.f.reg)
+#define PGB_JIT_PC	PGB_JIT_OFF(cpu_reg.pc.reg)
+#define PGB_JIT_HL	PGB_JIT_OFF(cpu_reg.hl.reg)
+#define PGB_JIT_HRAM_IO	PGB_JIT_OFF(hram_io)
+
+/* Registers in the order that they are encoded in opcodes. (HL) is not a
+ * register, and is handled separately. */
+static const uint32_t pgb_jit_r8[8] = {
+	PGB_JIT_OFF(cpu_reg.bc.bytes.b), PGB_JIT_OFF(cpu_reg.bc.bytes.c),
+	PGB_JIT_OFF(cpu_reg.de.bytes.d), PGB_JIT_OFF(cpu_reg.de.bytes.e),
+	PGB_JIT_OFF(cpu_reg.hl.bytes.h), PGB_JIT_OFF(cpu_reg.hl.bytes.l),
+	0, PGB_JIT_OFF(cpu_reg.a)
+};
+static const uint32_t pgb_jit_r16[4] = {
+	PGB_JIT_OFF(cpu_reg.bc.reg), PGB_JIT_OFF(cpu_reg.de.reg),
+	PGB_JIT_OFF(cpu_reg.hl.reg), PGB_JIT_OFF(cpu_reg.sp.reg)
+};
+
+/* Emit bytes of native code at p. */
+#define PGB_E8(v)	(*p++ = (uint8_t)(v))
+#define PGB_E16(v)	do { const uint_fast16_t v16_ = (v);		\
+		PGB_E8(v16_); PGB_E8(v16_ >> 8); } while(0)
+#define PGB_E32(v)	do { const uint32_t v32_ = (uint32_t)(v);	\
+		PGB_E16(v32_ & 0xFFFF); PGB_E16(v32_ >> 16); } while(0)
+#define PGB_E64(v)	do { const uint64_t v64_ = (uint64_t)(v);	\
+		PGB_E32(v64_); PGB_E32(v64_ >> 32); } while(0)
+/* Emit the ModRM byte and displacement for [rbx + off], where rbx holds the
+ * emulator context. */
+#define PGB_EM(reg, off) do { PGB_E8(0x83 | ((reg) << 3)); PGB_E32(off); } while(0)
+
+/* DIV and TIMA advance within a block, so reading them is left to the
+ * interpreter once the timers are up to date. Writes to IO registers may
+ * change when the next event occurs, so they are left to the interpreter too.
+ */
+#define PGB_JIT_READ_DEFERRED(addr)					\
+	((addr) == IO_ADDR + IO_DIV || (addr) == IO_ADDR + IO_TIMA)
+#define PGB_JIT_WRITE_DEFERRED(addr)					\
+	(((addr) >= IO_ADDR && (addr) < HRAM_ADDR) || (addr) == INTR_EN_ADDR)
+
+/**
+ * Internal function used by translated code to read memory. Returns -1 if
+ * the instruction must be executed by the interpreter instead.
+ */
+static int __gb_jit_read(struct gb_s *gb, uint16_t addr)
+{
+	if(PGB_JIT_READ_DEFERRED(addr))
+		return -1;
+
+	return __gb_read(gb, addr);
+}
+
+/**
+ * Internal function used by translated code to write memory. Returns -1 if
+ * the instruction must be executed by the interpreter instead. Returns 1 if
+ * the block must be left after this instruction, because the ROM bank may
+ * have changed or translated code was overwritten.
+ */
+static int __gb_jit_write(struct gb_s *gb, uint16_t addr, uint8_t val)
+{
+	if(PGB_JIT_WRITE_DEFERRED(addr))
+		return -1;
+
+	gb->jit->discarded = false;
+	__gb_write(gb, addr, val);
+	return addr < VRAM_ADDR || gb->jit->discarded;
+}
+
+/**
+ * Internal function used by translated code to push to the stack. Returns the
+ * same as __gb_jit_write(). Neither byte is written unless both can be.
+ */
+static int __gb_jit_push(struct gb_s *gb, uint16_t val)
+{
+	const uint16_t hi = gb->cpu_reg.sp.reg - 1;
+	const uint16_t lo = gb->cpu_reg.sp.reg - 2;
+
+	if(PGB_JIT_WRITE_DEFERRED(hi) || PGB_JIT_WRITE_DEFERRED(lo))
+		return -1;
+
+	gb->jit->discarded = false;
+	__gb_write(gb, hi, val >> 8);
+	__gb_write(gb, lo, val & 0xFF);
+	gb->cpu_reg.sp.reg = lo;
+	return hi < VRAM_ADDR || lo < VRAM_ADDR || gb->jit->discarded;
+}
+
+/**
+ * Internal function used by translated code to pop from the stack. Returns -1
+ * if the instruction must be executed by the interpreter instead.
+ */
+static int __gb_jit_pop(struct gb_s *gb)
+{
+	const uint16_t lo = gb->cpu_reg.sp.reg;
+	const uint16_t hi = gb->cpu_reg.sp.reg + 1;
+	int val;
+
+	if(PGB_JIT_READ_DEFERRED(lo) || PGB_JIT_READ_DEFERRED(hi))
+		return -1;
+
+	val = __gb_read(gb, lo);
+	val |= __gb_read(gb, hi) << 8;
+	gb->cpu_reg.sp.reg = hi + 1;
+	return val;
+}
+
+/**
+ * Internal function used to discard translated code that was overwritten.
+ */
+static void __gb_jit_invalidate(struct gb_s *gb, uint_fast16_t addr)
+{
+	struct gb_jit_s *jit = gb->jit;
+
+	if(jit == NULL)
+		return;
+
+	if(addr >= ECHO_ADDR && addr < OAM_ADDR)
+		addr -= ECHO_ADDR - WRAM_0_ADDR;
+
+	if(addr < ECHO_ADDR)
+	{
+		const uint_fast16_t page = (addr - WRAM_0_ADDR) >> 8;
+
+		if(!jit->wram_code[page])
+			return;
+
+		memset(&jit->wram[page << 8], 0, 0x100 * sizeof(jit->wram[0]));
+		jit->wram_code[page] = false;
+	}
+	else
+	{
+		if(!jit->hram_code)
+			return;
+
+		memset(jit->hram, 0, sizeof(jit->hram));
+		jit->hram_code = false;
 	}
 
-	case 0xE7: /* RST 0x0020 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0020;
-		break;
+	jit->discarded = true;
+}
+
+/**
+ * Internal function used to discard all translated code.
+ */
+static void __gb_jit_flush(struct gb_jit_s *jit)
+{
+	jit->code_used = 0;
+	memset(jit->rom, 0, sizeof(jit->rom));
+	jit->rom_count = 0;
+	memset(jit->wram, 0, sizeof(jit->wram));
+	memset(jit->hram, 0, sizeof(jit->hram));
+	memset(jit->wram_code, 0, sizeof(jit->wram_code));
+	jit->hram_code = false;
+}
+
+/**
+ * Internal function used to obtain the number of cycles that may be executed
+ * before the next event is due. Translated code stays below this budget, so
+ * that passing the cycles of a whole block to __gb_tick() at once has the same
+ * effect as passing the cycles of each instruction.
+ */
+static uint32_t __gb_jit_budget(const struct gb_s *gb)
+{
+	uint64_t budget;
+
+	if(gb->counter.next_event <= gb->counter.cycles)
+		return 0;
+
+	budget = gb->counter.next_event - gb->counter.cycles;
+	return budget < LCD_FRAME_CYCLES ? (uint32_t)budget : LCD_FRAME_CYCLES;
+}
+
+/**
+ * Internal functions used to emit common sequences of native code.
+ */
+static uint8_t *__gb_jit_exit(uint8_t *p, const uint8_t *epilogue,
+		uint_fast16_t pc)
+{
+	/* mov word [rbx + pc], imm16 */
+	PGB_E8(0x66); PGB_E8(0xC7); PGB_EM(0, PGB_JIT_PC); PGB_E16(pc);
+	/* jmp epilogue */
+	PGB_E8(0xE9); PGB_E32((uint32_t)(epilogue - (p + 4)));
+	return p;
+}
+
+static uint8_t *__gb_jit_check(uint8_t *p, const uint8_t *epilogue,
+		uint_fast16_t pc, uint_fast8_t cycles)
+{
+	/* lea eax, [r13 + cycles]; cmp eax, r12d; jb next */
+	PGB_E8(0x41); PGB_E8(0x8D); PGB_E8(0x85); PGB_E32(cycles);
+	PGB_E8(0x44); PGB_E8(0x39); PGB_E8(0xE0);
+	PGB_E8(0x72); PGB_E8(14);
+	return __gb_jit_exit(p, epilogue, pc);
+}
+
+static uint8_t *__gb_jit_cycles(uint8_t *p, uint_fast8_t cycles)
+{
+	/* add r13d, imm8 */
+	PGB_E8(0x41); PGB_E8(0x83); PGB_E8(0xC5); PGB_E8(cycles);
+	return p;
+}
+
+static uint8_t *__gb_jit_call(uint8_t *p, const void *fn)
+{
+	/* mov rax, fn; call rax */
+	PGB_E8(0x48); PGB_E8(0xB8); PGB_E64((uintptr_t)fn);
+	PGB_E8(0xFF); PGB_E8(0xD0);
+	return p;
+}
+
+/* Load the F register from the x86 flags in AH. Clobbers ecx. */
+static uint8_t *__gb_jit_lahf_flags(uint8_t *p)
+{
+	/* lahf; movzx ecx, ah; movzx ecx, byte [r14 + rcx] */
+	PGB_E8(0x9F);
+	PGB_E8(0x0F); PGB_E8(0xB6); PGB_E8(0xCC);
+	PGB_E8(0x41); PGB_E8(0x0F); PGB_E8(0xB6); PGB_E8(0x0C); PGB_E8(0x0E);
+	return p;
+}
+
+/* Merge the carry flag of F into cl, and store cl to F. */
+static uint8_t *__gb_jit_keep_carry(uint8_t *p)
+{
+	/* mov dl, [f]; and dl, 0x10; or cl, dl; mov [f], cl */
+	PGB_E8(0x8A); PGB_EM(2, PGB_JIT_F);
+	PGB_E8(0x80); PGB_E8(0xE2); PGB_E8(0x10);
+	PGB_E8(0x08); PGB_E8(0xD1);
+	PGB_E8(0x88); PGB_EM(1, PGB_JIT_F);
+	return p;
+}
+
+/* Set CF to the carry flag of F. Clobbers cl. */
+static uint8_t *__gb_jit_load_carry(uint8_t *p)
+{
+	/* mov cl, [f]; shr cl, 5 */
+	PGB_E8(0x8A); PGB_EM(1, PGB_JIT_F);
+	PGB_E8(0xC0); PGB_E8(0xE9); PGB_E8(5);
+	return p;
+}
+
+/* Execute ALU operation op (ADD, ADC, SUB, SBC, AND, XOR, OR, CP) on A and
+ * dl. */
+static uint8_t *__gb_jit_alu(uint8_t *p, uint_fast8_t op)
+{
+	static const uint8_t x86_op[8] = {
+		0x02, 0x12, 0x2A, 0x1A, 0x22, 0x32, 0x0A, 0x3A
+	};
+
+	if(op == 1 || op == 3)
+		p = __gb_jit_load_carry(p);
+
+	/* mov al, [a]; op al, dl */
+	PGB_E8(0x8A); PGB_EM(0, PGB_JIT_A);
+	PGB_E8(x86_op[op]); PGB_E8(0xC2);
+
+	if(op >= 4 && op <= 6)
+	{
+		/* mov [a], al; sete cl; shl cl, 7 */
+		PGB_E8(0x88); PGB_EM(0, PGB_JIT_A);
+		PGB_E8(0x0F); PGB_E8(0x94); PGB_E8(0xC1);
+		PGB_E8(0xC0); PGB_E8(0xE1); PGB_E8(7);
+
+		/* or cl, 0x20 */
+		if(op == 4)
+		{
+			PGB_E8(0x80); PGB_E8(0xC9); PGB_E8(0x20);
+		}
+	}
+	else
+	{
+		p = __gb_jit_lahf_flags(p);
+
+		if(op != 7)
+		{
+			PGB_E8(0x88); PGB_EM(0, PGB_JIT_A);
+		}
+
+		/* or cl, 0x40 */
+		if(op >= 2)
+		{
+			PGB_E8(0x80); PGB_E8(0xC9); PGB_E8(0x40);
+		}
+	}
+
+	/* mov [f], cl */
+	PGB_E8(0x88); PGB_EM(1, PGB_JIT_F);
+	return p;
+}
+
+/* Call one of the memory access functions above, with its arguments loaded
+ * into esi and edx by the caller. Leaves the block before the instruction at
+ * pc if the interpreter must execute it. */
+static uint8_t *__gb_jit_mem(uint8_t *p, const uint8_t *epilogue,
+		uint_fast16_t pc, const void *fn)
+{
+	/* mov rdi, rbx */
+	PGB_E8(0x48); PGB_E8(0x89); PGB_E8(0xDF);
+	p = __gb_jit_call(p, fn);
+
+	/* test eax, eax; jns next */
+	PGB_E8(0x85); PGB_E8(0xC0);
+	PGB_E8(0x79); PGB_E8(14);
+	return __gb_jit_exit(p, epilogue, pc);
+}
+
+#define PGB_JIT_READ	((const void *)&__gb_jit_read)
+#define PGB_JIT_WRITE	((const void *)&__gb_jit_write)
+#define PGB_JIT_PUSH	((const void *)&__gb_jit_push)
+#define PGB_JIT_POP	((const void *)&__gb_jit_pop)
+
+/* Load esi with the 16-bit register at off, or with an immediate address. */
+static uint8_t *__gb_jit_addr_reg(uint8_t *p, uint32_t off)
+{
+	/* movzx esi, word [rbx + off] */
+	PGB_E8(0x0F); PGB_E8(0xB7); PGB_EM(6, off);
+	return p;
+}
+
+static uint8_t *__gb_jit_addr_imm(uint8_t *p, uint_fast16_t addr)
+{
+	/* mov esi, imm32 */
+	PGB_E8(0xBE); PGB_E32(addr);
+	return p;
+}
+
+/* Finish an instruction that wrote to memory. Leaves the block after the
+ * instruction if __gb_jit_write() requested it. */
+static uint8_t *__gb_jit_write_end(uint8_t *p, const uint8_t *epilogue,
+		uint_fast16_t next_pc, uint_fast8_t cycles, int hl_step)
+{
+	/* mov r15d, eax */
+	PGB_E8(0x41); PGB_E8(0x89); PGB_E8(0xC7);
+
+	/* inc/dec word [hl] */
+	if(hl_step != 0)
+	{
+		PGB_E8(0x66); PGB_E8(0xFF);
+		PGB_EM(hl_step > 0 ? 0 : 1, PGB_JIT_HL);
+	}
+
+	p = __gb_jit_cycles(p, cycles);
+	/* test r15d, r15d; jz next */
+	PGB_E8(0x45); PGB_E8(0x85); PGB_E8(0xFF);
+	PGB_E8(0x74); PGB_E8(14);
+	return __gb_jit_exit(p, epilogue, next_pc);
+}
+
+/* INC or DEC al, and set F. */
+static uint8_t *__gb_jit_incdec(uint8_t *p, bool dec)
+{
+	/* inc/dec al */
+	PGB_E8(0xFE); PGB_E8(dec ? 0xC8 : 0xC0);
+	p = __gb_jit_lahf_flags(p);
+	/* and cl, 0xA0; or cl, 0x40 */
+	PGB_E8(0x80); PGB_E8(0xE1); PGB_E8(0xA0);
+	if(dec)
+	{
+		PGB_E8(0x80); PGB_E8(0xC9); PGB_E8(0x40);
+	}
+
+	return __gb_jit_keep_carry(p);
+}
+
+/* Execute the CB prefixed operation cb on al, and set F. */
+static uint8_t *__gb_jit_cb(uint8_t *p, uint8_t cb)
+{
+	const uint8_t bit = (cb >> 3) & 0x7;
+
+	if(cb >= 0x80)
+	{
+		/* RES and SET: and/or al, mask */
+		PGB_E8(cb >= 0xC0 ? 0x0C : 0x24);
+		PGB_E8(cb >= 0xC0 ? (1 << bit) : ~(1 << bit));
+	}
+	else if(cb >= 0x40)
+	{
+		/* BIT: test al, mask; sete cl; shl cl, 7; or cl, 0x20 */
+		PGB_E8(0xA8); PGB_E8(1 << bit);
+		PGB_E8(0x0F); PGB_E8(0x94); PGB_E8(0xC1);
+		PGB_E8(0xC0); PGB_E8(0xE1); PGB_E8(7);
+		PGB_E8(0x80); PGB_E8(0xC9); PGB_E8(0x20);
+		p = __gb_jit_keep_carry(p);
+	}
+	else
+	{
+		/* RLC, RRC, RL, RR, SLA, SRA, SWAP and SRL. */
+		static const uint8_t shift[8] = {
+			0xC0, 0xC8, 0xD0, 0xD8, 0xE0, 0xF8, 0xC0, 0xE8
+		};
+
+		if(bit == 2 || bit == 3)
+			p = __gb_jit_load_carry(p);
+
+		if(bit == 6)
+		{
+			/* rol al, 4; mov cl, 0 */
+			PGB_E8(0xC0); PGB_E8(0xC0); PGB_E8(4);
+			PGB_E8(0xB1); PGB_E8(0);
+		}
+		else
+		{
+			/* op al, 1; setc cl */
+			PGB_E8(0xD0); PGB_E8(shift[bit]);
+			PGB_E8(0x0F); PGB_E8(0x92); PGB_E8(0xC1);
+		}
+
+		/* test al, al; sete dl; shl cl, 4; shl dl, 7; or cl, dl;
+		 * mov [f], cl */
+		PGB_E8(0x84); PGB_E8(0xC0);
+		PGB_E8(0x0F); PGB_E8(0x94); PGB_E8(0xC2);
+		PGB_E8(0xC0); PGB_E8(0xE1); PGB_E8(4);
+		PGB_E8(0xC0); PGB_E8(0xE2); PGB_E8(7);
+		PGB_E8(0x08); PGB_E8(0xD1);
+		PGB_E8(0x88); PGB_EM(1, PGB_JIT_F);
+	}
+
+	return p;
+}
+
+/**
+ * Internal function used to translate the block of guest code starting at
+ * start. Returns PGB_JIT_INTERPRET if the first instruction cannot be
+ * translated.
+ *
+ * Registers are kept in the emulator context, which is held in rbx. r12d holds
+ * the cycle budget, r13d the number of cycles executed so far, and r14 the
+ * table converting x86 flags to the F register. Before each instruction, the
+ * block is left if the instruction could reach the budget, so that no event
+ * occurs within a block. Branches and instructions that are not translated end
+ * the block, and the interpreter takes over from there.
+ */
+static pgb_jit_block_fn __gb_jit_compile(struct gb_s *gb, uint_fast16_t start)
+{
+	struct gb_jit_s *jit = gb->jit;
+	uint8_t *const begin = jit->code + jit->code_used;
+	uint8_t *p = begin;
+	uint8_t *epilogue, *entry;
+	/* Start of each instruction, used by branches within the block. */
+	uint8_t *label[PGB_JIT_MAX_INSTRS];
+	uint_fast16_t label_pc[PGB_JIT_MAX_INSTRS];
+	uint_fast8_t count = 0;
+	uint_fast16_t pc = start;
+	uint_fast32_t limit;
+	bool done = false;
+
+	/* Blocks do not cross ROM banks or pages of RAM. */
+	if(start < ROM_N_ADDR)
+		limit = ROM_N_ADDR;
+	else if(start < VRAM_ADDR)
+		limit = VRAM_ADDR;
+	else if(start < HRAM_ADDR)
+		limit = (start | 0xFF) + 1;
+	else
+		limit = INTR_EN_ADDR;
+
+	/* Epilogue: mov eax, r13d; pop r15 - rbx; ret */
+	epilogue = p;
+	PGB_E8(0x44); PGB_E8(0x89); PGB_E8(0xE8);
+	PGB_E8(0x41); PGB_E8(0x5F); PGB_E8(0x41); PGB_E8(0x5E);
+	PGB_E8(0x41); PGB_E8(0x5D); PGB_E8(0x41); PGB_E8(0x5C);
+	PGB_E8(0x5B); PGB_E8(0xC3);
+
+	/* Prologue: push rbx - r15; mov rbx, rdi; mov r12d, esi;
+	 * xor r13d, r13d; mov r14, lahf_to_f */
+	entry = p;
+	PGB_E8(0x53); PGB_E8(0x41); PGB_E8(0x54); PGB_E8(0x41); PGB_E8(0x55);
+	PGB_E8(0x41); PGB_E8(0x56); PGB_E8(0x41); PGB_E8(0x57);
+	PGB_E8(0x48); PGB_E8(0x89); PGB_E8(0xFB);
+	PGB_E8(0x41); PGB_E8(0x89); PGB_E8(0xF4);
+	PGB_E8(0x45); PGB_E8(0x31); PGB_E8(0xED);
+	PGB_E8(0x49); PGB_E8(0xBE); PGB_E64((uintptr_t)jit->lahf_to_f);
+
+	while(!done && count < PGB_JIT_MAX_INSTRS)
+	{
+		const uint8_t opcode = __gb_read(gb, pc);
+		const uint8_t r = opcode & 0x7;
+		const uint8_t d = (opcode >> 3) & 0x7;
+		uint_fast8_t len, cycles;
+		uint8_t imm8 = 0;
+		uint_fast16_t imm16 = 0;
+
+		/* Length and cycles of translated instructions. Conditional
+		 * branches use the cycles taken when the branch is taken. */
+		switch(opcode)
+		{
+		case 0x00: case 0x07: case 0x0F: case 0x17: case 0x1F:
+		case 0x2F: case 0x37: case 0x3F:
+		case 0x04: case 0x0C: case 0x14: case 0x1C:
+		case 0x24: case 0x2C: case 0x3C:
+		case 0x05: case 0x0D: case 0x15: case 0x1D:
+		case 0x25: case 0x2D: case 0x3D:
+		case 0xE9:
+			len = 1; cycles = 4;
+			break;
+
+		case 0x02: case 0x12: case 0x22: case 0x32:
+		case 0x0A: case 0x1A: case 0x2A: case 0x3A:
+		case 0x03: case 0x13: case 0x23: case 0x33:
+		case 0x0B: case 0x1B: case 0x2B: case 0x3B:
+		case 0x09: case 0x19: case 0x29: case 0x39:
+		case 0xE2: case 0xF2:
+			len = 1; cycles = 8;
+			break;
+
+		case 0x06: case 0x0E: case 0x16: case 0x1E:
+		case 0x26: case 0x2E: case 0x3E:
+		case 0xC6: case 0xCE: case 0xD6: case 0xDE:
+		case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+			len = 2; cycles = 8;
+			break;
+
+		case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+		case 0x36: case 0xE0: case 0xF0:
+			len = 2; cycles = 12;
+			break;
+
+		case 0x34: case 0x35:
+		case 0xC1: case 0xD1: case 0xE1: case 0xF1:
+			len = 1; cycles = 12;
+			break;
+
+		case 0xC5: case 0xD5: case 0xE5: case 0xF5:
+		case 0xC9: case 0xC7: case 0xCF: case 0xD7: case 0xDF:
+		case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+			len = 1; cycles = 16;
+			break;
+
+		case 0xC0: case 0xC8: case 0xD0: case 0xD8:
+			len = 1; cycles = 20;
+			break;
+
+		case 0xC4: case 0xCC: case 0xD4: case 0xDC: case 0xCD:
+			len = 3; cycles = 24;
+			break;
+
+		case 0x01: case 0x11: case 0x21: case 0x31:
+			len = 3; cycles = 12;
+			break;
+
+		case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA:
+		case 0xEA: case 0xFA:
+			len = 3; cycles = 16;
+			break;
+
+		case 0xCB:
+			len = 2; cycles = 8;
+			break;
+
+		default:
+			if(opcode >= 0x40 && opcode < 0xC0 && opcode != 0x76)
+			{
+				len = 1;
+				cycles = (r == 6 || (opcode < 0x80 && d == 6)) ? 8 : 4;
+				break;
+			}
+
+			/* Not translated. */
+			goto finish;
+		}
+
+		if(pc + len > limit)
+			break;
+
+		if(len >= 2)
+			imm8 = __gb_read(gb, pc + 1);
+
+		if(len == 3)
+			imm16 = imm8 | (__gb_read(gb, pc + 2) << 8);
+
+		if(opcode == 0xCB && (imm8 & 0x7) == 6)
+			cycles = (imm8 >= 0x40 && imm8 < 0x80) ? 12 : 16;
+
+		/* Accesses to IO registers that are known to be left to the
+		 * interpreter are not translated. Neither are RL (HL) and
+		 * RR (HL), which could not be restarted by the interpreter
+		 * after changing the carry flag. */
+		if((opcode == 0xCB && (imm8 == 0x16 || imm8 == 0x1E)) ||
+				(opcode == 0xE0 && PGB_JIT_WRITE_DEFERRED(IO_ADDR + imm8)) ||
+				(opcode == 0xF0 && PGB_JIT_READ_DEFERRED(IO_ADDR + imm8)) ||
+				(opcode == 0xEA && PGB_JIT_WRITE_DEFERRED(imm16)) ||
+				(opcode == 0xFA && PGB_JIT_READ_DEFERRED(imm16)))
+			break;
+
+		label[count] = p;
+		label_pc[count] = pc;
+		count++;
+		p = __gb_jit_check(p, epilogue, pc, cycles);
+
+		switch(opcode)
+		{
+		case 0x00: /* NOP */
+			break;
+
+		case 0x01: case 0x11: case 0x21: case 0x31: /* LD rr, imm */
+			/* mov word [rr], imm16 */
+			PGB_E8(0x66); PGB_E8(0xC7);
+			PGB_EM(0, pgb_jit_r16[opcode >> 4]); PGB_E16(imm16);
+			break;
+
+		case 0x03: case 0x13: case 0x23: case 0x33: /* INC rr */
+		case 0x0B: case 0x1B: case 0x2B: case 0x3B: /* DEC rr */
+			/* inc/dec word [rr] */
+			PGB_E8(0x66); PGB_E8(0xFF);
+			PGB_EM((opcode >> 3) & 1, pgb_jit_r16[opcode >> 4]);
+			break;
+
+		case 0x04: case 0x0C: case 0x14: case 0x1C:
+		case 0x24: case 0x2C: case 0x3C: /* INC r */
+		case 0x05: case 0x0D: case 0x15: case 0x1D:
+		case 0x25: case 0x2D: case 0x3D: /* DEC r */
+			/* mov al, [r]; inc/dec al; mov [r], al */
+			PGB_E8(0x8A); PGB_EM(0, pgb_jit_r8[d]);
+			p = __gb_jit_incdec(p, r == 5);
+			PGB_E8(0x88); PGB_EM(0, pgb_jit_r8[d]);
+			break;
+
+		case 0x34: case 0x35: /* INC (HL), DEC (HL) */
+			/* Flags are set before the write. The interpreter sets
+			 * the same flags if it has to execute the instruction
+			 * instead. */
+			p = __gb_jit_addr_reg(p, PGB_JIT_HL);
+			p = __gb_jit_mem(p, epilogue, pc, PGB_JIT_READ);
+			p = __gb_jit_incdec(p, r == 5);
+			/* movzx edx, al */
+			PGB_E8(0x0F); PGB_E8(0xB6); PGB_E8(0xD0);
+			p = __gb_jit_addr_reg(p, PGB_JIT_HL);
+			p = __gb_jit_mem(p, epilogue, pc, PGB_JIT_WRITE);
+			p = __gb_jit_write_end(p, epilogue, pc + len, cycles, 0);
+			pc += len;
+			continue;
+
+		case 0xC1: case 0xD1: case 0xE1: case 0xF1: /* POP rr */
+			p = __gb_jit_mem(p, epilogue, pc, PGB_JIT_POP);
+			if(opcode == 0xF1)
+			{
+				/* and al, 0xF0 */
+				PGB_E8(0x24); PGB_E8(0xF0);
+			}
+
+			/* mov [rr], ax */
+			PGB_E8(0x66); PGB_E8(0x89);
+			PGB_EM(0, opcode == 0xF1 ? PGB_JIT_F : pgb_jit_r16[(opcode >> 4) & 3]);
+			break;
+
+		case 0xC5: case 0xD5: case 0xE5: case 0xF5: /* PUSH rr */
+			p = __gb_jit_addr_reg(p, opcode == 0xF5 ?
+					PGB_JIT_F : pgb_jit_r16[(opcode >> 4) & 3]);
+			p = __gb_jit_mem(p, epilogue, pc, PGB_JIT_PUSH);
+			p = __gb_jit_write_end(p, epilogue, pc + len, cycles, 0);
+			pc += len;
+			continue;
+
+		case 0x06: case 0x0E: case 0x16: case 0x1E:
+		case 0x26: case 0x2E: case 0x3E: /* LD r, imm */
+			/* mov byte [r], imm8 */
+			PGB_E8(0xC6); PGB_EM(0, pgb_jit_r8[d]); PGB_E8(imm8);
+			break;
+
+		case 0x07: case 0x0F: case 0x17: case 0x1F: /* RLCA, RRCA, RLA, RRA */
+		{
+			static const uint8_t rot[4] = { 0xC0, 0xC8, 0xD0, 0xD8 };
+
+			if(opcode >= 0x10)
+				p = __gb_jit_load_carry(p);
+
+			/* mov al, [a]; rol/ror/rcl/rcr al, 1; mov [a], al;
+			 * setc cl; shl cl, 4; mov [f], cl */
+			PGB_E8(0x8A); PGB_EM(0, PGB_JIT_A);
+			PGB_E8(0xD0); PGB_E8(rot[opcode >> 3]);
+			PGB_E8(0x88); PGB_EM(0, PGB_JIT_A);
+			PGB_E8(0x0F); PGB_E8(0x92); PGB_E8(0xC1);
+			PGB_E8(0xC0); PGB_E8(0xE1); PGB_E8(4);
+			PGB_E8(0x88); PGB_EM(1, PGB_JIT_F);
+			break;
+		}
+
+		case 0x09: case 0x19: case 0x29: case 0x39: /* ADD HL, rr */
+			/* movzx eax, word [hl]; movzx ecx, word [rr];
+			 * lea edx, [rax + rcx]; mov [hl], dx */
+			PGB_E8(0x0F); PGB_E8(0xB7); PGB_EM(0, PGB_JIT_HL);
+			PGB_E8(0x0F); PGB_E8(0xB7); PGB_EM(1, pgb_jit_r16[opcode >> 4]);
+			PGB_E8(0x8D); PGB_E8(0x14); PGB_E8(0x08);
+			PGB_E8(0x66); PGB_E8(0x89); PGB_EM(2, PGB_JIT_HL);
+			/* Half carry from bit 11 and carry from bit 15:
+			 * xor eax, ecx; xor eax, edx; shr eax, 7; and eax, 0x20;
+			 * shr edx, 12; and edx, 0x10; or eax, edx */
+			PGB_E8(0x31); PGB_E8(0xC8);
+			PGB_E8(0x31); PGB_E8(0xD0);
+			PGB_E8(0xC1); PGB_E8(0xE8); PGB_E8(7);
+			PGB_E8(0x83); PGB_E8(0xE0); PGB_E8(0x20);
+			PGB_E8(0xC1); PGB_E8(0xEA); PGB_E8(12);
+			PGB_E8(0x83); PGB_E8(0xE2); PGB_E8(0x10);
+			PGB_E8(0x09); PGB_E8(0xD0);
+			/* mov cl, [f]; and cl, 0x80; or cl, al; mov [f], cl */
+			PGB_E8(0x8A); PGB_EM(1, PGB_JIT_F);
+			PGB_E8(0x80); PGB_E8(0xE1); PGB_E8(0x80);
+			PGB_E8(0x08); PGB_E8(0xC1);
+			PGB_E8(0x88); PGB_EM(1, PGB_JIT_F);
+			break;
+
+		case 0x02: case 0x12: case 0x22: case 0x32: /* LD (rr), A */
+			p = __gb_jit_addr_reg(p, pgb_jit_r16[opcode < 0x20 ? opcode >> 4 : 2]);
+			/* movzx edx, byte [a] */
+			PGB_E8(0x0F); PGB_E8(0xB6); PGB_EM(2, PGB_JIT_A);
+			p = __gb_jit_mem(p, epilogue, pc, PGB_JIT_WRITE);
+			p = __gb_jit_write_end(p, epilogue, pc + len, cycles,
+					opcode == 0x22 ? 1 : opcode == 0x32 ? -1 : 0);
+			pc += len;
+			continue;
+
+		case 0x0A: case 0x1A: case 0x2A: case 0x3A: /* LD A, (rr) */
+			p = __gb_jit_addr_reg(p, pgb_jit_r16[opcode < 0x20 ? opcode >> 4 : 2]);
+			p = __gb_jit_mem(p, epilogue, pc, PGB_JIT_READ);
+			/* mov [a], al */
+			PGB_E8(0x88); PGB_EM(0, PGB_JIT_A);
+			if(opcode >= 0x20)
+			{
+				PGB_E8(0x66); PGB_E8(0xFF);
+				PGB_EM(opcode == 0x2A ? 0 : 1, PGB_JIT_HL);
+			}
+			break;
+
+		case 0x2F: /* CPL */
+			/* not byte [a]; or byte [f], 0x60 */
+			PGB_E8(0xF6); PGB_EM(2, PGB_JIT_A);
+			PGB_E8(0x80); PGB_EM(1, PGB_JIT_F); PGB_E8(0x60);
+			break;
+
+		case 0x37: /* SCF */
+			/* and byte [f], 0x80; or byte [f], 0x10 */
+			PGB_E8(0x80); PGB_EM(4, PGB_JIT_F); PGB_E8(0x80);
+			PGB_E8(0x80); PGB_EM(1, PGB_JIT_F); PGB_E8(0x10);
+			break;
+
+		case 0x3F: /* CCF */
+			/* and byte [f], 0x90; xor byte [f], 0x10 */
+			PGB_E8(0x80); PGB_EM(4, PGB_JIT_F); PGB_E8(0x90);
+			PGB_E8(0x80); PGB_EM(6, PGB_JIT_F); PGB_E8(0x10);
+			break;
+
+		case 0x36: /* LD (HL), imm */
+			p = __gb_jit_addr_reg(p, PGB_JIT_HL);
+			/* mov edx, imm32 */
+			PGB_E8(0xBA); PGB_E32(imm8);
+			p = __gb_jit_mem(p, epilogue, pc, PGB_JIT_WRITE);
+			p = __gb_jit_write_end(p, epilogue, pc + len, cycles, 0);
+			pc += len;
+			continue;
+
+		case 0xE0: /* LDH (imm), A */
+		case 0xEA: /* LD (imm), A */
+			p = __gb_jit_addr_imm(p, opcode == 0xE0 ?
+					(uint_fast16_t)(IO_ADDR + imm8) : imm16);
+			PGB_E8(0x0F); PGB_E8(0xB6); PGB_EM(2, PGB_JIT_A);
+			p = __gb_jit_mem(p, epilogue, pc, PGB_JIT_WRITE);
+			p = __gb_jit_write_end(p, epilogue, pc + len, cycles, 0);
+			pc += len;
+			continue;
+
+		case 0xE2: /* LD (C), A */
+			/* movzx esi, byte [c]; or esi, 0xFF00 */
+			PGB_E8(0x0F); PGB_E8(0xB6); PGB_EM(6, pgb_jit_r8[1]);
+			PGB_E8(0x81); PGB_E8(0xCE); PGB_E32(IO_ADDR);
+			PGB_E8(0x0F); PGB_E8(0xB6); PGB_EM(2, PGB_JIT_A);
+			p = __gb_jit_mem(p, epilogue, pc, PGB_JIT_WRITE);
+			p = __gb_jit_write_end(p, epilogue, pc + len, cycles, 0);
+			pc += len;
+			continue;
+
+		case 0xF0: /* LDH A, (imm) */
+			/* Registers outside of the APU are read directly, as they
+			 * only change on events. */
+			if(imm8 < 0x10 || imm8 > 0x3F)
+			{
+				/* mov al, [hram_io + imm]; mov [a], al */
+				PGB_E8(0x8A); PGB_EM(0, PGB_JIT_HRAM_IO + imm8);
+				PGB_E8(0x88); PGB_EM(0, PGB_JIT_A);
+				break;
+			}
+
+			p = __gb_jit_addr_imm(p, IO_ADDR + imm8);
+			p = __gb_jit_mem(p, epilogue, pc, PGB_JIT_READ);
+			PGB_E8(0x88); PGB_EM(0, PGB_JIT_A);
+			break;
+
+		case 0xFA: /* LD A, (imm) */
+			p = __gb_jit_addr_imm(p, imm16);
+			p = __gb_jit_mem(p, epilogue, pc, PGB_JIT_READ);
+			PGB_E8(0x88); PGB_EM(0, PGB_JIT_A);
+			break;
+
+		case 0xF2: /* LD A, (C) */
+			PGB_E8(0x0F); PGB_E8(0xB6); PGB_EM(6, pgb_jit_r8[1]);
+			PGB_E8(0x81); PGB_E8(0xCE); PGB_E32(IO_ADDR);
+			p = __gb_jit_mem(p, epilogue, pc, PGB_JIT_READ);
+			PGB_E8(0x88); PGB_EM(0, PGB_JIT_A);
+			break;
+
+		case 0xC6: case 0xCE: case 0xD6: case 0xDE:
+		case 0xE6: case 0xEE: case 0xF6: case 0xFE: /* ALU A, imm */
+			/* mov dl, imm8 */
+			PGB_E8(0xB2); PGB_E8(imm8);
+			p = __gb_jit_alu(p, d);
+			break;
+
+		case 0xCB:
+		{
+			const uint8_t cb_r = imm8 & 0x7;
+
+			if(cb_r == 6)
+			{
+				p = __gb_jit_addr_reg(p, PGB_JIT_HL);
+				p = __gb_jit_mem(p, epilogue, pc, PGB_JIT_READ);
+			}
+			else
+			{
+				/* mov al, [r] */
+				PGB_E8(0x8A); PGB_EM(0, pgb_jit_r8[cb_r]);
+			}
+
+			p = __gb_jit_cb(p, imm8);
+
+			/* BIT does not write the result. */
+			if(imm8 >= 0x40 && imm8 < 0x80)
+				break;
+
+			if(cb_r != 6)
+			{
+				/* mov [r], al */
+				PGB_E8(0x88); PGB_EM(0, pgb_jit_r8[cb_r]);
+				break;
+			}
+
+			/* As with INC (HL), flags are set before the write. */
+			PGB_E8(0x0F); PGB_E8(0xB6); PGB_E8(0xD0);
+			p = __gb_jit_addr_reg(p, PGB_JIT_HL);
+			p = __gb_jit_mem(p, epilogue, pc, PGB_JIT_WRITE);
+			p = __gb_jit_write_end(p, epilogue, pc + len, cycles, 0);
+			pc += len;
+			continue;
+		}
+
+		case 0x18: case 0xC3: case 0xCD: case 0xC9: /* JR, JP, CALL, RET */
+		case 0x20: case 0x28: case 0x30: case 0x38: /* JR cc, imm */
+		case 0xC2: case 0xCA: case 0xD2: case 0xDA: /* JP cc, imm */
+		case 0xC4: case 0xCC: case 0xD4: case 0xDC: /* CALL cc, imm */
+		case 0xC0: case 0xC8: case 0xD0: case 0xD8: /* RET cc */
+		case 0xC7: case 0xCF: case 0xD7: case 0xDF: /* RST */
+		case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+		{
+			const bool conditional = opcode < 0x40 ? opcode != 0x18 :
+				(opcode < 0xE0 && (r == 0 || r == 2 || r == 4));
+			const bool call = opcode >= 0x40 &&
+				(r == 4 || r == 7 || opcode == 0xCD);
+			const bool ret = opcode >= 0x40 && (r == 0 || opcode == 0xC9);
+			uint_fast16_t target;
+			uint8_t *skip = NULL;
+			uint_fast8_t i;
+
+			if(opcode < 0x40)
+				target = (uint16_t)(pc + len + (int8_t)imm8);
+			else if(r == 7)
+				target = opcode & 0x38;
+			else
+				target = imm16;
+
+			if(conditional)
+			{
+				/* test byte [f], mask; jump over the taken path
+				 * if the condition is false. */
+				PGB_E8(0xF6); PGB_EM(0, PGB_JIT_F);
+				PGB_E8((d & 2) ? 0x10 : 0x80);
+				PGB_E8((d & 1) ? 0x74 : 0x75);
+				skip = p;
+				PGB_E8(0);
+			}
+
+			if(call)
+			{
+				p = __gb_jit_addr_imm(p, pc + len);
+				p = __gb_jit_mem(p, epilogue, pc, PGB_JIT_PUSH);
+			}
+			else if(ret)
+				p = __gb_jit_mem(p, epilogue, pc, PGB_JIT_POP);
+
+			p = __gb_jit_cycles(p, cycles);
+
+			/* Jumps to an earlier instruction of this block stay
+			 * within native code. */
+			for(i = 0; i < count; i++)
+			{
+				if(label_pc[i] == target)
+					break;
+			}
+
+			if(ret)
+			{
+				/* mov [pc], ax; jmp epilogue */
+				PGB_E8(0x66); PGB_E8(0x89); PGB_EM(0, PGB_JIT_PC);
+				PGB_E8(0xE9);
+				PGB_E32((uint32_t)(epilogue - (p + 4)));
+			}
+			else if(!call && i < count)
+			{
+				/* jmp label */
+				PGB_E8(0xE9);
+				PGB_E32((uint32_t)(label[i] - (p + 4)));
+			}
+			else
+				p = __gb_jit_exit(p, epilogue, target);
+
+			if(!conditional)
+			{
+				done = true;
+				break;
+			}
+
+			*skip = (uint8_t)(p - (skip + 1));
+			/* Not taken. */
+			p = __gb_jit_cycles(p, cycles - (call || ret ? 12 : 4));
+			pc += len;
+			continue;
+		}
+
+		case 0xE9: /* JP HL */
+			/* mov ax, [hl]; mov [pc], ax; add r13d, 4; jmp epilogue */
+			PGB_E8(0x66); PGB_E8(0x8B); PGB_EM(0, PGB_JIT_HL);
+			PGB_E8(0x66); PGB_E8(0x89); PGB_EM(0, PGB_JIT_PC);
+			p = __gb_jit_cycles(p, cycles);
+			PGB_E8(0xE9); PGB_E32((uint32_t)(epilogue - (p + 4)));
+			done = true;
+			break;
+
+		default:
+			if(opcode < 0x80 && d == 6) /* LD (HL), r */
+			{
+				p = __gb_jit_addr_reg(p, PGB_JIT_HL);
+				PGB_E8(0x0F); PGB_E8(0xB6); PGB_EM(2, pgb_jit_r8[r]);
+				p = __gb_jit_mem(p, epilogue, pc, PGB_JIT_WRITE);
+				p = __gb_jit_write_end(p, epilogue, pc + len,
+						cycles, 0);
+				pc += len;
+				continue;
+			}
+
+			if(r == 6)
+			{
+				/* Read (HL) into dl. */
+				p = __gb_jit_addr_reg(p, PGB_JIT_HL);
+				p = __gb_jit_mem(p, epilogue, pc, PGB_JIT_READ);
+				/* mov dl, al */
+				PGB_E8(0x88); PGB_E8(0xC2);
+			}
+			else
+			{
+				/* mov dl, [r] */
+				PGB_E8(0x8A); PGB_EM(2, pgb_jit_r8[r]);
+			}
+
+			if(opcode < 0x80) /* LD r, r */
+			{
+				/* mov [r], dl */
+				PGB_E8(0x88); PGB_EM(2, pgb_jit_r8[d]);
+			}
+			else /* ALU A, r */
+				p = __gb_jit_alu(p, d);
+
+			break;
+		}
+
+		if(!done)
+			p = __gb_jit_cycles(p, cycles);
+
+		pc += len;
+	}
+
+finish:
+	if(count == 0)
+		return PGB_JIT_INTERPRET;
+
+	if(!done)
+		p = __gb_jit_exit(p, epilogue, pc);
+
+	/* Align the next block. */
+	jit->code_used = (p - jit->code + 15) & ~(size_t)15;
+
+	if(start >= WRAM_0_ADDR && start < ECHO_ADDR)
+		jit->wram_code[(start - WRAM_0_ADDR) >> 8] = true;
+	else if(start >= HRAM_ADDR)
+		jit->hram_code = true;
+
+	return (pgb_jit_block_fn)(uintptr_t)entry;
+}
+
+/**
+ * Internal function used to find the translated block at the current PC,
+ * translating it if required. Returns NULL or PGB_JIT_INTERPRET if the
+ * interpreter must be used.
+ */
+static pgb_jit_block_fn __gb_jit_lookup(struct gb_s *gb)
+{
+	struct gb_jit_s *jit = gb->jit;
+	const uint_fast16_t pc = gb->cpu_reg.pc.reg;
+	pgb_jit_block_fn *slot;
+	uint8_t *pages;
+	size_t pages_size;
+
+	if(pc < VRAM_ADDR)
+	{
+		uint_fast32_t key = pc;
+		uint_fast32_t i;
+
+		/* The boot ROM is not translated. */
+		if(pc < 0x0100 && gb->hram_io[IO_BOOT] == 0)
+			return NULL;
+
+		if(pc >= ROM_N_ADDR)
+		{
+			if(gb->mbc == 1 && gb->cart_mode_select)
+				key |= (uint_fast32_t)(gb->selected_rom_bank & 0x1F) << 16;
+			else
+				key |= (uint_fast32_t)gb->selected_rom_bank << 16;
+		}
+
+		i = (uint32_t)(key * 2654435761u) >> (32 - PGB_JIT_ROM_BITS);
+		while(jit->rom[i].fn != NULL)
+		{
+			if(jit->rom[i].key == key)
+				return jit->rom[i].fn;
+
+			i = (i + 1) & (PGB_JIT_ROM_BLOCKS - 1);
+		}
+
+		/* Keep the table sparse. */
+		if(jit->rom_count >= PGB_JIT_ROM_BLOCKS / 2)
+		{
+			__gb_jit_flush(jit);
+			i = (uint32_t)(key * 2654435761u) >> (32 - PGB_JIT_ROM_BITS);
+		}
+
+		jit->rom[i].key = key;
+		jit->rom_count++;
+		slot = &jit->rom[i].fn;
+	}
+	else if(pc >= WRAM_0_ADDR && pc < ECHO_ADDR)
+		slot = &jit->wram[pc - WRAM_0_ADDR];
+	else if(pc >= HRAM_ADDR && pc < INTR_EN_ADDR)
+		slot = &jit->hram[pc - HRAM_ADDR];
+	else
+		return NULL;
+
+	if(*slot != NULL)
+		return *slot;
+
+	if(jit->code_used + PGB_JIT_MAX_BLOCK_CODE > PGB_JIT_CODE_SIZE)
+	{
+		/* Start again once the buffer is full. The ROM slot is
+		 * reserved again afterwards. */
+		__gb_jit_flush(jit);
+		return __gb_jit_lookup(gb);
+	}
+
+	/* Only make the pages that the block may be written to writable, and
+	 * only whilst it is emitted. */
+	pages = jit->code + jit->code_used -
+		jit->code_used % PGB_JIT_PAGE_SIZE;
+	pages_size = jit->code + jit->code_used + PGB_JIT_MAX_BLOCK_CODE -
+		pages;
+
+	if(mprotect(pages, pages_size, PROT_READ | PROT_WRITE) != 0)
+		return NULL;
+
+	*slot = __gb_jit_compile(gb, pc);
+
+	if(mprotect(pages, pages_size, PROT_READ | PROT_EXEC) != 0)
+	{
+		/* None of the translated code can be executed. */
+		__gb_jit_flush(jit);
+		return NULL;
+	}
+
+	return *slot;
+}
+
+/**
+ * Internal function used to execute a translated block, or a single
+ * instruction with the interpreter if there is no translated block.
+ */
+static void __gb_jit_step(struct gb_s *gb)
+{
+	pgb_jit_block_fn fn;
+	uint32_t cycles;
+
+	/* Interrupts and HALT are handled by the interpreter. */
+	if(gb->gb_halt || (gb->gb_ime &&
+			gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & ANY_INTR))
+		goto interpret;
+
+	fn = __gb_jit_lookup(gb);
+	if(fn == NULL || fn == PGB_JIT_INTERPRET)
+		goto interpret;
+
+	/* Translated code uses F directly. */
+	PGB_FLAGS_SYNC();
+	cycles = fn(gb, __gb_jit_budget(gb));
+	/* The block was left before its first instruction. */
+	if(cycles == 0)
+		goto interpret;
+
+	__gb_tick(gb, cycles);
+	return;
+
+interpret:
+	__gb_execute(gb, true);
+}
+
+#undef PGB_E8
+#undef PGB_E16
+#undef PGB_E32
+#undef PGB_E64
+#undef PGB_EM
+
+int gb_jit_init(struct gb_s *gb)
+{
+	struct gb_jit_s *jit;
+	void *code;
+	uint_fast16_t i;
+
+	code = mmap(NULL, PGB_JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(code == MAP_FAILED)
+		return -1;
+
+	jit = calloc(1, sizeof(*jit));
+	/* Fail now if the host does not allow the buffer to be executable. */
+	if(jit == NULL || mprotect(code, PGB_JIT_CODE_SIZE,
+			PROT_READ | PROT_EXEC) != 0)
+	{
+		free(jit);
+		munmap(code, PGB_JIT_CODE_SIZE);
+		return -1;
+	}
+
+	jit->code = code;
+
+	/* LAHF stores SF:ZF:0:AF:0:PF:1:CF. */
+	for(i = 0; i < 0x100; i++)
+	{
+		jit->lahf_to_f[i] = ((i & 0x40) ? 0x80 : 0) |
+			((i & 0x10) ? 0x20 : 0) | ((i & 0x01) ? 0x10 : 0);
+	}
+
+	gb->jit = jit;
+#if PEANUT_GB_USE_MEMORY_MAP
+	__gb_update_memory_map(gb);
+#endif
+	return 0;
+}
+
+void gb_jit_free(struct gb_s *gb)
+{
+	if(gb->jit == NULL)
+		return;
+
+	munmap(gb->jit->code, PGB_JIT_CODE_SIZE);
+	free(gb->jit);
+	gb->jit = NULL;
+#if PEANUT_GB_USE_MEMORY_MAP
+	__gb_update_memory_map(gb);
+#endif
+}
+#endif
+
+/**
+ * Internal function used to step the CPU. When the JIT is used, a whole
+ * translated block may be executed.
+ */
+void __gb_step_cpu(struct gb_s *gb)
+{
+	/* If halted, run until an interrupt or the end of the frame. */
+	gb->run.mask = GB_RUN_FRAME;
+	gb->run.events = 0;
+	gb->run.stop = false;
+
+#if PEANUT_GB_JIT
+	if(gb->jit != NULL)
+		__gb_jit_step(gb);
+	else
+#endif
+		__gb_execute(gb, true);
+
+	PGB_FLAGS_SYNC();
+}
+
+/**
+ * Internal function used to run until an event in mask occurs, or until the
+ * given number of cycles has passed if cycles is not 0.
+ *
+ * \returns	Number of cycles that were run.
+ */
+static uint_fast32_t __gb_run(struct gb_s *gb, const uint_fast8_t mask,
+		const uint_fast32_t cycles)
+{
+	const uint64_t start = gb->counter.cycles;
+
+	gb->run.mask = mask;
+	gb->run.events = 0;
+	gb->run.stop = false;
+
+	if(cycles != 0)
+		__gb_schedule(gb, GB_EVENT_STOP, start + cycles);
+
+	if((mask & GB_RUN_BREAKPOINT) && gb->run.breakpoints != NULL)
+	{
+		/* Breakpoints are checked after each instruction, so that
+		 * a run may start at a breakpoint. */
+		do
+		{
+			uint_fast16_t pc;
+
+			__gb_execute(gb, true);
+			pc = gb->cpu_reg.pc.reg;
+
+			if(gb->run.breakpoints[pc >> 3] & (1 << (pc & 7)))
+				__gb_run_event(gb, GB_RUN_BREAKPOINT);
+		} while(!gb->run.stop);
+	}
+#if PEANUT_GB_JIT
+	else if(gb->jit != NULL)
+	{
+		while(!gb->run.stop)
+			__gb_jit_step(gb);
+	}
+#endif
+	else
+	{
+#if PEANUT_GB_THREADED_DISPATCH
+		__gb_execute(gb, false);
+#else
+		while(!gb->run.stop)
+			__gb_execute(gb, true);
+#endif
+	}
+
+	/* Remove the deadline if another event ended the run first. */
+	if(gb->counter.event[GB_EVENT_STOP] != UINT64_MAX)
+		__gb_schedule(gb, GB_EVENT_STOP, UINT64_MAX);
+
+	PGB_FLAGS_SYNC();
+
+	return (uint_fast32_t)(gb->counter.cycles - start);
+}
+
+void gb_run_frame(struct gb_s *gb)
+{
+	gb->gb_frame = false;
+	__gb_run(gb, GB_RUN_FRAME, 0);
+}
+
+uint_fast32_t gb_run_cycles(struct gb_s *gb, const uint_fast32_t cycles)
+{
+	if(cycles == 0)
+		return 0;
+
+	return __gb_run(gb, 0, cycles);
+}
+
+uint_fast32_t gb_run_until(struct gb_s *gb, const uint_fast8_t events)
+{
+	return __gb_run(gb, events & ~GB_RUN_CYCLES, 0);
+}
+
+void gb_set_breakpoints(struct gb_s *gb, const uint8_t *breakpoints)
+{
+	gb->run.breakpoints = breakpoints;
+}
+
+int gb_get_save_size_s(struct gb_s *gb, size_t *ram_size)
+{
+	const uint_fast16_t ram_size_location = 0x0149;
+	const uint_fast32_t ram_sizes[] =
+	{
+		/* 0,  2KiB,   8KiB,  32KiB,  128KiB,   64KiB */
+		0x00, 0x800, 0x2000, 0x8000, 0x20000, 0x10000
+	};
+	uint8_t ram_size_code = gb->gb_rom_read(gb, ram_size_location);
+
+	/* MBC2 always has 512 half-bytes of cart RAM.
+	 * This assumes that only the lower nibble of each byte is used; the
+	 * nibbles are not packed. */
+	if(gb->mbc == 2)
+	{
+		*ram_size = 0x200;
+		return 0;
+	}
+
+	/* Return -1 on invalid or unsupported RAM size. */
+	if(ram_size_code >= PEANUT_GB_ARRAYSIZE(ram_sizes))
+		return -1;
+
+	*ram_size = ram_sizes[ram_size_code];
+	return 0;
+}
+
+PGB_DEPRECATED("Does not return error code. Use gb_get_save_size_s instead.")
+uint_fast32_t gb_get_save_size(struct gb_s *gb)
+{
+	const uint_fast16_t ram_size_location = 0x0149;
+	const uint_fast32_t ram_sizes[] =
+	{
+		/* 0,  2KiB,   8KiB,  32KiB,  128KiB,   64KiB */
+		0x00, 0x800, 0x2000, 0x8000, 0x20000, 0x10000
+	};
+	uint8_t ram_size_code = gb->gb_rom_read(gb, ram_size_location);
+
+	/* MBC2 always has 512 half-bytes of cart RAM.
+	 * This assumes that only the lower nibble of each byte is used; the
+	 * nibbles are not packed. */
+	if(gb->mbc == 2)
+		return 0x200;
+
+	/* Return 0 on invalid or unsupported RAM size. */
+	if(ram_size_code >= PEANUT_GB_ARRAYSIZE(ram_sizes))
+		return 0;
+
+	return ram_sizes[ram_size_code];
+}
+
+void gb_init_serial(struct gb_s *gb,
+		    void (*gb_serial_tx)(struct gb_s*, const uint8_t),
+		    enum gb_serial_rx_ret_e (*gb_serial_rx)(struct gb_s*,
+			    uint8_t*))
+{
+	gb->gb_serial_tx = gb_serial_tx;
+	gb->gb_serial_rx = gb_serial_rx;
+}
+
+void gb_init_audio(struct gb_s *gb,
+		uint8_t (*gb_audio_read)(struct gb_s*, const uint_fast16_t),
+		void (*gb_audio_write)(struct gb_s*, const uint_fast16_t,
+			const uint8_t))
+{
+	gb->gb_audio_read = gb_audio_read;
+	gb->gb_audio_write = gb_audio_write;
+}
+
+void gb_init_audio_state(struct gb_s *gb, size_t size,
+		void (*gb_audio_state_save)(struct gb_s*, void *),
+		void (*gb_audio_state_load)(struct gb_s*, const void *))
+{
+	gb->gb_audio_state_size = size;
+	gb->gb_audio_state_save = gb_audio_state_save;
+	gb->gb_audio_state_load = gb_audio_state_load;
+}
+
+uint8_t gb_colour_hash(struct gb_s *gb)
+{
+#define ROM_TITLE_START_ADDR	0x0134
+#define ROM_TITLE_END_ADDR	0x0143
+
+	uint8_t x = 0;
+	uint16_t i;
+
+	for(i = ROM_TITLE_START_ADDR; i <= ROM_TITLE_END_ADDR; i++)
+		x += gb->gb_rom_read(gb, i);
+
+	return x;
+}
+
+uint8_t gb_get_io(const struct gb_s *gb, const uint_fast8_t reg)
+{
+	/* Work out DIV and TIMA as the game would read them, without bringing
+	 * them up to date. */
+	if(reg == IO_DIV)
+		return (uint8_t)((gb->counter.cycles - gb->counter.div_start) /
+				DIV_CYCLES);
+
+	if(reg == IO_TIMA && (gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK))
+	{
+		const uint_fast16_t period =
+			TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK];
+		uint_fast32_t count = gb->counter.tima_count +
+			(uint_fast32_t)(gb->counter.cycles -
+					gb->counter.tima_sync);
+		uint8_t tima = gb->hram_io[IO_TIMA];
+
+		for(; count >= period; count -= period)
+		{
+			if(++tima == 0)
+				tima = gb->hram_io[IO_TMA];
+		}
+
+		return tima;
+	}
+
+	return gb->hram_io[reg];
+}
+
+#if PEANUT_GB_IDLE_LOOP_SKIP
+uint64_t gb_get_idle_cycles(const struct gb_s *gb)
+{
+	return gb->idle.skipped;
+}
+#endif
+
+/* Version of the save state layout. Increment whenever the layout changes. */
+#define PGB_STATE_VERSION	3
+
+/* Size in bytes of the fields of struct pgb_state_s as they are stored. */
+#define PGB_STATE_HEADER_SIZE	(122 + 8 * GB_EVENT_MAX)
+
+/**
+ * Fields at the start of a save state, which are followed by WRAM, VRAM, OAM,
+ * HRAM and the I/O registers, then the cart RAM if it was saved, and then the
+ * APU state if it was saved. Each field is stored in the order given here,
+ * little endian and without padding, by __gb_state_encode(), so that the
+ * layout does not depend on the ABI of the host. The APU state is stored as
+ * it was given by the front-end.
+ */
+struct pgb_state_s
+{
+	uint8_t magic[4];	/* "PGBS" */
+	uint16_t version;	/* PGB_STATE_VERSION */
+	uint16_t flags;		/* enum gb_state_flags_e */
+	uint32_t size;		/* Size of the whole save state */
+	uint32_t cart_ram_size;	/* 0 if the cart RAM was not saved */
+	uint32_t apu_size;	/* 0 if the APU state was not saved */
+
+	uint64_t cycles;
+	uint64_t event[GB_EVENT_MAX];
+	uint64_t lcd_start;
+	uint64_t div_start;
+	uint64_t tima_sync;
+	uint64_t serial_sync;
+	uint64_t rtc_sync;
+	uint32_t rtc_count;
+	uint32_t lcd_off_count;
+	uint16_t tima_count;
+	uint16_t serial_count;
+
+	uint16_t af, bc, de, hl, sp, pc;
+	uint16_t selected_rom_bank;
+	uint8_t cart_ram_bank;
+	uint8_t enable_cart_ram;
+	uint8_t cart_mode_select;
+	uint8_t rtc_latched[5];
+	uint8_t rtc_real[5];
+
+	/* Bit 0: HALT, bit 1: IME, bit 2: LCD blank, bit 3: interlace
+	 * count. */
+	uint8_t bits;
+	uint8_t bg_palette[4];
+	uint8_t sp_palette[8];
+	uint8_t window_clear;
+	uint8_t WY;
+};
+
+/**
+ * Internal function used to store the lowest bytes of a value little endian.
+ * Returns the position after the stored value.
+ */
+static uint8_t *__gb_state_put(uint8_t *p, uint64_t val, const unsigned bytes)
+{
+	for(unsigned i = 0; i < bytes; i++, val >>= 8)
+		p[i] = val & 0xFF;
+
+	return p + bytes;
+}
+
+/**
+ * Internal function used to read a little endian value of the given number of
+ * bytes, and to move the position past it.
+ */
+static uint64_t __gb_state_get(const uint8_t **p, const unsigned bytes)
+{
+	uint64_t val = 0;
+
+	for(unsigned i = bytes; i != 0; i--)
+		val = (val << 8) | (*p)[i - 1];
+
+	*p += bytes;
+	return val;
+}
+
+/**
+ * Internal function used to store the fields of a save state. Exactly
+ * PGB_STATE_HEADER_SIZE bytes are written to p.
+ */
+static void __gb_state_encode(uint8_t *p, const struct pgb_state_s *s)
+{
+	memcpy(p, s->magic, sizeof(s->magic));
+	p += sizeof(s->magic);
+	p = __gb_state_put(p, s->version, 2);
+	p = __gb_state_put(p, s->flags, 2);
+	p = __gb_state_put(p, s->size, 4);
+	p = __gb_state_put(p, s->cart_ram_size, 4);
+	p = __gb_state_put(p, s->apu_size, 4);
+
+	p = __gb_state_put(p, s->cycles, 8);
+	for(unsigned i = 0; i < GB_EVENT_MAX; i++)
+		p = __gb_state_put(p, s->event[i], 8);
+	p = __gb_state_put(p, s->lcd_start, 8);
+	p = __gb_state_put(p, s->div_start, 8);
+	p = __gb_state_put(p, s->tima_sync, 8);
+	p = __gb_state_put(p, s->serial_sync, 8);
+	p = __gb_state_put(p, s->rtc_sync, 8);
+	p = __gb_state_put(p, s->rtc_count, 4);
+	p = __gb_state_put(p, s->lcd_off_count, 4);
+	p = __gb_state_put(p, s->tima_count, 2);
+	p = __gb_state_put(p, s->serial_count, 2);
+
+	p = __gb_state_put(p, s->af, 2);
+	p = __gb_state_put(p, s->bc, 2);
+	p = __gb_state_put(p, s->de, 2);
+	p = __gb_state_put(p, s->hl, 2);
+	p = __gb_state_put(p, s->sp, 2);
+	p = __gb_state_put(p, s->pc, 2);
+	p = __gb_state_put(p, s->selected_rom_bank, 2);
+	*p++ = s->cart_ram_bank;
+	*p++ = s->enable_cart_ram;
+	*p++ = s->cart_mode_select;
+	memcpy(p, s->rtc_latched, sizeof(s->rtc_latched));
+	p += sizeof(s->rtc_latched);
+	memcpy(p, s->rtc_real, sizeof(s->rtc_real));
+	p += sizeof(s->rtc_real);
+
+	*p++ = s->bits;
+	memcpy(p, s->bg_palette, sizeof(s->bg_palette));
+	p += sizeof(s->bg_palette);
+	memcpy(p, s->sp_palette, sizeof(s->sp_palette));
+	p += sizeof(s->sp_palette);
+	*p++ = s->window_clear;
+	*p = s->WY;
+}
+
+/**
+ * Internal function used to read the fields of a save state from the
+ * PGB_STATE_HEADER_SIZE bytes at p.
+ */
+static void __gb_state_decode(struct pgb_state_s *s, const uint8_t *p)
+{
+	memcpy(s->magic, p, sizeof(s->magic));
+	p += sizeof(s->magic);
+	s->version = __gb_state_get(&p, 2);
+	s->flags = __gb_state_get(&p, 2);
+	s->size = __gb_state_get(&p, 4);
+	s->cart_ram_size = __gb_state_get(&p, 4);
+	s->apu_size = __gb_state_get(&p, 4);
+
+	s->cycles = __gb_state_get(&p, 8);
+	for(unsigned i = 0; i < GB_EVENT_MAX; i++)
+		s->event[i] = __gb_state_get(&p, 8);
+	s->lcd_start = __gb_state_get(&p, 8);
+	s->div_start = __gb_state_get(&p, 8);
+	s->tima_sync = __gb_state_get(&p, 8);
+	s->serial_sync = __gb_state_get(&p, 8);
+	s->rtc_sync = __gb_state_get(&p, 8);
+	s->rtc_count = __gb_state_get(&p, 4);
+	s->lcd_off_count = __gb_state_get(&p, 4);
+	s->tima_count = __gb_state_get(&p, 2);
+	s->serial_count = __gb_state_get(&p, 2);
+
+	s->af = __gb_state_get(&p, 2);
+	s->bc = __gb_state_get(&p, 2);
+	s->de = __gb_state_get(&p, 2);
+	s->hl = __gb_state_get(&p, 2);
+	s->sp = __gb_state_get(&p, 2);
+	s->pc = __gb_state_get(&p, 2);
+	s->selected_rom_bank = __gb_state_get(&p, 2);
+	s->cart_ram_bank = *p++;
+	s->enable_cart_ram = *p++;
+	s->cart_mode_select = *p++;
+	memcpy(s->rtc_latched, p, sizeof(s->rtc_latched));
+	p += sizeof(s->rtc_latched);
+	memcpy(s->rtc_real, p, sizeof(s->rtc_real));
+	p += sizeof(s->rtc_real);
+
+	s->bits = *p++;
+	memcpy(s->bg_palette, p, sizeof(s->bg_palette));
+	p += sizeof(s->bg_palette);
+	memcpy(s->sp_palette, p, sizeof(s->sp_palette));
+	p += sizeof(s->sp_palette);
+	s->window_clear = *p++;
+	s->WY = *p;
+}
+
+/**
+ * Internal function used to obtain the size of the APU state that is saved in
+ * a save state.
+ */
+static size_t __gb_state_apu_size(struct gb_s *gb, const unsigned flags)
+{
+	if(!(flags & GB_STATE_APU) || gb->gb_audio_state_save == NULL)
+		return 0;
+
+	return gb->gb_audio_state_size;
+}
+
+/**
+ * Internal function used to obtain the size of the cart RAM that is saved in a
+ * save state.
+ */
+static size_t __gb_state_cart_ram_size(struct gb_s *gb, const unsigned flags)
+{
+	size_t size = 0;
+
+	if(!(flags & GB_STATE_CART_RAM) || !gb->cart_ram ||
+			gb_get_save_size_s(gb, &size) != 0)
+		return 0;
+
+	return size;
+}
+
+size_t gb_state_size(struct gb_s *gb, const unsigned flags)
+{
+	return PGB_STATE_HEADER_SIZE + WRAM_SIZE + VRAM_SIZE + OAM_SIZE +
+		HRAM_IO_SIZE + __gb_state_cart_ram_size(gb, flags) +
+		__gb_state_apu_size(gb, flags);
+}
+
+size_t gb_state_save(struct gb_s *gb, void *buf, const unsigned flags)
+{
+	struct pgb_state_s s;
+	uint8_t *p = buf;
+	const size_t cart_ram_size = __gb_state_cart_ram_size(gb, flags);
+	const size_t apu_size = __gb_state_apu_size(gb, flags);
+	size_t size;
+
+#if PEANUT_GB_LAZY_FLAGS
+	if(gb->lazy_flags.op != PGB_LAZY_NONE)
+		__gb_flags_sync(gb);
+#endif
 
-	case 0xE8: /* ADD SP, imm */
+	memcpy(s.magic, "PGBS", sizeof(s.magic));
+	s.version = PGB_STATE_VERSION;
+	s.flags = (cart_ram_size != 0 ? GB_STATE_CART_RAM : 0) |
+		(apu_size != 0 ? GB_STATE_APU : 0);
+	s.size = size = gb_state_size(gb, s.flags);
+	s.cart_ram_size = cart_ram_size;
+	s.apu_size = apu_size;
+
+	s.cycles = gb->counter.cycles;
+	memcpy(s.event, gb->counter.event, sizeof(s.event));
+	s.lcd_start = gb->counter.lcd_start;
+	s.div_start = gb->counter.div_start;
+	s.tima_sync = gb->counter.tima_sync;
+	s.serial_sync = gb->counter.serial_sync;
+	s.rtc_sync = gb->counter.rtc_sync;
+	s.rtc_count = gb->counter.rtc_count;
+	s.lcd_off_count = gb->counter.lcd_off_count;
+	s.tima_count = gb->counter.tima_count;
+	s.serial_count = gb->counter.serial_count;
+
+	s.af = (gb->cpu_reg.a << 8) | gb->cpu_reg.f.reg;
+	s.bc = gb->cpu_reg.bc.reg;
+	s.de = gb->cpu_reg.de.reg;
+	s.hl = gb->cpu_reg.hl.reg;
+	s.sp = gb->cpu_reg.sp.reg;
+	s.pc = gb->cpu_reg.pc.reg;
+	s.selected_rom_bank = gb->selected_rom_bank;
+	s.cart_ram_bank = gb->cart_ram_bank;
+	s.enable_cart_ram = gb->enable_cart_ram;
+	s.cart_mode_select = gb->cart_mode_select;
+	memcpy(s.rtc_latched, gb->rtc_latched.bytes, sizeof(s.rtc_latched));
+	memcpy(s.rtc_real, gb->rtc_real.bytes, sizeof(s.rtc_real));
+
+	s.bits = gb->gb_halt | (gb->gb_ime << 1) | (gb->lcd_blank << 2)
+#if ENABLE_LCD
+		| (gb->display.interlace_count << 3)
+#endif
+		;
+	memcpy(s.bg_palette, gb->display.bg_palette, sizeof(s.bg_palette));
+	memcpy(s.sp_palette, gb->display.sp_palette, sizeof(s.sp_palette));
+	s.window_clear = gb->display.window_clear;
+	s.WY = gb->display.WY;
+
+	__gb_state_encode(p, &s);
+	p += PGB_STATE_HEADER_SIZE;
+	memcpy(p, gb->wram, WRAM_SIZE);
+	p += WRAM_SIZE;
+	memcpy(p, gb->vram, VRAM_SIZE);
+	p += VRAM_SIZE;
+	memcpy(p, gb->oam, OAM_SIZE);
+	p += OAM_SIZE;
+	memcpy(p, gb->hram_io, HRAM_IO_SIZE);
+	p += HRAM_IO_SIZE;
+
+	if(cart_ram_size != 0 && gb->mem.cart_ram != NULL &&
+			gb->mem.cart_ram_size >= cart_ram_size)
+		memcpy(p, gb->mem.cart_ram, cart_ram_size);
+	else
 	{
-		int8_t offset = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
-		gb->cpu_reg.f.f_bits.c = ((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF);
-		gb->cpu_reg.sp.reg += offset;
-		break;
+		for(size_t i = 0; i < cart_ram_size; i++)
+			p[i] = gb->gb_cart_ram_read(gb, i);
 	}
+	p += cart_ram_size;
 
-	case 0xE9: /* JP (HL) */
-		gb->cpu_reg.pc.reg = gb->cpu_reg.hl.reg;
-		break;
+	if(apu_size != 0)
+		gb->gb_audio_state_save(gb, p);
 
-	case 0xEA: /* LD (imm), A */
-	{
-		uint8_t h, l;
-		uint16_t addr;
-		l = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		h = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		addr = PEANUT_GB_U8_TO_U16(h, l);
-		__gb_write(gb, addr, gb->cpu_reg.a);
-		break;
-	}
+	return size;
+}
 
-	case 0xEE: /* XOR imm */
-		PGB_INSTR_XOR_R8(__gb_read(gb, gb->cpu_reg.pc.reg++));
-		break;
+enum gb_state_error_e gb_state_load(struct gb_s *gb, const void *buf,
+		const size_t size)
+{
+	struct pgb_state_s s;
+	const uint8_t *p = buf;
 
-	case 0xEF: /* RST 0x0028 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0028;
-		break;
+	if(size < PGB_STATE_HEADER_SIZE)
+		return GB_STATE_INVALID;
 
-	case 0xF0: /* LD A, (0xFF00+imm) */
-		gb->cpu_reg.a =
-			__gb_read(gb, 0xFF00 | __gb_read(gb, gb->cpu_reg.pc.reg++));
-		break;
+	__gb_state_decode(&s, p);
 
-	case 0xF1: /* POP AF */
-	{
-		uint8_t temp_8 = __gb_read(gb, gb->cpu_reg.sp.reg++);
-		gb->cpu_reg.f.f_bits.z = (temp_8 >> 7) & 1;
-		gb->cpu_reg.f.f_bits.n = (temp_8 >> 6) & 1;
-		gb->cpu_reg.f.f_bits.h = (temp_8 >> 5) & 1;
-		gb->cpu_reg.f.f_bits.c = (temp_8 >> 4) & 1;
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.sp.reg++);
-		break;
-	}
+	if(memcmp(s.magic, "PGBS", sizeof(s.magic)) != 0)
+		return GB_STATE_INVALID;
 
-	case 0xF2: /* LD A, (C) */
-		gb->cpu_reg.a = __gb_read(gb, 0xFF00 | gb->cpu_reg.bc.bytes.c);
-		break;
+	if(s.version != PGB_STATE_VERSION)
+		return GB_STATE_VERSION;
 
-	case 0xF3: /* DI */
-		gb->gb_ime = false;
-		break;
+	if(s.cart_ram_size != __gb_state_cart_ram_size(gb, s.flags))
+		return GB_STATE_CART_RAM_SIZE;
 
-	case 0xF5: /* PUSH AF */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.a);
-		__gb_write(gb, --gb->cpu_reg.sp.reg,
-			   gb->cpu_reg.f.f_bits.z << 7 | gb->cpu_reg.f.f_bits.n << 6 |
-			   gb->cpu_reg.f.f_bits.h << 5 | gb->cpu_reg.f.f_bits.c << 4);
-		break;
+	/* The APU state is skipped if no APU was given to restore it to. */
+	if(s.apu_size != 0 && gb->gb_audio_state_load != NULL &&
+			s.apu_size != gb->gb_audio_state_size)
+		return GB_STATE_APU_SIZE;
 
-	case 0xF6: /* OR imm */
-		PGB_INSTR_OR_R8(__gb_read(gb, gb->cpu_reg.pc.reg++));
-		break;
+	if(s.size != gb_state_size(gb, s.flags & ~GB_STATE_APU) + s.apu_size ||
+			size < s.size)
+		return GB_STATE_INVALID;
 
-	case 0xF7: /* PUSH AF */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0030;
-		break;
+	p += PGB_STATE_HEADER_SIZE;
+	memcpy(gb->wram, p, WRAM_SIZE);
+	p += WRAM_SIZE;
+	memcpy(gb->vram, p, VRAM_SIZE);
+	p += VRAM_SIZE;
+	memcpy(gb->oam, p, OAM_SIZE);
+	p += OAM_SIZE;
+	memcpy(gb->hram_io, p, HRAM_IO_SIZE);
+	p += HRAM_IO_SIZE;
 
-	case 0xF8: /* LD HL, SP+/-imm */
+	if(s.cart_ram_size != 0 && gb->mem.cart_ram != NULL &&
+			gb->mem.cart_ram_size >= s.cart_ram_size)
+		memcpy(gb->mem.cart_ram, p, s.cart_ram_size);
+	else
 	{
-		/* Taken from SameBoy, which is released under MIT Licence. */
-		int8_t offset = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.hl.reg = gb->cpu_reg.sp.reg + offset;
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
-		gb->cpu_reg.f.f_bits.c = ((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF) ? 1 : 0;
-		break;
+		for(size_t i = 0; i < s.cart_ram_size; i++)
+			gb->gb_cart_ram_write(gb, i, p[i]);
 	}
+	p += s.cart_ram_size;
+
+	if(s.apu_size != 0 && gb->gb_audio_state_load != NULL)
+		gb->gb_audio_state_load(gb, p);
+
+	gb->counter.cycles = s.cycles;
+	memcpy(gb->counter.event, s.event, sizeof(s.event));
+	gb->counter.lcd_start = s.lcd_start;
+	gb->counter.div_start = s.div_start;
+	gb->counter.tima_sync = s.tima_sync;
+	gb->counter.serial_sync = s.serial_sync;
+	gb->counter.rtc_sync = s.rtc_sync;
+	gb->counter.rtc_count = s.rtc_count;
+	gb->counter.lcd_off_count = s.lcd_off_count;
+	gb->counter.tima_count = s.tima_count;
+	gb->counter.serial_count = s.serial_count;
+	/* The budget of the run that saved the state does not apply. */
+	__gb_schedule(gb, GB_EVENT_STOP, UINT64_MAX);
+
+	gb->cpu_reg.a = s.af >> 8;
+	gb->cpu_reg.f.reg = s.af & 0xFF;
+	gb->cpu_reg.bc.reg = s.bc;
+	gb->cpu_reg.de.reg = s.de;
+	gb->cpu_reg.hl.reg = s.hl;
+	gb->cpu_reg.sp.reg = s.sp;
+	gb->cpu_reg.pc.reg = s.pc;
+#if PEANUT_GB_LAZY_FLAGS
+	gb->lazy_flags.op = PGB_LAZY_NONE;
+#endif
+	gb->selected_rom_bank = s.selected_rom_bank;
+	gb->cart_ram_bank = s.cart_ram_bank;
+	gb->enable_cart_ram = s.enable_cart_ram;
+	gb->cart_mode_select = s.cart_mode_select;
+	memcpy(gb->rtc_latched.bytes, s.rtc_latched, sizeof(s.rtc_latched));
+	memcpy(gb->rtc_real.bytes, s.rtc_real, sizeof(s.rtc_real));
+
+	gb->gb_halt = s.bits & 0x01;
+	gb->gb_ime = (s.bits >> 1) & 0x01;
+	gb->lcd_blank = (s.bits >> 2) & 0x01;
+	gb->gb_frame = false;
+	memcpy(gb->display.bg_palette, s.bg_palette, sizeof(s.bg_palette));
+	memcpy(gb->display.sp_palette, s.sp_palette, sizeof(s.sp_palette));
+	gb->display.window_clear = s.window_clear;
+	gb->display.WY = s.WY;
 
-	case 0xF9: /* LD SP, HL */
-		gb->cpu_reg.sp.reg = gb->cpu_reg.hl.reg;
-		break;
-
-	case 0xFA: /* LD A, (imm) */
+	/* Anything worked out from the memory that was replaced must be worked
+	 * out again. */
+#if ENABLE_LCD
+	gb->display.interlace_count = (s.bits >> 3) & 0x01;
+#endif
+#if ENABLE_LCD && PEANUT_GB_TILE_CACHE
+	memset(gb->tile_cache.dirty, 0xFF, sizeof(gb->tile_cache.dirty));
+#endif
+#if PEANUT_GB_SPRITE_BUCKETS
+	gb->sprite_lines.dirty = true;
+#endif
+#if PEANUT_GB_SKIP_UNCHANGED_LINES
+	memset(gb->line_change.hash, 0, sizeof(gb->line_change.hash));
+#endif
+#if PEANUT_GB_IDLE_LOOP_SKIP
 	{
-		uint8_t h, l;
-		uint16_t addr;
-		l = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		h = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		addr = PEANUT_GB_U8_TO_U16(h, l);
-		gb->cpu_reg.a = __gb_read(gb, addr);
-		break;
-	}
+		const uint64_t skipped = gb->idle.skipped;
 
-	case 0xFB: /* EI */
-		gb->gb_ime = true;
-		break;
+		memset(&gb->idle, 0, sizeof(gb->idle));
+		gb->idle.skipped = skipped;
+	}
+#endif
+#if PEANUT_GB_JIT
+	/* Code in ROM is unchanged, so only code in RAM is discarded. */
+	if(gb->jit != NULL)
+	{
+		for(uint_fast16_t addr = WRAM_0_ADDR; addr < ECHO_ADDR;
+				addr += 0x100)
+			__gb_jit_invalidate(gb, addr);
 
-	case 0xFE: /* CP imm */
+		__gb_jit_invalidate(gb, HRAM_ADDR);
+	}
+#endif
+#if PEANUT_GB_PREDECODE
+	if(gb->predecode != NULL)
 	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		PGB_INSTR_CP_R8(val);
-		break;
+		memset(gb->predecode->wram, 0, sizeof(gb->predecode->wram));
+		memset(gb->predecode->hram, 0, sizeof(gb->predecode->hram));
 	}
+#endif
+#if PEANUT_GB_USE_MEMORY_MAP
+	__gb_update_memory_map(gb);
+#endif
 
-	case 0xFF: /* RST 0x0038 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0038;
-		break;
+	return GB_STATE_NO_ERROR;
+}
+#undef PGB_STATE_VERSION
+#undef PGB_STATE_HEADER_SIZE
 
-	default:
-		/* Return address where invalid opcode that was read. */
-		(gb->gb_error)(gb, GB_INVALID_OPCODE, gb->cpu_reg.pc.reg - 1);
-		PGB_UNREACHABLE();
-	}
+#if PEANUT_GB_REWIND
+/* Location of a compressed snapshot in the rewind buffer. */
+struct gb_rewind_entry_s
+{
+	size_t offset;
+	size_t size;
+	uint_fast32_t seq;
+	bool keyframe;
+};
 
-	do
-	{
-		/* DIV register timing */
-		gb->counter.div_count += inst_cycles;
-		while(gb->counter.div_count >= DIV_CYCLES)
-		{
-			gb->hram_io[IO_DIV]++;
-			gb->counter.div_count -= DIV_CYCLES;
-		}
+struct gb_rewind_s
+{
+	size_t state_size;
+	unsigned keyframe_interval;
+	/* Snapshots saved since the newest keyframe. */
+	unsigned since_key;
+	/* Number of the newest keyframe, counted from the first snapshot. */
+	uint_fast32_t key_seq;
+	uint_fast32_t next_seq;
+
+	/* Uncompressed state of the newest keyframe. */
+	uint8_t *key;
+	/* State that is being saved or restored. */
+	uint8_t *state;
+	/* State of zeros that keyframes are compared to. */
+	uint8_t *zero;
+	/* Snapshot that is being compressed. */
+	uint8_t *packed;
+
+	/* Compressed snapshots, oldest first from entry[first]. */
+	uint8_t *buf;
+	size_t buf_size;
+	size_t head;
+	struct gb_rewind_entry_s *entry;
+	unsigned frames;
+	unsigned first;
+	unsigned count;
+};
 
-		/* Check for RTC tick. */
-		if(gb->mbc == 3 && (gb->rtc_real.reg.high & 0x40) == 0)
-		{
-			gb->counter.rtc_count += inst_cycles;
-			while(PGB_UNLIKELY(gb->counter.rtc_count >= RTC_CYCLES))
-			{
-				gb->counter.rtc_count -= RTC_CYCLES;
+/* Largest size of a compressed snapshot of n bytes. */
+#define PGB_REWIND_PACKED_MAX(n)	((n) + (n) / 128 + 4)
+/* Parts of the emulator saved in each snapshot. */
+#define PGB_REWIND_STATE_FLAGS		(GB_STATE_CART_RAM | GB_STATE_APU)
 
-				/* Detect invalid rollover. */
-				if(PGB_UNLIKELY(gb->rtc_real.reg.sec == 63))
-				{
-					gb->rtc_real.reg.sec = 0;
-					continue;
-				}
+/**
+ * Internal function used to compress the difference between two states.
+ * Runs of up to 32767 unchanged bytes are stored in two bytes, and changed
+ * bytes as literals of up to 128 bytes XORed with the old state.
+ */
+static size_t __gb_rewind_pack(uint8_t *out, const uint8_t *cur,
+		const uint8_t *old, const size_t n)
+{
+	size_t i = 0, o = 0;
 
-				if(++gb->rtc_real.reg.sec != 60)
-					continue;
+	while(i < n)
+	{
+		size_t run = i;
 
-				gb->rtc_real.reg.sec = 0;
-				if(gb->rtc_real.reg.min == 63)
-				{
-					gb->rtc_real.reg.min = 0;
-					continue;
-				}
-				if(++gb->rtc_real.reg.min != 60)
-					continue;
+		/* Skip over unchanged memory a word at a time. */
+		while(run + 8 <= n)
+		{
+			uint64_t a, b;
 
-				gb->rtc_real.reg.min = 0;
-				if(gb->rtc_real.reg.hour == 31)
-				{
-					gb->rtc_real.reg.hour = 0;
-					continue;
-				}
-				if(++gb->rtc_real.reg.hour != 24)
-					continue;
+			memcpy(&a, cur + run, sizeof(a));
+			memcpy(&b, old + run, sizeof(b));
+			if(a != b)
+				break;
 
-				gb->rtc_real.reg.hour = 0;
-				if(++gb->rtc_real.reg.yday != 0)
-					continue;
+			run += 8;
+		}
 
-				if(gb->rtc_real.reg.high & 1)  /* Bit 8 of days*/
-					gb->rtc_real.reg.high |= 0x80; /* Overflow bit */
+		while(run < n && cur[run] == old[run])
+			run++;
 
-				gb->rtc_real.reg.high ^= 1;
-			}
-		}
+		run -= i;
+		i += run;
 
-		/* Check serial transmission. */
-		if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
+		while(run != 0)
 		{
-			/* If new transfer, call TX function. */
-			if(gb->counter.serial_count == 0 &&
-				gb->gb_serial_tx != NULL)
-				(gb->gb_serial_tx)(gb, gb->hram_io[IO_SB]);
-
-			gb->counter.serial_count += inst_cycles;
+			const size_t len = run < 0x7FFF ? run : 0x7FFF;
 
-			/* If it's time to receive byte, call RX function. */
-			if(gb->counter.serial_count >= SERIAL_CYCLES)
-			{
-				/* If RX can be done, do it. */
-				/* If RX failed, do not change SB if using external
-				 * clock, or set to 0xFF if using internal clock. */
-				uint8_t rx;
-
-				if(gb->gb_serial_rx != NULL &&
-					(gb->gb_serial_rx(gb, &rx) ==
-						GB_SERIAL_RX_SUCCESS))
-				{
-					gb->hram_io[IO_SB] = rx;
+			out[o++] = 0x80 | (len >> 8);
+			out[o++] = len & 0xFF;
+			run -= len;
+		}
 
-					/* Inform game of serial TX/RX completion. */
-					gb->hram_io[IO_SC] &= 0x01;
-					gb->hram_io[IO_IF] |= SERIAL_INTR;
-				}
-				else if(gb->hram_io[IO_SC] & SERIAL_SC_CLOCK_SRC)
-				{
-					/* If using internal clock, and console is not
-					 * attached to any external peripheral, shifted
-					 * bits are replaced with logic 1. */
-					gb->hram_io[IO_SB] = 0xFF;
-
-					/* Inform game of serial TX/RX completion. */
-					gb->hram_io[IO_SC] &= 0x01;
-					gb->hram_io[IO_IF] |= SERIAL_INTR;
-				}
-				else
-				{
-					/* If using external clock, and console is not
-					 * attached to any external peripheral, bits are
-					 * not shifted, so SB is not modified. */
-				}
+		if(i == n)
+			break;
 
-				gb->counter.serial_count = 0;
-			}
+		/* Changed bytes until the next three unchanged bytes, so that
+		 * a snapshot is never much larger than the state. */
+		for(run = i + 1; run < n && run - i < 128; run++)
+		{
+			if(cur[run] == old[run] && (run + 1 == n ||
+					(cur[run + 1] == old[run + 1] &&
+					(run + 2 == n ||
+					cur[run + 2] == old[run + 2]))))
+				break;
 		}
 
-		/* TIMA register timing */
-		/* TODO: Change tac_enable to struct of TAC timer control bits. */
-		if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
-		{
-			gb->counter.tima_count += inst_cycles;
+		out[o++] = run - i - 1;
+		for(; i < run; i++)
+			out[o++] = cur[i] ^ old[i];
+	}
 
-			while(gb->counter.tima_count >=
-				TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK])
-			{
-				gb->counter.tima_count -=
-					TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK];
+	return o;
+}
 
-				if(++gb->hram_io[IO_TIMA] == 0)
-				{
-					gb->hram_io[IO_IF] |= TIMER_INTR;
-					/* On overflow, set TMA to TIMA. */
-					gb->hram_io[IO_TIMA] = gb->hram_io[IO_TMA];
-				}
-			}
-		}
+/**
+ * Internal function used to apply a difference compressed by
+ * __gb_rewind_pack() to the old state in state.
+ */
+static void __gb_rewind_unpack(uint8_t *state, const uint8_t *in,
+		const size_t size)
+{
+	const uint8_t *end = in + size;
+
+	while(in < end)
+	{
+		const uint8_t c = *in++;
 
-		/* If LCD is off, don't update LCD state or increase the LCD
-		 * ticks. Instead, keep track of the amount of time that is
-		 * being passed. */
-		if(!(gb->hram_io[IO_LCDC] & LCDC_ENABLE))
+		if(c & 0x80)
 		{
-			gb->counter.lcd_off_count += inst_cycles;
-			if(gb->counter.lcd_off_count >= LCD_FRAME_CYCLES)
-			{
-				gb->counter.lcd_off_count -= LCD_FRAME_CYCLES;
-				gb->gb_frame = true;
-			}
+			state += ((size_t)(c & 0x7F) << 8) | *in++;
 			continue;
 		}
 
-		/* LCD Timing */
-		gb->counter.lcd_count += inst_cycles;
+		for(unsigned len = c + 1u; len != 0; len--)
+			*state++ ^= *in++;
+	}
+}
 
-		/* New Scanline. HBlank -> VBlank or OAM Scan */
-		if(gb->counter.lcd_count >= LCD_LINE_CYCLES)
-		{
-			gb->counter.lcd_count -= LCD_LINE_CYCLES;
+/**
+ * Internal function used to discard the oldest snapshot.
+ */
+static void __gb_rewind_drop_oldest(struct gb_rewind_s *rw)
+{
+	rw->first = (rw->first + 1) % rw->frames;
+	rw->count--;
+}
 
-			/* Next line */
-			gb->hram_io[IO_LY] = gb->hram_io[IO_LY] + 1;
-			if (gb->hram_io[IO_LY] == LCD_VERT_LINES)
-				gb->hram_io[IO_LY] = 0;
+/**
+ * Internal function used to make room for a snapshot of the given size, by
+ * discarding the oldest snapshots that are in the way. Snapshots that are
+ * left without their keyframe are also discarded. Returns the offset of the
+ * room.
+ */
+static size_t __gb_rewind_reserve(struct gb_rewind_s *rw, const size_t size)
+{
+	size_t offset = rw->head;
 
-			/* LYC Update */
-			if(gb->hram_io[IO_LY] == gb->hram_io[IO_LYC])
-			{
-				gb->hram_io[IO_STAT] |= STAT_LYC_COINC;
+	if(rw->count == rw->frames)
+		__gb_rewind_drop_oldest(rw);
 
-				if(gb->hram_io[IO_STAT] & STAT_LYC_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
-			}
-			else
-				gb->hram_io[IO_STAT] &= 0xFB;
+	if(offset + size > rw->buf_size)
+	{
+		/* The space left at the end of the buffer is not used, so the
+		 * snapshots in it are the oldest and are discarded first. */
+		while(rw->count != 0 && rw->entry[rw->first].offset >= offset)
+			__gb_rewind_drop_oldest(rw);
 
-			/* Check if LCD should be in Mode 1 (VBLANK) state */
-			if(gb->hram_io[IO_LY] == LCD_HEIGHT)
-			{
-				gb->hram_io[IO_STAT] =
-					(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_VBLANK;
-				gb->gb_frame = true;
-				gb->hram_io[IO_IF] |= VBLANK_INTR;
-				gb->lcd_blank = false;
+		offset = 0;
+	}
 
-				if(gb->hram_io[IO_STAT] & STAT_MODE_1_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
+	while(rw->count != 0)
+	{
+		const struct gb_rewind_entry_s *e = &rw->entry[rw->first];
 
-#if ENABLE_LCD
-				/* If frame skip is activated, check if we need to draw
-				 * the frame or skip it. */
-				if(gb->direct.frame_skip)
-				{
-					gb->display.frame_skip_count =
-						!gb->display.frame_skip_count;
-				}
+		if(e->offset >= offset + size || e->offset + e->size <= offset)
+			break;
 
-				/* If interlaced is activated, change which lines get
-				 * updated. Also, only update lines on frames that are
-				 * actually drawn when frame skip is enabled. */
-				if(gb->direct.interlace &&
-						(!gb->direct.frame_skip ||
-						 gb->display.frame_skip_count))
-				{
-					gb->display.interlace_count =
-						!gb->display.interlace_count;
-				}
-#endif
-                                /* If halted forever, then return on VBLANK. */
-                                if(gb->gb_halt && !gb->hram_io[IO_IE])
-					break;
-			}
-			/* Start of normal Line (not in VBLANK) */
-			else if(gb->hram_io[IO_LY] < LCD_HEIGHT)
-			{
-				if(gb->hram_io[IO_LY] == 0)
-				{
-					/* Clear Screen */
-					gb->display.WY = gb->hram_io[IO_WY];
-					gb->display.window_clear = 0;
-				}
+		__gb_rewind_drop_oldest(rw);
+	}
 
-				/* OAM Search occurs at the start of the line. */
-				gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_OAM_SCAN;
-				gb->counter.lcd_count = 0;
+	while(rw->count != 0 && !rw->entry[rw->first].keyframe)
+		__gb_rewind_drop_oldest(rw);
 
-				if(gb->hram_io[IO_STAT] & STAT_MODE_2_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
+	return offset;
+}
 
-				/* If halted immediately jump to next LCD mode.
-				 * From OAM Search to LCD Draw. */
-				//if(gb->counter.lcd_count < LCD_MODE2_OAM_SCAN_END)
-				//	inst_cycles = LCD_MODE2_OAM_SCAN_END - gb->counter.lcd_count;
-				inst_cycles = LCD_MODE2_OAM_SCAN_DURATION;
-			}
-		}
-		/* Go from Mode 3 (LCD Draw) to Mode 0 (HBLANK). */
-		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_LCD_DRAW &&
-				gb->counter.lcd_count >= LCD_MODE3_LCD_DRAW_END)
-		{
-			gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_HBLANK;
+void gb_rewind_free(struct gb_s *gb)
+{
+	struct gb_rewind_s *rw = gb->rewind;
 
-			if(gb->hram_io[IO_STAT] & STAT_MODE_0_INTR)
-				gb->hram_io[IO_IF] |= LCDC_INTR;
+	if(rw == NULL)
+		return;
 
-			/* If halted immediately, jump from OAM Scan to LCD Draw. */
-			if (gb->counter.lcd_count < LCD_MODE0_HBLANK_MAX_DRUATION)
-				inst_cycles = LCD_MODE0_HBLANK_MAX_DRUATION - gb->counter.lcd_count;
-		}
-		/* Go from Mode 2 (OAM Scan) to Mode 3 (LCD Draw). */
-		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_OAM_SCAN &&
-				gb->counter.lcd_count >= LCD_MODE2_OAM_SCAN_END)
-		{
-			gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_LCD_DRAW;
-#if ENABLE_LCD
-			if(!gb->lcd_blank)
-				__gb_draw_line(gb);
-#endif
-			/* If halted immediately jump to next LCD mode. */
-			if (gb->counter.lcd_count < LCD_MODE3_LCD_DRAW_MIN_DURATION)
-				inst_cycles = LCD_MODE3_LCD_DRAW_MIN_DURATION - gb->counter.lcd_count;
-		}
-	} while(gb->gb_halt && (gb->hram_io[IO_IF] & gb->hram_io[IO_IE]) == 0);
-	/* If halted, loop until an interrupt occurs. */
+	free(rw->key);
+	free(rw->state);
+	free(rw->zero);
+	free(rw->packed);
+	free(rw->buf);
+	free(rw->entry);
+	free(rw);
+	gb->rewind = NULL;
 }
 
-void gb_run_frame(struct gb_s *gb)
+int gb_rewind_init(struct gb_s *gb, const size_t size, const unsigned frames,
+		const unsigned keyframe_interval)
 {
-	gb->gb_frame = false;
+	struct gb_rewind_s *rw;
+	const size_t state_size = gb_state_size(gb, PGB_REWIND_STATE_FLAGS);
+
+	if(gb->rewind != NULL)
+		return 0;
+
+	if(frames == 0 || size < PGB_REWIND_PACKED_MAX(state_size))
+		return -1;
+
+	rw = calloc(1, sizeof(*rw));
+	if(rw == NULL)
+		return -1;
+
+	rw->state_size = state_size;
+	rw->keyframe_interval = keyframe_interval != 0 ? keyframe_interval : 1;
+	rw->buf_size = size;
+	rw->frames = frames;
+	rw->key = malloc(state_size);
+	rw->state = malloc(state_size);
+	rw->zero = calloc(1, state_size);
+	rw->packed = malloc(PGB_REWIND_PACKED_MAX(state_size));
+	rw->buf = malloc(size);
+	rw->entry = malloc(frames * sizeof(*rw->entry));
+
+	gb->rewind = rw;
+	if(rw->key == NULL || rw->state == NULL || rw->zero == NULL ||
+			rw->packed == NULL || rw->buf == NULL || rw->entry == NULL)
+	{
+		gb_rewind_free(gb);
+		return -1;
+	}
 
-	while(!gb->gb_frame)
-		__gb_step_cpu(gb);
+	return 0;
 }
 
-int gb_get_save_size_s(struct gb_s *gb, size_t *ram_size)
+int gb_rewind_push(struct gb_s *gb)
 {
-	const uint_fast16_t ram_size_location = 0x0149;
-	const uint_fast32_t ram_sizes[] =
-	{
-		/* 0,  2KiB,   8KiB,  32KiB,  128KiB,   64KiB */
-		0x00, 0x800, 0x2000, 0x8000, 0x20000, 0x10000
-	};
-	uint8_t ram_size_code = gb->gb_rom_read(gb, ram_size_location);
+	struct gb_rewind_s *rw = gb->rewind;
+	struct gb_rewind_entry_s *e;
+	size_t size, offset;
+	bool keyframe;
+
+	if(rw == NULL ||
+			gb_state_size(gb, PGB_REWIND_STATE_FLAGS) !=
+			rw->state_size)
+		return -1;
 
-	/* MBC2 always has 512 half-bytes of cart RAM.
-	 * This assumes that only the lower nibble of each byte is used; the
-	 * nibbles are not packed. */
-	if(gb->mbc == 2)
+	gb_state_save(gb, rw->state, PGB_REWIND_STATE_FLAGS);
+	keyframe = rw->count == 0 || rw->since_key + 1 >= rw->keyframe_interval;
+
+	for(;;)
 	{
-		*ram_size = 0x200;
-		return 0;
+		size = __gb_rewind_pack(rw->packed, rw->state,
+				keyframe ? rw->zero : rw->key, rw->state_size);
+		offset = __gb_rewind_reserve(rw, size);
+
+		/* Start again with a keyframe if the one that this snapshot
+		 * is compared to had to be discarded. */
+		if(keyframe || (rw->count != 0 &&
+				rw->entry[rw->first].seq <= rw->key_seq))
+			break;
+
+		keyframe = true;
 	}
 
-	/* Return -1 on invalid or unsupported RAM size. */
-	if(ram_size_code >= PEANUT_GB_ARRAYSIZE(ram_sizes))
-		return -1;
+	memcpy(rw->buf + offset, rw->packed, size);
+	e = &rw->entry[(rw->first + rw->count) % rw->frames];
+	e->offset = offset;
+	e->size = size;
+	e->seq = rw->next_seq++;
+	e->keyframe = keyframe;
+	rw->count++;
+	rw->head = offset + size;
+
+	if(keyframe)
+	{
+		memcpy(rw->key, rw->state, rw->state_size);
+		rw->key_seq = e->seq;
+		rw->since_key = 0;
+	}
+	else
+		rw->since_key++;
 
-	*ram_size = ram_sizes[ram_size_code];
 	return 0;
 }
 
-PGB_DEPRECATED("Does not return error code. Use gb_get_save_size_s instead.")
-uint_fast32_t gb_get_save_size(struct gb_s *gb)
+int gb_rewind_pop(struct gb_s *gb)
 {
-	const uint_fast16_t ram_size_location = 0x0149;
-	const uint_fast32_t ram_sizes[] =
+	struct gb_rewind_s *rw = gb->rewind;
+	const struct gb_rewind_entry_s *e;
+
+	if(rw == NULL || rw->count == 0)
+		return -1;
+
+	rw->count--;
+	e = &rw->entry[(rw->first + rw->count) % rw->frames];
+	rw->head = e->offset;
+
+	if(e->keyframe)
 	{
-		/* 0,  2KiB,   8KiB,  32KiB,  128KiB,   64KiB */
-		0x00, 0x800, 0x2000, 0x8000, 0x20000, 0x10000
-	};
-	uint8_t ram_size_code = gb->gb_rom_read(gb, ram_size_location);
+		if(gb_state_load(gb, rw->key, rw->state_size) !=
+				GB_STATE_NO_ERROR)
+			return -1;
+
+		/* The previous keyframe is needed by the snapshots before
+		 * this one. */
+		rw->since_key = 0;
+		while(rw->since_key < rw->count)
+		{
+			e = &rw->entry[(rw->first + rw->count - 1 -
+					rw->since_key) % rw->frames];
+			if(e->keyframe)
+				break;
 
-	/* MBC2 always has 512 half-bytes of cart RAM.
-	 * This assumes that only the lower nibble of each byte is used; the
-	 * nibbles are not packed. */
-	if(gb->mbc == 2)
-		return 0x200;
+			rw->since_key++;
+		}
+
+		if(rw->since_key != rw->count)
+		{
+			memset(rw->key, 0, rw->state_size);
+			__gb_rewind_unpack(rw->key, rw->buf + e->offset,
+					e->size);
+			rw->key_seq = e->seq;
+		}
 
-	/* Return 0 on invalid or unsupported RAM size. */
-	if(ram_size_code >= PEANUT_GB_ARRAYSIZE(ram_sizes))
 		return 0;
+	}
 
-	return ram_sizes[ram_size_code];
-}
+	memcpy(rw->state, rw->key, rw->state_size);
+	__gb_rewind_unpack(rw->state, rw->buf + e->offset, e->size);
+	rw->since_key--;
 
-void gb_init_serial(struct gb_s *gb,
-		    void (*gb_serial_tx)(struct gb_s*, const uint8_t),
-		    enum gb_serial_rx_ret_e (*gb_serial_rx)(struct gb_s*,
-			    uint8_t*))
-{
-	gb->gb_serial_tx = gb_serial_tx;
-	gb->gb_serial_rx = gb_serial_rx;
+	return gb_state_load(gb, rw->state, rw->state_size) ==
+		GB_STATE_NO_ERROR ? 0 : -1;
 }
 
-uint8_t gb_colour_hash(struct gb_s *gb)
+unsigned gb_rewind_count(const struct gb_s *gb)
 {
-#define ROM_TITLE_START_ADDR	0x0134
-#define ROM_TITLE_END_ADDR	0x0143
-
-	uint8_t x = 0;
-	uint16_t i;
-
-	for(i = ROM_TITLE_START_ADDR; i <= ROM_TITLE_END_ADDR; i++)
-		x += gb->gb_rom_read(gb, i);
-
-	return x;
+	return gb->rewind != NULL ? gb->rewind->count : 0;
 }
+#undef PGB_REWIND_PACKED_MAX
+#undef PGB_REWIND_STATE_FLAGS
+#endif
 
 /**
  * Resets the context, and initialises startup values for a DMG console.
@@ -3617,6 +8249,18 @@ void gb_reset(struct gb_s *gb)
 {
 	gb->gb_halt = false;
 	gb->gb_ime = true;
+#if PEANUT_GB_LAZY_FLAGS
+	gb->lazy_flags.op = PGB_LAZY_NONE;
+#endif
+#if ENABLE_LCD && PEANUT_GB_TILE_CACHE
+	memset(gb->tile_cache.dirty, 0xFF, sizeof(gb->tile_cache.dirty));
+#endif
+#if PEANUT_GB_SPRITE_BUCKETS
+	gb->sprite_lines.dirty = true;
+#endif
+#if PEANUT_GB_SKIP_UNCHANGED_LINES
+	memset(&gb->line_change, 0, sizeof(gb->line_change));
+#endif
 
 	/* Initialise MBC values. */
 	gb->selected_rom_bank = 1;
@@ -3661,12 +8305,6 @@ void gb_reset(struct gb_s *gb)
 		gb->hram_io[IO_BOOT] = 0x00;
 	}
 
-	gb->counter.lcd_count = 0;
-	gb->counter.div_count = 0;
-	gb->counter.tima_count = 0;
-	gb->counter.serial_count = 0;
-	gb->counter.rtc_count = 0;
-	gb->counter.lcd_off_count = 0;
 
 	gb->direct.joypad = 0xFF;
 	gb->hram_io[IO_JOYP] = 0xCF;
@@ -3691,9 +8329,29 @@ void gb_reset(struct gb_s *gb)
 	gb->hram_io[IO_WX] = 0x00;
 	gb->hram_io[IO_IE] = 0x00;
 	gb->hram_io[IO_IF] = 0xE1;
+
+	memset(&gb->counter, 0, sizeof(gb->counter));
+	gb->counter.div_start = 0 - ((uint64_t)gb->hram_io[IO_DIV] * DIV_CYCLES);
+	gb->counter.event[GB_EVENT_STOP] = UINT64_MAX;
+	__gb_lcd_schedule(gb);
+	__gb_tima_sync(gb);
+	__gb_serial_sync(gb);
+	__gb_rtc_sync(gb);
+
+#if PEANUT_GB_IDLE_LOOP_SKIP
+	memset(&gb->idle, 0, sizeof(gb->idle));
+#endif
+
+#if PEANUT_GB_USE_MEMORY_MAP
+	__gb_update_memory_map(gb);
+#endif
 }
 
-enum gb_init_error_e gb_init(struct gb_s *gb,
+/**
+ * Initialises the context using the given memory access functions. Used by
+ * gb_init() and gb_init_buffer(), which set gb->mem beforehand.
+ */
+static enum gb_init_error_e __gb_init(struct gb_s *gb,
 			     uint8_t (*gb_rom_read)(struct gb_s*, const uint_fast32_t),
 			     uint8_t (*gb_cart_ram_read)(struct gb_s*, const uint_fast32_t),
 			     void (*gb_cart_ram_write)(struct gb_s*, const uint_fast32_t, const uint8_t),
@@ -3744,8 +8402,14 @@ enum gb_init_error_e gb_init(struct gb_s *gb,
 	 * automatically. */
 	gb->gb_serial_tx = NULL;
 	gb->gb_serial_rx = NULL;
+	gb->gb_audio_read = NULL;
+	gb->gb_audio_write = NULL;
+	gb->gb_audio_state_size = 0;
+	gb->gb_audio_state_save = NULL;
+	gb->gb_audio_state_load = NULL;
 
 	gb->gb_bootrom_read = NULL;
+	gb->run.breakpoints = NULL;
 
 	/* Check valid ROM using checksum value. */
 	{
@@ -3791,12 +8455,61 @@ enum gb_init_error_e gb_init(struct gb_s *gb,
 
 	gb->lcd_blank = false;
 	gb->display.lcd_draw_line = NULL;
+	gb->display.frame_buffer[0] = NULL;
+	gb->display.obs_buffer = NULL;
+#if PEANUT_GB_JIT
+	gb->jit = NULL;
+#endif
+#if PEANUT_GB_PREDECODE
+	gb->predecode = NULL;
+#endif
+#if PEANUT_GB_REWIND
+	gb->rewind = NULL;
+#endif
 
 	gb_reset(gb);
 
 	return GB_INIT_NO_ERROR;
 }
 
+enum gb_init_error_e gb_init(struct gb_s *gb,
+			     uint8_t (*gb_rom_read)(struct gb_s*, const uint_fast32_t),
+			     uint8_t (*gb_cart_ram_read)(struct gb_s*, const uint_fast32_t),
+			     void (*gb_cart_ram_write)(struct gb_s*, const uint_fast32_t, const uint8_t),
+			     void (*gb_error)(struct gb_s*, const enum gb_error_e, const uint16_t),
+			     void *priv)
+{
+	memset(&gb->mem, 0, sizeof(gb->mem));
+	return __gb_init(gb, gb_rom_read, gb_cart_ram_read, gb_cart_ram_write,
+			 gb_error, priv);
+}
+
+enum gb_init_error_e gb_init_buffer(struct gb_s *gb,
+			     const uint8_t *rom, size_t rom_size,
+			     uint8_t *cart_ram, size_t cart_ram_size,
+			     void (*gb_error)(struct gb_s*, const enum gb_error_e, const uint16_t),
+			     void *priv)
+{
+	memset(&gb->mem, 0, sizeof(gb->mem));
+	gb->mem.rom = rom;
+	gb->mem.rom_size = rom_size;
+	gb->mem.cart_ram = cart_ram;
+	gb->mem.cart_ram_size = cart_ram != NULL ? cart_ram_size : 0;
+
+	return __gb_init(gb, &__gb_rom_read_buffer, &__gb_cart_ram_read_buffer,
+			 &__gb_cart_ram_write_buffer, gb_error, priv);
+}
+
+void gb_set_cart_ram(struct gb_s *gb, uint8_t *cart_ram, size_t cart_ram_size)
+{
+	gb->mem.cart_ram = cart_ram;
+	gb->mem.cart_ram_size = cart_ram != NULL ? cart_ram_size : 0;
+
+#if PEANUT_GB_USE_MEMORY_MAP
+	__gb_update_memory_map(gb);
+#endif
+}
+
 const char* gb_get_rom_name(struct gb_s* gb, char *title_str)
 {
 	uint_fast16_t title_loc = 0x134;
@@ -3822,23 +8535,145 @@ const char* gb_get_rom_name(struct gb_s* gb, char *title_str)
 }
 
 #if ENABLE_LCD
+void gb_set_lcd_region(struct gb_s *gb, const uint8_t line_mask[18],
+		uint8_t x_start, uint8_t x_end)
+{
+	if(line_mask != NULL)
+		memcpy(gb->display.line_mask, line_mask,
+				sizeof(gb->display.line_mask));
+	else
+		memset(gb->display.line_mask, 0xFF,
+				sizeof(gb->display.line_mask));
+
+	if(x_end > LCD_WIDTH)
+		x_end = LCD_WIDTH;
+
+	if(x_start >= x_end)
+	{
+		x_start = 0;
+		x_end = LCD_WIDTH;
+	}
+
+	gb->display.x_start = x_start;
+	gb->display.x_end = x_end;
+
+#if PEANUT_GB_SKIP_UNCHANGED_LINES
+	/* Lines drawn before only have the columns that were asked for. */
+	memset(gb->line_change.hash, 0, sizeof(gb->line_change.hash));
+#endif
+}
+
 void gb_init_lcd(struct gb_s *gb,
 		void (*lcd_draw_line)(struct gb_s *gb,
 			const uint8_t *pixels,
 			const uint_fast8_t line))
 {
 	gb->display.lcd_draw_line = lcd_draw_line;
+	gb->display.frame_buffer[0] = NULL;
+	gb->display.obs_buffer = NULL;
 
 	gb->direct.interlace = false;
 	gb->display.interlace_count = false;
 	gb->direct.frame_skip = false;
-	gb->display.frame_skip_count = false;
+	gb->direct.skip_next_frame = false;
+	gb->direct.frame_skip_ratio = 0;
+	gb->display.frame_skip_count = 0;
+	gb->display.frame_skipped = false;
 
 	gb->display.window_clear = 0;
 	gb->display.WY = 0;
 
+	gb_set_lcd_region(gb, NULL, 0, LCD_WIDTH);
+
+#if PEANUT_GB_SKIP_UNCHANGED_LINES
+	memset(&gb->line_change, 0, sizeof(gb->line_change));
+#endif
+
 	return;
 }
+
+void gb_init_lcd_frame(struct gb_s *gb, void *front, void *back,
+		size_t stride, enum gb_pixel_format_e format,
+		void (*lcd_frame_ready)(struct gb_s *gb, void *frame))
+{
+	gb_init_lcd(gb, NULL);
+
+	gb->display.frame_buffer[0] = front;
+	gb->display.frame_buffer[1] = back;
+	gb->display.frame_back = 1;
+	gb->display.frame_stride = stride;
+	gb->display.frame_format = format;
+	gb->display.lcd_frame_ready = lcd_frame_ready;
+
+	/* Default to the same four shades of grey for each palette. */
+	for(uint_fast8_t i = 0; i < 12; i++)
+	{
+		const uint32_t grey[4] = {
+			0xFFFFFF, 0xA5A5A5, 0x525252, 0x000000
+		};
+		gb->display.frame_palette[i] =
+			gb_rgb_to_pixel(format, grey[i & 3]);
+	}
+}
+
+const void *gb_get_frame(const struct gb_s *gb)
+{
+	return gb->display.frame_buffer[gb->display.frame_back ^ 1];
+}
+
+void gb_set_lcd_palette(struct gb_s *gb, const uint32_t palette[12])
+{
+	memcpy(gb->display.frame_palette, palette,
+			sizeof(gb->display.frame_palette));
+#if PEANUT_GB_SKIP_UNCHANGED_LINES
+	/* Draw every line again in the new colours. */
+	memset(gb->line_change.hash, 0, sizeof(gb->line_change.hash));
+#endif
+}
+
+int gb_set_lcd_obs(struct gb_s *gb, uint8_t *buffer, uint8_t width,
+		uint8_t height, size_t stride, enum gb_obs_format_e format,
+		uint8_t stack)
+{
+	uint8_t line_mask[LCD_HEIGHT / 8] = {0};
+
+	if(buffer == NULL)
+	{
+		gb->display.obs_buffer = NULL;
+		gb_set_lcd_region(gb, NULL, 0, LCD_WIDTH);
+		return 0;
+	}
+
+	if(width == 0 || width > LCD_WIDTH ||
+			height == 0 || height > LCD_HEIGHT ||
+			stride < width || stack == 0)
+		return -1;
+
+	gb->display.obs_buffer = buffer;
+	gb->display.obs_stride = stride;
+	gb->display.obs_width = width;
+	gb->display.obs_height = height;
+	gb->display.obs_stack = stack;
+	gb->display.obs_format = format;
+	gb->display.obs_shift = false;
+
+	/* Only draw the lines that are sampled. */
+	for(uint_fast16_t row = 0; row < height; row++)
+	{
+		const uint_fast16_t line = row * LCD_HEIGHT / height;
+		line_mask[line >> 3] |= 1 << (line & 0x07);
+	}
+
+	gb_set_lcd_region(gb, line_mask, 0, LCD_WIDTH);
+	return 0;
+}
+
+#if PEANUT_GB_SKIP_UNCHANGED_LINES
+const uint8_t *gb_get_changed_lines(const struct gb_s *gb)
+{
+	return gb->line_change.changed;
+}
+#endif
 #endif
 
 void gb_set_bootrom(struct gb_s *gb,
@@ -3859,11 +8694,13 @@ void gb_tick_rtc(struct gb_s *gb)
 
 void gb_set_rtc(struct gb_s *gb, const struct tm * const time)
 {
+	__gb_rtc_sync(gb);
 	gb->rtc_real.bytes[0] = time->tm_sec;
 	gb->rtc_real.bytes[1] = time->tm_min;
 	gb->rtc_real.bytes[2] = time->tm_hour;
 	gb->rtc_real.bytes[3] = time->tm_yday & 0xFF; /* Low 8 bits of day counter. */
 	gb->rtc_real.bytes[4] = time->tm_yday >> 8; /* High 1 bit of day counter. */
+	__gb_rtc_sync(gb);
 }
 #endif // PEANUT_GB_HEADER_ONLY
 
@@ -3894,6 +8731,30 @@ enum gb_init_error_e gb_init(struct gb_s *gb,
 			     void (*gb_error)(struct gb_s*, const enum gb_error_e, const uint16_t),
 			     void *priv);
 
+/**
+ * Initialises the emulator context with a ROM image and cart RAM held in
+ * memory. This is an alternative to gb_init() that allows Peanut-GB to read
+ * ROM and cart RAM directly instead of calling a function for every byte.
+ * The buffers must remain valid for the lifetime of the context.
+ *
+ * \param gb	Allocated emulator context. Must not be NULL.
+ * \param rom	Pointer to the whole ROM image. Must not be NULL.
+ * \param rom_size Size of the ROM image in bytes.
+ * \param cart_ram Pointer to cart RAM. May be NULL if the game has no cart RAM
+ *		or if it is set later with gb_set_cart_ram().
+ * \param cart_ram_size Size of cart_ram in bytes. See gb_get_save_size_s().
+ * \param gb_error Pointer to function that is called when an unrecoverable
+ *		error occurs. Must not be NULL.
+ * \param priv	Private data that is stored within the emulator context. Set to
+ * 		NULL if unused.
+ * \returns	0 on success or an enum that describes the error.
+ */
+enum gb_init_error_e gb_init_buffer(struct gb_s *gb,
+			     const uint8_t *rom, size_t rom_size,
+			     uint8_t *cart_ram, size_t cart_ram_size,
+			     void (*gb_error)(struct gb_s*, const enum gb_error_e, const uint16_t),
+			     void *priv);
+
 /**
  * Executes the emulator and runs for the duration of time equal to one frame.
  *
@@ -3903,12 +8764,52 @@ void gb_run_frame(struct gb_s *gb);
 
 /**
  * Internal function used to step the CPU. Used mainly for testing.
- * Use gb_run_frame() instead.
+ * Use gb_run_frame() or gb_run_cycles() instead.
+ * If the JIT is used, this may execute a block of several instructions.
  *
  * \param	An initialised emulator context. Must not be NULL.
  */
 void __gb_step_cpu(struct gb_s *gb);
 
+/**
+ * Runs the emulator for the given number of cycles. The run ends after the
+ * instruction that reaches the budget, so slightly more cycles than requested
+ * may be run; the difference can be taken from the next budget. If the CPU is
+ * halted, the run ends exactly at the budget.
+ * There are 4194304 cycles per second, and 70224 cycles per frame.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param cycles	Number of cycles to run.
+ * \returns	Number of cycles that were run.
+ */
+uint_fast32_t gb_run_cycles(struct gb_s *gb, const uint_fast32_t cycles);
+
+/**
+ * Runs the emulator until one of the given events occurs. The events that
+ * occurred during the run are then set in gb->run.events.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param events	Events from enum gb_run_event_e to stop at. Must include
+ *		an event that is certain to occur, such as GB_RUN_FRAME.
+ *		GB_RUN_BREAKPOINT stops after each instruction that ends at
+ *		a breakpoint set with gb_set_breakpoints().
+ * \returns	Number of cycles that were run.
+ */
+uint_fast32_t gb_run_until(struct gb_s *gb, const uint_fast8_t events);
+
+/**
+ * Sets the breakpoints used by gb_run_until() with GB_RUN_BREAKPOINT. Runs
+ * that stop at breakpoints are executed one instruction at a time by the
+ * interpreter.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param breakpoints	Bitmap of 0x2000 bytes, in which bit (addr & 7) of
+ *		byte (addr >> 3) is set if addr is a breakpoint. The bitmap is
+ *		not copied and may be changed between runs. NULL removes all
+ *		breakpoints.
+ */
+void gb_set_breakpoints(struct gb_s *gb, const uint8_t *breakpoints);
+
 /** Function prototypes: Optional Functions **/
 /**
  * Reset the emulator, like turning the Game Boy off and on again.
@@ -3937,6 +8838,142 @@ void gb_init_lcd(struct gb_s *gb,
 		void (*lcd_draw_line)(struct gb_s *gb,
 			const uint8_t *pixels,
 			const uint_fast8_t line));
+
+/**
+ * Initialises the display context of the emulator to draw whole frames into
+ * two frame buffers owned by the front-end, instead of calling lcd_draw_line
+ * for each line. Lines are drawn into the back buffer, and at the end of each
+ * frame the buffers are swapped and lcd_frame_ready is called with the frame
+ * that was completed. Frames that are skipped with frame skip are not shown.
+ * The same buffer may be given for both front and back, in which case lines
+ * not drawn due to interlacing keep those of the previous frame. Only
+ * available when ENABLE_LCD is defined to a non-zero value.
+ * This function can be called at any time, and replaces any function set by
+ * gb_init_lcd.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param front	Frame buffer that is shown first. Must not be NULL.
+ * \param back	Frame buffer that is drawn to first. Must not be NULL.
+ * \param stride Number of bytes between the start of each line.
+ * \param format Format of the pixels written to the frame buffers.
+ * \param lcd_frame_ready Pointer to function that is called with each
+ *		completed frame. May be NULL.
+ */
+void gb_init_lcd_frame(struct gb_s *gb, void *front, void *back,
+		size_t stride, enum gb_pixel_format_e format,
+		void (*lcd_frame_ready)(struct gb_s *gb, void *frame));
+
+/**
+ * Returns the last frame completed in the frame buffers set with
+ * gb_init_lcd_frame(). Only available when ENABLE_LCD is defined to a
+ * non-zero value.
+ *
+ * \param gb	An emulator context initialised with gb_init_lcd_frame().
+ * 
+ * \returns	Front buffer.
+ */
+const void *gb_get_frame(const struct gb_s *gb);
+
+/**
+ * Sets the colours written to frame buffers set with gb_init_lcd_frame(), for
+ * formats other than GB_PIXEL_FORMAT_SHADE. By default, each palette is four
+ * shades of grey. Only available when ENABLE_LCD is defined to a non-zero
+ * value.
+ *
+ * \param gb	An emulator context initialised with gb_init_lcd_frame().
+ * \param palette Four colours each for OBJ0, OBJ1 and BG, from lightest
+ *		to darkest shade, in the format of the frame buffers. See
+ *		gb_rgb_to_pixel(). If PEANUT_GB_12_COLOUR is 0, only the
+ *		first four colours are used.
+ */
+void gb_set_lcd_palette(struct gb_s *gb, const uint32_t palette[12]);
+
+/**
+ * Sets which part of the screen is drawn, for front-ends that only use part of
+ * each frame. Lines that are not drawn are not given to lcd_draw_line, and
+ * are left as they were in the frame buffers set with gb_init_lcd_frame().
+ * Pixels outside of the columns drawn are undefined. By default, the whole
+ * screen is drawn. Only available when ENABLE_LCD is defined to a non-zero
+ * value.
+ *
+ * \param gb	An initialised emulator context.
+ * \param line_mask 18 bytes, where bit (line % 8) of byte (line / 8) is set
+ *		for each line to draw. If NULL, every line is drawn.
+ * \param x_start First column to draw.
+ * \param x_end	Column after the last column to draw, up to 160. If this is
+ *		not after x_start, every column is drawn.
+ */
+void gb_set_lcd_region(struct gb_s *gb, const uint8_t line_mask[18],
+		uint8_t x_start, uint8_t x_end);
+
+/**
+ * Sets a buffer that is given scaled down frames, such as for machine learning
+ * agents that observe the game. Each row and column of the frame is sampled
+ * from the nearest line and column of the screen, and only the lines that are
+ * sampled are drawn; this replaces the region set with gb_set_lcd_region().
+ * lcd_draw_line and frame buffers set with gb_init_lcd_frame() are still
+ * given the lines that are drawn. Must be called after gb_init_lcd() or
+ * gb_init_lcd_frame(), which stop the output. Only available when
+ * ENABLE_LCD is defined to a non-zero value.
+ *
+ * \param gb	An initialised emulator context.
+ * \param buffer Buffer of stack * height * stride bytes, which holds the
+ *		last stack frames from oldest to newest. If NULL, the output
+ *		stops and the whole screen is drawn again.
+ * \param width	Width of each frame, from 1 to 160.
+ * \param height Height of each frame, from 1 to 144.
+ * \param stride Number of bytes between the start of each row.
+ * \param format Format of the pixels written to the buffer.
+ * \param stack	Number of frames kept in the buffer. At least 1.
+ * \returns	0 on success, or -1 if the size of the frames is invalid.
+ */
+int gb_set_lcd_obs(struct gb_s *gb, uint8_t *buffer, uint8_t width,
+		uint8_t height, size_t stride, enum gb_obs_format_e format,
+		uint8_t stack);
+
+#if PEANUT_GB_SKIP_UNCHANGED_LINES
+/**
+ * Returns which lines were drawn in the current frame. Lines that are the same
+ * as in the previous frame are not drawn: lcd_draw_line is not called for
+ * them, and they are copied from the front buffer when using
+ * gb_init_lcd_frame(). Only available when PEANUT_GB_SKIP_UNCHANGED_LINES is
+ * defined to a non-zero value.
+ *
+ * \param gb	An initialised emulator context.
+ * \returns	18 bytes, where bit (line % 8) of byte (line / 8) is set if the
+ *		line was drawn. Valid after gb_run_frame() returns, until the
+ *		next frame starts.
+ */
+const uint8_t *gb_get_changed_lines(const struct gb_s *gb);
+#endif
+
+/**
+ * Converts a colour to a pixel of the given format. The result may be used in
+ * palettes given to gb_set_lcd_palette() and gb_lcd_convert_line().
+ * Only available when ENABLE_LCD is defined to a non-zero value.
+ *
+ * \param format Format of the pixel.
+ * \param rgb	Colour as 0xRRGGBB.
+ * \returns	Pixel value. For GB_PIXEL_FORMAT_RGB565_BE, this is the same as
+ *		GB_PIXEL_FORMAT_RGB565, and only the bytes written to a line
+ *		are swapped.
+ */
+uint32_t gb_rgb_to_pixel(const enum gb_pixel_format_e format,
+		const uint32_t rgb);
+
+/**
+ * Converts the 160 pixels given to lcd_draw_line to the given format, using a
+ * palette for each of OBJ0, OBJ1 and BG. Only available when ENABLE_LCD is
+ * defined to a non-zero value.
+ *
+ * \param dst	Output of 160 pixels, aligned to the size of a pixel.
+ * \param pixels Pixels given to lcd_draw_line.
+ * \param format Format of the output.
+ * \param palette Four colours each for OBJ0, OBJ1 and BG, as in
+ *		gb_set_lcd_palette(). Not used for GB_PIXEL_FORMAT_SHADE.
+ */
+void gb_lcd_convert_line(void *dst, const uint8_t *pixels,
+		const enum gb_pixel_format_e format, const uint32_t palette[12]);
 #endif
 
 /**
@@ -3956,6 +8993,46 @@ void gb_init_serial(struct gb_s *gb,
 		    enum gb_serial_rx_ret_e (*gb_serial_rx)(struct gb_s*,
 			    uint8_t*));
 
+/**
+ * Initialises the audio of the emulator, by giving reads and writes of the APU
+ * registers (0xFF10 to 0xFF3F) to an external APU library. This function is
+ * optional, and if not called, the APU registers are only stored, or given to
+ * the global audio_read() and audio_write() functions if ENABLE_SOUND is
+ * defined to a non-zero value. Each emulator context may use its own APU,
+ * which may be found with gb->direct.priv.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param gb_audio_read Pointer to function that returns the value of an APU
+ *		register. Must not be NULL.
+ * \param gb_audio_write Pointer to function that writes to an APU register.
+ *		Must not be NULL.
+ */
+void gb_init_audio(struct gb_s *gb,
+		uint8_t (*gb_audio_read)(struct gb_s*, const uint_fast16_t),
+		void (*gb_audio_write)(struct gb_s*, const uint_fast16_t,
+			const uint8_t));
+
+/**
+ * Gives save states the state of the external APU, so that the APU is
+ * restored along with the APU registers. This function is optional, and if
+ * not called, the state of the APU is not saved. The APU state is saved when
+ * GB_STATE_APU is given to gb_state_save(), and is placed at the end of the
+ * save state in the format written by gb_audio_state_save. Save states with an
+ * APU state may still be loaded by a context without an APU, which skips it.
+ * Must be called before gb_rewind_init() for the APU to be rewound.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param size	Size of the APU state in bytes.
+ * \param gb_audio_state_save Pointer to function that writes size bytes of
+ *		APU state to the given buffer, or NULL to not save the APU.
+ * \param gb_audio_state_load Pointer to function that restores the APU from
+ *		size bytes written by gb_audio_state_save, or NULL to not
+ *		restore the APU.
+ */
+void gb_init_audio_state(struct gb_s *gb, size_t size,
+		void (*gb_audio_state_save)(struct gb_s*, void *buf),
+		void (*gb_audio_state_load)(struct gb_s*, const void *buf));
+
 /**
  * Obtains the save size of the game (size of the Cart RAM). Required by the
  * frontend to allocate enough memory for the Cart RAM.
@@ -3982,6 +9059,154 @@ int gb_get_save_size_s(struct gb_s *gb, size_t *ram_size);
  */
 uint_fast32_t gb_get_save_size(struct gb_s *gb);
 
+/**
+ * Sets the cart RAM used by a context initialised with gb_init_buffer(). This
+ * is useful when the size of the cart RAM is obtained with
+ * gb_get_save_size_s() after initialisation.
+ *
+ * \param gb	An emulator context initialised with gb_init_buffer(). Must not
+ *		be NULL.
+ * \param cart_ram Pointer to cart RAM, or NULL to remove it.
+ * \param cart_ram_size Size of cart_ram in bytes.
+ */
+void gb_set_cart_ram(struct gb_s *gb, uint8_t *cart_ram, size_t cart_ram_size);
+
+/**
+ * Returns the size of a save state of the given context.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param flags Parts of the emulator to save, from enum gb_state_flags_e.
+ * \returns	Size of the save state in bytes.
+ */
+size_t gb_state_size(struct gb_s *gb, const unsigned flags);
+
+/**
+ * Saves the state of the emulated console: the CPU registers, timers, memory,
+ * MBC and RTC registers, LCD state and optionally the cart RAM. The state is
+ * copied as a few blocks of memory, so that it may be saved every frame, such
+ * as to rewind the game. Functions and settings given by the front-end are
+ * not saved, and the state of an external APU is only saved if it was given
+ * to gb_init_audio_state(). Must not be called while the emulator is running,
+ * such as from lcd_draw_line.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param buf	Buffer of at least gb_state_size() bytes.
+ * \param flags Parts of the emulator to save, from enum gb_state_flags_e.
+ * \returns	Number of bytes written to buf.
+ */
+size_t gb_state_save(struct gb_s *gb, void *buf, const unsigned flags);
+
+/**
+ * Restores a state saved with gb_state_save() for the same game. Must not be
+ * called while the emulator is running.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param buf	Save state.
+ * \param size	Size of buf in bytes.
+ * \returns	GB_STATE_NO_ERROR on success, or the reason that the save
+ *		state could not be loaded, in which case the context is
+ *		unchanged.
+ */
+enum gb_state_error_e gb_state_load(struct gb_s *gb, const void *buf,
+		const size_t size);
+
+#if PEANUT_GB_JIT
+/**
+ * Enables translation of guest code into native code. Only available when
+ * PEANUT_GB_JIT is defined to a non-zero value. Must be called after
+ * gb_init(), and gb_jit_free() must be called before the context is
+ * initialised again or discarded.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \returns	0 on success, or -1 if memory could not be allocated, in which
+ *		case the interpreter continues to be used.
+ */
+int gb_jit_init(struct gb_s *gb);
+
+/**
+ * Frees the memory used by the JIT. The interpreter is used afterwards.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ */
+void gb_jit_free(struct gb_s *gb);
+#endif
+
+#if PEANUT_GB_PREDECODE
+/**
+ * Enables the cache of decoded instructions used by the interpreter. Only
+ * available when PEANUT_GB_PREDECODE is defined to a non-zero value. Must be
+ * called after gb_init(), and gb_predecode_free() must be called before the
+ * context is initialised again or discarded.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \returns	0 on success, or -1 if memory could not be allocated, in which
+ *		case instructions are decoded each time they are executed.
+ */
+int gb_predecode_init(struct gb_s *gb);
+
+/**
+ * Frees the cache of decoded instructions.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ */
+void gb_predecode_free(struct gb_s *gb);
+#endif
+
+#if PEANUT_GB_REWIND
+/**
+ * Enables rewinding. Only available when PEANUT_GB_REWIND is defined to a
+ * non-zero value. Must be called after gb_init() and after the cart RAM and
+ * any APU state given to gb_init_audio_state() are set, and gb_rewind_free()
+ * must be called before the context is initialised again or discarded.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param size	Bytes of memory used for the compressed snapshots. Must be
+ *		at least a little larger than gb_state_size(gb,
+ *		GB_STATE_CART_RAM | GB_STATE_APU).
+ * \param frames Largest number of snapshots that are kept.
+ * \param keyframe_interval Every this many snapshots is a keyframe. The
+ *		other snapshots are stored as the difference to the last
+ *		keyframe, so a larger interval uses less memory for games
+ *		that change little between frames.
+ * \returns	0 on success, or -1 if memory could not be allocated or size
+ *		is too small.
+ */
+int gb_rewind_init(struct gb_s *gb, const size_t size, const unsigned frames,
+		const unsigned keyframe_interval);
+
+/**
+ * Frees the memory used for rewinding, and discards all snapshots.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ */
+void gb_rewind_free(struct gb_s *gb);
+
+/**
+ * Saves a snapshot of the current state, including the cart RAM and the APU.
+ * The oldest snapshots are discarded to make room. Usually called after each
+ * frame.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \returns	0 on success, or -1 if rewinding is not enabled.
+ */
+int gb_rewind_push(struct gb_s *gb);
+
+/**
+ * Restores the newest snapshot, and discards it.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \returns	0 on success, or -1 if there are no snapshots left.
+ */
+int gb_rewind_pop(struct gb_s *gb);
+
+/**
+ * Returns the number of snapshots that can be restored.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ */
+unsigned gb_rewind_count(const struct gb_s *gb);
+#endif
+
 /**
  * Calculates and returns a hash of the game header in the same way the Game
  * Boy Color does for colourising old Game Boy games. The frontend can use this
@@ -3992,6 +9217,31 @@ uint_fast32_t gb_get_save_size(struct gb_s *gb);
  */
 uint8_t gb_colour_hash(struct gb_s *gb);
 
+/**
+ * Returns the value of an I/O or HRAM register without side effects, such as
+ * for a debugger. DIV and TIMA are worked out as the game would read them at
+ * this point, as they are otherwise only brought up to date when the game
+ * reads them. The APU registers of an external APU are not read from it.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param reg	Register to read, as an offset from 0xFF00, such as IO_TIMA.
+ * \returns	Value of the register.
+ */
+uint8_t gb_get_io(const struct gb_s *gb, const uint_fast8_t reg);
+
+#if PEANUT_GB_IDLE_LOOP_SKIP
+/**
+ * Returns the number of cycles skipped while the game was waiting in a loop
+ * that only polls memory, such as waiting for the next line or frame. These
+ * cycles are still counted as emulated time. Only available when
+ * PEANUT_GB_IDLE_LOOP_SKIP is defined to a non-zero value.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \returns	Number of cycles skipped since the last reset.
+ */
+uint64_t gb_get_idle_cycles(const struct gb_s *gb);
+#endif
+
 /**
  * Returns the title of ROM.
  *
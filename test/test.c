@@ -3,6 +3,7 @@
 #define ENABLE_SOUND 0
 #define ENABLE_LCD 1
 #include "../peanut_gb.h"
+#include "../examples/replay/peanut_movie.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -112,6 +113,30 @@ void gb_serial_tx(struct gb_s *gb, const uint8_t tx)
 	p->str[p->count++] = c;
 }
 
+/* Run the tests with the JIT and the decoded instruction cache when they are
+ * enabled. */
+static void test_cache_init(struct gb_s *gb)
+{
+#if PEANUT_GB_JIT
+	lok(gb_jit_init(gb) == 0);
+#endif
+#if PEANUT_GB_PREDECODE
+	lok(gb_predecode_init(gb) == 0);
+#endif
+	(void) gb;
+}
+
+static void test_cache_free(struct gb_s *gb)
+{
+#if PEANUT_GB_JIT
+	gb_jit_free(gb);
+#endif
+#if PEANUT_GB_PREDECODE
+	gb_predecode_free(gb);
+#endif
+	(void) gb;
+}
+
 static void acid_lcd_draw_line(struct gb_s *gb, const uint8_t *pixels,
                                const uint_fast8_t line)
 {
@@ -135,6 +160,7 @@ void test_cpu_inst(void)
 		return;
 
 	gb_init_serial(&gb, &gb_serial_tx, NULL);
+	test_cache_init(&gb);
 
 	printf("Serial: ");
 
@@ -143,6 +169,7 @@ void test_cpu_inst(void)
 		__gb_step_cpu(&gb);
 
 	p.str[p.count++] = '\0';
+	test_cache_free(&gb);
 
 	/* Check test results. */
 	lok(strstr(p.str, "Passed all tests") != NULL);
@@ -165,6 +192,7 @@ void test_instr_timing(void)
 		return;
 
 	gb_init_serial(&gb, &gb_serial_tx, NULL);
+	test_cache_init(&gb);
 
 	printf("Serial: ");
 
@@ -173,6 +201,7 @@ void test_instr_timing(void)
 		__gb_step_cpu(&gb);
 
 	p.str[p.count++] = '\0';
+	test_cache_free(&gb);
 
 	/* Check test results. */
 	lok(strstr(p.str, "Passed") != NULL);
@@ -193,10 +222,18 @@ void test_dmg_acid2(void)
 	        return;
 
 	gb_init_lcd(&gb, acid_lcd_draw_line);
+	test_cache_init(&gb);
 
 	for(unsigned int i = 0; i < 100; i++)
 	        gb_run_frame(&gb);
 
+	test_cache_free(&gb);
+
+#if PEANUT_GB_IDLE_LOOP_SKIP && !PEANUT_GB_JIT
+	/* The test waits for VBlank by polling LY. */
+	lok(gb_get_idle_cycles(&gb) > 0);
+#endif
+
 	{
 	        uint32_t hash = fnv1a_hash(&p.fb[0][0],
 	                                 LCD_WIDTH * LCD_HEIGHT);
@@ -206,10 +243,674 @@ void test_dmg_acid2(void)
 	}
 }
 
+void test_dmg_acid2_buffer(void)
+{
+	struct gb_s gb;
+	struct acid_priv p = {0};
+	enum gb_init_error_e gb_err;
+
+	/* Same as the dmg-acid2 test, but with the ROM read directly from
+	 * memory instead of with gb_rom_read. */
+	gb_err = gb_init_buffer(&gb, dmg_acid2_gb, dmg_acid2_gb_len, NULL, 0,
+				&gb_error, &p);
+	lok(gb_err == GB_INIT_NO_ERROR);
+	if(gb_err != GB_INIT_NO_ERROR)
+		return;
+
+	gb_init_lcd(&gb, acid_lcd_draw_line);
+	test_cache_init(&gb);
+
+	for(unsigned int i = 0; i < 100; i++)
+		gb_run_frame(&gb);
+
+	test_cache_free(&gb);
+	lok(fnv1a_hash(&p.fb[0][0], LCD_WIDTH * LCD_HEIGHT) == DMG_ACID2_HASH);
+}
+
+struct frame_priv
+{
+	uint8_t fb[2][LCD_HEIGHT][LCD_WIDTH];
+	const void *frame;
+	unsigned int count;
+};
+
+static void frame_ready(struct gb_s *gb, void *frame)
+{
+	struct frame_priv *p = gb->direct.priv;
+
+	p->frame = frame;
+	p->count++;
+}
+
+void test_dmg_acid2_frame(void)
+{
+	struct gb_s gb;
+	static struct frame_priv p;
+	enum gb_init_error_e gb_err;
+
+	/* Same as the dmg-acid2 test, but with whole frames drawn into two
+	 * frame buffers. */
+	gb_err = gb_init_buffer(&gb, dmg_acid2_gb, dmg_acid2_gb_len, NULL, 0,
+				&gb_error, &p);
+	lok(gb_err == GB_INIT_NO_ERROR);
+	if(gb_err != GB_INIT_NO_ERROR)
+		return;
+
+	gb_init_lcd_frame(&gb, p.fb[0], p.fb[1], LCD_WIDTH,
+			GB_PIXEL_FORMAT_SHADE, frame_ready);
+	test_cache_init(&gb);
+
+	for(unsigned int i = 0; i < 100; i++)
+		gb_run_frame(&gb);
+
+#if PEANUT_GB_SKIP_UNCHANGED_LINES
+	/* The picture is still, so no lines are drawn in the next frame. */
+	gb_run_frame(&gb);
+	{
+		const uint8_t *changed = gb_get_changed_lines(&gb);
+		uint8_t any = 0;
+
+		for(unsigned int i = 0; i < LCD_HEIGHT / 8; i++)
+			any |= changed[i];
+
+		lok(any == 0);
+	}
+#endif
+
+	test_cache_free(&gb);
+
+	/* Frames where the LCD is off, or the first frame after it is
+	 * switched on, are not shown. */
+	lok(p.count > 0 && p.count <= 100);
+	lok(p.frame == gb_get_frame(&gb));
+	lok(fnv1a_hash(p.frame, LCD_WIDTH * LCD_HEIGHT) == DMG_ACID2_HASH);
+}
+
+void test_frame_skip(void)
+{
+	struct gb_s gb;
+	static struct frame_priv p;
+
+	if(gb_init_buffer(&gb, dmg_acid2_gb, dmg_acid2_gb_len, NULL, 0,
+			&gb_error, &p) != GB_INIT_NO_ERROR)
+	{
+		lok(0);
+		return;
+	}
+
+	gb_init_lcd_frame(&gb, p.fb[0], p.fb[1], LCD_WIDTH,
+			GB_PIXEL_FORMAT_SHADE, frame_ready);
+
+	for(unsigned int i = 0; i < 20; i++)
+		gb_run_frame(&gb);
+
+	/* Draw one of every three frames. */
+	p.count = 0;
+	gb.direct.frame_skip = true;
+	gb.direct.frame_skip_ratio = 3;
+	for(unsigned int i = 0; i < 30; i++)
+		gb_run_frame(&gb);
+
+	lok(p.count == 10);
+
+	/* A ratio of 1 draws every frame, whichever way skipping is asked
+	 * for. */
+	p.count = 0;
+	gb.direct.frame_skip_ratio = 1;
+	for(unsigned int i = 0; i < 30; i++)
+		gb_run_frame(&gb);
+
+	lok(p.count == 30);
+
+	p.count = 0;
+	gb.direct.frame_skip = false;
+	gb.direct.skip_next_frame = true;
+	for(unsigned int i = 0; i < 30; i++)
+		gb_run_frame(&gb);
+
+	lok(p.count == 30);
+	gb.direct.skip_next_frame = false;
+
+	/* Skip every frame while the front-end asks. */
+	p.count = 0;
+	gb.direct.frame_skip = false;
+	gb.direct.frame_skip_ratio = 0;
+	gb.direct.skip_next_frame = true;
+	for(unsigned int i = 0; i < 30; i++)
+		gb_run_frame(&gb);
+
+	lok(p.count == 0);
+
+	/* Still draw one of every four frames. */
+	gb.direct.frame_skip_ratio = 4;
+	for(unsigned int i = 0; i < 30; i++)
+		gb_run_frame(&gb);
+
+	lok(p.count == 8);
+	lok(fnv1a_hash(gb_get_frame(&gb), LCD_WIDTH * LCD_HEIGHT) ==
+			DMG_ACID2_HASH);
+}
+
+void test_lcd_region(void)
+{
+	struct gb_s gb;
+	static struct acid_priv full, part;
+	uint8_t line_mask[LCD_HEIGHT / 8];
+	unsigned int line, drawn = 1, blank = 1;
+
+	/* Draw every other line, and only the middle of each line. */
+	memset(line_mask, 0x55, sizeof(line_mask));
+
+	for(unsigned int i = 0; i < 2; i++)
+	{
+		struct acid_priv *p = i == 0 ? &full : &part;
+
+		if(gb_init_buffer(&gb, dmg_acid2_gb, dmg_acid2_gb_len, NULL, 0,
+				&gb_error, p) != GB_INIT_NO_ERROR)
+		{
+			lok(0);
+			return;
+		}
+
+		gb_init_lcd(&gb, acid_lcd_draw_line);
+		if(i != 0)
+			gb_set_lcd_region(&gb, line_mask, 40, 120);
+
+		for(unsigned int f = 0; f < 100; f++)
+			gb_run_frame(&gb);
+	}
+
+	for(line = 0; line < LCD_HEIGHT; line++)
+	{
+		if(line & 1)
+			blank &= part.fb[line][60] == 0;
+		else
+			drawn &= memcmp(&part.fb[line][40], &full.fb[line][40],
+					80) == 0;
+	}
+
+	lok(drawn);
+	lok(blank);
+}
+
+void test_lcd_obs(void)
+{
+	struct gb_s gb;
+	static struct acid_priv p;
+	static uint8_t obs[2][72][80];
+	unsigned int row, col, same = 1;
+
+	if(gb_init_buffer(&gb, dmg_acid2_gb, dmg_acid2_gb_len, NULL, 0,
+			&gb_error, &p) != GB_INIT_NO_ERROR)
+	{
+		lok(0);
+		return;
+	}
+
+	gb_init_lcd(&gb, acid_lcd_draw_line);
+	lok(gb_set_lcd_obs(&gb, &obs[0][0][0], 80, 145, 80,
+			GB_OBS_FORMAT_LUMA, 2) == -1);
+	lok(gb_set_lcd_obs(&gb, &obs[0][0][0], 80, 72, 80,
+			GB_OBS_FORMAT_LUMA, 2) == 0);
+
+	for(unsigned int f = 0; f < 100; f++)
+		gb_run_frame(&gb);
+
+	/* Every other line and column, in both of the last two frames. */
+	for(row = 0; row < 72; row++)
+	{
+		for(col = 0; col < 80; col++)
+		{
+			const uint8_t luma =
+				255 - 85 * (p.fb[row * 2][col * 2] & 0x03);
+
+			same &= obs[0][row][col] == luma;
+			same &= obs[1][row][col] == luma;
+		}
+	}
+
+	lok(same);
+}
+
+void test_lcd_convert(void)
+{
+	uint8_t pixels[LCD_WIDTH] = {0};
+	uint32_t palette[12];
+	uint32_t out32[LCD_WIDTH];
+	uint16_t out16[LCD_WIDTH];
+	unsigned int i;
+
+	/* Each shade of OBJ0, OBJ1 and BG. */
+	for(i = 0; i < 12; i++)
+		pixels[i] = (i & 3) | ((i >> 2) << 4);
+
+	for(i = 0; i < 12; i++)
+		palette[i] = gb_rgb_to_pixel(GB_PIXEL_FORMAT_XRGB8888,
+				0x102030 * (i + 1));
+
+	gb_lcd_convert_line(out32, pixels, GB_PIXEL_FORMAT_XRGB8888, palette);
+	lok(memcmp(out32, palette, sizeof(palette)) == 0);
+	lok(out32[LCD_WIDTH - 1] == palette[0]);
+
+	lok(gb_rgb_to_pixel(GB_PIXEL_FORMAT_RGB565, 0xFF0000) == 0xF800);
+	lok(gb_rgb_to_pixel(GB_PIXEL_FORMAT_RGB555, 0x00FF00) == 0x03E0);
+	lok(gb_rgb_to_pixel(GB_PIXEL_FORMAT_RGBA8888, 0x0000FF) == 0x0000FFFF);
+
+	for(i = 0; i < 12; i++)
+		palette[i] = gb_rgb_to_pixel(GB_PIXEL_FORMAT_RGB565_BE,
+				0x102030 * (i + 1));
+
+	gb_lcd_convert_line(out16, pixels, GB_PIXEL_FORMAT_RGB565_BE, palette);
+	lok(((const uint8_t *)out16)[22] == (palette[11] >> 8));
+	lok(((const uint8_t *)out16)[23] == (palette[11] & 0xFF));
+}
+
+struct audio_priv
+{
+	uint8_t regs[0x30];
+	unsigned int writes;
+};
+
+static uint8_t test_audio_read(struct gb_s *gb, const uint_fast16_t addr)
+{
+	const struct audio_priv *p = gb->direct.priv;
+	return p->regs[addr - 0xFF10];
+}
+
+static void test_audio_write(struct gb_s *gb, const uint_fast16_t addr,
+		const uint8_t val)
+{
+	struct audio_priv *p = gb->direct.priv;
+	p->regs[addr - 0xFF10] = val;
+	p->writes++;
+}
+
+void test_audio(void)
+{
+	/* Writes 0x77 to NR50, then copies NR50 to WRAM. */
+	static const uint8_t prog[] = {
+		0x3E, 0x77,		/* LD A, 0x77 */
+		0xE0, 0x24,		/* LDH (0x24), A */
+		0xF0, 0x24,		/* LDH A, (0x24) */
+		0xEA, 0x00, 0xC0,	/* LD (0xC000), A */
+		0x18, 0xFE		/* JR -2 */
+	};
+	static uint8_t rom[0x8000];
+	struct gb_s gb[2];
+	struct audio_priv p[2] = {0};
+	uint8_t chk = 0;
+
+	memcpy(&rom[0x100], prog, sizeof(prog));
+	for(unsigned int i = 0x134; i <= 0x14C; i++)
+		chk = chk - rom[i] - 1;
+	rom[0x14D] = chk;
+
+	for(unsigned int i = 0; i < 2; i++)
+	{
+		if(gb_init_buffer(&gb[i], rom, sizeof(rom), NULL, 0,
+				&gb_error, &p[i]) != GB_INIT_NO_ERROR)
+		{
+			lok(0);
+			return;
+		}
+
+		gb_init_audio(&gb[i], test_audio_read, test_audio_write);
+	}
+
+	/* Only the APU of the context that is run is written to. */
+	test_cache_init(&gb[0]);
+	gb_run_cycles(&gb[0], 1000);
+	test_cache_free(&gb[0]);
+
+	lok(p[0].writes == 1 && p[0].regs[0x24 - 0x10] == 0x77);
+	lok(p[1].writes == 0);
+	lok(gb[0].wram[0] == 0x77);
+}
+
+static void test_audio_state_save(struct gb_s *gb, void *buf)
+{
+	const struct audio_priv *p = gb->direct.priv;
+	memcpy(buf, p->regs, sizeof(p->regs));
+}
+
+static void test_audio_state_load(struct gb_s *gb, const void *buf)
+{
+	struct audio_priv *p = gb->direct.priv;
+	memcpy(p->regs, buf, sizeof(p->regs));
+}
+
+void test_save_state(void)
+{
+	struct gb_s gb;
+	struct audio_priv apu = { 0 };
+	static uint8_t state[0x8000];
+	size_t size;
+	uint32_t wram_hash;
+	uint16_t pc;
+	enum gb_init_error_e gb_err;
+
+	gb_err = gb_init(&gb, &gb_rom_read_cpu_instrs, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, NULL);
+	lok(gb_err == GB_INIT_NO_ERROR);
+	if(gb_err != GB_INIT_NO_ERROR)
+		return;
+
+	test_cache_init(&gb);
+
+	for(unsigned int i = 0; i < 200; i++)
+		gb_run_frame(&gb);
+
+	size = gb_state_size(&gb, GB_STATE_CART_RAM);
+	lok(size <= sizeof(state));
+	lok(gb_state_save(&gb, state, GB_STATE_CART_RAM) == size);
+	/* Fields are stored little endian at fixed offsets without padding,
+	 * such as the size and the cycle count, and WRAM follows the last
+	 * field. */
+	lok((state[8] | (state[9] << 8) | ((uint32_t)state[10] << 16) |
+			((uint32_t)state[11] << 24)) == size);
+	{
+		uint64_t cycles = 0;
+
+		for(unsigned int i = 8; i != 0; i--)
+			cycles = (cycles << 8) | state[20 + i - 1];
+
+		lok(cycles == gb.counter.cycles);
+		lok(memcmp(state + 122 + 8 * GB_EVENT_MAX, gb.wram,
+				WRAM_SIZE) == 0);
+	}
+
+	for(unsigned int i = 0; i < 300; i++)
+		gb_run_frame(&gb);
+
+	wram_hash = fnv1a_hash(gb.wram, WRAM_SIZE);
+	pc = gb.cpu_reg.pc.reg;
+
+	/* The game must continue exactly as it did after the save. */
+	lok(gb_state_load(&gb, state, size) == GB_STATE_NO_ERROR);
+	for(unsigned int i = 0; i < 300; i++)
+		gb_run_frame(&gb);
+
+	lok(fnv1a_hash(gb.wram, WRAM_SIZE) == wram_hash);
+	lok(gb.cpu_reg.pc.reg == pc);
+
+	/* Truncated, foreign and future save states are refused. */
+	lok(gb_state_load(&gb, state, size - 1) == GB_STATE_INVALID);
+	state[4]++;
+	lok(gb_state_load(&gb, state, size) == GB_STATE_VERSION);
+	state[0] = 'X';
+	lok(gb_state_load(&gb, state, size) == GB_STATE_INVALID);
+
+	/* The APU is restored along with the rest of the console, and is
+	 * skipped by contexts without an APU. */
+	gb.direct.priv = &apu;
+	memset(apu.regs, 0x55, sizeof(apu.regs));
+	gb_init_audio_state(&gb, sizeof(apu.regs), &test_audio_state_save,
+			&test_audio_state_load);
+	size = gb_state_size(&gb, GB_STATE_CART_RAM | GB_STATE_APU);
+	lok(size <= sizeof(state));
+	lok(gb_state_save(&gb, state, GB_STATE_CART_RAM | GB_STATE_APU) ==
+			size);
+	memset(apu.regs, 0, sizeof(apu.regs));
+	lok(gb_state_load(&gb, state, size) == GB_STATE_NO_ERROR);
+	lok(apu.regs[0] == 0x55 && apu.regs[sizeof(apu.regs) - 1] == 0x55);
+
+	gb_init_audio_state(&gb, sizeof(apu.regs) - 1, &test_audio_state_save,
+			&test_audio_state_load);
+	lok(gb_state_load(&gb, state, size) == GB_STATE_APU_SIZE);
+	gb_init_audio_state(&gb, 0, NULL, NULL);
+	lok(gb_state_load(&gb, state, size) == GB_STATE_NO_ERROR);
+
+	test_cache_free(&gb);
+}
+
+#if PEANUT_GB_REWIND
+void test_rewind(void)
+{
+	/* Keep fewer snapshots than are saved, and then use a buffer that is
+	 * too small for all of them. */
+	const size_t sizes[] = { 1024 * 1024, 20 * 1024 };
+
+	for(unsigned int t = 0; t < 2; t++)
+	{
+		struct gb_s gb;
+		uint32_t wram_hash[40];
+		uint16_t pc[40];
+		unsigned int frame, count;
+
+		if(gb_init(&gb, &gb_rom_read_cpu_instrs, &gb_cart_ram_read,
+				&gb_cart_ram_write, &gb_error, NULL) !=
+				GB_INIT_NO_ERROR)
+		{
+			lok(0);
+			return;
+		}
+
+		lok(gb_rewind_init(&gb, 1024, 32, 8) == -1);
+		lok(gb_rewind_init(&gb, sizes[t], 32, 8) == 0);
+		lok(gb_rewind_pop(&gb) == -1);
+
+		for(frame = 0; frame < 40; frame++)
+		{
+			gb_run_frame(&gb);
+			lok(gb_rewind_push(&gb) == 0);
+			wram_hash[frame] = fnv1a_hash(gb.wram, WRAM_SIZE);
+			pc[frame] = gb.cpu_reg.pc.reg;
+		}
+
+		count = gb_rewind_count(&gb);
+		lok(count > 8 && count <= 32);
+
+		/* Each snapshot is restored exactly, newest first. */
+		while(gb_rewind_pop(&gb) == 0)
+		{
+			frame--;
+			lok(fnv1a_hash(gb.wram, WRAM_SIZE) == wram_hash[frame]);
+			lok(gb.cpu_reg.pc.reg == pc[frame]);
+		}
+
+		lok(frame == 40 - count);
+		gb_rewind_free(&gb);
+	}
+}
+#endif
+
+void test_run_cycles(void)
+{
+	struct gb_s gb;
+	struct acid_priv p = {0};
+	static uint8_t breakpoints[0x2000];
+	uint_fast32_t total = 0;
+	uint_fast32_t cycles;
+	enum gb_init_error_e gb_err;
+
+	gb_err = gb_init_buffer(&gb, dmg_acid2_gb, dmg_acid2_gb_len, NULL, 0,
+				&gb_error, &p);
+	lok(gb_err == GB_INIT_NO_ERROR);
+	if(gb_err != GB_INIT_NO_ERROR)
+		return;
+
+	gb_init_lcd(&gb, acid_lcd_draw_line);
+	test_cache_init(&gb);
+
+	/* Each run may overrun its budget by at most one instruction. */
+	while(total < 100 * LCD_FRAME_CYCLES)
+	{
+		cycles = gb_run_cycles(&gb, 1000);
+		if(cycles < 1000 || cycles > 1000 + 24)
+			break;
+
+		total += cycles;
+	}
+
+	lok(total >= 100 * LCD_FRAME_CYCLES);
+	lok(fnv1a_hash(&p.fb[0][0], LCD_WIDTH * LCD_HEIGHT) == DMG_ACID2_HASH);
+
+	/* A scanline is at most one line of cycles away. */
+	{
+		const uint8_t ly = gb.hram_io[0x44]; /* LY */
+
+		cycles = gb_run_until(&gb, GB_RUN_SCANLINE);
+		lok(cycles <= LCD_LINE_CYCLES + 24);
+		lok(gb.run.events & GB_RUN_SCANLINE);
+		lok(gb.hram_io[0x44] != ly);
+	}
+
+	/* The test waits in HALT for the LCD STAT interrupt. */
+	breakpoints[LCDC_INTR_ADDR >> 3] |= 1 << (LCDC_INTR_ADDR & 7);
+	gb_set_breakpoints(&gb, breakpoints);
+	gb_run_until(&gb, GB_RUN_BREAKPOINT | GB_RUN_FRAME);
+	lok(gb.run.events & GB_RUN_BREAKPOINT);
+	lok(gb.cpu_reg.pc.reg == LCDC_INTR_ADDR);
+
+	test_cache_free(&gb);
+}
+
+#if !PEANUT_GB_SKIP_UNCHANGED_LINES
+static void movie_lcd_draw_line(struct gb_s *gb, const uint8_t *pixels,
+		const uint_fast8_t line)
+{
+	uint32_t *hash = gb->direct.priv;
+
+	(void) line;
+	*hash = movie_hash_line(*hash, pixels);
+}
+
+void test_movie(void)
+{
+	const char *file_name = "test_movie.pgbm";
+	struct gb_s gb;
+	struct movie_s rec, play;
+	uint32_t hash;
+	unsigned int mismatches = 0;
+
+	if(gb_init(&gb, &gb_rom_read_cpu_instrs, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &hash) !=
+			GB_INIT_NO_ERROR)
+	{
+		lok(0);
+		return;
+	}
+
+	gb_init_lcd(&gb, movie_lcd_draw_line);
+	test_cache_init(&gb);
+
+	/* The test switches the LCD off for the second to fourth frames.
+	 * Every frame is drawn whilst recording. */
+	lok(movie_record_start(&rec, &gb) == 0);
+	rec.hash_interval = 2;
+	for(unsigned int i = 0; i < 40; i++)
+	{
+		lok(movie_record_input(&rec, 0xFF) == 0);
+		hash = movie_hash_init();
+		gb_run_frame(&gb);
+		lok(movie_record_hash(&rec, hash) == 0);
+	}
+
+	/* Frames without any lines drawn have a defined hash. */
+	lok(rec.hash[0] == movie_hash_init());
+	lok(movie_save(&rec, file_name) == 0);
+	movie_free(&rec);
+
+	/* Only the frames that are hashed are drawn whilst replaying. */
+	lok(movie_load(&play, file_name) == 0);
+	remove(file_name);
+	lok(play.frames == 40 && play.hashes == 20);
+	lok(gb_state_load(&gb, play.state, play.state_size) ==
+			GB_STATE_NO_ERROR);
+	for(uint_fast32_t frame = 1; frame <= play.frames; frame++)
+	{
+		gb.direct.skip_next_frame = !movie_hash_frame(&play, frame);
+		gb.direct.joypad = play.input[frame - 1];
+		hash = movie_hash_init();
+		gb_run_frame(&gb);
+
+		if(movie_hash_frame(&play, frame) &&
+				hash != play.hash[frame / play.hash_interval - 1])
+			mismatches++;
+	}
+
+	lok(mismatches == 0);
+	movie_free(&play);
+	test_cache_free(&gb);
+}
+#endif
+
+void test_get_io(void)
+{
+	struct gb_s gb;
+	uint8_t hram_io[HRAM_IO_SIZE];
+	uint8_t div, tima;
+
+	if(gb_init(&gb, &gb_rom_read_instr_timing, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, NULL) !=
+			GB_INIT_NO_ERROR)
+	{
+		lok(0);
+		return;
+	}
+
+	test_cache_init(&gb);
+
+	/* instr_timing times instructions with the timer. */
+	for(unsigned int i = 0; i < 30; i++)
+		gb_run_frame(&gb);
+
+	/* Stop where TIMA has counted since the game last read it. */
+	gb_run_cycles(&gb, 5000);
+	lok(gb.hram_io[IO_TAC] & 0x04);
+
+	/* Reading DIV and TIMA does not change the context. */
+	memcpy(hram_io, gb.hram_io, sizeof(hram_io));
+	div = gb_get_io(&gb, IO_DIV);
+	tima = gb_get_io(&gb, IO_TIMA);
+	lok(memcmp(hram_io, gb.hram_io, sizeof(hram_io)) == 0);
+
+	/* DIV counts every 256 cycles, and TIMA counts every period given by
+	 * TAC from the value it had when it was last brought up to date. */
+	{
+		static const unsigned int tac_cycles[] = { 1024, 16, 64, 256 };
+		const uint64_t ticks = (gb.counter.tima_count +
+				gb.counter.cycles - gb.counter.tima_sync) /
+			tac_cycles[gb.hram_io[IO_TAC] & 0x03];
+
+		lok(div == (uint8_t)((gb.counter.cycles -
+					gb.counter.div_start) / 256));
+		lok(ticks != 0);
+		lok(gb.hram_io[IO_TIMA] + ticks < 0x100);
+		lok(tima == gb.hram_io[IO_TIMA] + ticks);
+	}
+
+#ifndef PEANUT_GB_HEADER_ONLY
+	/* The game reads the same values. */
+	lok(__gb_read(&gb, IO_ADDR | IO_DIV) == div);
+	lok(__gb_read(&gb, IO_ADDR | IO_TIMA) == tima);
+#endif
+
+	test_cache_free(&gb);
+}
+
 int main(void)
 {
 	lrun("cpu_inst blarrg tests    ", test_cpu_inst);
 	lrun("instr_timing blarrg tests", test_instr_timing);
 	lrun("dmg-acid2 lcd test     ", test_dmg_acid2);
+	lrun("dmg-acid2 buffer test  ", test_dmg_acid2_buffer);
+	lrun("dmg-acid2 frame test   ", test_dmg_acid2_frame);
+	lrun("frame skip test        ", test_frame_skip);
+	lrun("lcd region test        ", test_lcd_region);
+	lrun("lcd obs test           ", test_lcd_obs);
+	lrun("lcd convert test       ", test_lcd_convert);
+	lrun("audio test             ", test_audio);
+	lrun("save state test        ", test_save_state);
+#if PEANUT_GB_REWIND
+	lrun("rewind test            ", test_rewind);
+#endif
+	lrun("run cycles test        ", test_run_cycles);
+	lrun("get io test            ", test_get_io);
+#if !PEANUT_GB_SKIP_UNCHANGED_LINES
+	/* Unchanged lines are not drawn, so the hash of a frame would depend
+	 * on which frames were drawn before it. */
+	lrun("movie test             ", test_movie);
+#endif
 	return lfails != 0;
 }